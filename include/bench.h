@@ -0,0 +1,31 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <Arduino.h>
+
+// Region markers for the cycle benchmarks under simavr, see tools/avr_bench.c.
+// A marker is a single write to GPIOR0, which the simulator watches, so it
+// costs one cycle. Regions may nest, only the outermost one is measured.
+// Compiled in with -D BENCH=1, see the bench environment in platformio.ini.
+
+#ifndef BENCH
+#define BENCH 0
+#endif
+
+enum bench_marker_t
+{
+	BENCH_NMEA_BEGIN = 1, // One byte through the NMEA decoder
+	BENCH_NMEA_END,
+	BENCH_AT_BEGIN, // One gsm_command*() call, command to final result
+	BENCH_AT_END,
+	BENCH_WAIT_BEGIN, // Blocked on a peripheral, the PROFILER_WAIT_* spans
+	BENCH_WAIT_END
+};
+
+#if BENCH && defined(GPIOR0)
+#define BENCH_MARK(marker) (GPIOR0 = (marker))
+#else
+#define BENCH_MARK(marker) do { } while (0)
+#endif
+
+#endif
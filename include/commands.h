@@ -6,6 +6,7 @@
 
 bool send_position(gsm_t *gsm, const char *phone_no);
 bool send_subscription(gsm_t *gsm);
+bool send_geofence_alerts(gsm_t *gsm);
 bool commands_handle_sms_command(gsm_t *gsm, const char* phone_no, const char* content);
 
 #endif
\ No newline at end of file
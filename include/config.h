@@ -0,0 +1,48 @@
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include <Arduino.h>
+#include "util.h"
+
+// Settings kept in EEPROM and changed at run time with SET over SMS.
+//
+// The store is a log of key, length, value, CRC-8 records in one of two
+// pages. A change appends a record, the last one of a key wins, so the
+// cells are written in turn rather than one of them every time. A full
+// page is compacted into the other one, whose header is written last so
+// a reset half way leaves the old page in use.
+
+#define CONFIG_EEPROM_BASE 0x200
+#define CONFIG_PAGE_SIZE 0x100
+#define CONFIG_MAX_STRING 31
+
+enum config_key_t
+{
+	CONFIG_APN,
+	CONFIG_HOST,
+	CONFIG_PORT,
+	CONFIG_LIVE, // Data connection enabled
+	CONFIG_GPS_WINDOW, // ms per main loop
+	CONFIG_GSM_WINDOW, // ms per main loop
+	CONFIG_UPLOAD_INTERVAL, // s
+	CONFIG_SUBSCRIPTION_INTERVAL, // s
+	CONFIG_PRUNE_AGE, // s, high scores older than this are dropped
+	CONFIG_SMS_BATCH, // Fixes per binary SMS to subscribers, 0 for a text SMS each
+	CONFIG_NUM_KEYS
+};
+
+void config_init();
+
+uint16_t config_get(config_key_t key);
+// Returns the length, out holds up to CONFIG_MAX_STRING characters
+uint8_t config_get_string(config_key_t key, char *out);
+
+bool config_set(config_key_t key, uint16_t value);
+bool config_set_string(config_key_t key, const char *value);
+
+// By name as sent over SMS, the value is checked against the key's range
+bool config_set_text(const char *name, const char *value);
+// name=value lines of every key that fit
+void config_format(char *out, uint8_t max_chars);
+
+#endif
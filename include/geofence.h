@@ -0,0 +1,92 @@
+#ifndef _GEOFENCE_H_
+#define _GEOFENCE_H_
+
+#include <Arduino.h>
+#include "gps.h"
+#include "util.h"
+
+// Circles and small polygons kept in EEPROM, checked against every fix.
+// Coordinates are fixed point in 1e-5 degrees (about 1 m), which keeps all
+// of the evaluation in 32 bit integers as long as a fence is no larger
+// than GEOFENCE_MAX_EXTENT in either direction.
+
+#define GEOFENCE_MAX 4
+#define GEOFENCE_MAX_POINTS 6
+#define GEOFENCE_MAX_EXTENT 30000L // 0.3 degrees
+#define GEOFENCE_MAX_RADIUS 30000 // m
+#define GEOFENCE_EEPROM_BASE 0x20
+
+// Consecutive fixes on the other side before an enter or exit is reported
+#ifndef GEOFENCE_CONFIRM
+#define GEOFENCE_CONFIRM 3
+#endif
+// Fixes worse than this (1/100) are not evaluated
+#ifndef GEOFENCE_MAX_HDOP
+#define GEOFENCE_MAX_HDOP 500
+#endif
+
+#define GEOFENCE_EVENT_QUEUE 4
+
+enum geofence_type_t
+{
+	GEOFENCE_CIRCLE = 1,
+	GEOFENCE_POLYGON = 2
+};
+
+struct geofence_point_t
+{
+	int32_t lat;
+	int32_t lon;
+};
+
+// As stored in EEPROM, an erased record has type 0xff
+struct geofence_record_t
+{
+	uint8_t type;
+	uint8_t num_points;
+	uint16_t radius; // m, circles only
+	char owner[MAX_PHONE_NO_LENGTH + 1];
+	geofence_point_t points[GEOFENCE_MAX_POINTS]; // Circles use the first as center
+};
+
+// Kept in RAM so most fixes are decided without reading the EEPROM
+struct geofence_state_t
+{
+	uint8_t type; // 0 when unused
+	geofence_point_t min;
+	geofence_point_t max;
+	uint16_t lon_scale; // cos(lat) << 10, circles only
+	int8_t inside; // -1 until known
+	uint8_t count; // Consecutive fixes disagreeing with inside
+};
+
+struct geofence_event_t
+{
+	uint8_t index;
+	bool entered;
+	geofence_point_t position;
+};
+
+struct geofence_t
+{
+	geofence_state_t state[GEOFENCE_MAX];
+	geofence_event_t events[GEOFENCE_EVENT_QUEUE];
+	uint8_t event_head;
+	uint8_t event_count;
+};
+
+void geofence_init(geofence_t *geofence);
+
+// Return the index used, or -1 when full or the fence is too large
+int8_t geofence_add_circle(geofence_t *geofence, const char *owner, double lat, double lon, uint16_t radius);
+int8_t geofence_add_polygon(geofence_t *geofence, const char *owner, const double *lat, const double *lon, uint8_t num_points);
+bool geofence_remove(geofence_t *geofence, uint8_t index);
+bool geofence_get(geofence_t *geofence, uint8_t index, geofence_record_t *out);
+
+void geofence_update(geofence_t *geofence, gps_position_t *fix);
+bool geofence_pop_event(geofence_t *geofence, geofence_event_t *out);
+
+int32_t geofence_to_fixed(double degrees);
+double geofence_to_degrees(int32_t fixed);
+
+#endif
@@ -2,9 +2,68 @@
 #define _GPS_H_
 
 #include <Arduino.h>
-#include <SoftwareSerial.h>
+#include "serial.h"
 
+#ifndef GPS_NUM_HIGHSCORE
 #define GPS_NUM_HIGHSCORE 5
+#endif
+
+// Receiver setup in gps_init, see gps_config.cpp. GPS_BAUD is negotiated
+// after the receiver has been found at GPS_DEFAULT_BAUD or any other common
+// rate. SoftwareSerial at 8 MHz is not reliable above 19200, more than
+// 1 Hz also needs more than 9600 baud.
+#ifndef GPS_CONFIG
+#define GPS_CONFIG 1
+#endif
+#ifndef GPS_DEFAULT_BAUD
+#define GPS_DEFAULT_BAUD 9600
+#endif
+#ifndef GPS_BAUD
+#define GPS_BAUD GPS_DEFAULT_BAUD
+#endif
+#ifndef GPS_RATE_HZ
+#define GPS_RATE_HZ 1
+#endif
+
+// Listening window policy, see gps_run. The window ends as soon as a fix
+// reaches the target quality (hdop in 1/100) and may grow to
+// GPS_MAX_WINDOW_FACTOR times the requested time while a fix is expected
+// soon, judged by the learned time to fix.
+#ifndef GPS_TARGET_HDOP
+#define GPS_TARGET_HDOP 150
+#endif
+#ifndef GPS_TARGET_SATS
+#define GPS_TARGET_SATS 6
+#endif
+#ifndef GPS_MAX_WINDOW_FACTOR
+#define GPS_MAX_WINDOW_FACTOR 5
+#endif
+// Starting guesses in seconds before anything has been learned
+#ifndef GPS_DEFAULT_TTFF
+#define GPS_DEFAULT_TTFF 45
+#endif
+#ifndef GPS_DEFAULT_CONVERGE
+#define GPS_DEFAULT_CONVERGE 15
+#endif
+
+// Warm start, see gps_warm.cpp. The last fix, UTC time and the learned
+// time to fix are kept in EEPROM and handed back to the receiver after a
+// reset.
+#ifndef GPS_WARM_START
+#define GPS_WARM_START 1
+#endif
+#define GPS_WARM_EEPROM_BASE 0x140 // After the geofences
+#define GPS_WARM_SAVE_INTERVAL MINUTES(15)
+// The periodic save only rewrites the record after a move this far, m. Aiding
+// is good to tens of km, and the cells last while the unit stands still.
+#define GPS_WARM_SAVE_DISTANCE 10000
+
+enum gps_chip_t
+{
+	GPS_CHIP_UNKNOWN,
+	GPS_CHIP_MTK,
+	GPS_CHIP_UBLOX
+};
 
 struct gps_position_t
 {
@@ -17,23 +76,81 @@ struct gps_position_t
 	uint8_t sats;
 };
 
+struct gps_utc_t
+{
+	uint16_t year;
+	uint8_t month;
+	uint8_t day;
+	uint8_t hour;
+	uint8_t minute;
+	uint8_t second;
+};
+
+// As stored in EEPROM
+struct gps_warm_t
+{
+	uint8_t magic;
+	uint8_t flags;
+	int32_t latitude; // 1e-6 degrees
+	int32_t longitude;
+	int16_t altitude; // m
+	uint16_t hdop;
+	uint8_t sats;
+	uint16_t age; // s, age of the fix when saved
+	uint32_t utc; // s since 2000 when saved
+	uint16_t ttff_estimate;
+	uint16_t converge_estimate;
+	uint8_t checksum;
+};
+
+struct gps_t;
+
+// Called once per new fix while listening
+typedef void (*gps_fix_callback_t)(gps_t *, gps_position_t *);
+
 struct gps_t
 {
 	gps_position_t current_position;
 	gps_position_t high_score[GPS_NUM_HIGHSCORE];
-	SoftwareSerial *serial;
-	bool has_valid_position;
+	serial_t *serial;
+	bool has_valid_position; // A fix this window
+	bool has_last_position; // current_position holds a fix, maybe an old or restored one
+	gps_chip_t chip;
+	uint32_t baud;
+	uint32_t acquire_start; // When the receiver was last without a fix
+	uint32_t fix_start; // First fix since acquire_start, 0 while acquiring
+	uint32_t last_fix;
+	uint16_t ttff_estimate; // Seconds from no fix to a fix, learned
+	uint16_t converge_estimate; // Seconds from a fix to the target quality, learned
+	bool target_reached;
+	gps_fix_callback_t fix_callback;
+	uint32_t fix_time; // NMEA time of the last fix passed to fix_callback
 };
 
-bool gps_init(gps_t *gps, SoftwareSerial *serial);
+bool gps_init(gps_t *gps, serial_t *serial, gps_fix_callback_t fix_callback = NULL);
+bool gps_configure(gps_t *gps);
+bool gps_aid(gps_t *gps, int32_t latitude, int32_t longitude, int16_t altitude, gps_utc_t *utc);
 void gps_run(gps_t *gps, uint32_t time);
 
+void gps_warm_start(gps_t *gps);
+bool gps_warm_save(gps_t *gps, bool before_reset);
+
+// Age of a position that was restored from the warm start record or never set
+#define GPS_AGE_UNKNOWN 0xFFFF
+
+// GPS_AGE_UNKNOWN for a timestamp of 0 and anything older
 uint16_t gps_get_age_in_seconds(gps_position_t *pos);
+// Now in seconds since 2000-01-01 UTC, 0 while the receiver has not sent the date
+uint32_t gps_get_utc(gps_t *gps);
 
 bool gps_get_position(gps_t *gps, gps_position_t *out);
+// The last fix however old, false if there never was one
+bool gps_get_last_position(gps_t *gps, gps_position_t *out);
 bool gps_get_high_score(gps_t *gps, int index, gps_position_t *out);
 
 void gps_print_position(gps_t *gps);
 void gps_print_high_scores(gps_t *gps);
+void gps_print_decoder_stats(gps_t *gps);
+void gps_print_window_stats(gps_t *gps);
 
 #endif
\ No newline at end of file
@@ -2,20 +2,73 @@
 #define _GSM_H_
 
 #include <Arduino.h>
-#include <SoftwareSerial.h>
+#include "serial.h"
 #include "timer.h"
 #include "gps.h"
+#include "gsm_stats.h"
+#include "gsm_link.h"
+#include "gsm_locate.h"
 
 struct gsm_t;
 
+// Bench and bring-up switches, fixed at build time so a normal build carries
+// none of their code:
+//   GSM_MONITOR      echo all traffic with the modem on the debug console
+//   GSM_PASSTHROUGH  hand the modem to the debug console, the driver stops
+//   GSM_SMS_DRY_RUN  print outgoing SMS instead of sending them
+#ifndef GSM_MONITOR
+#define GSM_MONITOR 0
+#endif
+#ifndef GSM_PASSTHROUGH
+#define GSM_PASSTHROUGH 0
+#endif
+#ifndef GSM_SMS_DRY_RUN
+#define GSM_SMS_DRY_RUN 0
+#endif
+
+#if (GSM_MONITOR || GSM_PASSTHROUGH) && !DEBUG_ENABLE
+#error "GSM_MONITOR and GSM_PASSTHROUGH need the debug console"
+#endif
+
+// Modem start up, stepped from gsm_run so the GPS can work meanwhile
+enum gsm_boot_state_t
+{
+	GSM_BOOT_PROBE, // AT until the autobaud locks
+	GSM_BOOT_SETUP, // Echo off, full functionality
+	GSM_BOOT_NETWORK, // Waiting for Call Ready, registration and SMS Ready
+	GSM_BOOT_READY
+};
+
+#define GSM_BOOT_CALL_READY 0x01
+#define GSM_BOOT_SMS_READY 0x02
+#define GSM_BOOT_REGISTERED 0x04
+#define GSM_BOOT_ALL (GSM_BOOT_CALL_READY | GSM_BOOT_SMS_READY | GSM_BOOT_REGISTERED)
+
 typedef bool (*sms_callback_t)(gsm_t *, const char *, const char *);
 typedef bool (*call_callback_t)(gsm_t *, const char *);
+// Writes line index of a reply into line, false past the last one
+typedef bool (*sms_line_callback_t)(uint8_t index, char *line, uint8_t size);
+
+// Replies longer than one SMS go out as up to GSM_SMS_MAX_PARTS concatenated
+// parts of GSM_SMS_PART_LENGTH characters, lines that do not fit are left out
+#ifndef GSM_SMS_MAX_PARTS
+#define GSM_SMS_MAX_PARTS 6
+#endif
+#define GSM_SMS_PART_LENGTH 153 // 160 less the concatenation header
+#define GSM_SMS_LINE_MAX 48 // Longer lines are cut
+
+// Unsolicited results picked up between commands, see gsm_read_urcs
+#define GSM_URC_CALL_READY 0x01
+#define GSM_URC_SMS_READY 0x02
+#define GSM_URC_CLOSED 0x04
+#define GSM_URC_PDP_DEACT 0x08
+#define GSM_URC_NEW_SMS 0x10
 
 struct gsm_t
 {
 	double battery_voltage;
 	uint8_t battery_percentage;
-	SoftwareSerial *serial;
+	serial_t *serial;
 	bool incoming_call;
 	sms_callback_t sms_callback;
 	call_callback_t call_callback;
@@ -23,23 +76,45 @@ struct gsm_t
 	timer_t battery_timer;
 	timer_t sms_timer;
 	timer_t check_gprs_timer;
-
-	bool disable_sms;
-	bool monitor;
-	bool debug;
+	timer_t bearer_timer;
+	timer_t signal_timer;
 
 	bool enable_data_connection;
 	bool gprs_status;
 
 	bool tcp_connection_active;
 	uint32_t tcp_last_activity;
+	uint32_t upload_deferred; // Since when, see gsm_link_defer
+
+	gsm_link_t link;
+	gsm_locate_t locate; // Cell positions looked up so far
+
+	uint8_t urcs; // GSM_URC_ bits seen and not yet handled
+
+	gsm_boot_state_t boot_state;
+	bool resuming; // Probing a modem that ran on through a reset
+	uint8_t boot_flags;
+	uint8_t boot_attempts;
+	uint32_t boot_state_start;
+	uint32_t ready_ms; // Since power on
+	uint32_t first_report_ms;
+
+	bool timed_out; // Whether the last failed wait ran out of time
+#if GSM_STATS
+	gsm_stats_t stats;
+#endif
 };
 
-bool gsm_init(gsm_t *gsm, SoftwareSerial *serial, sms_callback_t sms_callback, call_callback_t call_callback, bool disable_sms = false, bool monitor = false, bool debug = false);
+bool gsm_init(gsm_t *gsm, serial_t *serial, sms_callback_t sms_callback, call_callback_t call_callback);
 
 void gsm_hangup(gsm_t *gsm);
-bool gsm_first_setup(gsm_t *gsm);
+bool gsm_boot(gsm_t *gsm, uint32_t time);
 bool gsm_send_sms(gsm_t *gsm, const char *phone_no, const char *message);
+// Asks the callback for the lines again for each pass instead of keeping the
+// reply in RAM. Sent as text when it fits in one SMS.
+bool gsm_send_sms_lines(gsm_t *gsm, const char *phone_no, sms_line_callback_t lines);
+// 8-bit data in PDU mode, up to 140 bytes
+bool gsm_send_binary_sms(gsm_t *gsm, const char *phone_no, const uint8_t *data, uint8_t length);
 bool gsm_handle_call_id(gsm_t *gsm, char *caller_id);
 bool gsm_handle_sms(gsm_t *gsm);
 
@@ -47,6 +122,9 @@ bool gsm_run(gsm_t *gsm, gps_t *gps, uint32_t time);
 
 void gsm_print_battery_status(gsm_t *gsm);
 
+// Coarse position of the serving cell, see gsm_locate.h
+bool gsm_locate(gsm_t *gsm, gsm_location_t *location);
+
 void gsm_enable_data(gsm_t *gsm);
 void gsm_disable_data(gsm_t *gsm);
 
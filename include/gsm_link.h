@@ -0,0 +1,55 @@
+#ifndef _GSM_LINK_H_
+#define _GSM_LINK_H_
+
+#include <Arduino.h>
+#include "util.h"
+
+// Radio link quality from AT+CSQ and the registration state, and how the
+// transmissions over it went. Periodic traffic is held back while the link
+// is poor, urgent traffic (alerts, command replies) always goes out.
+
+// CSQ below this is poor, 8 is about -97 dBm. Good again 2 steps above.
+#ifndef GSM_LINK_MIN_RSSI
+#define GSM_LINK_MIN_RSSI 8
+#endif
+// Longest a periodic transmission waits for a better link
+#ifndef GSM_LINK_MAX_DEFER
+#define GSM_LINK_MAX_DEFER MINUTES(5)
+#endif
+
+#define GSM_LINK_HYSTERESIS 2
+#define GSM_LINK_PERIOD MINUTES(60)
+
+struct gsm_link_counts_t
+{
+	uint16_t attempts;
+	uint16_t failed; // Wasted attempts
+	uint16_t deferred;
+};
+
+struct gsm_link_t
+{
+	uint16_t rssi; // CSQ moving average, 4 fractional bits
+	uint32_t sampled_at; // 0 before the first sample
+	bool registered;
+	bool poor;
+	uint32_t period_start;
+	gsm_link_counts_t current; // This hour so far
+	gsm_link_counts_t last; // The hour before
+};
+
+void gsm_link_init(gsm_link_t *link);
+
+// csq as reported, 99 is unknown
+void gsm_link_sample(gsm_link_t *link, uint8_t csq, bool registered);
+bool gsm_link_good(gsm_link_t *link);
+
+// Called when periodic traffic is due, true to hold it back. since is the
+// caller's own, it times how long that traffic has waited.
+bool gsm_link_defer(gsm_link_t *link, uint32_t *since);
+void gsm_link_record(gsm_link_t *link, bool success);
+
+void gsm_link_print(gsm_link_t *link);
+uint8_t gsm_link_format(gsm_link_t *link, char *out, uint8_t max_chars);
+
+#endif
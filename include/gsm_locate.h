@@ -0,0 +1,50 @@
+#ifndef _GSM_LOCATE_H_
+#define _GSM_LOCATE_H_
+
+#include <Arduino.h>
+#include "util.h"
+
+// Coarse position from the serving cell while the GPS has no fix. The
+// modem's AT+CIPGSMLOC looks the cell up over the bearer, which takes a few
+// seconds and some data, so results are kept per cell ID. The accuracy
+// comes from the timing advance of AT+CENG, the distance to the tower in
+// steps of about 550 m.
+
+#ifndef GSM_LOCATE_CACHE_SIZE
+#define GSM_LOCATE_CACHE_SIZE 4
+#endif
+
+#define GSM_LOCATE_TA_STEP 550 // m per timing advance step
+#define GSM_LOCATE_MAX_TA 63
+#define GSM_LOCATE_DEFAULT_ACCURACY 3000 // m, the timing advance is unknown
+
+struct gsm_location_t
+{
+	float latitude;
+	float longitude;
+	uint16_t accuracy; // m
+	bool cached; // From an earlier lookup of the same cell
+};
+
+struct gsm_locate_entry_t
+{
+	uint32_t cell; // LAC and cell ID, 0 is unused
+	float latitude;
+	float longitude;
+	uint32_t used; // millis, the least recently used entry goes first
+};
+
+struct gsm_locate_t
+{
+	gsm_locate_entry_t entries[GSM_LOCATE_CACHE_SIZE];
+};
+
+void gsm_locate_init(gsm_locate_t *locate);
+
+bool gsm_locate_find(gsm_locate_t *locate, uint32_t cell, gsm_location_t *location);
+void gsm_locate_store(gsm_locate_t *locate, uint32_t cell, gsm_location_t *location);
+
+// ta as reported by AT+CENG, 255 is unknown
+uint16_t gsm_locate_accuracy(uint8_t ta);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef _GSM_STATS_H_
+#define _GSM_STATS_H_
+
+#include <Arduino.h>
+
+// Per AT command counters and latency histograms. Set GSM_STATS to 0 to
+// compile them out, GSM_STATS_UPLINK to 1 to append a summary to every
+// uplink packet.
+#ifndef GSM_STATS
+#define GSM_STATS 1
+#endif
+
+#ifndef GSM_STATS_UPLINK
+#define GSM_STATS_UPLINK 0
+#endif
+
+// RAM use is GSM_STATS_SLOTS * (12 + GSM_STATS_BUCKETS) bytes. Bucket 0 holds
+// latencies below GSM_STATS_FIRST_BUCKET_MS, every following bucket is twice
+// as wide and the last one is open ended.
+#define GSM_STATS_SLOTS 10
+#define GSM_STATS_BUCKETS 8
+#define GSM_STATS_FIRST_BUCKET_MS 64
+
+enum gsm_stats_result_t
+{
+	GSM_STATS_OK,
+	GSM_STATS_ERROR,
+	GSM_STATS_TIMEOUT
+};
+
+struct gsm_stats_slot_t
+{
+	const char *command; // Label, printed up to the first '"'
+	uint16_t count;
+	uint8_t timeouts;
+	uint8_t errors;
+	uint16_t max_ms;
+	uint32_t total_ms;
+	uint8_t histogram[GSM_STATS_BUCKETS];
+};
+
+struct gsm_stats_t
+{
+	gsm_stats_slot_t slot[GSM_STATS_SLOTS];
+	uint32_t since;
+};
+
+struct __attribute__((packed)) gsm_stats_uplink_t
+{
+	uint16_t sapbr_open_ms; // averages
+	uint16_t cipstart_ms;
+	uint16_t cipsend_ms;
+	uint16_t cmgs_ms;
+	uint8_t timeouts; // all commands
+	uint8_t errors;
+};
+
+void gsm_stats_reset(gsm_stats_t *stats);
+
+// command must outlive the stats, i.e. be a string literal. Commands that
+// only differ after a '"' share a slot. The last slot is "other", when the
+// rest are taken the command with the least total time is folded into it.
+void gsm_stats_record(gsm_stats_t *stats, const char *command, uint32_t start, gsm_stats_result_t result);
+gsm_stats_slot_t *gsm_stats_find(gsm_stats_t *stats, const char *command);
+
+void gsm_stats_print(gsm_stats_t *stats);
+void gsm_stats_format(gsm_stats_t *stats, char *out, uint8_t max_chars);
+void gsm_stats_fill_uplink(gsm_stats_t *stats, gsm_stats_uplink_t *out);
+
+#endif
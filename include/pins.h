@@ -10,4 +10,31 @@
 #define GSM_ENABLE   6
 #define GSM_RING     7
 
-#endif
\ No newline at end of file
+// Which UART each device is wired to. AltSoftSerial always uses pin 8 (RX)
+// and pin 9 (TX), the hardware UART pins 0 and 1. Override with build flags,
+// e.g. -D GSM_UART=UART_HARDWARE -D GPS_UART=UART_ALTSOFT.
+#define UART_HARDWARE 1
+#define UART_SOFTWARE 2
+#define UART_ALTSOFT  3
+#define UART_HOST     4
+
+#ifdef HOST_BUILD
+#undef GPS_UART
+#undef GSM_UART
+#define GPS_UART UART_HOST
+#define GSM_UART UART_HOST
+#endif
+
+#ifndef GPS_UART
+#define GPS_UART UART_SOFTWARE
+#endif
+
+#ifndef GSM_UART
+#define GSM_UART UART_SOFTWARE
+#endif
+
+#if GPS_UART == GSM_UART && (GPS_UART == UART_HARDWARE || GPS_UART == UART_ALTSOFT)
+#error "GPS and GSM can not share the same UART"
+#endif
+
+#endif
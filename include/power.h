@@ -0,0 +1,52 @@
+#ifndef _POWER_H_
+#define _POWER_H_
+
+#include <Arduino.h>
+#include "util.h"
+
+// Sleeping between events, and the modem's RING line as an interrupt.
+//
+// Waits put the MCU in idle sleep instead of spinning. Idle keeps the
+// clocks running, so millis(), SoftwareSerial's pin change interrupts and
+// the UARTs still work, and the CPU wakes on the next of: the millis tick,
+// a received byte or RING. The deeper modes stop the I/O clock and take
+// too long to wake up for the start bit of a SoftwareSerial byte.
+//
+// RING is on pin 7, which is also AIN1 of the analog comparator. Its pin
+// change vector is taken by SoftwareSerial, so the comparator against the
+// bandgap reference gives RING an interrupt of its own. The edge is
+// latched: a call that rings in the middle of the GPS window ends it, and
+// gsm_run() answers right after.
+//
+// Compiled out with -D POWER_SLEEP=0, RING is then polled as before.
+
+#ifndef POWER_SLEEP
+#define POWER_SLEEP 1
+#endif
+
+// MCU supply current in uA for the energy estimate in the profiler report,
+// ATmega328P at 8 MHz and 3.3 V from the datasheet's typical curves
+#ifndef POWER_ACTIVE_UA
+#define POWER_ACTIVE_UA 3000
+#endif
+#ifndef POWER_IDLE_UA
+#define POWER_IDLE_UA 800
+#endif
+
+void power_init();
+
+// Sleeps until the next interrupt, at most a millis tick or so. Feeds the
+// watchdog, see watchdog.h.
+void power_idle();
+
+// delay() that sleeps in between
+void power_delay(uint32_t ms);
+
+// Whether RING went low since the last call to power_ring_clear()
+bool power_ring_pending();
+void power_ring_clear();
+
+// Time spent in power_idle() since the last call, in us
+uint32_t power_take_sleep_us();
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+#include <Arduino.h>
+#include "serial.h"
+#include "bench.h"
+#include "util.h"
+
+// Cycle time per main loop phase and the part of it spent in blocking waits,
+// collected between reports. Compiled out with -D PROFILER=0. The waits are
+// marked for the cycle benchmarks as well, see bench.h.
+
+enum profiler_phase_t
+{
+	PHASE_LOOP,
+	PHASE_GPS,
+	PHASE_PRINT,
+	PHASE_GSM,
+	PHASE_SUBSCRIPTION,
+	NUM_PHASES
+};
+
+struct profiler_phase_stats_t
+{
+	uint16_t count;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint32_t total_us;
+	uint32_t wait_us;
+};
+
+#if PROFILER
+
+void profiler_begin(profiler_phase_t phase);
+void profiler_end(profiler_phase_t phase);
+
+// Marks time spent blocked on a peripheral, may nest
+void profiler_wait_begin();
+void profiler_wait_end();
+
+void profiler_print(serial_t *gps_serial, serial_t *gsm_serial);
+
+#define PROFILER_BEGIN(phase) profiler_begin(phase)
+#define PROFILER_END(phase) profiler_end(phase)
+#define PROFILER_WAIT_BEGIN() do { profiler_wait_begin(); BENCH_MARK(BENCH_WAIT_BEGIN); } while (0)
+#define PROFILER_WAIT_END() do { BENCH_MARK(BENCH_WAIT_END); profiler_wait_end(); } while (0)
+
+#else
+
+#define PROFILER_BEGIN(phase)
+#define PROFILER_END(phase)
+#define PROFILER_WAIT_BEGIN() BENCH_MARK(BENCH_WAIT_BEGIN)
+#define PROFILER_WAIT_END() BENCH_MARK(BENCH_WAIT_END)
+
+#endif
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef _SERIAL_H_
+#define _SERIAL_H_
+
+#include <Arduino.h>
+#include "pins.h"
+#include "util.h"
+#include "trace.h"
+
+#if GPS_UART == UART_SOFTWARE || GSM_UART == UART_SOFTWARE
+#include <SoftwareSerial.h>
+#endif
+#if GPS_UART == UART_ALTSOFT || GSM_UART == UART_ALTSOFT
+#include <AltSoftSerial.h>
+#endif
+#if GPS_UART == UART_HOST || GSM_UART == UART_HOST
+#include <HostSerial.h>
+#endif
+
+struct serial_t;
+
+typedef void (*serial_begin_t)(serial_t *, uint32_t);
+typedef void (*serial_listen_t)(serial_t *);
+typedef bool (*serial_overflow_t)(serial_t *);
+
+// Byte stream the drivers talk to. All backends are Arduino Streams, only
+// starting, listening and overflow detection differ between them.
+struct serial_t
+{
+	Stream *stream;
+	void *port;
+	serial_begin_t begin;
+	serial_listen_t listen;
+	serial_overflow_t overflow;
+#if PROFILER
+	uint32_t rx_bytes;
+	uint16_t overflows;
+#endif
+#if SERIAL_TRACE
+	uint8_t trace_channel; // TRACE_GPS or TRACE_GSM
+#endif
+};
+
+#if GPS_UART == UART_HARDWARE || GSM_UART == UART_HARDWARE
+void serial_init_hardware(serial_t *serial, HardwareSerial *port);
+#endif
+#if GPS_UART == UART_SOFTWARE || GSM_UART == UART_SOFTWARE
+void serial_init_software(serial_t *serial, SoftwareSerial *port);
+#endif
+#if GPS_UART == UART_ALTSOFT || GSM_UART == UART_ALTSOFT
+void serial_init_altsoft(serial_t *serial, AltSoftSerial *port);
+#endif
+#if GPS_UART == UART_HOST || GSM_UART == UART_HOST
+void serial_init_host(serial_t *serial, HostSerial *port);
+#endif
+
+void serial_begin(serial_t *serial, uint32_t baud);
+void serial_listen(serial_t *serial);
+
+// Whether received bytes were lost since the last call, also in the trace
+bool serial_overflow(serial_t *serial);
+
+// With both devices on the same kind of port its class is known here, and
+// the per byte calls go straight to it instead of through Stream's vtable
+#if GPS_UART == GSM_UART && GPS_UART == UART_SOFTWARE
+#define SERIAL_PORT SoftwareSerial
+#elif GPS_UART == GSM_UART && GPS_UART == UART_HOST
+#define SERIAL_PORT HostSerial
+#endif
+
+#ifdef SERIAL_PORT
+#define SERIAL_CALL(serial, method) (((SERIAL_PORT *)(serial)->port)->SERIAL_PORT::method())
+#else
+#define SERIAL_CALL(serial, method) ((serial)->stream->method())
+#endif
+
+inline int serial_available(serial_t *serial)
+{
+#if SERIAL_TRACE
+	// Polled while waiting, the bytes before a hang are written out
+	trace_poll();
+#endif
+	return SERIAL_CALL(serial, available);
+}
+
+inline int serial_read(serial_t *serial)
+{
+#if PROFILER || SERIAL_TRACE
+	int c = SERIAL_CALL(serial, read);
+	if (c >= 0)
+	{
+#if PROFILER
+		serial->rx_bytes++;
+#endif
+#if SERIAL_TRACE
+		trace_byte(serial->trace_channel | TRACE_RX, c);
+#endif
+	}
+	return c;
+#else
+	return SERIAL_CALL(serial, read);
+#endif
+}
+
+inline size_t serial_write(serial_t *serial, uint8_t c)
+{
+#if SERIAL_TRACE
+	trace_byte(serial->trace_channel | TRACE_TX, c);
+#endif
+	return serial->stream->write(c);
+}
+
+inline size_t serial_print(serial_t *serial, const char *out)
+{
+#if SERIAL_TRACE
+	trace_string(serial->trace_channel | TRACE_TX, out);
+#endif
+	return serial->stream->print(out);
+}
+
+inline size_t serial_println(serial_t *serial, const char *out)
+{
+#if SERIAL_TRACE
+	trace_string(serial->trace_channel | TRACE_TX, out);
+	trace_string(serial->trace_channel | TRACE_TX, "\r\n");
+#endif
+	return serial->stream->println(out);
+}
+
+#endif
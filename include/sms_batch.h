@@ -0,0 +1,51 @@
+#ifndef _SMS_BATCH_H_
+#define _SMS_BATCH_H_
+
+#include <Arduino.h>
+#include "gps.h"
+
+// Fixes packed for one binary SMS, for units that only report over SMS.
+// A text SMS holds a single position, this holds SMS_BATCH_MAX_FIXES.
+// tools/sms_batch.py decodes it. Big endian:
+//
+//   0   version, SMS_BATCH_VERSION
+//   1   number of fixes
+//   2   battery, % when the last fix was added
+//   3   time of the first fix, s since 2000-01-01 UTC, 0 if unknown (4)
+//   7   latitude of the first fix, 1e-5 degrees (4)
+//   11  longitude (4)
+//   15  HDOP of the first fix, 0.1, 255 for anything worse
+//   16  every later fix: s since the one before (2), latitude and
+//       longitude change in 1e-5 degrees (2 + 2) and HDOP (1)
+//
+// 1e-5 degrees is a metre or so, and a change fits in 16 bits up to
+// 36 km and 18 hours from the fix before.
+
+#define SMS_BATCH_SIZE 140 // User data of one 8-bit SMS
+#define SMS_BATCH_VERSION 1
+#define SMS_BATCH_HEADER 16
+#define SMS_BATCH_FIX 7
+#define SMS_BATCH_MAX_FIXES (1 + (SMS_BATCH_SIZE - SMS_BATCH_HEADER) / SMS_BATCH_FIX)
+
+struct sms_batch_t
+{
+	uint8_t data[SMS_BATCH_SIZE];
+	uint8_t length;
+	uint32_t last_time; // millis() of the last fix, whole seconds after the first
+	int32_t last_latitude;
+	int32_t last_longitude;
+};
+
+void sms_batch_init(sms_batch_t *batch);
+
+// utc is the time of the fix as from gps_get_utc(), only the first one's is
+// kept. False when the batch is full or the fix is too far from the last
+// one, send it and start over.
+bool sms_batch_add(sms_batch_t *batch, gps_position_t *pos, uint32_t utc, uint8_t battery);
+
+inline uint8_t sms_batch_count(sms_batch_t *batch)
+{
+	return batch->data[1];
+}
+
+#endif
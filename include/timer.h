@@ -12,5 +12,7 @@ struct timer_t
 void timer_reset(timer_t *timer);
 void timer_init(timer_t *timer, uint32_t interval);
 bool timer_elapsed(timer_t *timer);
+bool timer_due(timer_t *timer);
+void timer_expire(timer_t *timer);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,67 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <Arduino.h>
+#include "util.h"
+
+// Capture of every byte to and from the GPS and the modem, for replaying
+// field problems on the native build, see tools/serial_trace.py.
+//
+// Bytes are logged as the drivers read and write them, with millis(). The
+// trace goes out of the hardware UART at TRACE_BAUD, which then carries
+// nothing else, so the debug console is off. The native build writes it to
+// the file in $HOST_TRACE.
+//
+// After the "ST" magic and version each record is a tag, the ms since the
+// record before as a varint, seven bits a byte, and the data. The tag holds
+// the channel in the top two bits and the byte count, 1 to TRACE_RECORD_MAX,
+// in the others. Bytes of a channel within the same ms share a record.
+// A count of 0 marks a receive overflow on the channel, bytes were lost
+// before the driver read them, and has no data.
+//
+// A record is written once the next one starts or it is TRACE_FLUSH_MS
+// old, and before a reset, so the bytes up to a stall are in the trace.
+//
+// Built in with -D SERIAL_TRACE=1.
+
+#ifndef SERIAL_TRACE
+#define SERIAL_TRACE 0
+#endif
+
+#ifndef TRACE_BAUD
+#define TRACE_BAUD 115200
+#endif
+
+#ifndef TRACE_FLUSH_MS
+#define TRACE_FLUSH_MS 5
+#endif
+
+#define TRACE_VERSION 2
+#define TRACE_RECORD_MAX 16 // Below 'S', so the magic is never a valid tag
+
+#define TRACE_RX 0
+#define TRACE_TX 1
+#define TRACE_GPS 0
+#define TRACE_GSM 2
+
+#if SERIAL_TRACE && !defined(HOST_BUILD)
+#if DEBUG_ENABLE
+#error "SERIAL_TRACE takes the hardware UART from the debug console"
+#endif
+#if GPS_UART == UART_HARDWARE || GSM_UART == UART_HARDWARE
+#error "SERIAL_TRACE needs the hardware UART to itself"
+#endif
+#endif
+
+#if SERIAL_TRACE
+void trace_init();
+void trace_byte(uint8_t channel, uint8_t c);
+void trace_string(uint8_t channel, const char *s);
+void trace_overflow(uint8_t channel);
+// Writes a record that has been pending for TRACE_FLUSH_MS
+void trace_poll();
+// Writes the pending record and waits until it is out of the UART
+void trace_flush();
+#endif
+
+#endif
@@ -1,7 +1,10 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+// Buffer sizes, may be lowered with build flags to save RAM
+#ifndef MAX_SMS_LENGTH
 #define MAX_SMS_LENGTH 160
+#endif
 #define MAX_PHONE_NO_LENGTH 14
 #define SECONDS(x) (x * 1000UL) // seconds
 #define MINUTES(x) SECONDS(60 * x)
@@ -10,14 +13,34 @@
 extern char phone_scratch_pad[MAX_PHONE_NO_LENGTH + 1];
 extern char text_scratch_pad[MAX_SMS_LENGTH + 1];
 
-#if 1
+#include "pins.h"
+
+// The debug console shares the hardware UART, so it goes quiet when a device
+// or the serial trace is on that UART.
+#ifndef DEBUG_ENABLE
+#if GPS_UART == UART_HARDWARE || GSM_UART == UART_HARDWARE || (SERIAL_TRACE && !defined(HOST_BUILD))
+#define DEBUG_ENABLE 0
+#else
+#define DEBUG_ENABLE 1
+#endif
+#endif
+
+// Main loop profiler, reports over the debug console, see profiler.h
+#ifndef PROFILER
+#define PROFILER DEBUG_ENABLE
+#endif
+
+#if DEBUG_ENABLE
 #define DEBUG_PRINTLN(x) Serial.println(x)
 #define DEBUG_PRINT(x) Serial.print(x)
 #else
-#define DEBUG_PRINTLN(x) (void)x
-#define DEBUG_PRINT(x) (void)x
+#define DEBUG_PRINTLN(x) (void)(x)
+#define DEBUG_PRINT(x) (void)(x)
 #endif
 
-extern void(* resetFunc) (void);
+// Intentional resets go through here, reset_hook gets to save state first.
+// The watchdog resets the peripherals along with the MCU, see watchdog.h.
+extern void(* reset_hook) (void);
+void system_reset();
 
 #endif
\ No newline at end of file
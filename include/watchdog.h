@@ -0,0 +1,90 @@
+#ifndef _WATCHDOG_H_
+#define _WATCHDOG_H_
+
+#include <Arduino.h>
+#include "util.h"
+
+// Hardware watchdog supervising the main loop, the GPS and the modem.
+//
+// The AVR watchdog resets the MCU and its peripherals unless it is fed
+// within WATCHDOG_PERIOD. It is fed from power_idle(), which every wait
+// goes through, and from the main loop, but only while each busy task has
+// beaten within its limit. Code that spins without waiting trips it after
+// WATCHDOG_PERIOD, a wait that never ends once its task's limit has passed.
+//
+// The tasks that were busy and the last AT command are kept in RAM the
+// startup code leaves alone, and copied to EEPROM after the reset for
+// STATS. The modem runs on through a reset of the MCU, so gsm_init() then
+// probes it before power cycling it, and a modem still registered is ready
+// again in a second or two.
+//
+// After a watchdog reset the watchdog stays on at its shortest period. The
+// old ATmegaBOOT does not turn it off and resets over and over, so the
+// watchdog is only started under Optiboot, see platformio.ini. Under any
+// other bootloader there is no supervision and system_reset() jumps to the
+// start of the program.
+//
+// The supervision is compiled out with -D WATCHDOG=0, system_reset() still
+// resets through the watchdog.
+
+#ifndef WATCHDOG
+#define WATCHDOG 1
+#endif
+
+#define WATCHDOG_PERIOD 4000 // ms, WDTO_4S
+#define WATCHDOG_EEPROM_BASE 0x180 // After the GPS warm start record
+#define WATCHDOG_COMMAND_MAX 15
+
+// Longest time between heartbeats while busy
+#define WATCHDOG_LOOP_LIMIT MINUTES(10) // SMS to every subscriber
+#define WATCHDOG_GPS_LIMIT MINUTES(3) // The longest window, 5 times 30 s
+#define WATCHDOG_GSM_LIMIT SECONDS(60) // The longest wait, AT+CMGS, is 40 s
+
+enum watchdog_task_t
+{
+	WATCHDOG_LOOP,
+	WATCHDOG_GPS,
+	WATCHDOG_GSM,
+	WATCHDOG_NUM_TASKS
+};
+
+enum watchdog_cause_t
+{
+	WATCHDOG_POWER_ON,
+	WATCHDOG_STALL, // The watchdog went off
+	WATCHDOG_RESET, // system_reset()
+	WATCHDOG_EXTERNAL // The reset pin
+};
+
+// As kept over the reset and in EEPROM
+struct watchdog_crumb_t
+{
+	uint8_t magic;
+	uint8_t cause;
+	uint8_t stalled; // Task over its limit, WATCHDOG_NUM_TASKS if none was
+	uint8_t busy; // Bit per task
+	char command[WATCHDOG_COMMAND_MAX + 1]; // Last AT command sent
+	uint8_t checksum;
+};
+
+// First thing in setup(), keeps what the last reset left and starts the
+// watchdog
+void watchdog_init();
+// How the last reset came about, crumb may be NULL
+watchdog_cause_t watchdog_last_reset(watchdog_crumb_t *crumb);
+
+// The task is busy and alive
+void watchdog_beat(watchdog_task_t task);
+// The task is not busy, no heartbeat is expected until the next one
+void watchdog_rest(watchdog_task_t task);
+void watchdog_feed();
+
+void watchdog_command(const char *command);
+
+// Resets the MCU and its peripherals now
+void watchdog_reset();
+
+// The last reset other than a power on, returns the length
+uint8_t watchdog_format(char *out, uint8_t max_chars);
+
+#endif
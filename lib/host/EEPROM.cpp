@@ -0,0 +1,57 @@
+#include "EEPROM.h"
+
+EEPROMClass EEPROM;
+
+static const char *eeprom_path()
+{
+	const char *path = getenv("HOST_EEPROM");
+	return path ? path : "eeprom.bin";
+}
+
+void EEPROMClass::load()
+{
+	// Erased EEPROM reads as 0xff
+	memset(data, 0xff, sizeof(data));
+
+	FILE *f = fopen(eeprom_path(), "rb");
+	if (f)
+	{
+		size_t n = fread(data, 1, sizeof(data), f);
+		(void)n;
+		fclose(f);
+	}
+	loaded = true;
+}
+
+uint8_t EEPROMClass::read(int address)
+{
+	if (!loaded)
+	{
+		load();
+	}
+	if (address < 0 || address >= HOST_EEPROM_SIZE)
+	{
+		return 0xff;
+	}
+	return data[address];
+}
+
+void EEPROMClass::write(int address, uint8_t value)
+{
+	if (!loaded)
+	{
+		load();
+	}
+	if (address < 0 || address >= HOST_EEPROM_SIZE)
+	{
+		return;
+	}
+	data[address] = value;
+
+	FILE *f = fopen(eeprom_path(), "wb");
+	if (f)
+	{
+		fwrite(data, 1, sizeof(data), f);
+		fclose(f);
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef _HOST_EEPROM_H_
+#define _HOST_EEPROM_H_
+
+#include "Arduino.h"
+
+#define HOST_EEPROM_SIZE 1024
+
+// EEPROM backed by a file, so settings survive a restart of the native build.
+// The file is taken from $HOST_EEPROM and defaults to eeprom.bin.
+class EEPROMClass
+{
+public:
+	uint8_t read(int address);
+	void write(int address, uint8_t value);
+	void update(int address, uint8_t value) { if (read(address) != value) write(address, value); }
+	uint16_t length() { return HOST_EEPROM_SIZE; }
+
+	template <typename T> T &get(int address, T &out)
+	{
+		for (size_t i = 0; i < sizeof(T); i++)
+		{
+			((uint8_t *)&out)[i] = read(address + i);
+		}
+		return out;
+	}
+
+	template <typename T> const T &put(int address, const T &in)
+	{
+		for (size_t i = 0; i < sizeof(T); i++)
+		{
+			update(address + i, ((const uint8_t *)&in)[i]);
+		}
+		return in;
+	}
+
+private:
+	void load();
+	bool loaded = false;
+	uint8_t data[HOST_EEPROM_SIZE];
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,433 @@
+#include <errno.h>
+#include <time.h>
+#include "HostReplay.h"
+#include "HostSerial.h"
+
+// As in include/trace.h
+#define REPLAY_VERSION 2
+#define REPLAY_RECORD_MAX 16
+#define REPLAY_CHANNELS 4 // GPS RX, GPS TX, GSM RX, GSM TX
+#define REPLAY_TX 1
+
+#define REPLAY_TAIL_US 2000000ULL // For the last answers after the last byte
+#define REPLAY_SAMPLE 40 // Characters of a differing line kept for the report
+
+struct replay_cursor_t
+{
+	size_t at;
+	uint32_t time; // ms of the last record passed
+};
+
+struct replay_record_t
+{
+	uint8_t channel;
+	uint8_t length; // 0 for a receive overflow
+	uint32_t time;
+	const uint8_t *data;
+};
+
+// A line sent by the firmware, or the one it sent in the recording
+struct replay_line_t
+{
+	uint32_t hash;
+	uint16_t length;
+	char sample[REPLAY_SAMPLE + 1];
+};
+
+// Each channel goes through the trace on its own, so a port the firmware
+// is not reading never holds up the other one
+struct replay_channel_t
+{
+	HostSerial *port;
+	replay_cursor_t cursor;
+	replay_record_t record;
+	uint8_t index; // Into record
+	bool done;
+	replay_line_t sent; // So far, on the sending channels
+};
+
+static bool active;
+static uint8_t *trace;
+static size_t trace_size;
+static uint64_t now_us;
+static struct timespec wall_start;
+
+static const char *end_reason; // Why the recording ended
+static uint32_t end_time; // ms of the last record
+
+static replay_channel_t channels[REPLAY_CHANNELS];
+
+static uint32_t rx_bytes;
+static uint32_t rx_overflows; // In the recording, the bytes were never traced
+static uint32_t lines;
+static uint32_t lines_differ;
+static uint32_t lines_extra; // Sent beyond the end of the recording
+static uint64_t lag_sum_ms;
+static uint32_t lag_max_ms;
+static bool first_found;
+static uint32_t first_time;
+static uint8_t first_channel;
+static replay_line_t first_expected;
+static replay_line_t first_sent;
+
+// Next record of the trace, false at its end or the next boot
+static bool replay_next(replay_cursor_t *cursor, replay_record_t *out)
+{
+	if (cursor->at >= trace_size)
+	{
+		return false;
+	}
+
+	uint8_t tag = trace[cursor->at];
+	uint8_t length = tag & 0x3f;
+	if (length > REPLAY_RECORD_MAX)
+	{
+		return false;
+	}
+
+	size_t at = cursor->at + 1;
+	uint32_t delta = 0;
+	for (uint8_t shift = 0; at < trace_size; shift += 7)
+	{
+		uint8_t b = trace[at++];
+		delta |= uint32_t(b & 0x7f) << shift;
+		if (!(b & 0x80))
+		{
+			break;
+		}
+	}
+	if (at + length > trace_size)
+	{
+		return false;
+	}
+
+	out->channel = tag >> 6;
+	out->length = length;
+	out->time = cursor->time + delta;
+	out->data = trace + at;
+	cursor->at = at + length;
+	cursor->time = out->time;
+	return true;
+}
+
+// Moves the channel on to its next record, false past its last one
+static bool replay_next_on(replay_channel_t *ch, uint8_t channel)
+{
+	ch->index = 0;
+	while (replay_next(&ch->cursor, &ch->record))
+	{
+		if (ch->record.channel != channel)
+		{
+			continue;
+		}
+		if (ch->record.length)
+		{
+			return true;
+		}
+		rx_overflows++;
+		fprintf(stderr, "replay: %s receive overflow at %.3f s in the recording\n",
+			channel >> 1 ? "GSM" : "GPS", ch->record.time / 1000.0);
+	}
+	ch->done = true;
+	ch->record.length = 0;
+	return false;
+}
+
+static void replay_line_add(replay_line_t *line, uint8_t c)
+{
+	line->hash = (line->hash ^ c) * 16777619UL;
+	if (line->length < REPLAY_SAMPLE)
+	{
+		line->sample[line->length] = c >= ' ' && c < 0x7f ? c : '.';
+		line->sample[line->length + 1] = '\0';
+	}
+	line->length++;
+}
+
+static void replay_line_clear(replay_line_t *line)
+{
+	line->hash = 2166136261UL;
+	line->length = 0;
+	line->sample[0] = '\0';
+}
+
+// The next recorded line sent on the channel, false past the last one
+static bool replay_expected_line(replay_channel_t *ch, uint8_t channel, replay_line_t *line, uint32_t *time)
+{
+	replay_line_clear(line);
+	for (;;)
+	{
+		if (ch->index == ch->record.length)
+		{
+			if (ch->done || !replay_next_on(ch, channel))
+			{
+				return line->length != 0;
+			}
+		}
+		uint8_t c = ch->record.data[ch->index++];
+		*time = ch->record.time;
+		replay_line_add(line, c);
+		if (c == '\n')
+		{
+			return true;
+		}
+	}
+}
+
+static void replay_compare(replay_channel_t *ch, uint8_t channel)
+{
+	replay_line_t expected;
+	uint32_t time;
+
+	lines++;
+	if (!replay_expected_line(ch, channel, &expected, &time))
+	{
+		lines_extra++;
+		return;
+	}
+
+	uint32_t now_ms = now_us / 1000;
+	uint32_t lag = now_ms > time ? now_ms - time : time - now_ms;
+	lag_sum_ms += lag;
+	if (lag > lag_max_ms)
+	{
+		lag_max_ms = lag;
+	}
+
+	if (expected.hash != ch->sent.hash || expected.length != ch->sent.length)
+	{
+		lines_differ++;
+		if (!first_found)
+		{
+			first_found = true;
+			first_time = now_ms;
+			first_channel = channel;
+			first_expected = expected;
+			first_sent = ch->sent;
+		}
+	}
+}
+
+static void replay_deliver()
+{
+	for (uint8_t channel = 0; channel < REPLAY_CHANNELS; channel += 2)
+	{
+		replay_channel_t *ch = &channels[channel];
+		while (!ch->done && uint64_t(ch->record.time) * 1000 <= now_us)
+		{
+			while (ch->port && ch->index < ch->record.length && ch->port->receive(ch->record.data[ch->index]))
+			{
+				ch->index++;
+				rx_bytes++;
+			}
+			if (ch->port && ch->index < ch->record.length)
+			{
+				break; // Full, wait for the firmware to read
+			}
+			replay_next_on(ch, channel);
+		}
+	}
+}
+
+// When the next byte is due on any port
+static uint64_t replay_due()
+{
+	uint64_t due = UINT64_MAX;
+	for (uint8_t channel = 0; channel < REPLAY_CHANNELS; channel += 2)
+	{
+		replay_channel_t *ch = &channels[channel];
+		if (!ch->done && uint64_t(ch->record.time) * 1000 < due)
+		{
+			due = uint64_t(ch->record.time) * 1000;
+		}
+	}
+	return due;
+}
+
+// Bytes the firmware read in the recording that are still to be handed over
+static uint32_t replay_left()
+{
+	uint32_t left = 0;
+	for (uint8_t channel = 0; channel < REPLAY_CHANNELS; channel += 2)
+	{
+		replay_channel_t *ch = &channels[channel];
+		replay_cursor_t cursor = ch->cursor;
+		replay_record_t record;
+		left += ch->record.length - ch->index;
+		while (replay_next(&cursor, &record))
+		{
+			left += record.channel == channel ? record.length : 0;
+		}
+	}
+	return left;
+}
+
+// Ends at the time of the last record, even if the firmware fell behind
+// reading one of the ports
+static void replay_advance(uint64_t us)
+{
+	now_us += us;
+	if (now_us >= uint64_t(end_time) * 1000 + REPLAY_TAIL_US)
+	{
+		host_replay_end(end_reason);
+	}
+}
+
+bool host_replay_begin()
+{
+	const char *path = getenv("HOST_REPLAY");
+	if (!path)
+	{
+		return false;
+	}
+
+	FILE *f = fopen(path, "rb");
+	if (!f)
+	{
+		fprintf(stderr, "replay: could not open %s: %s\n", path, strerror(errno));
+		exit(2);
+	}
+	fseek(f, 0, SEEK_END);
+	trace_size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	trace = (uint8_t *)malloc(trace_size ? trace_size : 1);
+	if (fread(trace, 1, trace_size, f) != trace_size || trace_size < 3 ||
+		trace[0] != 'S' || trace[1] != 'T' || trace[2] != REPLAY_VERSION)
+	{
+		fprintf(stderr, "replay: %s is not a version %d trace\n", path, REPLAY_VERSION);
+		exit(2);
+	}
+	fclose(f);
+
+	active = true;
+	clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+	for (uint8_t i = 0; i < REPLAY_CHANNELS; i++)
+	{
+		channels[i].cursor.at = 3;
+		replay_line_clear(&channels[i].sent);
+	}
+
+	replay_cursor_t cursor = channels[0].cursor;
+	replay_record_t record;
+	while (replay_next(&cursor, &record))
+	{
+	}
+	end_time = cursor.time;
+	end_reason = cursor.at < trace_size ? "reset in the recording" : "end of trace";
+	return true;
+}
+
+bool host_replay_active()
+{
+	return active;
+}
+
+uint64_t host_replay_now()
+{
+	replay_advance(1);
+	return now_us;
+}
+
+void host_replay_wait(uint32_t us)
+{
+	replay_deliver();
+
+	uint64_t until = now_us + us;
+	uint64_t due = replay_due();
+	if (due > now_us && due < until)
+	{
+		until = due;
+	}
+	replay_advance(until - now_us);
+
+	replay_deliver();
+}
+
+void host_replay_attach(HostSerial *port, const char *env_name)
+{
+	uint8_t channel = strncmp(env_name, "GSM", 3) == 0 ? 2 : 0;
+	channels[channel].port = port;
+	channels[channel | REPLAY_TX].port = port;
+}
+
+void host_replay_sent(HostSerial *port, const uint8_t *data, size_t size)
+{
+	for (uint8_t channel = REPLAY_TX; channel < REPLAY_CHANNELS; channel += 2)
+	{
+		replay_channel_t *ch = &channels[channel];
+		if (ch->port != port)
+		{
+			continue;
+		}
+		for (size_t i = 0; i < size; i++)
+		{
+			replay_line_add(&ch->sent, data[i]);
+			if (data[i] == '\n')
+			{
+				replay_compare(ch, channel);
+				replay_line_clear(&ch->sent);
+			}
+		}
+	}
+}
+
+// The samples are printable ASCII already
+static void replay_json_safe(char *s)
+{
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+		{
+			*s = '.';
+		}
+	}
+}
+
+void host_replay_end(const char *reason)
+{
+	struct timespec wall;
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	double wall_s = (wall.tv_sec - wall_start.tv_sec) + (wall.tv_nsec - wall_start.tv_nsec) / 1e9;
+	double trace_s = now_us / 1e6;
+	uint32_t compared = lines - lines_extra;
+	const char *name = first_channel >> 1 ? "GSM" : "GPS";
+
+	fflush(stdout);
+	uint32_t left = replay_left();
+	fprintf(stderr, "replay: %s, %.1f s of trace in %.1f s, %u bytes received, %u not read, %u overflows recorded\n",
+		reason, trace_s, wall_s, rx_bytes, left, rx_overflows);
+	fprintf(stderr, "replay: %u lines sent, %u differ, %u past the recording\n", lines, lines_differ, lines_extra);
+	if (first_found)
+	{
+		fprintf(stderr, "replay: first difference at %.3f s on %s, recorded \"%s\", sent \"%s\"\n",
+			first_time / 1000.0, name, first_expected.sample, first_sent.sample);
+	}
+	if (compared)
+	{
+		fprintf(stderr, "replay: sent lines off the recorded time by %.0f ms on average, %u ms at most\n",
+			double(lag_sum_ms) / compared, lag_max_ms);
+	}
+
+	const char *path = getenv("HOST_REPLAY_REPORT");
+	FILE *f = path ? fopen(path, "w") : NULL;
+	if (f)
+	{
+		fprintf(f, "{\"end\": \"%s\", \"trace_s\": %.3f, \"wall_s\": %.3f, \"rx_bytes\": %u, \"rx_not_read\": %u, "
+			"\"rx_overflows\": %u, \"lines\": %u, \"lines_differ\": %u, \"lines_extra\": %u, "
+			"\"lag_ms\": {\"mean\": %.1f, \"max\": %u}",
+			reason, trace_s, wall_s, rx_bytes, left, rx_overflows, lines, lines_differ, lines_extra,
+			compared ? double(lag_sum_ms) / compared : 0.0, lag_max_ms);
+		if (first_found)
+		{
+			replay_json_safe(first_expected.sample);
+			replay_json_safe(first_sent.sample);
+			fprintf(f, ", \"first_difference\": {\"time_s\": %.3f, \"port\": \"%s\", \"recorded\": \"%s\", \"sent\": \"%s\"}",
+				first_time / 1000.0, name, first_expected.sample, first_sent.sample);
+		}
+		fprintf(f, "}\n");
+		fclose(f);
+	}
+
+	exit(lines_differ ? 1 : 0);
+}
@@ -0,0 +1,37 @@
+#ifndef _HOST_REPLAY_H_
+#define _HOST_REPLAY_H_
+
+#include "Arduino.h"
+
+// Replay of a trace recorded with SERIAL_TRACE, see include/trace.h.
+//
+// With $HOST_REPLAY naming a trace file the GPS and modem ports take their
+// input from it instead of an endpoint, and the clock is virtual: waiting
+// for input jumps ahead to the next recorded byte, and every read of the
+// clock costs a microsecond so busy waits end. A replay does the same thing
+// every time, and runs much faster than real time.
+//
+// Received bytes are handed over when the firmware read them in the
+// recording. What the firmware sends is compared line by line with what it
+// sent then. The replay ends a little after the last recorded byte, or at
+// the next boot in the trace, with a summary on stderr and as JSON in
+// $HOST_REPLAY_REPORT. The exit status is 1 if any line differed.
+
+class HostSerial;
+
+// Loads $HOST_REPLAY, false without it
+bool host_replay_begin();
+bool host_replay_active();
+
+// Virtual time in us
+uint64_t host_replay_now();
+// Lets up to us pass, less if a byte is due before, and hands out due bytes
+void host_replay_wait(uint32_t us);
+
+// Ports are told apart by the name of their environment variable
+void host_replay_attach(HostSerial *port, const char *env_name);
+void host_replay_sent(HostSerial *port, const uint8_t *data, size_t size);
+
+void host_replay_end(const char *reason);
+
+#endif
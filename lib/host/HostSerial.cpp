@@ -0,0 +1,342 @@
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "HostSerial.h"
+#include "HostReplay.h"
+
+#define HOST_SERIAL_PORTS 4
+
+// Open ports, for idle()
+static HostSerial *host_serial_ports[HOST_SERIAL_PORTS];
+
+HostSerial::HostSerial(const char *env_name, const char *default_endpoint, uint8_t ring_pin)
+	: env_name(env_name), default_endpoint(default_endpoint), ring_pin(ring_pin), ring_match(0), no_carrier_match(0),
+	  hangup_match(0), fd(-1), overflowed(false), rx_head(0), rx_tail(0)
+{
+}
+
+// Advances a match of pattern over a byte stream, true when it completes
+static bool host_serial_match(const char *pattern, uint8_t *progress, uint8_t c)
+{
+	if (c == pattern[*progress])
+	{
+		(*progress)++;
+	}
+	else
+	{
+		*progress = c == pattern[0] ? 1 : 0;
+	}
+
+	if (pattern[*progress] == '\0')
+	{
+		*progress = 0;
+		return true;
+	}
+	return false;
+}
+
+static int host_serial_open_pty()
+{
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0)
+	{
+		return -1;
+	}
+
+	struct termios tio;
+	if (tcgetattr(fd, &tio) == 0)
+	{
+		cfmakeraw(&tio);
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+	return fd;
+}
+
+static int host_serial_open_tcp(const char *endpoint)
+{
+	char host[64];
+	const char *port = strrchr(endpoint, ':');
+	if (!port || size_t(port - endpoint) >= sizeof(host))
+	{
+		return -1;
+	}
+	memcpy(host, endpoint, port - endpoint);
+	host[port - endpoint] = '\0';
+	port++;
+
+	struct addrinfo hints;
+	struct addrinfo *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res) != 0)
+	{
+		return -1;
+	}
+
+	int fd = -1;
+	for (struct addrinfo *ai = res; ai; ai = ai->ai_next)
+	{
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+		{
+			continue;
+		}
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+		{
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd >= 0)
+	{
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	return fd;
+}
+
+void HostSerial::begin(unsigned long baud)
+{
+	(void)baud;
+	// Baud changes don't apply to a pty or socket, keep the endpoint
+	if (fd >= 0)
+	{
+		return;
+	}
+
+	if (host_replay_active())
+	{
+		host_replay_attach(this, env_name);
+		return;
+	}
+
+	const char *endpoint = getenv(env_name);
+	if (!endpoint)
+	{
+		endpoint = default_endpoint;
+	}
+
+	if (strcmp(endpoint, "pty") == 0)
+	{
+		fd = host_serial_open_pty();
+		if (fd >= 0)
+		{
+			fprintf(stderr, "%s: %s\n", env_name, ptsname(fd));
+		}
+	}
+	else if (strncmp(endpoint, "tcp:", 4) == 0)
+	{
+		fd = host_serial_open_tcp(endpoint + 4);
+	}
+	else
+	{
+		fd = open(endpoint, O_RDWR | O_NOCTTY);
+	}
+
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s: could not open %s: %s\n", env_name, endpoint, strerror(errno));
+		return;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	for (uint8_t i = 0; i < HOST_SERIAL_PORTS; i++)
+	{
+		if (host_serial_ports[i] == this || !host_serial_ports[i])
+		{
+			host_serial_ports[i] = this;
+			break;
+		}
+	}
+}
+
+void HostSerial::idle(uint32_t us)
+{
+	if (host_replay_active())
+	{
+		host_replay_wait(us);
+		return;
+	}
+
+	struct pollfd pfd[HOST_SERIAL_PORTS];
+	HostSerial *port[HOST_SERIAL_PORTS];
+	nfds_t n = 0;
+
+	// A full buffer waits for the firmware, not for more input
+	for (uint8_t i = 0; i < HOST_SERIAL_PORTS; i++)
+	{
+		HostSerial *p = host_serial_ports[i];
+		if (p && p->fd >= 0 && (p->rx_head + 1) % HOST_SERIAL_RX_SIZE != p->rx_tail)
+		{
+			pfd[n].fd = p->fd;
+			pfd[n].events = POLLIN;
+			port[n++] = p;
+		}
+	}
+
+	struct timespec timeout = { 0, long(us) * 1000 };
+	if (ppoll(pfd, n, &timeout, NULL) <= 0)
+	{
+		return;
+	}
+	for (nfds_t i = 0; i < n; i++)
+	{
+		if (pfd[i].revents & POLLIN)
+		{
+			port[i]->fill();
+		}
+	}
+}
+
+void HostSerial::end()
+{
+	if (fd >= 0)
+	{
+		close(fd);
+		fd = -1;
+	}
+	rx_head = rx_tail = 0;
+}
+
+void HostSerial::fill()
+{
+	if (host_replay_active())
+	{
+		host_replay_wait(0);
+		return;
+	}
+	if (fd < 0)
+	{
+		return;
+	}
+
+	// Read no more than fits, the kernel keeps the rest for us
+	while ((rx_head + 1) % HOST_SERIAL_RX_SIZE != rx_tail)
+	{
+		uint8_t c;
+		if (::read(fd, &c, 1) != 1)
+		{
+			break;
+		}
+		receive(c);
+	}
+}
+
+bool HostSerial::receive(uint8_t c)
+{
+	uint16_t next = (rx_head + 1) % HOST_SERIAL_RX_SIZE;
+	if (next == rx_tail)
+	{
+		return false;
+	}
+	rx_buffer[rx_head] = c;
+	rx_head = next;
+
+	if (ring_pin != 0xff)
+	{
+		if (host_serial_match("RING", &ring_match, c))
+		{
+			host_pin_set(ring_pin, LOW);
+		}
+		if (host_serial_match("NO CARRIER", &no_carrier_match, c))
+		{
+			host_pin_set(ring_pin, HIGH);
+		}
+	}
+	return true;
+}
+
+size_t HostSerial::write(uint8_t c)
+{
+	return write(&c, 1);
+}
+
+size_t HostSerial::write(const uint8_t *buffer, size_t size)
+{
+	if (ring_pin != 0xff)
+	{
+		for (size_t i = 0; i < size; i++)
+		{
+			if (host_serial_match("ATH", &hangup_match, buffer[i]))
+			{
+				host_pin_set(ring_pin, HIGH);
+			}
+		}
+	}
+
+	if (host_replay_active())
+	{
+		host_replay_sent(this, buffer, size);
+		return size;
+	}
+
+	size_t sent = 0;
+	while (fd >= 0 && sent < size)
+	{
+		ssize_t n = ::write(fd, buffer + sent, size - sent);
+		if (n > 0)
+		{
+			sent += n;
+		}
+		else if (n < 0 && errno != EAGAIN && errno != EINTR)
+		{
+			break;
+		}
+	}
+	return sent;
+}
+
+int HostSerial::available()
+{
+	fill();
+	int count = (HOST_SERIAL_RX_SIZE + rx_head - rx_tail) % HOST_SERIAL_RX_SIZE;
+	if (!count)
+	{
+		// Don't spin a host core at 100% in the drivers' busy waits
+		if (host_replay_active())
+		{
+			host_replay_wait(50);
+		}
+		else
+		{
+			usleep(50);
+		}
+	}
+	return count;
+}
+
+int HostSerial::read()
+{
+	fill();
+	if (rx_head == rx_tail)
+	{
+		return -1;
+	}
+	uint8_t c = rx_buffer[rx_tail];
+	rx_tail = (rx_tail + 1) % HOST_SERIAL_RX_SIZE;
+	return c;
+}
+
+int HostSerial::peek()
+{
+	fill();
+	if (rx_head == rx_tail)
+	{
+		return -1;
+	}
+	return rx_buffer[rx_tail];
+}
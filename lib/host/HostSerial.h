@@ -0,0 +1,63 @@
+#ifndef _HOST_SERIAL_H_
+#define _HOST_SERIAL_H_
+
+#include "Arduino.h"
+
+#ifndef HOST_SERIAL_RX_SIZE
+#define HOST_SERIAL_RX_SIZE 64
+#endif
+
+// Byte stream to a simulator on the host. The endpoint is read from an
+// environment variable when begin() is called:
+//   pty           - create a new pty and print the name of the slave side
+//   tcp:HOST:PORT - connect to a TCP socket, e.g. the SIM800 emulator
+//   /dev/...      - open an existing tty or pty, e.g. one made by socat
+//
+// With a ring pin set, the modem's RI line is modelled from the byte stream:
+// it goes low on a RING URC and high again on NO CARRIER or a sent ATH.
+//
+// idle() is the host's sleep: it waits for input on any open port and
+// reads it in, like a UART interrupt would.
+//
+// While replaying a trace the ports are fed from it instead, see
+// HostReplay.h.
+class HostSerial : public Stream
+{
+public:
+	HostSerial(const char *env_name, const char *default_endpoint, uint8_t ring_pin = 0xff);
+
+	void begin(unsigned long baud);
+	void end();
+	bool listen() { return true; }
+	bool overflow() { bool ret = overflowed; overflowed = false; return ret; }
+
+	size_t write(uint8_t c) override;
+	size_t write(const uint8_t *buffer, size_t size) override;
+	int available() override;
+	int read() override;
+	int peek() override;
+	using Print::write;
+
+	// Waits up to us for any port to receive, then reads all that did
+	static void idle(uint32_t us);
+
+	// Takes in a received byte, false when the buffer is full
+	bool receive(uint8_t c);
+
+private:
+	void fill();
+
+	const char *env_name;
+	const char *default_endpoint;
+	uint8_t ring_pin;
+	uint8_t ring_match;
+	uint8_t no_carrier_match;
+	uint8_t hangup_match;
+	int fd;
+	bool overflowed;
+	uint8_t rx_buffer[HOST_SERIAL_RX_SIZE];
+	uint16_t rx_head;
+	uint16_t rx_tail;
+};
+
+#endif
@@ -0,0 +1,334 @@
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "Arduino.h"
+#include "HostReplay.h"
+
+#define HOST_NUM_PINS 20
+
+HostConsole Serial;
+
+static uint8_t pin_mode[HOST_NUM_PINS];
+static uint8_t pin_value[HOST_NUM_PINS];
+static void (*pin_handler[HOST_NUM_PINS])();
+static struct timespec start_time;
+
+static uint64_t host_elapsed_us()
+{
+	if (host_replay_active())
+	{
+		return host_replay_now();
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return uint64_t(now.tv_sec - start_time.tv_sec) * 1000000ULL + (now.tv_nsec - start_time.tv_nsec) / 1000;
+}
+
+uint32_t millis()
+{
+	return uint32_t(host_elapsed_us() / 1000);
+}
+
+uint32_t micros()
+{
+	return uint32_t(host_elapsed_us());
+}
+
+void delay(uint32_t ms)
+{
+	if (host_replay_active())
+	{
+		uint64_t until = host_replay_now() + ms * 1000ULL;
+		while (host_replay_now() < until)
+		{
+			host_replay_wait(until - host_replay_now());
+		}
+		return;
+	}
+	usleep(ms * 1000UL);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+	if (host_replay_active())
+	{
+		host_replay_wait(us);
+		return;
+	}
+	usleep(us);
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+	if (pin >= HOST_NUM_PINS)
+	{
+		return;
+	}
+	pin_mode[pin] = mode;
+	if (mode == INPUT_PULLUP)
+	{
+		pin_value[pin] = HIGH;
+	}
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+	if (pin >= HOST_NUM_PINS)
+	{
+		return;
+	}
+	// Like the AVR, writing HIGH to an input enables the pull-up
+	pin_value[pin] = value ? HIGH : LOW;
+}
+
+int digitalRead(uint8_t pin)
+{
+	if (pin >= HOST_NUM_PINS)
+	{
+		return LOW;
+	}
+	return pin_value[pin];
+}
+
+void host_pin_set(uint8_t pin, uint8_t value)
+{
+	if (pin < HOST_NUM_PINS && pin_mode[pin] != OUTPUT)
+	{
+		uint8_t old = pin_value[pin];
+		pin_value[pin] = value ? HIGH : LOW;
+		if (pin_handler[pin] && pin_value[pin] != old)
+		{
+			pin_handler[pin]();
+		}
+	}
+}
+
+void host_pin_change(uint8_t pin, void (*handler)())
+{
+	if (pin < HOST_NUM_PINS)
+	{
+		pin_handler[pin] = handler;
+	}
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+	size_t n = 0;
+	while (size--)
+	{
+		n += write(*buffer++);
+	}
+	return n;
+}
+
+size_t Print::print(long n, int base)
+{
+	if (n < 0 && base == DEC)
+	{
+		return print('-') + print((unsigned long)-n, base);
+	}
+	return print((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base)
+{
+	char buf[8 * sizeof(long) + 1];
+	char *str = &buf[sizeof(buf) - 1];
+	*str = '\0';
+
+	if (base < 2)
+	{
+		base = 10;
+	}
+
+	do
+	{
+		char c = n % base;
+		n /= base;
+		*--str = c < 10 ? c + '0' : c + 'A' - 10;
+	} while (n);
+
+	return write(str);
+}
+
+size_t Print::print(double n, int digits)
+{
+	char buf[48];
+	snprintf(buf, sizeof(buf), "%.*f", digits, n);
+	return write(buf);
+}
+
+size_t HostConsole::write(uint8_t c)
+{
+	return fwrite(&c, 1, 1, stdout);
+}
+
+size_t HostConsole::write(const uint8_t *buffer, size_t size)
+{
+	return fwrite(buffer, 1, size, stdout);
+}
+
+static int console_peek = -1;
+
+int HostConsole::available()
+{
+	if (console_peek >= 0)
+	{
+		return 1;
+	}
+
+	struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+	if (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN))
+	{
+		uint8_t c;
+		if (::read(STDIN_FILENO, &c, 1) == 1)
+		{
+			console_peek = c;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int HostConsole::read()
+{
+	if (!available())
+	{
+		return -1;
+	}
+	int c = console_peek;
+	console_peek = -1;
+	return c;
+}
+
+int HostConsole::peek()
+{
+	return available() ? console_peek : -1;
+}
+
+static char **host_argv;
+
+void host_reset()
+{
+	if (host_replay_active())
+	{
+		host_replay_end("firmware reset");
+	}
+	fprintf(stderr, "host: reset\n");
+	fflush(stdout);
+	// The interval timer lives on through execv(), as the AVR's watchdog does
+	// until watchdog_init() takes over
+	struct itimerval off = {};
+	setitimer(ITIMER_REAL, &off, NULL);
+	execv("/proc/self/exe", host_argv);
+	abort();
+}
+
+// Async signal safe, the watchdog goes off in the middle of anything. The
+// restarted program inherits the signal mask, so SIGALRM must not be blocked
+// while in here, see SA_NODEFER below.
+static void host_watchdog_expired(int)
+{
+	static const char message[] = "host: watchdog reset\n";
+	ssize_t ignored = write(STDERR_FILENO, message, sizeof(message) - 1);
+	(void)ignored;
+	execv("/proc/self/exe", host_argv);
+	abort();
+}
+
+void host_watchdog(uint32_t ms)
+{
+	static bool installed;
+	if (host_replay_active())
+	{
+		return;
+	}
+	if (!installed)
+	{
+		struct sigaction action = {};
+		action.sa_handler = host_watchdog_expired;
+		action.sa_flags = SA_NODEFER;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGALRM, &action, NULL);
+		installed = true;
+	}
+
+	struct itimerval timer = {};
+	timer.it_value.tv_sec = ms / 1000;
+	timer.it_value.tv_usec = (ms % 1000) * 1000;
+	setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+// A memfd the restarted program finds in $HOST_NOINIT
+#define HOST_NOINIT_SIZE 256
+
+void *host_noinit(size_t size)
+{
+	static uint8_t *noinit;
+	static size_t used;
+
+	if (!noinit)
+	{
+		const char *inherited = getenv("HOST_NOINIT");
+		int fd = inherited ? atoi(inherited) : memfd_create("noinit", 0);
+		if (fd < 0 || (!inherited && ftruncate(fd, HOST_NOINIT_SIZE) < 0))
+		{
+			perror("host: noinit");
+			exit(2);
+		}
+		noinit = (uint8_t *)mmap(NULL, HOST_NOINIT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (noinit == MAP_FAILED)
+		{
+			perror("host: noinit");
+			exit(2);
+		}
+		char text[12];
+		snprintf(text, sizeof(text), "%d", fd);
+		setenv("HOST_NOINIT", text, 1);
+	}
+
+	if (used + size > HOST_NOINIT_SIZE)
+	{
+		fprintf(stderr, "host: noinit is full\n");
+		exit(2);
+	}
+	used += size;
+	return noinit + used - size;
+}
+
+extern void setup();
+extern void loop();
+
+int main(int argc, char **argv)
+{
+	host_argv = argv;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	host_replay_begin();
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	// $HOST_HANG=s stops the main loop that long after the start, or after
+	// setup() if that takes longer, as firmware stuck in a loop would. Every
+	// restart hangs again, for checking the watchdog.
+	const char *hang = getenv("HOST_HANG");
+	uint32_t hang_ms = hang ? atoi(hang) * 1000UL : 0;
+
+	setup();
+	for (;;)
+	{
+		if (hang_ms && millis() >= hang_ms)
+		{
+			fprintf(stderr, "host: hanging\n");
+			for (;;)
+			{
+				pause();
+			}
+		}
+		loop();
+	}
+	return 0;
+}
@@ -1,18 +1,47 @@
 #include "commands.h"
 #include "gps.h"
+#include "geofence.h"
+#include "config.h"
+#include "sms_batch.h"
+#include "watchdog.h"
 #include "util.h"
+#include <stdlib.h>
 
 typedef bool (*sms_handler_t)(gsm_t *, const char *);
+// Commands with arguments, args points into text_scratch_pad and has to be
+// parsed before the reply is written there
+typedef bool (*sms_args_handler_t)(gsm_t *, const char *, const char *);
 extern gps_t gps;
+extern geofence_t geofence;
 
+// Falls back on the serving cell while the GPS has no fix, then on the last
+// fix however old
 bool send_position(gsm_t *gsm, const char *phone_no)
 {
 	text_scratch_pad[0] = '\0';
 	gps_position_t position;
+	gsm_location_t location;
 	bool is_valid = gps_get_position(&gps, &position);
 	if (is_valid)
 	{
-		sprintf(text_scratch_pad, "maps.google.com/?q=%.6f+%.6f\nHDOP: %.2f\nSats: %d\nAge: %d\n", position.latitude, position.longitude, double(position.hdop) / 100.0f, position.sats, gps_get_age_in_seconds(&position));
+		sprintf(text_scratch_pad, "maps.google.com/?q=%.6f+%.6f\nSource: GPS\nHDOP: %.2f\nSats: %d\nAge: %d\n", position.latitude, position.longitude, double(position.hdop) / 100.0f, position.sats, gps_get_age_in_seconds(&position));
+	}
+	else if (gsm_locate(gsm, &location))
+	{
+		sprintf(text_scratch_pad, "maps.google.com/?q=%.6f+%.6f\nSource: cell%s, within %um\n", location.latitude, location.longitude, location.cached ? " (cached)" : "", location.accuracy);
+	}
+	else if (gps_get_last_position(&gps, &position))
+	{
+		uint16_t age = gps_get_age_in_seconds(&position);
+		sprintf(text_scratch_pad, "maps.google.com/?q=%.6f+%.6f\nSource: last GPS fix\n", position.latitude, position.longitude);
+		if (age == GPS_AGE_UNKNOWN)
+		{
+			strcat(text_scratch_pad, "Age: unknown\n");
+		}
+		else
+		{
+			sprintf(text_scratch_pad + strlen(text_scratch_pad), "Age: %u\n", age);
+		}
 	}
 	else
 	{
@@ -28,33 +57,80 @@ bool commands_handle_position(gsm_t *gsm, const char *phone_no)
 	return send_position(gsm, phone_no);
 }
 
-bool commands_handle_list(gsm_t *gsm, const char *phone_no)
+static bool list_line(uint8_t index, char *line, uint8_t size)
 {
-	text_scratch_pad[0] = '\0';
-
-	for (uint8_t i = 0; i < GPS_NUM_HIGHSCORE; i++)
+	gps_position_t pos;
+	if (!gps_get_high_score(&gps, index, &pos))
 	{
-		gps_position_t pos;
-		if (gps_get_high_score(&gps, i, &pos))
-		{
-			sprintf(text_scratch_pad + strlen(text_scratch_pad), "%.6f,%.6f,%.2f,%d\n", pos.latitude, pos.longitude, double(pos.hdop) / 100.0f, gps_get_age_in_seconds(&pos));
-		}
+		return false;
 	}
 
-	return gsm_send_sms(gsm, phone_no, text_scratch_pad);
+	snprintf(line, size, "%.6f,%.6f,%.2f,%d\n", pos.latitude, pos.longitude, double(pos.hdop) / 100.0f, gps_get_age_in_seconds(&pos));
+	return true;
+}
+
+bool commands_handle_list(gsm_t *gsm, const char *phone_no)
+{
+	return gsm_send_sms_lines(gsm, phone_no, list_line);
 }
 
+#ifndef MAX_SUBSCRIBERS
 #define MAX_SUBSCRIBERS 5
+#endif
 char subscriber[MAX_SUBSCRIBERS][MAX_PHONE_NO_LENGTH + 1] = {0};
 
-bool send_subscription(gsm_t *gsm)
+sms_batch_t subscription_batch;
+
+static void send_subscription_batch(gsm_t *gsm)
 {
 	for (uint8_t i = 0; i < MAX_SUBSCRIBERS; i++)
 	{
 		if (strlen(subscriber[i]))
 		{
-			send_position(gsm, subscriber[i]);
+			gsm_send_binary_sms(gsm, subscriber[i], subscription_batch.data, subscription_batch.length);
+		}
+	}
+	sms_batch_init(&subscription_batch);
+}
+
+// With BATCH set, each interval adds the current fix to a binary SMS, which
+// goes out once it holds that many
+bool send_subscription(gsm_t *gsm)
+{
+	uint8_t batch_size = config_get(CONFIG_SMS_BATCH);
+	if (!batch_size)
+	{
+		for (uint8_t i = 0; i < MAX_SUBSCRIBERS; i++)
+		{
+			if (strlen(subscriber[i]))
+			{
+				send_position(gsm, subscriber[i]);
+			}
 		}
+		return true;
+	}
+
+	gps_position_t position;
+	if (subscription_batch.data[0] != SMS_BATCH_VERSION)
+	{
+		sms_batch_init(&subscription_batch);
+	}
+	if (gps_get_position(&gps, &position))
+	{
+		uint32_t utc = gps_get_utc(&gps);
+		if (utc)
+		{
+			utc -= gps_get_age_in_seconds(&position);
+		}
+		if (!sms_batch_add(&subscription_batch, &position, utc, gsm->battery_percentage))
+		{
+			send_subscription_batch(gsm);
+			sms_batch_add(&subscription_batch, &position, utc, gsm->battery_percentage);
+		}
+	}
+	if (sms_batch_count(&subscription_batch) >= batch_size)
+	{
+		send_subscription_batch(gsm);
 	}
 
 	return true;
@@ -112,10 +188,202 @@ bool commands_handle_stop_live(gsm_t *gsm, const char *phone_no)
 	return true;
 }
 
+// Link quality first, then the AT command stats that fit
+bool commands_handle_stats(gsm_t *gsm, const char *phone_no)
+{
+	uint8_t length = gsm_link_format(&gsm->link, text_scratch_pad, MAX_SMS_LENGTH);
+	length += watchdog_format(text_scratch_pad + length, MAX_SMS_LENGTH - length);
+#if GSM_STATS
+	gsm_stats_format(&gsm->stats, text_scratch_pad + length, MAX_SMS_LENGTH - length);
+#else
+	(void)length;
+#endif
+	return gsm_send_sms(gsm, phone_no, text_scratch_pad);
+}
+
+// Numbers may be separated by spaces or commas
+static bool parse_number(const char **next, double *out)
+{
+	char *end;
+
+	while (**next == ' ' || **next == ',')
+	{
+		(*next)++;
+	}
+	*out = strtod(*next, &end);
+	if (end == *next)
+	{
+		return false;
+	}
+	*next = end;
+	return true;
+}
+
+// The index-th fence that is set
+static bool fence_line(uint8_t index, char *line, uint8_t size)
+{
+	geofence_record_t record;
+	uint8_t found = 0;
+	uint8_t i;
+
+	for (i = 0; i < GEOFENCE_MAX; i++)
+	{
+		if (geofence_get(&geofence, i, &record) && found++ == index)
+		{
+			break;
+		}
+	}
+	if (i == GEOFENCE_MAX)
+	{
+		// Something to say if there are none
+		if (!found && index == 0)
+		{
+			snprintf(line, size, "No fences");
+			return true;
+		}
+		return false;
+	}
+
+	uint8_t length = snprintf(line, size, "%d: %.5f,%.5f ", i + 1,
+		geofence_to_degrees(record.points[0].lat), geofence_to_degrees(record.points[0].lon));
+	if (record.type == GEOFENCE_CIRCLE)
+	{
+		length += snprintf(line + length, size - length, "r=%um", record.radius);
+	}
+	else
+	{
+		length += snprintf(line + length, size - length, "+%d points", record.num_points - 1);
+	}
+	snprintf(line + length, size - length, " %s\n",
+		geofence.state[i].inside < 0 ? "?" : geofence.state[i].inside ? "in" : "out");
+	return true;
+}
+
+// FENCE CIRCLE <lat> <lon> <radius m>
+// FENCE POLY <lat> <lon> <lat> <lon> <lat> <lon> ...
+// FENCE LIST
+// FENCE DEL <n>
+bool commands_handle_fence(gsm_t *gsm, const char *phone_no, const char *args)
+{
+	double lat[GEOFENCE_MAX_POINTS];
+	double lon[GEOFENCE_MAX_POINTS];
+	uint8_t num_points = 0;
+	int8_t index = -1;
+	char *end;
+
+	if (strncmp(args, "CIRCLE ", 7) == 0 || strncmp(args, "POLY ", 5) == 0)
+	{
+		bool circle = args[0] == 'C';
+		const char *next = args + (circle ? 7 : 5);
+
+		while (num_points < GEOFENCE_MAX_POINTS && parse_number(&next, &lat[num_points]) && parse_number(&next, &lon[num_points]))
+		{
+			num_points++;
+
+			if (circle)
+			{
+				double radius;
+				if (parse_number(&next, &radius) && radius >= 1 && radius <= GEOFENCE_MAX_RADIUS)
+				{
+					index = geofence_add_circle(&geofence, phone_no, lat[0], lon[0], uint16_t(radius));
+				}
+				break;
+			}
+		}
+
+		if (!circle)
+		{
+			index = geofence_add_polygon(&geofence, phone_no, lat, lon, num_points);
+		}
+
+		if (index < 0)
+		{
+			return gsm_send_sms(gsm, phone_no, "Fence not added: full, too large or bad coordinates.");
+		}
+		sprintf(text_scratch_pad, "Fence %d added.", index + 1);
+		return gsm_send_sms(gsm, phone_no, text_scratch_pad);
+	}
+
+	if (strncmp(args, "DEL ", 4) == 0)
+	{
+		long number = strtol(args + 4, &end, 10);
+		if (number < 1 || number > GEOFENCE_MAX || !geofence_remove(&geofence, uint8_t(number - 1)))
+		{
+			return gsm_send_sms(gsm, phone_no, "No such fence.");
+		}
+		return gsm_send_sms(gsm, phone_no, "Fence removed.");
+	}
+
+	if (strcmp(args, "LIST") == 0)
+	{
+		return gsm_send_sms_lines(gsm, phone_no, fence_line);
+	}
+
+	return gsm_send_sms(gsm, phone_no, "FENCE CIRCLE lat lon radius, FENCE POLY lat lon lat lon lat lon.., FENCE LIST, FENCE DEL n");
+}
+
+// SET lists the settings, SET <key> <value> changes one. The server and APN
+// are used from the next connection on.
+bool commands_handle_set(gsm_t *gsm, const char *phone_no, const char *args)
+{
+	char name[12];
+	const char *value = strchr(args, ' ');
+
+	if (*args)
+	{
+		if (!value || size_t(value - args) >= sizeof(name))
+		{
+			return gsm_send_sms(gsm, phone_no, "SET key value, SET to list");
+		}
+
+		memcpy(name, args, value - args);
+		name[value - args] = '\0';
+		while (*value == ' ')
+		{
+			value++;
+		}
+
+		if (!config_set_text(name, value))
+		{
+			return gsm_send_sms(gsm, phone_no, "Unknown setting or value out of range.");
+		}
+
+		if (strcmp(name, "LIVE") == 0)
+		{
+			config_get(CONFIG_LIVE) ? gsm_enable_data(gsm) : gsm_disable_data(gsm);
+		}
+	}
+
+	config_format(text_scratch_pad, MAX_SMS_LENGTH);
+	return gsm_send_sms(gsm, phone_no, text_scratch_pad);
+}
+
+// Sends queued enter and exit events to whoever set the fence
+bool send_geofence_alerts(gsm_t *gsm)
+{
+	geofence_event_t event;
+
+	while (geofence_pop_event(&geofence, &event))
+	{
+		geofence_record_t record;
+		if (!geofence_get(&geofence, event.index, &record) || !record.owner[0])
+		{
+			continue;
+		}
+
+		sprintf(text_scratch_pad, "%s fence %d\nmaps.google.com/?q=%.5f+%.5f", event.entered ? "Entered" : "Left", event.index + 1,
+			geofence_to_degrees(event.position.lat), geofence_to_degrees(event.position.lon));
+		gsm_send_sms(gsm, record.owner, text_scratch_pad);
+	}
+
+	return true;
+}
+
 struct sms_command_t
 {
 	const char *command;
 	sms_handler_t handler;
+	sms_args_handler_t args_handler;
 };
 
 bool commands_handle_help(gsm_t *gsm, const char *phone_no);
@@ -127,23 +395,27 @@ sms_command_t command_list[] = {
 	{"STOP", commands_handle_unsubscribe},
 	{"START LIVE", commands_handle_start_live },
 	{"STOP LIVE", commands_handle_stop_live },
+	{"STATS", commands_handle_stats },
+	{"FENCE", NULL, commands_handle_fence },
+	{"SET", NULL, commands_handle_set },
 	{"HELP", commands_handle_help },
 	{NULL, NULL}
 };
 
-bool commands_handle_help(gsm_t *gsm, const char *phone_no)
+static bool help_line(uint8_t index, char *line, uint8_t size)
 {
-	text_scratch_pad[0] = '\0';
-
-	sms_command_t *cmd_ptr = command_list;
-
-	while((*cmd_ptr).command)
+	if (!command_list[index].command)
 	{
-		sprintf(text_scratch_pad + strlen(text_scratch_pad), "%s\n", (*cmd_ptr).command);
-		cmd_ptr++;
+		return false;
 	}
 
-	return gsm_send_sms(gsm, phone_no, text_scratch_pad);
+	snprintf(line, size, "%s\n", command_list[index].command);
+	return true;
+}
+
+bool commands_handle_help(gsm_t *gsm, const char *phone_no)
+{
+	return gsm_send_sms_lines(gsm, phone_no, help_line);
 }
 
 void to_upper(char *str)
@@ -168,7 +440,21 @@ bool commands_handle_sms_command(gsm_t *gsm, const char *phone_no, const char *c
 			return false;
 		}
 
-		if (strcmp(text_scratch_pad, command_list[index].command) == 0)
+		if (command_list[index].args_handler)
+		{
+			size_t length = strlen(command_list[index].command);
+			if (strncmp(text_scratch_pad, command_list[index].command, length) == 0 &&
+				(text_scratch_pad[length] == ' ' || text_scratch_pad[length] == '\0'))
+			{
+				const char *args = text_scratch_pad + length;
+				while (*args == ' ')
+				{
+					args++;
+				}
+				return command_list[index].args_handler(gsm, phone_no, args);
+			}
+		}
+		else if (strcmp(text_scratch_pad, command_list[index].command) == 0)
 		{
 			return command_list[index].handler(gsm, phone_no);
 		}
@@ -0,0 +1,378 @@
+#include "config.h"
+#include "sms_batch.h"
+#include <EEPROM.h>
+#include <stdlib.h>
+
+#define CONFIG_MAGIC 0xC5
+#define CONFIG_END 0xff // Erased, the log ends here
+#define CONFIG_HEADER_SIZE 3 // Magic, sequence, CRC
+#define CONFIG_RECORD_SIZE(len) (3 + (len)) // Key, length, value, CRC
+#define CONFIG_ADDRESS(page, offset) (CONFIG_EEPROM_BASE + (page) * CONFIG_PAGE_SIZE + (offset))
+
+// The data connection flag before the store, taken over on the first boot
+#define CONFIG_LEGACY_LIVE 0x0
+
+enum config_type_t
+{
+	CONFIG_NUMBER,
+	CONFIG_STRING
+};
+
+// Numbers are 16 bit, for strings min and max are the length
+struct config_entry_t
+{
+	char name[9];
+	uint8_t type;
+	uint16_t min;
+	uint16_t max;
+	uint16_t number;
+	const char *text; // In flash
+};
+
+static const char config_default_apn[] PROGMEM = "4g.tele2.se";
+static const char config_default_host[] PROGMEM = "www.danielkarling.se";
+
+// In flash, the SRAM is better spent elsewhere. Read with config_entry().
+static const config_entry_t config_entries[CONFIG_NUM_KEYS] PROGMEM = {
+	{ "APN", CONFIG_STRING, 1, CONFIG_MAX_STRING, 0, config_default_apn },
+	{ "HOST", CONFIG_STRING, 1, CONFIG_MAX_STRING, 0, config_default_host },
+	{ "PORT", CONFIG_NUMBER, 1, 65535, 5195, NULL },
+	{ "LIVE", CONFIG_NUMBER, 0, 1, 0, NULL },
+	{ "GPS_MS", CONFIG_NUMBER, 500, 30000, 2000, NULL },
+	{ "GSM_MS", CONFIG_NUMBER, 500, 30000, 5000, NULL },
+	{ "UPLOAD_S", CONFIG_NUMBER, 5, 3600, 20, NULL },
+	{ "SUB_S", CONFIG_NUMBER, 60, 65535, 600, NULL },
+	{ "PRUNE_S", CONFIG_NUMBER, 60, 65535, 1800, NULL },
+	{ "BATCH", CONFIG_NUMBER, 0, SMS_BATCH_MAX_FIXES, 0, NULL },
+};
+
+static uint8_t config_page;
+static uint8_t config_sequence;
+static uint16_t config_end; // Where the next record goes
+static uint16_t config_offset[CONFIG_NUM_KEYS]; // Latest record, 0 while at the default
+static uint16_t config_number[CONFIG_NUM_KEYS];
+
+static void config_entry(uint8_t key, config_entry_t *out)
+{
+	memcpy_P(out, &config_entries[key], sizeof(*out));
+}
+
+// CRC-8, polynomial 0x07
+static uint8_t config_crc(uint8_t crc, uint8_t data)
+{
+	crc ^= data;
+	for (uint8_t i = 0; i < 8; i++)
+	{
+		crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+	return crc;
+}
+
+static uint8_t config_read(uint8_t page, uint16_t offset)
+{
+	return EEPROM.read(CONFIG_ADDRESS(page, offset));
+}
+
+static void config_write(uint8_t page, uint16_t offset, uint8_t value)
+{
+	EEPROM.update(CONFIG_ADDRESS(page, offset), value);
+}
+
+static bool config_header_valid(uint8_t page, uint8_t *sequence)
+{
+	*sequence = config_read(page, 1);
+	return config_read(page, 0) == CONFIG_MAGIC &&
+		config_read(page, 2) == config_crc(config_crc(0, CONFIG_MAGIC), *sequence);
+}
+
+static void config_write_header(uint8_t page, uint8_t sequence)
+{
+	config_write(page, 0, CONFIG_MAGIC);
+	config_write(page, 1, sequence);
+	config_write(page, 2, config_crc(config_crc(0, CONFIG_MAGIC), sequence));
+}
+
+// Length of the record at offset, 0 at the end of the log or a torn write
+static uint8_t config_record_length(uint8_t page, uint16_t offset)
+{
+	if (offset + CONFIG_RECORD_SIZE(0) > CONFIG_PAGE_SIZE)
+	{
+		return 0;
+	}
+
+	uint8_t key = config_read(page, offset);
+	uint8_t length = config_read(page, offset + 1);
+	if (key == CONFIG_END || offset + CONFIG_RECORD_SIZE(length) > CONFIG_PAGE_SIZE)
+	{
+		return 0;
+	}
+
+	uint8_t crc = config_crc(config_crc(0, key), length);
+	for (uint8_t i = 0; i < length; i++)
+	{
+		crc = config_crc(crc, config_read(page, offset + 2 + i));
+	}
+	return crc == config_read(page, offset + 2 + length) ? length : 0;
+}
+
+// Finds the latest record of every key and the end of the log
+static void config_scan()
+{
+	config_entry_t entry;
+	uint16_t offset = CONFIG_HEADER_SIZE;
+	uint8_t length;
+
+	memset(config_offset, 0, sizeof(config_offset));
+	while ((length = config_record_length(config_page, offset)))
+	{
+		uint8_t key = config_read(config_page, offset);
+		// Keys this build doesn't know are dropped at the next compaction
+		if (key < CONFIG_NUM_KEYS)
+		{
+			config_entry(key, &entry);
+			if (entry.type == CONFIG_NUMBER ? length == 2 : length <= CONFIG_MAX_STRING)
+			{
+				config_offset[key] = offset;
+			}
+		}
+		offset += CONFIG_RECORD_SIZE(length);
+	}
+	config_end = offset;
+
+	for (uint8_t key = 0; key < CONFIG_NUM_KEYS; key++)
+	{
+		config_entry(key, &entry);
+		config_number[key] = entry.number;
+		if (config_offset[key] && entry.type == CONFIG_NUMBER)
+		{
+			config_number[key] = config_read(config_page, config_offset[key] + 2) |
+				(config_read(config_page, config_offset[key] + 3) << 8);
+		}
+	}
+}
+
+// Copies the latest record of every key to the other page, which then
+// takes over
+static void config_compact()
+{
+	uint8_t page = !config_page;
+	uint16_t offset = CONFIG_HEADER_SIZE;
+
+	for (uint8_t key = 0; key < CONFIG_NUM_KEYS; key++)
+	{
+		if (!config_offset[key])
+		{
+			continue;
+		}
+
+		uint8_t size = CONFIG_RECORD_SIZE(config_read(config_page, config_offset[key] + 1));
+		for (uint8_t i = 0; i < size; i++)
+		{
+			config_write(page, offset + i, config_read(config_page, config_offset[key] + i));
+		}
+		offset += size;
+	}
+	config_write(page, offset, CONFIG_END);
+	config_write_header(page, config_sequence + 1);
+
+	config_page = page;
+	config_sequence++;
+	config_scan();
+}
+
+// The key byte goes last, until then the record ends the log as if erased
+static bool config_append(config_key_t key, const uint8_t *value, uint8_t length)
+{
+	uint16_t size = CONFIG_RECORD_SIZE(length);
+
+	// Room for the record and an end marker after it
+	if (config_end + size + 1 > CONFIG_PAGE_SIZE)
+	{
+		config_compact();
+		if (config_end + size + 1 > CONFIG_PAGE_SIZE)
+		{
+			return false;
+		}
+	}
+
+	uint8_t crc = config_crc(config_crc(0, key), length);
+	config_write(config_page, config_end + 1, length);
+	for (uint8_t i = 0; i < length; i++)
+	{
+		config_write(config_page, config_end + 2 + i, value[i]);
+		crc = config_crc(crc, value[i]);
+	}
+	config_write(config_page, config_end + 2 + length, crc);
+	config_write(config_page, config_end + size, CONFIG_END);
+	config_write(config_page, config_end, key);
+
+	config_offset[key] = config_end;
+	config_end += size;
+	return true;
+}
+
+void config_init()
+{
+	uint8_t sequence[2];
+	bool valid[2];
+
+	for (uint8_t page = 0; page < 2; page++)
+	{
+		valid[page] = config_header_valid(page, &sequence[page]);
+	}
+
+	if (!valid[0] && !valid[1])
+	{
+		DEBUG_PRINTLN("Config: new store");
+		config_write(0, CONFIG_HEADER_SIZE, CONFIG_END);
+		config_write_header(0, 0);
+		config_page = 0;
+		config_sequence = 0;
+		config_scan();
+
+		if (EEPROM.read(CONFIG_LEGACY_LIVE) == 1)
+		{
+			config_set(CONFIG_LIVE, 1);
+		}
+		return;
+	}
+
+	// The page compacted from stays valid, the newer one is in use
+	config_page = valid[0] && valid[1] ? int8_t(sequence[1] - sequence[0]) > 0 : valid[1];
+	config_sequence = sequence[config_page];
+	config_scan();
+
+	// A torn record is overwritten by the next one, until then end the log
+	// in front of it
+	config_write(config_page, config_end, CONFIG_END);
+}
+
+uint16_t config_get(config_key_t key)
+{
+	return config_number[key];
+}
+
+uint8_t config_get_string(config_key_t key, char *out)
+{
+	config_entry_t entry;
+	uint8_t length;
+
+	if (!config_offset[key])
+	{
+		config_entry(key, &entry);
+		strcpy_P(out, entry.text);
+		return strlen(out);
+	}
+
+	length = config_read(config_page, config_offset[key] + 1);
+	for (uint8_t i = 0; i < length; i++)
+	{
+		out[i] = config_read(config_page, config_offset[key] + 2 + i);
+	}
+	out[length] = '\0';
+	return length;
+}
+
+// Writing only on a change keeps repeated commands from wearing the EEPROM
+bool config_set(config_key_t key, uint16_t value)
+{
+	config_entry_t entry;
+	uint8_t bytes[2] = { uint8_t(value), uint8_t(value >> 8) };
+
+	config_entry(key, &entry);
+	if (entry.type != CONFIG_NUMBER)
+	{
+		return false;
+	}
+	if (value == config_number[key])
+	{
+		return true;
+	}
+	if (!config_append(key, bytes, sizeof(bytes)))
+	{
+		return false;
+	}
+
+	config_number[key] = value;
+	return true;
+}
+
+bool config_set_string(config_key_t key, const char *value)
+{
+	config_entry_t entry;
+	char current[CONFIG_MAX_STRING + 1];
+	uint8_t length = strlen(value);
+
+	config_entry(key, &entry);
+	if (entry.type != CONFIG_STRING || length < entry.min || length > entry.max)
+	{
+		return false;
+	}
+
+	config_get_string(key, current);
+	if (strcmp(current, value) == 0)
+	{
+		return true;
+	}
+	return config_append(key, (const uint8_t *)value, length);
+}
+
+bool config_set_text(const char *name, const char *value)
+{
+	config_entry_t entry;
+
+	for (uint8_t key = 0; key < CONFIG_NUM_KEYS; key++)
+	{
+		config_entry(key, &entry);
+		if (strcmp(name, entry.name) != 0)
+		{
+			continue;
+		}
+
+		if (entry.type == CONFIG_STRING)
+		{
+			return config_set_string(config_key_t(key), value);
+		}
+
+		char *end;
+		unsigned long number = strtoul(value, &end, 10);
+		if (end == value || *end || number < entry.min || number > entry.max)
+		{
+			return false;
+		}
+		return config_set(config_key_t(key), uint16_t(number));
+	}
+
+	return false;
+}
+
+void config_format(char *out, uint8_t max_chars)
+{
+	config_entry_t entry;
+	char line[CONFIG_MAX_STRING + 12];
+	uint8_t length = 0;
+
+	out[0] = '\0';
+	for (uint8_t key = 0; key < CONFIG_NUM_KEYS; key++)
+	{
+		config_entry(key, &entry);
+		uint8_t line_length = snprintf(line, sizeof(line), "%s=", entry.name);
+		if (entry.type == CONFIG_STRING)
+		{
+			line_length += config_get_string(config_key_t(key), line + line_length);
+			line[line_length++] = '\n';
+			line[line_length] = '\0';
+		}
+		else
+		{
+			line_length += snprintf(line + line_length, sizeof(line) - line_length, "%u\n", config_number[key]);
+		}
+
+		if (length + line_length > max_chars)
+		{
+			break;
+		}
+		strcpy(out + length, line);
+		length += line_length;
+	}
+}
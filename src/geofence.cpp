@@ -0,0 +1,294 @@
+#include "geofence.h"
+#include <EEPROM.h>
+
+#define GEOFENCE_ADDRESS(index) (GEOFENCE_EEPROM_BASE + (index) * sizeof(geofence_record_t))
+#define GEOFENCE_EMPTY 0xff
+
+// 1e-5 degrees of latitude in mm
+#define GEOFENCE_UNIT_MM 1113
+
+int32_t geofence_to_fixed(double degrees)
+{
+	return int32_t(degrees * 100000.0 + (degrees < 0 ? -0.5 : 0.5));
+}
+
+double geofence_to_degrees(int32_t fixed)
+{
+	return double(fixed) / 100000.0;
+}
+
+static void geofence_load_state(geofence_t *geofence, uint8_t index)
+{
+	geofence_state_t *state = &geofence->state[index];
+	geofence_record_t record;
+
+	EEPROM.get(GEOFENCE_ADDRESS(index), record);
+	memset(state, 0, sizeof(geofence_state_t));
+	state->inside = -1;
+
+	if (record.type == GEOFENCE_CIRCLE)
+	{
+		geofence_point_t *center = &record.points[0];
+		int32_t lat_extent = int32_t(record.radius) * 1000 / GEOFENCE_UNIT_MM + 1;
+		state->lon_scale = uint16_t(cos(geofence_to_degrees(center->lat) * M_PI / 180.0) * 1024);
+		if (state->lon_scale < 16)
+		{
+			state->lon_scale = 16; // Keeps the offsets in range near the poles
+		}
+		int32_t lon_extent = lat_extent * 1024 / state->lon_scale + 1;
+
+		state->min.lat = center->lat - lat_extent;
+		state->max.lat = center->lat + lat_extent;
+		state->min.lon = center->lon - lon_extent;
+		state->max.lon = center->lon + lon_extent;
+	}
+	else if (record.type == GEOFENCE_POLYGON && record.num_points >= 3 && record.num_points <= GEOFENCE_MAX_POINTS)
+	{
+		state->min = state->max = record.points[0];
+		for (uint8_t i = 1; i < record.num_points; i++)
+		{
+			state->min.lat = min(state->min.lat, record.points[i].lat);
+			state->min.lon = min(state->min.lon, record.points[i].lon);
+			state->max.lat = max(state->max.lat, record.points[i].lat);
+			state->max.lon = max(state->max.lon, record.points[i].lon);
+		}
+	}
+	else
+	{
+		return;
+	}
+
+	state->type = record.type;
+}
+
+void geofence_init(geofence_t *geofence)
+{
+	memset(geofence, 0, sizeof(geofence_t));
+
+	for (uint8_t i = 0; i < GEOFENCE_MAX; i++)
+	{
+		geofence_load_state(geofence, i);
+	}
+}
+
+static int8_t geofence_store(geofence_t *geofence, geofence_record_t *record)
+{
+	for (uint8_t i = 0; i < GEOFENCE_MAX; i++)
+	{
+		if (!geofence->state[i].type)
+		{
+			EEPROM.put(GEOFENCE_ADDRESS(i), *record);
+			geofence_load_state(geofence, i);
+			return i;
+		}
+	}
+	return -1;
+}
+
+int8_t geofence_add_circle(geofence_t *geofence, const char *owner, double lat, double lon, uint16_t radius)
+{
+	geofence_record_t record;
+
+	if (radius == 0 || radius > GEOFENCE_MAX_RADIUS)
+	{
+		return -1;
+	}
+
+	memset(&record, 0, sizeof(record));
+	record.type = GEOFENCE_CIRCLE;
+	record.num_points = 1;
+	record.radius = radius;
+	strncpy(record.owner, owner, MAX_PHONE_NO_LENGTH);
+	record.points[0].lat = geofence_to_fixed(lat);
+	record.points[0].lon = geofence_to_fixed(lon);
+
+	return geofence_store(geofence, &record);
+}
+
+int8_t geofence_add_polygon(geofence_t *geofence, const char *owner, const double *lat, const double *lon, uint8_t num_points)
+{
+	geofence_record_t record;
+	geofence_point_t low, high;
+
+	if (num_points < 3 || num_points > GEOFENCE_MAX_POINTS)
+	{
+		return -1;
+	}
+
+	memset(&record, 0, sizeof(record));
+	record.type = GEOFENCE_POLYGON;
+	record.num_points = num_points;
+	strncpy(record.owner, owner, MAX_PHONE_NO_LENGTH);
+
+	for (uint8_t i = 0; i < num_points; i++)
+	{
+		record.points[i].lat = geofence_to_fixed(lat[i]);
+		record.points[i].lon = geofence_to_fixed(lon[i]);
+		if (i == 0)
+		{
+			low = high = record.points[0];
+		}
+		low.lat = min(low.lat, record.points[i].lat);
+		low.lon = min(low.lon, record.points[i].lon);
+		high.lat = max(high.lat, record.points[i].lat);
+		high.lon = max(high.lon, record.points[i].lon);
+	}
+
+	// Larger fences would overflow the 32 bit crossing test
+	if (high.lat - low.lat > GEOFENCE_MAX_EXTENT || high.lon - low.lon > GEOFENCE_MAX_EXTENT)
+	{
+		return -1;
+	}
+
+	return geofence_store(geofence, &record);
+}
+
+bool geofence_remove(geofence_t *geofence, uint8_t index)
+{
+	if (index >= GEOFENCE_MAX || !geofence->state[index].type)
+	{
+		return false;
+	}
+
+	EEPROM.update(GEOFENCE_ADDRESS(index), GEOFENCE_EMPTY);
+	geofence->state[index].type = 0;
+	return true;
+}
+
+bool geofence_get(geofence_t *geofence, uint8_t index, geofence_record_t *out)
+{
+	if (index >= GEOFENCE_MAX || !geofence->state[index].type)
+	{
+		return false;
+	}
+
+	EEPROM.get(GEOFENCE_ADDRESS(index), *out);
+	return true;
+}
+
+// The point is already known to be inside the bounding box, so the offsets
+// are bounded by the fence size
+static bool geofence_inside_circle(geofence_state_t *state, geofence_record_t *record, geofence_point_t *point)
+{
+	int32_t radius = record->radius;
+	int32_t dy = (point->lat - record->points[0].lat) * GEOFENCE_UNIT_MM / 1000;
+	int32_t dx = (point->lon - record->points[0].lon) * GEOFENCE_UNIT_MM / 1000;
+	dx = dx * state->lon_scale >> 10;
+
+	return dx * dx + dy * dy <= radius * radius;
+}
+
+// Crossing number, with the point as origin
+static bool geofence_inside_polygon(geofence_record_t *record, geofence_point_t *point)
+{
+	bool inside = false;
+
+	for (uint8_t i = 0, j = record->num_points - 1; i < record->num_points; j = i++)
+	{
+		int32_t yi = record->points[i].lat - point->lat;
+		int32_t yj = record->points[j].lat - point->lat;
+
+		if ((yi > 0) != (yj > 0))
+		{
+			int32_t xi = record->points[i].lon - point->lon;
+			int32_t xj = record->points[j].lon - point->lon;
+
+			// Edge crosses the positive x axis when this has the sign of yj - yi
+			int32_t cross = xi * (yj - yi) - yi * (xj - xi);
+			if ((cross > 0) == (yj > yi))
+			{
+				inside = !inside;
+			}
+		}
+	}
+
+	return inside;
+}
+
+static bool geofence_contains(geofence_t *geofence, uint8_t index, geofence_point_t *point)
+{
+	geofence_state_t *state = &geofence->state[index];
+	geofence_record_t record;
+
+	if (point->lat < state->min.lat || point->lat > state->max.lat ||
+		point->lon < state->min.lon || point->lon > state->max.lon)
+	{
+		return false;
+	}
+
+	EEPROM.get(GEOFENCE_ADDRESS(index), record);
+	if (state->type == GEOFENCE_CIRCLE)
+	{
+		return geofence_inside_circle(state, &record, point);
+	}
+	return geofence_inside_polygon(&record, point);
+}
+
+static void geofence_push_event(geofence_t *geofence, uint8_t index, bool entered, geofence_point_t *point)
+{
+	// A full queue drops the oldest event
+	if (geofence->event_count == GEOFENCE_EVENT_QUEUE)
+	{
+		geofence->event_head = (geofence->event_head + 1) % GEOFENCE_EVENT_QUEUE;
+		geofence->event_count--;
+	}
+
+	geofence_event_t *event = &geofence->events[(geofence->event_head + geofence->event_count) % GEOFENCE_EVENT_QUEUE];
+	event->index = index;
+	event->entered = entered;
+	event->position = *point;
+	geofence->event_count++;
+}
+
+// Called for every new fix. The first fix only sets the state, after that a
+// change needs GEOFENCE_CONFIRM fixes in a row.
+void geofence_update(geofence_t *geofence, gps_position_t *fix)
+{
+	geofence_point_t point;
+
+	if (fix->hdop > GEOFENCE_MAX_HDOP)
+	{
+		return;
+	}
+
+	point.lat = geofence_to_fixed(fix->latitude);
+	point.lon = geofence_to_fixed(fix->longitude);
+
+	for (uint8_t i = 0; i < GEOFENCE_MAX; i++)
+	{
+		geofence_state_t *state = &geofence->state[i];
+		if (!state->type)
+		{
+			continue;
+		}
+
+		int8_t inside = geofence_contains(geofence, i, &point) ? 1 : 0;
+		if (state->inside < 0)
+		{
+			state->inside = inside;
+		}
+		else if (inside == state->inside)
+		{
+			state->count = 0;
+		}
+		else if (++state->count >= GEOFENCE_CONFIRM)
+		{
+			state->inside = inside;
+			state->count = 0;
+			geofence_push_event(geofence, i, inside, &point);
+		}
+	}
+}
+
+bool geofence_pop_event(geofence_t *geofence, geofence_event_t *out)
+{
+	if (!geofence->event_count)
+	{
+		return false;
+	}
+
+	*out = geofence->events[geofence->event_head];
+	geofence->event_head = (geofence->event_head + 1) % GEOFENCE_EVENT_QUEUE;
+	geofence->event_count--;
+	return true;
+}
@@ -1,23 +1,50 @@
 #include "gps.h"
 #include "timer.h"
 #include "util.h"
+#include "profiler.h"
+#include "power.h"
+#include "bench.h"
+#include "config.h"
+#include "watchdog.h"
 #include <TinyGPS++.h>
 
 TinyGPSPlus gps_decoder;
 
-bool gps_init(gps_t *gps, SoftwareSerial *serial)
+// A fix older than this no longer counts as current
+#define GPS_FIX_FRESH SECONDS(2)
+// Without a fix for this long the receiver is acquiring again
+#define GPS_FIX_LOST SECONDS(10)
+
+bool gps_init(gps_t *gps, serial_t *serial, gps_fix_callback_t fix_callback)
 {
 	memset(gps, 0, sizeof(gps_t));
 	gps->serial = serial;
+	gps->fix_callback = fix_callback;
+	gps->baud = GPS_DEFAULT_BAUD;
+	gps->ttff_estimate = GPS_DEFAULT_TTFF;
+	gps->converge_estimate = GPS_DEFAULT_CONVERGE;
+	gps->acquire_start = millis();
+
+	serial_begin(gps->serial, gps->baud);
 
-	gps->serial->begin(9600);
+#if GPS_CONFIG
+	gps_configure(gps);
+#endif
+#if GPS_WARM_START
+	gps_warm_start(gps);
+#endif
 
 	return true;
 }
 
 uint16_t gps_get_age_in_seconds(gps_position_t *pos)
 {
-	return uint16_t((millis() - pos->timestamp) / SECONDS(1));
+	if (pos->timestamp == 0)
+	{
+		return GPS_AGE_UNKNOWN;
+	}
+	uint32_t age = (millis() - pos->timestamp) / SECONDS(1);
+	return age < GPS_AGE_UNKNOWN ? age : GPS_AGE_UNKNOWN;
 }
 
 void gps_high_score_move_forwards(gps_t *gps, uint8_t offset)
@@ -75,40 +102,174 @@ void gps_high_score_add_current(gps_t *gps)
 	}
 }
 
+static void gps_read_decoder(gps_position_t *pos)
+{
+	pos->latitude = gps_decoder.location.lat();
+	pos->longitude = gps_decoder.location.lng();
+	pos->hdop = gps_decoder.hdop.value();
+	pos->timestamp = millis() - gps_decoder.location.age();
+	pos->course = gps_decoder.course.deg();
+	pos->speed = gps_decoder.speed.mps();
+	pos->sats = gps_decoder.satellites.value();
+}
+
+// RMC and GGA both update the location, the time tells a new fix apart
+static void gps_report_fix(gps_t *gps)
+{
+	if (!gps->fix_callback || !gps_decoder.location.isValid() || !gps_decoder.hdop.isValid() ||
+		gps_decoder.location.age() > GPS_FIX_FRESH || gps_decoder.time.value() == gps->fix_time)
+	{
+		return;
+	}
+
+	gps_position_t fix;
+	gps_read_decoder(&fix);
+	gps->fix_time = gps_decoder.time.value();
+	gps->fix_callback(gps, &fix);
+}
+
+// Moves a learned estimate a quarter of the way towards a new sample
+static void gps_learn(uint16_t *estimate, uint32_t since)
+{
+	uint32_t sample = (millis() - since) / SECONDS(1);
+	if (sample > 0xffff)
+	{
+		sample = 0xffff;
+	}
+	*estimate = uint16_t((3UL * *estimate + sample) / 4);
+}
+
+// Worth waiting longer while a fix, or a better one, usually shows up
+// within twice the learned time. Past that the receiver is probably
+// indoors and the time is better spent elsewhere.
+static uint32_t gps_window(gps_t *gps, uint32_t time)
+{
+	uint32_t now = millis();
+
+	if (!gps->fix_start)
+	{
+		if (now - gps->acquire_start < 2 * SECONDS(gps->ttff_estimate))
+		{
+			return time * GPS_MAX_WINDOW_FACTOR;
+		}
+	}
+	else if (!gps->target_reached)
+	{
+		if (now - gps->fix_start < 2 * SECONDS(gps->converge_estimate))
+		{
+			return time * GPS_MAX_WINDOW_FACTOR;
+		}
+	}
+	return time;
+}
+
+// Tracks acquisition and learns the time to fix, returns true when the
+// fix is good enough to stop listening
+static bool gps_update_fix(gps_t *gps)
+{
+	if (!gps_decoder.location.isValid() || gps_decoder.location.age() > GPS_FIX_FRESH)
+	{
+		return false;
+	}
+
+	gps->last_fix = millis();
+	if (!gps->fix_start)
+	{
+		gps->fix_start = gps->last_fix;
+		gps_learn(&gps->ttff_estimate, gps->acquire_start);
+	}
+
+	if (!gps_decoder.hdop.isValid() || gps_decoder.hdop.value() > GPS_TARGET_HDOP ||
+		gps_decoder.satellites.value() < GPS_TARGET_SATS)
+	{
+		return false;
+	}
+
+	if (!gps->target_reached)
+	{
+		gps->target_reached = true;
+		gps_learn(&gps->converge_estimate, gps->fix_start);
+	}
+	return true;
+}
+
+// Listens for up to time ms, less once the target quality is reached and
+// more while a fix is expected soon
 void gps_run(gps_t *gps, uint32_t time)
 {
-	timer_t timeout;
-	timer_init(&timeout, time);
+	uint32_t start = millis();
+	uint32_t window = gps_window(gps, time);
 
-	gps->serial->listen();
+	watchdog_beat(WATCHDOG_GPS);
+	serial_listen(gps->serial);
 
-	gps_high_score_prune(gps, MINUTES(30));
+	gps_high_score_prune(gps, SECONDS(config_get(CONFIG_PRUNE_AGE)));
 
+	// The best fix this window replaces the last one, which is kept until then
+	uint16_t best_hdop = 9999;
 	gps->has_valid_position = false;
-	gps->current_position.hdop = 9999; // Reset hdop at beginning of cycle to store the best result
 
-	while (!timer_elapsed(&timeout))
+	// The window is spent waiting for the receiver, except while decoding.
+	// A call ends it early, gsm_run() answers it next.
+	PROFILER_WAIT_BEGIN();
+	while (millis() - start < window && !power_ring_pending())
 	{
-		while (gps->serial->available())
+		bool sentence = false;
+
+		if (serial_available(gps->serial))
+		{
+			PROFILER_WAIT_END();
+			while (serial_available(gps->serial))
+			{
+				BENCH_MARK(BENCH_NMEA_BEGIN);
+				sentence |= gps_decoder.encode(serial_read(gps->serial));
+				BENCH_MARK(BENCH_NMEA_END);
+			}
+			PROFILER_WAIT_BEGIN();
+		}
+		else
 		{
-			gps_decoder.encode(gps->serial->read());
+			power_idle();
+			continue;
 		}
 
 		if (gps_decoder.location.isValid() && gps_decoder.hdop.isValid())
 		{
-			if (gps_decoder.hdop.value() < gps->current_position.hdop)
+			if (gps_decoder.hdop.value() < best_hdop)
 			{
-				gps->current_position.latitude = gps_decoder.location.lat();
-				gps->current_position.longitude = gps_decoder.location.lng();
-				gps->current_position.hdop = gps_decoder.hdop.value();
-				gps->current_position.timestamp = millis() - gps_decoder.location.age();
-				gps->current_position.course = gps_decoder.course.deg();
-				gps->current_position.speed = gps_decoder.speed.mps();
-				gps->current_position.sats = gps_decoder.satellites.value();
+				best_hdop = gps_decoder.hdop.value();
+				gps_read_decoder(&gps->current_position);
 				gps->has_valid_position = true;
+				gps->has_last_position = true;
 				
 			}
 		}
+
+		if (sentence)
+		{
+			gps_report_fix(gps);
+
+			if (gps_update_fix(gps))
+			{
+				break;
+			}
+			window = gps_window(gps, time);
+		}
+	}
+
+	PROFILER_WAIT_END();
+
+	if (gps->fix_start && millis() - gps->last_fix > GPS_FIX_LOST)
+	{
+		DEBUG_PRINTLN("GPS: fix lost");
+		gps->fix_start = 0;
+		gps->target_reached = false;
+		gps->acquire_start = gps->last_fix;
+	}
+
+	if (serial_overflow(gps->serial))
+	{
+		DEBUG_PRINTLN("GPS RX overflow");
 	}
 
 	// If we have a recent valid position, store it in the high scores
@@ -116,6 +277,8 @@ void gps_run(gps_t *gps, uint32_t time)
 	{
 		gps_high_score_add_current(gps);
 	}
+
+	watchdog_rest(WATCHDOG_GPS);
 }
 
 bool gps_get_position(gps_t *gps, gps_position_t *out)
@@ -127,6 +290,12 @@ bool gps_get_position(gps_t *gps, gps_position_t *out)
 	}
 	return true;
 }
+bool gps_get_last_position(gps_t *gps, gps_position_t *out)
+{
+	memcpy(out, &gps->current_position, sizeof(gps_position_t));
+	return gps->has_last_position;
+}
+
 bool gps_get_high_score(gps_t *gps, int index, gps_position_t *out)
 {
 	if (index >= GPS_NUM_HIGHSCORE)
@@ -166,3 +335,23 @@ void gps_print_high_scores(gps_t *gps)
 		Serial.println(gps_get_age_in_seconds(&pos));
 	}
 }
+
+void gps_print_decoder_stats(gps_t *gps)
+{
+	Serial.print("NMEA: chars=");
+	Serial.print(gps_decoder.charsProcessed());
+	Serial.print(" passed=");
+	Serial.print(gps_decoder.passedChecksum());
+	Serial.print(" failed=");
+	Serial.println(gps_decoder.failedChecksum());
+}
+
+void gps_print_window_stats(gps_t *gps)
+{
+	Serial.print("GPS: ttff=");
+	Serial.print(gps->ttff_estimate);
+	Serial.print("s converge=");
+	Serial.print(gps->converge_estimate);
+	Serial.print("s ");
+	Serial.println(gps->target_reached ? "on target" : gps->fix_start ? "converging" : "acquiring");
+}
@@ -0,0 +1,380 @@
+#include "gps.h"
+#include "timer.h"
+#include "power.h"
+#include "util.h"
+
+#define GPS_PROBE_TIMEOUT SECONDS(2)
+#define GPS_ACK_TIMEOUT SECONDS(1)
+
+#define UBX_CLASS_ACK 0x05
+#define UBX_CLASS_CFG 0x06
+#define UBX_CFG_PRT   0x00
+#define UBX_CFG_MSG   0x01
+#define UBX_CFG_RATE  0x08
+#define UBX_CLASS_NMEA 0xF0
+#define UBX_CLASS_AID 0x0B
+#define UBX_AID_INI   0x01
+
+#define UBX_AID_INI_POS  0x0001
+#define UBX_AID_INI_TIME 0x0002
+#define UBX_AID_INI_LLA  0x0020
+#define UBX_AID_INI_UTC  0x0400
+
+#define GPS_AID_POSITION_ACCURACY 1000000UL // cm
+#define GPS_AID_TIME_ACCURACY 10000UL // ms
+
+// Baud rates tried when the receiver isn't at GPS_DEFAULT_BAUD
+static const uint32_t gps_bauds[] = { 9600, 4800, 19200, 38400, 57600, 115200 };
+
+// NMEA sentences we don't decode, u-blox ids in class 0xF0
+static const uint8_t ublox_unused_nmea[] = { 0x01, 0x02, 0x03, 0x05 }; // GLL, GSA, GSV, VTG
+
+static bool gps_wait_for_bytes(gps_t *gps, const uint8_t *pattern, uint8_t len, uint32_t to)
+{
+	uint8_t matched = 0;
+	timer_t timeout;
+	timer_init(&timeout, to);
+
+	while (!timer_elapsed(&timeout))
+	{
+		if (serial_available(gps->serial))
+		{
+			uint8_t in = serial_read(gps->serial);
+			if (in == pattern[matched])
+			{
+				matched++;
+			}
+			else
+			{
+				matched = in == pattern[0] ? 1 : 0;
+			}
+
+			if (matched == len)
+			{
+				return true;
+			}
+		}
+		else
+		{
+			// Keeps the watchdog fed through the baud scan, 2 s per rate
+			power_idle();
+		}
+	}
+	return false;
+}
+
+static bool gps_wait_for(gps_t *gps, const char *pattern, uint32_t to)
+{
+	return gps_wait_for_bytes(gps, (const uint8_t *)pattern, strlen(pattern), to);
+}
+
+// Sends $<body>*<checksum>
+static void gps_send_nmea(gps_t *gps, const char *body)
+{
+	uint8_t checksum = 0;
+	char tail[6];
+
+	for (const char *c = body; *c; c++)
+	{
+		checksum ^= *c;
+	}
+	sprintf(tail, "*%02X", checksum);
+
+	serial_print(gps->serial, "$");
+	serial_print(gps->serial, body);
+	serial_println(gps->serial, tail);
+}
+
+static void gps_send_ubx(gps_t *gps, uint8_t msg_class, uint8_t msg_id, const uint8_t *payload, uint16_t len)
+{
+	uint8_t header[] = { 0xB5, 0x62, msg_class, msg_id, uint8_t(len & 0xff), uint8_t(len >> 8) };
+	uint8_t ck_a = 0;
+	uint8_t ck_b = 0;
+
+	for (uint8_t i = 0; i < sizeof(header); i++)
+	{
+		serial_write(gps->serial, header[i]);
+		if (i >= 2)
+		{
+			ck_a += header[i];
+			ck_b += ck_a;
+		}
+	}
+	for (uint16_t i = 0; i < len; i++)
+	{
+		serial_write(gps->serial, payload[i]);
+		ck_a += payload[i];
+		ck_b += ck_a;
+	}
+	serial_write(gps->serial, ck_a);
+	serial_write(gps->serial, ck_b);
+}
+
+static bool gps_ubx_command(gps_t *gps, uint8_t msg_id, const uint8_t *payload, uint16_t len)
+{
+	const uint8_t ack[] = { 0xB5, 0x62, UBX_CLASS_ACK, 0x01, 0x02, 0x00, UBX_CLASS_CFG, msg_id };
+
+	gps_send_ubx(gps, UBX_CLASS_CFG, msg_id, payload, len);
+	return gps_wait_for_bytes(gps, ack, sizeof(ack), GPS_ACK_TIMEOUT);
+}
+
+static bool gps_mtk_command(gps_t *gps, const char *body, const char *ack)
+{
+	gps_send_nmea(gps, body);
+	return gps_wait_for(gps, ack, GPS_ACK_TIMEOUT);
+}
+
+// Listens for the start of an NMEA sentence at the given baud rate
+static bool gps_probe_baud(gps_t *gps, uint32_t baud)
+{
+	serial_begin(gps->serial, baud);
+	serial_listen(gps->serial);
+	if (gps_wait_for(gps, "$G", GPS_PROBE_TIMEOUT))
+	{
+		gps->baud = baud;
+		return true;
+	}
+	return false;
+}
+
+static bool gps_find_baud(gps_t *gps)
+{
+	if (gps_probe_baud(gps, gps->baud))
+	{
+		return true;
+	}
+
+	for (uint8_t i = 0; i < sizeof(gps_bauds) / sizeof(gps_bauds[0]); i++)
+	{
+		if (gps_bauds[i] != gps->baud && gps_probe_baud(gps, gps_bauds[i]))
+		{
+			return true;
+		}
+	}
+
+	// Nothing heard, stay at the default and hope it shows up later
+	serial_begin(gps->serial, GPS_DEFAULT_BAUD);
+	gps->baud = GPS_DEFAULT_BAUD;
+	return false;
+}
+
+static gps_chip_t gps_detect_chip(gps_t *gps)
+{
+	if (gps_mtk_command(gps, "PMTK000", "$PMTK001,0,3"))
+	{
+		return GPS_CHIP_MTK;
+	}
+
+	// Turning GLL off is wanted anyway and acked by any u-blox
+	const uint8_t payload[] = { UBX_CLASS_NMEA, ublox_unused_nmea[0], 0 };
+	if (gps_ubx_command(gps, UBX_CFG_MSG, payload, sizeof(payload)))
+	{
+		return GPS_CHIP_UBLOX;
+	}
+
+	return GPS_CHIP_UNKNOWN;
+}
+
+static bool gps_configure_mtk(gps_t *gps)
+{
+	bool result = true;
+	char body[24];
+
+	// GLL, RMC, VTG, GGA, GSA, GSV, ... keep only RMC and GGA
+	if (!gps_mtk_command(gps, "PMTK314,0,1,0,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0", "$PMTK001,314,3"))
+	{
+		DEBUG_PRINTLN("GPS: sentence filter not acked");
+		result = false;
+	}
+
+	if (GPS_RATE_HZ != 1)
+	{
+		sprintf(body, "PMTK220,%u", 1000 / GPS_RATE_HZ);
+		if (!gps_mtk_command(gps, body, "$PMTK001,220,3"))
+		{
+			DEBUG_PRINTLN("GPS: update rate not acked");
+			result = false;
+		}
+	}
+
+	if (GPS_BAUD != gps->baud)
+	{
+		sprintf(body, "PMTK251,%lu", (unsigned long)GPS_BAUD);
+		gps_send_nmea(gps, body);
+		delay(100);
+	}
+
+	return result;
+}
+
+static bool gps_configure_ublox(gps_t *gps)
+{
+	bool result = true;
+
+	for (uint8_t i = 1; i < sizeof(ublox_unused_nmea); i++)
+	{
+		const uint8_t payload[] = { UBX_CLASS_NMEA, ublox_unused_nmea[i], 0 };
+		if (!gps_ubx_command(gps, UBX_CFG_MSG, payload, sizeof(payload)))
+		{
+			DEBUG_PRINTLN("GPS: sentence filter not acked");
+			result = false;
+		}
+	}
+
+	if (GPS_RATE_HZ != 1)
+	{
+		uint16_t period = 1000 / GPS_RATE_HZ;
+		const uint8_t payload[] = { uint8_t(period & 0xff), uint8_t(period >> 8), 1, 0, 1, 0 };
+		if (!gps_ubx_command(gps, UBX_CFG_RATE, payload, sizeof(payload)))
+		{
+			DEBUG_PRINTLN("GPS: update rate not acked");
+			result = false;
+		}
+	}
+
+	if (GPS_BAUD != gps->baud)
+	{
+		// UART1, 8N1, UBX+NMEA in, NMEA out. The ack comes at the new rate.
+		uint32_t baud = GPS_BAUD;
+		const uint8_t payload[] = {
+			1, 0, 0, 0,
+			0xD0, 0x08, 0, 0,
+			uint8_t(baud), uint8_t(baud >> 8), uint8_t(baud >> 16), uint8_t(baud >> 24),
+			0x03, 0, 0x02, 0,
+			0, 0, 0, 0
+		};
+		gps_send_ubx(gps, UBX_CLASS_CFG, UBX_CFG_PRT, payload, sizeof(payload));
+		delay(100);
+	}
+
+	return result;
+}
+
+// Finds the receiver, turns off sentences we don't decode and sets the
+// update and baud rates, checking each step by its ack. A receiver that
+// doesn't answer is left as it is.
+bool gps_configure(gps_t *gps)
+{
+	bool result;
+
+	if (!gps_find_baud(gps))
+	{
+		DEBUG_PRINTLN("GPS: no receiver found");
+		return false;
+	}
+
+	gps->chip = gps_detect_chip(gps);
+	switch (gps->chip)
+	{
+	case GPS_CHIP_MTK:
+		DEBUG_PRINTLN("GPS: MTK");
+		result = gps_configure_mtk(gps);
+		break;
+	case GPS_CHIP_UBLOX:
+		DEBUG_PRINTLN("GPS: u-blox");
+		result = gps_configure_ublox(gps);
+		break;
+	default:
+		DEBUG_PRINTLN("GPS: unknown receiver, using its defaults");
+		return false;
+	}
+
+	if (GPS_BAUD != gps->baud)
+	{
+		uint32_t old_baud = gps->baud;
+		if (!gps_probe_baud(gps, GPS_BAUD))
+		{
+			DEBUG_PRINTLN("GPS: baud change failed");
+			gps->baud = old_baud;
+			gps_find_baud(gps);
+			result = false;
+		}
+	}
+
+	DEBUG_PRINT("GPS: baud ");
+	DEBUG_PRINTLN(gps->baud);
+
+	return result;
+}
+
+// Formats 1e-6 degrees without going through float
+static void gps_format_degrees(char *out, int32_t value)
+{
+	uint32_t magnitude = value < 0 ? -value : value;
+	sprintf(out, "%s%lu.%06lu", value < 0 ? "-" : "", (unsigned long)(magnitude / 1000000UL), (unsigned long)(magnitude % 1000000UL));
+}
+
+static bool gps_aid_mtk(gps_t *gps, int32_t latitude, int32_t longitude, int16_t altitude, gps_utc_t *utc)
+{
+	char body[72];
+	char lat[14];
+	char lon[14];
+
+	// Position aiding needs the time as well
+	if (!utc)
+	{
+		return false;
+	}
+
+	sprintf(body, "PMTK740,%u,%u,%u,%u,%u,%u", utc->year, utc->month, utc->day, utc->hour, utc->minute, utc->second);
+	if (!gps_mtk_command(gps, body, "$PMTK001,740,3"))
+	{
+		return false;
+	}
+
+	gps_format_degrees(lat, latitude);
+	gps_format_degrees(lon, longitude);
+	sprintf(body, "PMTK741,%s,%s,%d,%u,%u,%u,%u,%u,%u", lat, lon, altitude,
+		utc->year, utc->month, utc->day, utc->hour, utc->minute, utc->second);
+	return gps_mtk_command(gps, body, "$PMTK001,741,3");
+}
+
+static void gps_put_u32(uint8_t *out, uint32_t value)
+{
+	out[0] = uint8_t(value);
+	out[1] = uint8_t(value >> 8);
+	out[2] = uint8_t(value >> 16);
+	out[3] = uint8_t(value >> 24);
+}
+
+// AID-INI isn't acked
+static bool gps_aid_ublox(gps_t *gps, int32_t latitude, int32_t longitude, int16_t altitude, gps_utc_t *utc)
+{
+	uint8_t payload[48];
+	uint32_t flags = UBX_AID_INI_POS | UBX_AID_INI_LLA;
+
+	memset(payload, 0, sizeof(payload));
+	gps_put_u32(&payload[0], uint32_t(latitude * 10)); // 1e-7 degrees
+	gps_put_u32(&payload[4], uint32_t(longitude * 10));
+	gps_put_u32(&payload[8], uint32_t(int32_t(altitude) * 100)); // cm
+	gps_put_u32(&payload[12], GPS_AID_POSITION_ACCURACY);
+
+	if (utc)
+	{
+		uint16_t date = (utc->year - 2000) * 100 + utc->month;
+		payload[18] = uint8_t(date);
+		payload[19] = uint8_t(date >> 8);
+		gps_put_u32(&payload[20], utc->day * 1000000UL + utc->hour * 10000UL + utc->minute * 100UL + utc->second);
+		gps_put_u32(&payload[28], GPS_AID_TIME_ACCURACY);
+		flags |= UBX_AID_INI_TIME | UBX_AID_INI_UTC;
+	}
+	gps_put_u32(&payload[44], flags);
+
+	gps_send_ubx(gps, UBX_CLASS_AID, UBX_AID_INI, payload, sizeof(payload));
+	return true;
+}
+
+// Gives the receiver a rough position and, when known, the UTC time so it
+// can skip most of the sky search
+bool gps_aid(gps_t *gps, int32_t latitude, int32_t longitude, int16_t altitude, gps_utc_t *utc)
+{
+	switch (gps->chip)
+	{
+	case GPS_CHIP_MTK:
+		return gps_aid_mtk(gps, latitude, longitude, altitude, utc);
+	case GPS_CHIP_UBLOX:
+		return gps_aid_ublox(gps, latitude, longitude, altitude, utc);
+	default:
+		return false;
+	}
+}
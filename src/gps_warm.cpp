@@ -0,0 +1,165 @@
+#include "gps.h"
+#include "util.h"
+#include <EEPROM.h>
+#include <TinyGPS++.h>
+
+#define GPS_WARM_MAGIC 0xA5
+#define GPS_WARM_TIME_VALID 0x01 // Saved right before a reset, the time is still good
+
+extern TinyGPSPlus gps_decoder;
+
+static const uint16_t days_before_month[] = { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+
+static bool gps_leap_year(uint16_t year)
+{
+	return year % 4 == 0; // Good until 2100
+}
+
+static uint32_t gps_utc_to_seconds(gps_utc_t *utc)
+{
+	uint16_t years = utc->year - 2000;
+	uint32_t days = years * 365UL + (years + 3) / 4 + days_before_month[utc->month - 1] + utc->day - 1;
+
+	if (utc->month > 2 && gps_leap_year(utc->year))
+	{
+		days++;
+	}
+	return ((days * 24 + utc->hour) * 60 + utc->minute) * 60 + utc->second;
+}
+
+static void gps_seconds_to_utc(uint32_t seconds, gps_utc_t *utc)
+{
+	uint32_t days = seconds / 86400UL;
+	seconds %= 86400UL;
+	utc->hour = seconds / 3600;
+	utc->minute = seconds / 60 % 60;
+	utc->second = seconds % 60;
+
+	for (utc->year = 2000; days >= (gps_leap_year(utc->year) ? 366U : 365U); utc->year++)
+	{
+		days -= gps_leap_year(utc->year) ? 366 : 365;
+	}
+
+	for (utc->month = 12; utc->month > 1; utc->month--)
+	{
+		uint16_t start = days_before_month[utc->month - 1] + (utc->month > 2 && gps_leap_year(utc->year) ? 1 : 0);
+		if (days >= start)
+		{
+			days -= start;
+			break;
+		}
+	}
+	utc->day = days + 1;
+}
+
+static uint8_t gps_warm_checksum(gps_warm_t *warm)
+{
+	uint8_t sum = 0;
+	for (uint8_t i = 0; i < offsetof(gps_warm_t, checksum); i++)
+	{
+		sum += ((uint8_t *)warm)[i];
+	}
+	return sum;
+}
+
+uint32_t gps_get_utc(gps_t *gps)
+{
+	if (!gps_decoder.date.isValid() || !gps_decoder.time.isValid() || gps_decoder.date.year() < 2000)
+	{
+		return 0;
+	}
+	gps_utc_t utc = { gps_decoder.date.year(), gps_decoder.date.month(), gps_decoder.date.day(),
+		gps_decoder.time.hour(), gps_decoder.time.minute(), gps_decoder.time.second() };
+	return gps_utc_to_seconds(&utc) + gps_decoder.time.age() / SECONDS(1);
+}
+
+// Saves the latest fix, and the time if the decoder has it. Before a reset
+// the time is marked good enough to aid the receiver with on the next boot.
+// Otherwise the record is left alone until the unit has moved, the same
+// cells would be rewritten every GPS_WARM_SAVE_INTERVAL.
+bool gps_warm_save(gps_t *gps, bool before_reset)
+{
+	gps_warm_t warm;
+
+	if (!gps_decoder.location.isValid())
+	{
+		return false;
+	}
+
+	if (!before_reset)
+	{
+		EEPROM.get(GPS_WARM_EEPROM_BASE, warm);
+		if (warm.magic == GPS_WARM_MAGIC && warm.checksum == gps_warm_checksum(&warm) &&
+			TinyGPSPlus::distanceBetween(warm.latitude / 1000000.0, warm.longitude / 1000000.0,
+				gps_decoder.location.lat(), gps_decoder.location.lng()) < GPS_WARM_SAVE_DISTANCE)
+		{
+			return false;
+		}
+	}
+
+	memset(&warm, 0, sizeof(warm));
+	warm.magic = GPS_WARM_MAGIC;
+	warm.latitude = int32_t(gps_decoder.location.lat() * 1000000.0);
+	warm.longitude = int32_t(gps_decoder.location.lng() * 1000000.0);
+	warm.altitude = int16_t(gps_decoder.altitude.meters());
+	warm.hdop = gps_decoder.hdop.value();
+	warm.sats = gps_decoder.satellites.value();
+	uint32_t age = gps_decoder.location.age() / SECONDS(1);
+	warm.age = age < UINT16_MAX ? age : UINT16_MAX;
+	warm.ttff_estimate = gps->ttff_estimate;
+	warm.converge_estimate = gps->converge_estimate;
+
+	warm.utc = gps_get_utc(gps);
+	if (warm.utc && before_reset)
+	{
+		warm.flags |= GPS_WARM_TIME_VALID;
+	}
+
+	warm.checksum = gps_warm_checksum(&warm);
+	EEPROM.put(GPS_WARM_EEPROM_BASE, warm);
+	return true;
+}
+
+// Restores the last known position, see gps_get_last_position(), and the
+// learned time to fix from the saved record and aids the receiver. The time is only trusted once, a later
+// power loss would leave it arbitrarily old.
+void gps_warm_start(gps_t *gps)
+{
+	gps_warm_t warm;
+	gps_utc_t utc;
+
+	EEPROM.get(GPS_WARM_EEPROM_BASE, warm);
+	if (warm.magic != GPS_WARM_MAGIC || warm.checksum != gps_warm_checksum(&warm))
+	{
+		DEBUG_PRINTLN("GPS: no warm start data");
+		return;
+	}
+
+	gps->current_position.latitude = warm.latitude / 1000000.0;
+	gps->current_position.longitude = warm.longitude / 1000000.0;
+	gps->current_position.hdop = warm.hdop;
+	gps->current_position.sats = warm.sats;
+	// How long the unit was off is only known right after a reset
+	gps->current_position.timestamp = 0;
+	gps->has_last_position = true;
+	if (warm.ttff_estimate)
+	{
+		gps->ttff_estimate = warm.ttff_estimate;
+		gps->converge_estimate = warm.converge_estimate;
+	}
+
+	bool time_valid = (warm.flags & GPS_WARM_TIME_VALID) && warm.utc;
+	if (time_valid)
+	{
+		gps->current_position.timestamp = millis() - warm.age * SECONDS(1);
+		gps_seconds_to_utc(warm.utc + millis() / SECONDS(1), &utc);
+		warm.flags &= ~GPS_WARM_TIME_VALID;
+		warm.checksum = gps_warm_checksum(&warm);
+		EEPROM.put(GPS_WARM_EEPROM_BASE, warm);
+	}
+
+	if (gps_aid(gps, warm.latitude, warm.longitude, warm.altitude, time_valid ? &utc : NULL))
+	{
+		DEBUG_PRINTLN(time_valid ? "GPS: aided with position and time" : "GPS: aided with position");
+	}
+}
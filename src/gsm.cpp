@@ -1,9 +1,49 @@
 #include "gsm.h"
 #include "pins.h"
 #include "util.h"
-#include <EEPROM.h>
-
-#define EEPROM_ENABLE_DATA_CONNECTION 0x0
+#include "profiler.h"
+#include "power.h"
+#include "bench.h"
+#include "config.h"
+#include "watchdog.h"
+
+#define GSM_BOOT_ATTEMPTS 3
+#define GSM_POWER_PULSE 1100 // ms the power key is held low
+#define GSM_PROBE_INTERVAL 300 // AT retries while the autobaud locks
+#define GSM_PROBE_TIMEOUT SECONDS(10)
+#define GSM_RESUME_TIMEOUT SECONDS(2) // Probing a modem that may still be on
+#define GSM_BOOT_POLL_INTERVAL SECONDS(1)
+#define GSM_NETWORK_TIMEOUT SECONDS(60)
+
+// Housekeeping polls back off while nothing changes, see gsm_update_battery
+// and gsm_poll_bearer
+#define GSM_BATTERY_MIN_INTERVAL SECONDS(10)
+#define GSM_BATTERY_MAX_INTERVAL MINUTES(5)
+#define GSM_BATTERY_STABLE_MV 20
+#define GSM_BATTERY_FALLING_MV 50
+#define GSM_BATTERY_LOW_PERCENT 15
+#define GSM_BEARER_MIN_INTERVAL SECONDS(20)
+#define GSM_BEARER_MAX_INTERVAL MINUTES(10)
+
+// Signal quality, polled more often while poor to catch the next good window
+#define GSM_SIGNAL_INTERVAL SECONDS(30)
+#define GSM_SIGNAL_POOR_INTERVAL SECONDS(10)
+#define GSM_SIGNAL_FRESH SECONDS(10) // Sampled again before a report if older
+
+#define GSM_IDLE_SLICE 50 // ms
+
+// Queries sent together on one command line, see gsm_batch_run
+#define GSM_BATCH_MAX 4
+#define GSM_BATCH_LINE 48
+
+#define GSM_LOCATE_TIMEOUT SECONDS(20) // The lookup goes to a server
+
+#if GSM_STATS
+#define GSM_STATS_RECORD(gsm, command, start, success) \
+	gsm_stats_record(&(gsm)->stats, command, start, (success) ? GSM_STATS_OK : (gsm)->timed_out ? GSM_STATS_TIMEOUT : GSM_STATS_ERROR)
+#else
+#define GSM_STATS_RECORD(gsm, command, start, success) (void)(start)
+#endif
 
 struct data_type_t
 {
@@ -14,76 +54,123 @@ struct data_type_t
 	char stop_char;
 };
 
-struct tcp_packet_t
+// Wire format, 26 bytes. double is 4 bytes on the AVR, so float and packed
+// keep the native build sending the same frame.
+struct __attribute__((packed)) tcp_packet_t
 {
-	double latitude;
-	double longitude;
-	double course; // deg
-	double speed; // m/s
+	float latitude;
+	float longitude;
+	float course; // deg
+	float speed; // m/s
 	uint16_t hdop; // 100ths
 	uint16_t gps_age; // seconds
 	uint8_t sats;
-	double battery_voltage;
+	float battery_voltage;
 	uint8_t battery_percent;
+#if GSM_STATS_UPLINK
+	gsm_stats_uplink_t stats;
+#endif
 };
 
 inline char gsm_get_char(gsm_t *gsm)
 {
-	char in = gsm->serial->read();
-	if (gsm->monitor)
-	{
-		Serial.write(in);
-	}
+	char in = serial_read(gsm->serial);
+#if GSM_MONITOR
+	Serial.write(in);
+#endif
 	return in;
 }
 
 inline void gsm_print(gsm_t *gsm, const char *out)
 {
-	if (gsm->monitor)
-	{
-		Serial.print(out);
-	}
-	gsm->serial->print(out);
+#if GSM_MONITOR
+	Serial.print(out);
+#endif
+	serial_print(gsm->serial, out);
 }
 
+// Command lines are the modem's heartbeat, and the last one is kept for
+// after a watchdog reset
 inline void gsm_println(gsm_t *gsm, const char *out)
 {
-	if (gsm->monitor)
+#if GSM_MONITOR
+	Serial.println(out);
+#endif
+	if (out[0] == 'A' && out[1] == 'T')
 	{
-		Serial.println(out);
+		watchdog_command(out);
+		watchdog_beat(WATCHDOG_GSM);
 	}
-	gsm->serial->println(out);
+	serial_println(gsm->serial, out);
 }
 
 bool gsm_check_for_call(gsm_t *gsm)
 {
+	// The edge only wakes us, the level tells a call from a short pulse
+	power_ring_clear();
 	gsm->incoming_call = !digitalRead(GSM_RING);
 
 	return gsm->incoming_call;
 }
 
-void gsm_flush(gsm_t *gsm)
+// In the order of the GSM_URC_ bits
+static const char *gsm_urc_text[] = { "Call Ready", "SMS Ready", "CLOSED", "+PDP: DEACT", "+CMTI" };
+#define GSM_NUM_URCS (sizeof(gsm_urc_text) / sizeof(gsm_urc_text[0]))
+
+// Reads whatever arrived between commands and notes the URCs in it, returns
+// the ones seen this time
+static uint8_t gsm_read_urcs(gsm_t *gsm)
 {
-	delay(500);
-	while (gsm->serial->available())
+	static uint8_t matched[GSM_NUM_URCS];
+	uint8_t seen = 0;
+
+	while (serial_available(gsm->serial))
 	{
-		gsm_get_char(gsm);
+		char in = gsm_get_char(gsm);
+		for (uint8_t i = 0; i < GSM_NUM_URCS; i++)
+		{
+			matched[i] = in == gsm_urc_text[i][matched[i]] ? matched[i] + 1 : in == gsm_urc_text[i][0];
+			if (!gsm_urc_text[i][matched[i]])
+			{
+				seen |= 1 << i;
+				matched[i] = 0;
+			}
+		}
 	}
+
+	gsm->urcs |= seen;
+	return seen;
+}
+
+void gsm_flush(gsm_t *gsm)
+{
+	PROFILER_WAIT_BEGIN();
+	power_delay(500);
+	gsm_read_urcs(gsm);
+	PROFILER_WAIT_END();
 }
 
 bool gsm_wait_for_char(gsm_t *gsm, char in, uint32_t to = DEFAULT_TIMEOUT)
 {
 	timer_t timeout;
 	timer_init(&timeout, to);
+	PROFILER_WAIT_BEGIN();
 	for (;;)
 	{
-		if (gsm->serial->available() && gsm_get_char(gsm) == in)
+		if (!serial_available(gsm->serial))
+		{
+			power_idle();
+		}
+		else if (gsm_get_char(gsm) == in)
 		{
+			PROFILER_WAIT_END();
 			return true;
 		}
 
 		if (timer_elapsed(&timeout))
 		{
+			PROFILER_WAIT_END();
+			gsm->timed_out = true;
 			return false;
 		}
 	}
@@ -94,9 +181,10 @@ bool gsm_wait_for_response(gsm_t *gsm, const char *response, uint32_t to = DEFAU
 	uint32_t match_position = 0;
 	timer_t timeout;
 	timer_init(&timeout, to);
+	PROFILER_WAIT_BEGIN();
 	for (;;)
 	{
-		if (gsm->serial->available())
+		if (serial_available(gsm->serial))
 		{
 			if (gsm_get_char(gsm) == response[match_position])
 			{
@@ -104,37 +192,101 @@ bool gsm_wait_for_response(gsm_t *gsm, const char *response, uint32_t to = DEFAU
 			}
 			else if (match_position > 0)
 			{
+				PROFILER_WAIT_END();
+				gsm->timed_out = false;
 				return false;
 			}
 
 			if (match_position == strlen(response))
 			{
+				PROFILER_WAIT_END();
 				return true;
 			}
 		}
+		else
+		{
+			power_idle();
+		}
 
 		if (timer_elapsed(&timeout))
 		{
+			PROFILER_WAIT_END();
+			gsm->timed_out = true;
 			return false;
 		}
 	}
 }
 
-bool gsm_command_and_response(gsm_t *gsm, const char *command, const char *response, uint32_t timeout = DEFAULT_TIMEOUT)
+// Waits for whichever of two responses comes first, returns 1 or 2 for it
+// and 0 if neither came in time
+static uint8_t gsm_wait_for_either(gsm_t *gsm, const char *first, const char *second, uint32_t to)
+{
+	const char *response[2] = { first, second };
+	uint8_t matched[2] = { 0, 0 };
+	timer_t timeout;
+	timer_init(&timeout, to);
+	PROFILER_WAIT_BEGIN();
+	for (;;)
+	{
+		if (serial_available(gsm->serial))
+		{
+			char in = gsm_get_char(gsm);
+			for (uint8_t i = 0; i < 2; i++)
+			{
+				matched[i] = in == response[i][matched[i]] ? matched[i] + 1 : in == response[i][0] ? 1 : 0;
+				if (response[i][matched[i]] == '\0')
+				{
+					PROFILER_WAIT_END();
+					return i + 1;
+				}
+			}
+		}
+		else
+		{
+			power_idle();
+		}
+
+		if (timer_elapsed(&timeout))
+		{
+			PROFILER_WAIT_END();
+			gsm->timed_out = true;
+			return 0;
+		}
+	}
+}
+
+// For commands put together at run time, the stats keep label instead
+static bool gsm_command_labeled(gsm_t *gsm, const char *label, const char *command, const char *response, uint32_t timeout)
 {
+	uint32_t start = millis();
+	BENCH_MARK(BENCH_AT_BEGIN);
 	gsm_println(gsm, command);
 
-	return gsm_wait_for_response(gsm, response, timeout);
+	bool result = gsm_wait_for_response(gsm, response, timeout);
+	GSM_STATS_RECORD(gsm, label, start, result);
+	BENCH_MARK(BENCH_AT_END);
+	return result;
+}
+
+bool gsm_command_and_response(gsm_t *gsm, const char *command, const char *response, uint32_t timeout = DEFAULT_TIMEOUT)
+{
+	return gsm_command_labeled(gsm, command, command, response, timeout);
 }
 
 bool gsm_command(gsm_t *gsm, const char *command, const char *wait_response = "OK", uint32_t to = DEFAULT_TIMEOUT)
 {
+	uint32_t start = millis();
+	BENCH_MARK(BENCH_AT_BEGIN);
 	gsm_println(gsm, command);
 	if (!gsm_wait_for_response(gsm, wait_response, to))
 	{
+		GSM_STATS_RECORD(gsm, command, start, false);
+		BENCH_MARK(BENCH_AT_END);
 		return false;
 	}
 
+	GSM_STATS_RECORD(gsm, command, start, true);
+	BENCH_MARK(BENCH_AT_END);
 	return true;
 }
 
@@ -181,25 +333,34 @@ string_end_cause_t gsm_read_string(gsm_t *gsm, char *out, uint8_t max_chars, cha
 		}
 	}
 
+	PROFILER_WAIT_BEGIN();
 	for (;;)
 	{
-		if (gsm->serial->available())
+		if (serial_available(gsm->serial))
 		{
 			char in = gsm_get_char(gsm);
 			if (in == end_char)
 			{
+				PROFILER_WAIT_END();
 				out[char_index] = '\0';
 				return END_CHAR;
 			}
 			out[char_index++] = in;
 			if (char_index == max_chars)
 			{
+				PROFILER_WAIT_END();
 				out[char_index] = '\0';
 				return MAX_SIZE;
 			}
 		}
+		else
+		{
+			power_idle();
+		}
 		if (timer_elapsed(&timeout))
 		{
+			PROFILER_WAIT_END();
+			gsm->timed_out = true;
 			return FAILURE;
 		}
 	}
@@ -232,120 +393,629 @@ bool gsm_retrieve_data(gsm_t *gsm, data_type_t *data, uint8_t num_entries, uint3
 
 bool gsm_command_and_retrieve_data(gsm_t *gsm, const char *command, const char *response, data_type_t *data, uint8_t num_entries, uint32_t step_timeout = DEFAULT_TIMEOUT)
 {
+	return gsm_command_and_response(gsm, command, response, step_timeout) &&
+		gsm_retrieve_data(gsm, data, num_entries, step_timeout) &&
+		gsm_wait_for_response(gsm, "OK", step_timeout);
+}
+
+// A query within a batch, command without the AT, e.g. "+CSQ"
+struct gsm_query_t
+{
+	const char *command;
+	const char *response;
+	data_type_t *data;
+	uint8_t num_entries;
+};
+
+struct gsm_batch_t
+{
+	gsm_query_t query[GSM_BATCH_MAX];
+	uint8_t count;
+	uint8_t answered; // Queries whose data was read, in order
+};
 
-	if (!gsm_command_and_response(gsm, command, response, step_timeout))
+static void gsm_batch_init(gsm_batch_t *batch)
+{
+	batch->count = 0;
+	batch->answered = 0;
+}
+
+// Returns the query's place in the batch, the answer is valid once
+// batch->answered is past it
+static uint8_t gsm_batch_add(gsm_batch_t *batch, const char *command, const char *response, data_type_t *data, uint8_t num_entries)
+{
+	gsm_query_t *query = &batch->query[batch->count];
+	query->command = command;
+	query->response = response;
+	query->data = data;
+	query->num_entries = num_entries;
+	return batch->count++;
+}
+
+// Sends the queries as one line, AT+CBC;+CSQ;+CREG?, and reads the answers
+// into each query's data. The modem answers in order with a single OK at
+// the end, an error stops it at the failing query.
+static bool gsm_batch_run(gsm_t *gsm, gsm_batch_t *batch)
+{
+	char line[GSM_BATCH_LINE] = "AT";
+
+	for (uint8_t i = 0; i < batch->count; i++)
 	{
-		return false;
+		if (i)
+		{
+			strcat(line, ";");
+		}
+		strcat(line, batch->query[i].command);
 	}
 
-	if (!gsm_retrieve_data(gsm, data, num_entries, step_timeout))
+	uint32_t start = millis();
+	gsm_println(gsm, line);
+
+	bool result = true;
+	for (batch->answered = 0; batch->answered < batch->count; batch->answered++)
 	{
-		return false;
+		gsm_query_t *query = &batch->query[batch->answered];
+		if (!(gsm_wait_for_response(gsm, query->response) && gsm_retrieve_data(gsm, query->data, query->num_entries)))
+		{
+			result = false;
+			break;
+		}
+	}
+	result = result && gsm_wait_for_response(gsm, "OK");
+
+	// The line varies with what is due, the stats keep one label for all
+	GSM_STATS_RECORD(gsm, "AT+BATCH", start, result);
+	return result;
+}
+
+static void gsm_boot_enter(gsm_t *gsm, gsm_boot_state_t state)
+{
+	gsm->boot_state = state;
+	gsm->boot_state_start = millis();
+}
+
+// Presses the power key, the modem then takes a few seconds to answer
+static void gsm_boot_power(gsm_t *gsm)
+{
+	digitalWrite(GSM_ENABLE, LOW);
+	PROFILER_WAIT_BEGIN();
+	delay(GSM_POWER_PULSE);
+	PROFILER_WAIT_END();
+	digitalWrite(GSM_ENABLE, HIGH);
+
+	gsm->boot_flags = 0;
+	gsm->urcs = 0;
+	gsm_boot_enter(gsm, GSM_BOOT_PROBE);
+}
+
+// Power cycles the modem again, resets after GSM_BOOT_ATTEMPTS tries
+static void gsm_boot_retry(gsm_t *gsm)
+{
+	if (++gsm->boot_attempts >= GSM_BOOT_ATTEMPTS)
+	{
+		DEBUG_PRINTLN("GSM boot failed");
+		system_reset();
+	}
+
+	DEBUG_PRINT("GSM boot attempt ");
+	DEBUG_PRINTLN(gsm->boot_attempts + 1);
+	gsm_boot_power(gsm);
+}
+
+// Asks for what the URCs may have been missed for, SoftwareSerial only hears
+// the modem while it listens to it
+static void gsm_boot_poll_network(gsm_t *gsm)
+{
+	char status[2];
+	data_type_t data[1] = { {1, status, 1, 0, 0} };
+
+	if (!(gsm->boot_flags & GSM_BOOT_REGISTERED) &&
+		gsm_command_and_retrieve_data(gsm, "AT+CREG?", "+CREG", data, 1))
+	{
+		// Home or roaming
+		if (status[0] == '1' || status[0] == '5')
+		{
+			gsm->boot_flags |= GSM_BOOT_REGISTERED;
+		}
+	}
+
+	data[0].index = 0;
+	data[0].start_char = ' ';
+	if (!(gsm->boot_flags & GSM_BOOT_CALL_READY) &&
+		gsm_command_and_retrieve_data(gsm, "AT+CCALR?", "+CCALR:", data, 1) && status[0] == '1')
+	{
+		gsm->boot_flags |= GSM_BOOT_CALL_READY;
+	}
+
+	// Deleting old messages only works once SMS is up, so it doubles as the check
+	if (!(gsm->boot_flags & GSM_BOOT_SMS_READY) && gsm_command(gsm, "AT+CMGD=1,4", "OK", SECONDS(10)))
+	{
+		gsm->boot_flags |= GSM_BOOT_SMS_READY;
+	}
+}
+
+void gsm_tcp_shut(gsm_t *gsm);
+
+static void gsm_boot_ready(gsm_t *gsm)
+{
+	// A connection left open before the reset is in an unknown state
+	if (gsm->resuming)
+	{
+		gsm_tcp_shut(gsm);
+		gsm->resuming = false;
+	}
+
+	gsm->ready_ms = millis();
+	gsm->tcp_last_activity = gsm->ready_ms;
+	gsm_boot_enter(gsm, GSM_BOOT_READY);
+
+	// Nothing to wait for, start reporting right away
+	timer_expire(&gsm->battery_timer);
+	timer_expire(&gsm->check_gprs_timer);
+	timer_expire(&gsm->signal_timer);
+
+	DEBUG_PRINT("GSM ready after ");
+	DEBUG_PRINT(gsm->ready_ms);
+	DEBUG_PRINTLN(" ms");
+}
+
+// Steps the start up for up to time ms, returns true once the modem is ready
+bool gsm_boot(gsm_t *gsm, uint32_t time)
+{
+	uint32_t start = millis();
+	uint32_t poll = start - GSM_BOOT_POLL_INTERVAL;
+
+	serial_listen(gsm->serial);
+
+	while (gsm->boot_state != GSM_BOOT_READY && millis() - start < time)
+	{
+		uint32_t in_state = millis() - gsm->boot_state_start;
+
+		switch (gsm->boot_state)
+		{
+		case GSM_BOOT_PROBE:
+			if (gsm_command(gsm, "AT", "OK", GSM_PROBE_INTERVAL))
+			{
+				gsm_boot_enter(gsm, GSM_BOOT_SETUP);
+			}
+			else if (gsm->resuming && in_state > GSM_RESUME_TIMEOUT)
+			{
+				DEBUG_PRINTLN("GSM not running");
+				gsm->resuming = false;
+				gsm_boot_power(gsm);
+			}
+			else if (in_state > GSM_PROBE_TIMEOUT)
+			{
+				DEBUG_PRINTLN("Could not detect GSM");
+				gsm_boot_retry(gsm);
+			}
+			break;
+
+		case GSM_BOOT_SETUP:
+			gsm_flush(gsm);
+			if ((GSM_PASSTHROUGH || gsm_command(gsm, "ATE0")) && gsm_command(gsm, "AT+CFUN=1", "OK", SECONDS(10)))
+			{
+				gsm_boot_enter(gsm, GSM_BOOT_NETWORK);
+			}
+			else
+			{
+				gsm_boot_retry(gsm);
+			}
+			break;
+
+		case GSM_BOOT_NETWORK:
+			if (gsm_read_urcs(gsm))
+			{
+				poll = millis() - GSM_BOOT_POLL_INTERVAL;
+			}
+
+			if (gsm->urcs & GSM_URC_CALL_READY)
+			{
+				gsm->boot_flags |= GSM_BOOT_CALL_READY;
+			}
+
+			if ((gsm->boot_flags & GSM_BOOT_ALL) == GSM_BOOT_ALL)
+			{
+				gsm_boot_ready(gsm);
+			}
+			else if (in_state > GSM_NETWORK_TIMEOUT)
+			{
+				// No coverage is no reason to reset, the main loop copes
+				DEBUG_PRINTLN("GSM network not ready, going on");
+				gsm_boot_ready(gsm);
+			}
+			else if (millis() - poll >= GSM_BOOT_POLL_INTERVAL)
+			{
+				poll = millis();
+				gsm_boot_poll_network(gsm);
+			}
+			break;
+
+		default:
+			break;
+		}
 	}
 
-	if (!gsm_wait_for_response(gsm, "OK", step_timeout))
+	if (gsm->boot_state != GSM_BOOT_READY)
 	{
+		// Nothing answers a call yet, it would only cut the GPS windows short.
+		// Pulses from the booting modem look the same.
+		power_ring_clear();
 		return false;
 	}
 	return true;
 }
 
-bool gsm_first_setup(gsm_t *gsm)
+static uint32_t gsm_backoff(timer_t *timer, uint32_t max_interval)
 {
-	if (!gsm_command(gsm, "AT"))
+	return timer->interval < max_interval / 2 ? timer->interval * 2 : max_interval;
+}
+
+// Takes in an answer to AT+CBC, or none with NULLs. The battery is read less
+// often while the voltage holds, and often again once it falls or runs low.
+static void gsm_update_battery(gsm_t *gsm, const char *percentage, const char *voltage)
+{
+	int16_t last_mv = int16_t(gsm->battery_voltage * 1000 + 0.5f);
+	uint32_t interval = gsm->battery_timer.interval;
+
+	if (percentage)
 	{
-		DEBUG_PRINTLN("Could not detect GSM");
-		return false;
+		gsm->battery_voltage = atoi(voltage);
+		gsm->battery_voltage /= 1000.0f;
+		gsm->battery_percentage = atoi(percentage);
 	}
-	gsm_flush(gsm);
 
-	if (!gsm->debug)
+	if (!percentage)
+	{
+		interval = GSM_BATTERY_MIN_INTERVAL;
+	}
+	else if (last_mv)
 	{
-		if (!gsm_command(gsm, "ATE0"))
+		int16_t change = int16_t(gsm->battery_voltage * 1000 + 0.5f) - last_mv;
+		if (change <= -GSM_BATTERY_FALLING_MV || gsm->battery_percentage <= GSM_BATTERY_LOW_PERCENT)
 		{
-			return false;
+			interval = GSM_BATTERY_MIN_INTERVAL;
+		}
+		else if (change < GSM_BATTERY_STABLE_MV && change > -GSM_BATTERY_STABLE_MV)
+		{
+			interval = gsm_backoff(&gsm->battery_timer, GSM_BATTERY_MAX_INTERVAL);
 		}
 	}
 
-	if (!gsm_command(gsm, "AT+CFUN=1"))
+	timer_init(&gsm->battery_timer, interval);
+}
+
+// Takes in answers to AT+CSQ and AT+CREG?, or none with NULLs
+static void gsm_update_signal(gsm_t *gsm, const char *rssi, const char *status)
+{
+	if (rssi)
+	{
+		gsm_link_sample(&gsm->link, atoi(rssi), status[0] == '1' || status[0] == '5');
+	}
+
+	timer_init(&gsm->signal_timer, gsm_link_good(&gsm->link) ? GSM_SIGNAL_INTERVAL : GSM_SIGNAL_POOR_INTERVAL);
+}
+
+// A failure may be the first sign of a fading signal, look at it right away
+static void gsm_record_transmission(gsm_t *gsm, bool success)
+{
+	gsm_link_record(&gsm->link, success);
+	if (!success)
 	{
+		timer_expire(&gsm->signal_timer);
+	}
+}
+
+void gsm_send_eod(gsm_t *gsm)
+{
+	serial_write(gsm->serial, '\x1A');
+}
+
+#if !GSM_SMS_DRY_RUN
+// Sends the SMS written after the prompt and waits for the network to take it
+static bool gsm_submit_sms(gsm_t *gsm, uint32_t start)
+{
+	gsm_send_eod(gsm);
+
+	bool result = gsm_wait_for_response(gsm, "+CMGS:", SECONDS(30)) &&
+		gsm_wait_for_response(gsm, "OK", SECONDS(10));
+	GSM_STATS_RECORD(gsm, "AT+CMGS", start, result);
+	return result;
+}
+
+static void gsm_print_hex(gsm_t *gsm, uint8_t value)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	char hex[3] = { digits[value >> 4], digits[value & 0x0f], '\0' };
+	gsm_print(gsm, hex);
+}
+#endif
+
+static bool gsm_transmit_sms(gsm_t *gsm, const char *phone_no, const char *message)
+{
+	DEBUG_PRINT("SMS To: ");
+	DEBUG_PRINTLN(phone_no);
+	DEBUG_PRINT("Content: \"");
+	DEBUG_PRINT(message);
+	DEBUG_PRINTLN("\"");
+
+
+	gsm_flush(gsm);
+
+#if GSM_SMS_DRY_RUN
+	return true;
+#else
+	// Text mode is set on the same line
+	uint32_t start = millis();
+	gsm_print(gsm, "AT+CMGF=1;+CMGS=\"");
+	gsm_print(gsm, phone_no);
+	gsm_println(gsm, "\"");
+	if (!gsm_wait_for_char(gsm, '>', 3000))
+	{
+		GSM_STATS_RECORD(gsm, "AT+CMGS", start, false);
 		return false;
 	}
 
-	delay(5000);
+	gsm_println(gsm, message);
 
-	if (!gsm_command(gsm, "AT+CMGD=1,4", "OK", 10000))
+	return gsm_submit_sms(gsm, start);
+#endif
+}
+
+#if !GSM_SMS_DRY_RUN
+// AT+CMGS for an SMS-SUBMIT in PDU mode, see 3GPP TS 23.040, and the PDU up
+// to the protocol identifier. The number goes in as swapped BCD digits,
+// international with a leading +. The user data of data_length bytes and
+// what goes before it are left to the caller.
+static bool gsm_begin_pdu(gsm_t *gsm, const char *phone_no, uint8_t first_octet, uint8_t data_length, uint32_t start)
+{
+	bool international = phone_no[0] == '+';
+	const char *digits = phone_no + international;
+	uint8_t num_digits = strlen(digits);
+
+	// The length leaves out the service centre, PDU mode is set on the same line
+	sprintf(text_scratch_pad, "AT+CMGF=0;+CMGS=%d", 7 + (num_digits + 1) / 2 + data_length);
+	gsm_println(gsm, text_scratch_pad);
+	if (!gsm_wait_for_char(gsm, '>', 3000))
 	{
+		GSM_STATS_RECORD(gsm, "AT+CMGS", start, false);
 		return false;
 	}
 
+	gsm_print(gsm, "00"); // The modem's service centre
+	gsm_print_hex(gsm, first_octet);
+	gsm_print(gsm, "00"); // Reference, set by the modem
+	gsm_print_hex(gsm, num_digits);
+	gsm_print_hex(gsm, international ? 0x91 : 0x81);
+	for (uint8_t i = 0; i < num_digits; i += 2)
+	{
+		uint8_t low = digits[i] - '0';
+		uint8_t high = i + 1 < num_digits ? digits[i + 1] - '0' : 0x0f;
+		gsm_print_hex(gsm, high << 4 | low);
+	}
+	gsm_print(gsm, "00"); // Protocol
 	return true;
 }
+#endif
 
-bool gsm_get_battery_status(gsm_t *gsm)
+// 8-bit data in PDU mode
+static bool gsm_transmit_binary_sms(gsm_t *gsm, const char *phone_no, const uint8_t *data, uint8_t length)
 {
-	char percentage[3];
-	char voltage[5];
+	DEBUG_PRINT("Binary SMS To: ");
+	DEBUG_PRINTLN(phone_no);
+	DEBUG_PRINT("Length: ");
+	DEBUG_PRINTLN(length);
 
-	data_type_t out_data[2] = {{1, percentage, 3, 0, ','}, {2, voltage, 4, 0, 0}};
+	gsm_flush(gsm);
 
-	if (!gsm_command_and_retrieve_data(gsm, "AT+CBC", "+CBC", out_data, 2))
+#if GSM_SMS_DRY_RUN
+	return true;
+#else
+	uint32_t start = millis();
+	if (!gsm_begin_pdu(gsm, phone_no, 0x01, length, start)) // SMS-SUBMIT
 	{
 		return false;
 	}
 
-	gsm->battery_voltage = atoi(voltage);
-	gsm->battery_voltage /= 1000.0f;
-	gsm->battery_percentage = atoi(percentage);
+	gsm_print(gsm, "04"); // 8-bit data
+	gsm_print_hex(gsm, length);
+	for (uint8_t i = 0; i < length; i++)
+	{
+		gsm_print_hex(gsm, data[i]);
+	}
 
-	return true;
+	return gsm_submit_sms(gsm, start);
+#endif
 }
 
-void gsm_send_eod(gsm_t *gsm)
+// Where a reply from an sms_line_callback_t has got to
+struct gsm_sms_lines_t
 {
-	gsm->serial->print('\x1A');
-}
+	sms_line_callback_t callback;
+	uint8_t index; // Of the next line to ask for
+	uint8_t num_lines; // That fit
+	uint8_t offset; // Into line
+	char line[GSM_SMS_LINE_MAX];
+};
 
-bool gsm_send_sms(gsm_t *gsm, const char *phone_no, const char *message)
+// Next character of the reply, '\0' after the last line that fits
+static char gsm_sms_lines_next(gsm_sms_lines_t *lines)
 {
-	if (!gsm_command(gsm, "AT+CMGF=1"))
+	while (!lines->line[lines->offset])
 	{
-		return false;
+		if (lines->index == lines->num_lines || !lines->callback(lines->index, lines->line, sizeof(lines->line)))
+		{
+			lines->line[0] = '\0';
+			lines->offset = 0;
+			return '\0';
+		}
+		lines->index++;
+		lines->offset = 0;
 	}
+	return lines->line[lines->offset++];
+}
 
-	DEBUG_PRINT("SMS To: ");
-	DEBUG_PRINTLN(phone_no);
-	DEBUG_PRINT("Content: \"");
-	DEBUG_PRINT(message);
-	DEBUG_PRINTLN("\"");
+#if !GSM_SMS_DRY_RUN
+// The GSM 7-bit default alphabet matches ASCII for letters, digits and most
+// punctuation. The rest of ASCII would need escapes or is missing.
+static uint8_t gsm_septet(char c)
+{
+	switch (c)
+	{
+	case '@':
+		return 0x00;
+	case '$':
+		return 0x02;
+	case '_':
+		return 0x11;
+	case '\n':
+	case '\r':
+		return c;
+	}
+	if ((c >= ' ' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+	{
+		return c;
+	}
+	return '?';
+}
 
+// One part of a concatenated SMS in 7-bit PDU mode, with the next length
+// characters of the reply
+static bool gsm_transmit_sms_part(gsm_t *gsm, const char *phone_no, gsm_sms_lines_t *lines,
+	uint8_t reference, uint8_t parts, uint8_t part, uint8_t length)
+{
+	// The six header bytes and a fill bit take up seven septets
+	uint8_t data_length = 6 + (1 + 7 * length + 7) / 8;
+	uint32_t start = millis();
 
 	gsm_flush(gsm);
+	if (!gsm_begin_pdu(gsm, phone_no, 0x41, data_length, start)) // SMS-SUBMIT with a header
+	{
+		return false;
+	}
 
-	if (!gsm->disable_sms)
+	gsm_print(gsm, "00"); // 7-bit default alphabet
+	gsm_print_hex(gsm, 7 + length);
+	gsm_print(gsm, "050003"); // Concatenation, 8-bit reference
+	gsm_print_hex(gsm, reference);
+	gsm_print_hex(gsm, parts);
+	gsm_print_hex(gsm, part);
+
+	uint16_t bits = 0;
+	uint8_t num_bits = 1; // The fill bit
+	for (uint8_t i = 0; i < length; i++)
 	{
-		gsm_print(gsm, "AT+CMGS=\"");
-		gsm_print(gsm, phone_no);
-		gsm_println(gsm, "\"");
-		if (!gsm_wait_for_char(gsm, '>', 3000))
+		bits |= uint16_t(gsm_septet(gsm_sms_lines_next(lines))) << num_bits;
+		num_bits += 7;
+		if (num_bits >= 8)
 		{
-			return false;
+			gsm_print_hex(gsm, bits & 0xff);
+			bits >>= 8;
+			num_bits -= 8;
 		}
+	}
+	if (num_bits)
+	{
+		gsm_print_hex(gsm, bits);
+	}
 
-		gsm_println(gsm, message);
+	return gsm_submit_sms(gsm, start);
+}
+#endif
 
-		gsm_send_eod(gsm);
+static bool gsm_transmit_sms_lines(gsm_t *gsm, const char *phone_no, sms_line_callback_t callback)
+{
+	static uint8_t reference;
+	gsm_sms_lines_t lines;
+	uint16_t length = 0;
 
-		if (!gsm_wait_for_response(gsm, "+CMGS:", SECONDS(30)))
+	// How much of the reply fits
+	lines.callback = callback;
+	for (lines.num_lines = 0; lines.num_lines < 255; lines.num_lines++)
+	{
+		if (!callback(lines.num_lines, lines.line, sizeof(lines.line)))
 		{
-			return false;
+			break;
+		}
+		uint8_t line_length = strlen(lines.line);
+		if (length + line_length > GSM_SMS_MAX_PARTS * GSM_SMS_PART_LENGTH)
+		{
+			break;
 		}
-		if (!gsm_wait_for_response(gsm, "OK", SECONDS(10)))
+		length += line_length;
+	}
+
+	if (length <= MAX_SMS_LENGTH)
+	{
+		text_scratch_pad[0] = '\0';
+		for (uint8_t i = 0; i < lines.num_lines; i++)
+		{
+			uint8_t used = strlen(text_scratch_pad);
+			if (!callback(i, text_scratch_pad + used, sizeof(text_scratch_pad) - used))
+			{
+				break;
+			}
+		}
+		return gsm_transmit_sms(gsm, phone_no, text_scratch_pad);
+	}
+
+	uint8_t parts = (length + GSM_SMS_PART_LENGTH - 1) / GSM_SMS_PART_LENGTH;
+	reference++;
+	lines.index = 0;
+	lines.offset = 0;
+	lines.line[0] = '\0';
+
+	DEBUG_PRINT("SMS To: ");
+	DEBUG_PRINTLN(phone_no);
+	DEBUG_PRINT("Parts: ");
+	DEBUG_PRINTLN(parts);
+
+#if GSM_SMS_DRY_RUN
+	DEBUG_PRINT("Content: \"");
+	for (char c = gsm_sms_lines_next(&lines); c; c = gsm_sms_lines_next(&lines))
+	{
+		DEBUG_PRINT(c);
+	}
+	DEBUG_PRINTLN("\"");
+	return true;
+#else
+	for (uint8_t part = 1; part <= parts; part++)
+	{
+		uint8_t part_length = part < parts ? GSM_SMS_PART_LENGTH : length - (parts - 1) * GSM_SMS_PART_LENGTH;
+		if (!gsm_transmit_sms_part(gsm, phone_no, &lines, reference, parts, part, part_length))
 		{
 			return false;
 		}
 	}
 	return true;
+#endif
+}
+
+bool gsm_send_sms(gsm_t *gsm, const char *phone_no, const char *message)
+{
+	bool result = gsm_transmit_sms(gsm, phone_no, message);
+#if !GSM_SMS_DRY_RUN
+	gsm_record_transmission(gsm, result);
+#endif
+	return result;
+}
+
+bool gsm_send_sms_lines(gsm_t *gsm, const char *phone_no, sms_line_callback_t lines)
+{
+	bool result = gsm_transmit_sms_lines(gsm, phone_no, lines);
+#if !GSM_SMS_DRY_RUN
+	gsm_record_transmission(gsm, result);
+#endif
+	return result;
+}
+
+bool gsm_send_binary_sms(gsm_t *gsm, const char *phone_no, const uint8_t *data, uint8_t length)
+{
+	bool result = gsm_transmit_binary_sms(gsm, phone_no, data, length);
+#if !GSM_SMS_DRY_RUN
+	gsm_record_transmission(gsm, result);
+#endif
+	return result;
 }
 
 bool gsm_handle_call_id(gsm_t *gsm, char *caller_id)
@@ -362,14 +1032,14 @@ bool gsm_handle_call_id(gsm_t *gsm, char *caller_id)
 
 bool gsm_handle_sms(gsm_t *gsm)
 {
-	if (!gsm_command(gsm, "AT+CMGF=1"))
+	// An empty inbox is just OK
+	uint32_t start = millis();
+	gsm_println(gsm, "AT+CMGF=1;+CMGL");
+	uint8_t found = gsm_wait_for_either(gsm, "+CMGL", "OK", DEFAULT_TIMEOUT);
+	GSM_STATS_RECORD(gsm, "AT+CMGL", start, found != 0);
+	if (found != 1)
 	{
-		return false;
-	}
-
-	if (!gsm_command_and_response(gsm, "AT+CMGL", "+CMGL"))
-	{
-		return false;
+		return found == 2;
 	}
 
 	for (;;)
@@ -403,22 +1073,20 @@ bool gsm_handle_sms(gsm_t *gsm)
 	return true;
 }
 
-void gsm_reset()
-{
-	digitalWrite(GSM_ENABLE, LOW);
-	delay(1100);
-	digitalWrite(GSM_ENABLE, HIGH);
-}
-
 bool gsm_setup_gprs(gsm_t *gsm)
 {
+	char command[CONFIG_MAX_STRING + 24];
+
 	if(!gsm_command(gsm, "AT+SAPBR=3,1,\"CONTYPE\",\"GPRS\""))
 	{
 		DEBUG_PRINTLN("Failed to set connection type");
 		return false;
 	}
 
-	if(!gsm_command(gsm, "AT+SAPBR=3,1,\"APN\",\"4g.tele2.se\""))
+	strcpy(command, "AT+SAPBR=3,1,\"APN\",\"");
+	config_get_string(CONFIG_APN, command + strlen(command));
+	strcat(command, "\"");
+	if(!gsm_command_labeled(gsm, "AT+SAPBR=3,1,\"APN\"", command, "OK", DEFAULT_TIMEOUT))
 	{
 		DEBUG_PRINTLN("Failed to set APN");
 		return false;
@@ -460,9 +1128,117 @@ bool gsm_check_gprs_status(gsm_t *gsm, bool enable)
 	}
 }
 
+// A successful CIPSEND shows the bearer is up, no need to ask then
+static bool gsm_bearer_known(gsm_t *gsm)
+{
+	return gsm->tcp_connection_active && !(gsm->urcs & (GSM_URC_CLOSED | GSM_URC_PDP_DEACT)) &&
+		!timer_due(&gsm->bearer_timer);
+}
+
+// Asks for the bearer only when there is no other evidence. While sends go
+// through the query backs off, and a bearer that changes state is watched
+// closely. status is the +SAPBR status when gsm_poll_status already asked.
+static bool gsm_poll_bearer(gsm_t *gsm, const char *status)
+{
+	bool was_up = gsm->gprs_status;
+
+	if (gsm_bearer_known(gsm))
+	{
+		return true;
+	}
+
+	if (gsm->urcs & GSM_URC_PDP_DEACT)
+	{
+		DEBUG_PRINTLN("Bearer deactivated");
+		gsm->tcp_connection_active = false;
+	}
+	else if (gsm->urcs & GSM_URC_CLOSED)
+	{
+		gsm->tcp_connection_active = false;
+	}
+	gsm->urcs &= ~(GSM_URC_CLOSED | GSM_URC_PDP_DEACT);
+
+	if (status)
+	{
+		gsm->gprs_status = status[0] == '1' || (gsm->enable_data_connection && gsm_setup_gprs(gsm));
+	}
+	else
+	{
+		gsm->gprs_status = gsm_check_gprs_status(gsm, gsm->enable_data_connection);
+	}
+	timer_init(&gsm->bearer_timer, gsm->gprs_status == was_up ?
+		gsm_backoff(&gsm->bearer_timer, GSM_BEARER_MAX_INTERVAL) : GSM_BEARER_MIN_INTERVAL);
+
+	return gsm->gprs_status;
+}
+
+// Battery, signal and bearer queries that are due, asked in one round trip.
+// The bearer is asked ahead of a report while the link looked good, its
+// status is left in bearer, or an empty string. Returns false if nothing
+// was due.
+static bool gsm_poll_status(gsm_t *gsm, bool report_due, char *bearer)
+{
+	char percentage[3];
+	char voltage[5];
+	char rssi[3];
+	char status[2];
+	data_type_t cbc_data[2] = { {1, percentage, 3, 0, ','}, {2, voltage, 4, 0, 0} };
+	data_type_t csq_data[1] = { {0, rssi, 2, ' ', ','} };
+	data_type_t creg_data[1] = { {1, status, 1, 0, 0} };
+	data_type_t sapbr_data[1] = { {1, bearer, 1, 0, 0} };
+	uint8_t cbc = GSM_BATCH_MAX;
+	uint8_t creg = GSM_BATCH_MAX;
+	uint8_t sapbr = GSM_BATCH_MAX;
+	gsm_batch_t batch;
+
+	bearer[0] = '\0';
+	gsm_batch_init(&batch);
+
+	if (timer_due(&gsm->battery_timer))
+	{
+		cbc = gsm_batch_add(&batch, "+CBC", "+CBC", cbc_data, 2);
+	}
+	if (timer_due(&gsm->signal_timer) || (report_due && millis() - gsm->link.sampled_at > GSM_SIGNAL_FRESH))
+	{
+		gsm_batch_add(&batch, "+CSQ", "+CSQ:", csq_data, 1);
+		creg = gsm_batch_add(&batch, "+CREG?", "+CREG", creg_data, 1);
+	}
+	if (report_due && gsm_link_good(&gsm->link) && !gsm_bearer_known(gsm))
+	{
+		sapbr = gsm_batch_add(&batch, "+SAPBR=2,1", "+SAPBR", sapbr_data, 1);
+	}
+
+	if (!batch.count)
+	{
+		return false;
+	}
+	gsm_batch_run(gsm, &batch);
+
+	if (cbc < GSM_BATCH_MAX)
+	{
+		bool read = batch.answered > cbc;
+		gsm_update_battery(gsm, read ? percentage : NULL, voltage);
+	}
+	if (creg < GSM_BATCH_MAX)
+	{
+		bool read = batch.answered > creg;
+		gsm_update_signal(gsm, read ? rssi : NULL, status);
+	}
+	if (sapbr < GSM_BATCH_MAX && batch.answered <= sapbr)
+	{
+		bearer[0] = '\0';
+	}
+	return true;
+}
+
 bool gsm_init_tcp_connection(gsm_t *gsm)
 {
-	if(!gsm_command(gsm, "AT+CIPSTART=\"TCP\",\"www.danielkarling.se\",5195", "CONNECT OK", SECONDS(10)))
+	char command[CONFIG_MAX_STRING + 32];
+
+	strcpy(command, "AT+CIPSTART=\"TCP\",\"");
+	config_get_string(CONFIG_HOST, command + strlen(command));
+	sprintf(command + strlen(command), "\",%u", config_get(CONFIG_PORT));
+	if(!gsm_command_labeled(gsm, "AT+CIPSTART=\"TCP\"", command, "CONNECT OK", SECONDS(10)))
 	{
 		DEBUG_PRINTLN("Failed to open TCP");
 		gsm->tcp_connection_active = false;
@@ -472,6 +1248,118 @@ bool gsm_init_tcp_connection(gsm_t *gsm)
 	return true;
 }
 
+// Serving cell from engineering mode, the first quoted line of AT+CENG? is
+// arfcn,rxl,rxq,mcc,mnc,bsic,cellid,rla,txp,lac,ta with the IDs in hex
+static bool gsm_serving_cell(gsm_t *gsm, uint32_t *cell, uint8_t *ta)
+{
+	char info[48];
+	data_type_t data[1] = { {0, info, sizeof(info) - 1, '"', '"'} };
+	uint16_t cell_id = 0;
+	uint16_t lac = 0;
+	const char *next = info;
+	uint8_t field;
+
+	if (!gsm_command(gsm, "AT+CENG=1,1") ||
+		!gsm_command_and_retrieve_data(gsm, "AT+CENG?", "+CENG:", data, 1))
+	{
+		return false;
+	}
+
+	for (field = 0; next && field <= 10; field++)
+	{
+		if (field == 6)
+		{
+			cell_id = strtoul(next, NULL, 16);
+		}
+		else if (field == 9)
+		{
+			lac = strtoul(next, NULL, 16);
+		}
+		else if (field == 10)
+		{
+			*ta = atoi(next);
+		}
+
+		next = strchr(next, ',');
+		if (next)
+		{
+			next++;
+		}
+	}
+
+	// Not camped on a cell
+	if (field <= 10 || !cell_id || cell_id == 0xffff)
+	{
+		return false;
+	}
+
+	*cell = uint32_t(lac) << 16 | cell_id;
+	return true;
+}
+
+// +CIPGSMLOC: 0,<longitude>,<latitude>,<date>,<time>, any other code is
+// an error without the rest
+static bool gsm_lookup_cell(gsm_t *gsm, gsm_location_t *location)
+{
+	char code[4];
+	char longitude[12];
+	char latitude[12];
+	data_type_t code_data[1] = { {0, code, 3, ' ', ','} };
+	data_type_t data[2] = { {0, longitude, 11, 0, ','}, {1, latitude, 11, 0, ','} };
+
+	if (!(gsm_command_and_response(gsm, "AT+CIPGSMLOC=1,1", "+CIPGSMLOC:", GSM_LOCATE_TIMEOUT) &&
+		gsm_retrieve_data(gsm, code_data, 1) && strcmp(code, "0") == 0 &&
+		gsm_retrieve_data(gsm, data, 2) && gsm_wait_for_response(gsm, "OK")))
+	{
+		DEBUG_PRINTLN("Cell lookup failed");
+		return false;
+	}
+
+	location->latitude = atof(latitude);
+	location->longitude = atof(longitude);
+	location->cached = false;
+	return true;
+}
+
+// A cell looked up before is answered from the cache. Without engineering
+// mode the lookup still works, it is just not kept.
+bool gsm_locate(gsm_t *gsm, gsm_location_t *location)
+{
+	uint32_t cell = 0;
+	uint8_t ta = 0xff;
+	bool bearer_was_up;
+	bool result;
+
+	if (gsm_serving_cell(gsm, &cell, &ta) && gsm_locate_find(&gsm->locate, cell, location))
+	{
+		location->accuracy = gsm_locate_accuracy(ta);
+		return true;
+	}
+
+	// The lookup needs the bearer, closed again after unless reports use it
+	bearer_was_up = gsm_check_gprs_status(gsm, false);
+	if (!bearer_was_up && !gsm_setup_gprs(gsm))
+	{
+		return false;
+	}
+
+	result = gsm_lookup_cell(gsm, location);
+
+	if (!bearer_was_up && !gsm->enable_data_connection)
+	{
+		gsm_command(gsm, "AT+SAPBR=0,1");
+	}
+
+	if (!result)
+	{
+		return false;
+	}
+
+	location->accuracy = gsm_locate_accuracy(ta);
+	gsm_locate_store(&gsm->locate, cell, location);
+	return true;
+}
+
 void gsm_tcp_shut(gsm_t *gsm)
 {
 	gsm_command(gsm, "AT+CIPSHUT", "SHUT OK", SECONDS(20));
@@ -485,10 +1373,12 @@ bool gsm_send_data(gsm_t *gsm, const char *data, uint16_t data_len)
 	{
 		if(!gsm_init_tcp_connection(gsm))
 		{
+			gsm_record_transmission(gsm, false);
 			return false;
 		}
 	}
 
+	uint32_t start = millis();
 	text_scratch_pad[0] = '\0';
 	sprintf(text_scratch_pad, "AT+CIPSEND=%d", data_len);
 	gsm_println(gsm, text_scratch_pad);
@@ -500,7 +1390,7 @@ bool gsm_send_data(gsm_t *gsm, const char *data, uint16_t data_len)
 
 	for(uint16_t i = 0; i < data_len; i++)
 	{
-		gsm->serial->write(data[i]);
+		serial_write(gsm->serial, data[i]);
 	}
 
 	if (!gsm_wait_for_response(gsm, "OK", SECONDS(10)))
@@ -509,6 +1399,8 @@ bool gsm_send_data(gsm_t *gsm, const char *data, uint16_t data_len)
 	}
 
 cleanup:
+	GSM_STATS_RECORD(gsm, "AT+CIPSEND", start, result);
+	gsm_record_transmission(gsm, result);
 	if(result == false)
 	{
 		gsm_tcp_shut(gsm);
@@ -516,153 +1408,225 @@ cleanup:
 	else
 	{
 		gsm->tcp_last_activity = millis();
+		if (!gsm->first_report_ms)
+		{
+			gsm->first_report_ms = gsm->tcp_last_activity;
+			DEBUG_PRINT("First report after ");
+			DEBUG_PRINT(gsm->first_report_ms);
+			DEBUG_PRINTLN(" ms");
+		}
 	}
 	return result;
 }
 
-bool gsm_init(gsm_t *gsm, SoftwareSerial *serial, sms_callback_t sms_callback, call_callback_t call_callback, bool disable_sms, bool monitor, bool debug)
+bool gsm_init(gsm_t *gsm, serial_t *serial, sms_callback_t sms_callback, call_callback_t call_callback)
 {
-	uint8_t init_attempts = 0;
-
 	memset(gsm, 0, sizeof(gsm_t));
 	gsm->serial = serial;
 	gsm->sms_callback = sms_callback;
 	gsm->call_callback = call_callback;
-	gsm->disable_sms = disable_sms;
-	gsm->monitor = monitor;
-	gsm->debug = debug;
-	gsm->enable_data_connection = EEPROM.read(EEPROM_ENABLE_DATA_CONNECTION) == 1;
+	gsm->enable_data_connection = config_get(CONFIG_LIVE);
 	timer_init(&gsm->battery_timer, SECONDS(5));
 	timer_init(&gsm->sms_timer, SECONDS(5));
-	timer_init(&gsm->check_gprs_timer, SECONDS(20));
-
-	gsm->serial->begin(19200);
-
+	timer_init(&gsm->check_gprs_timer, SECONDS(config_get(CONFIG_UPLOAD_INTERVAL)));
+	timer_init(&gsm->bearer_timer, GSM_BEARER_MIN_INTERVAL);
+	timer_init(&gsm->signal_timer, GSM_SIGNAL_INTERVAL);
+	gsm_link_init(&gsm->link);
+	gsm_locate_init(&gsm->locate);
+#if GSM_STATS
+	gsm_stats_reset(&gsm->stats);
+#endif
+
+	serial_begin(gsm->serial, 19200);
+
+	// Released, a running modem takes a low power key as the off switch
+	digitalWrite(GSM_ENABLE, HIGH);
 	pinMode(GSM_ENABLE, OUTPUT);
 	pinMode(GSM_RING, INPUT);
 	digitalWrite(GSM_RING, HIGH);
-	gsm->serial->listen();
-	while (init_attempts < 3)
-	{
-		init_attempts++;
-		DEBUG_PRINT("GSM init attempt ");
-		DEBUG_PRINTLN(init_attempts);
-		gsm_reset();
-		delay(2500);
-		gsm_flush(gsm);
-		if (gsm_first_setup(gsm))
-		{
-			init_attempts = 0;
-			break;
-		}
 
-		
+	// The modem boots on its own from here, gsm_run follows it. A reset of
+	// the MCU alone leaves it running, and most likely registered, which
+	// the first poll of the network finds out.
+	if (watchdog_last_reset(NULL) != WATCHDOG_POWER_ON)
+	{
+		DEBUG_PRINTLN("GSM resuming");
+		gsm->resuming = true;
+		gsm_boot_enter(gsm, GSM_BOOT_PROBE);
 	}
-
-	if (!init_attempts)
+	else
 	{
-		DEBUG_PRINTLN("GSM module initialized");
+		gsm_boot_power(gsm);
+	}
 
-		return true;
+	return true;
+}
+
+// Nothing to do until the modem says something or a timer is due
+static void gsm_idle(gsm_t *gsm)
+{
+	uint32_t start = millis();
+
+	PROFILER_WAIT_BEGIN();
+	while (!serial_available(gsm->serial) && millis() - start < GSM_IDLE_SLICE && digitalRead(GSM_RING))
+	{
+		power_idle();
 	}
-	else
+	PROFILER_WAIT_END();
+}
+
+#if GSM_PASSTHROUGH
+// The debug console and the modem talk directly from here on
+static void gsm_passthrough(gsm_t *gsm)
+{
+	// Nothing to supervise, the console is in charge
+	watchdog_rest(WATCHDOG_GSM);
+	for (;;)
 	{
-		return false;
+		watchdog_beat(WATCHDOG_LOOP);
+		watchdog_feed();
+		while (serial_available(gsm->serial))
+		{
+			Serial.write(serial_read(gsm->serial));
+		}
+		while (Serial.available())
+		{
+			serial_write(gsm->serial, Serial.read());
+		}
 	}
 }
+#endif
 
 bool gsm_run(gsm_t *gsm, gps_t *gps, uint32_t time)
 {
 	timer_t timeout;
 	timer_init(&timeout, time);
 
-	gsm->serial->listen();
+	watchdog_beat(WATCHDOG_GSM);
+	if (gsm->boot_state != GSM_BOOT_READY && !gsm_boot(gsm, time))
+	{
+		watchdog_rest(WATCHDOG_GSM);
+		return false;
+	}
+
+	serial_listen(gsm->serial);
+
+#if GSM_PASSTHROUGH
+	gsm_passthrough(gsm);
+#endif
 
 	while (!timer_elapsed(&timeout))
 	{
-		if (gsm->debug)
+		bool active = false;
+
+		watchdog_beat(WATCHDOG_GSM);
+		gsm_read_urcs(gsm);
+		if (gsm->urcs & GSM_URC_NEW_SMS)
 		{
-			for(;;)
-			{
-				while (gsm->serial->available())
-				{
-					Serial.write(gsm->serial->read());
-				}
-				while (Serial.available())
-				{
-					gsm->serial->write(Serial.read());
-				}
-			}
+			gsm->urcs &= ~GSM_URC_NEW_SMS;
+			timer_expire(&gsm->sms_timer);
 		}
-		else
+
+		if (gsm_check_for_call(gsm))
 		{
-			if (gsm_check_for_call(gsm))
+			active = true;
+			bool success = false;
+			if (gsm_handle_call_id(gsm, phone_scratch_pad))
 			{
-				bool success = false;
-				if (gsm_handle_call_id(gsm, phone_scratch_pad))
-				{
-					success = true;
-				}
-
-				gsm_hangup(gsm);
-
-				if (success)
-				{
-					gsm->call_callback(gsm, phone_scratch_pad);
-				}
+				success = true;
 			}
 
-			if (timer_elapsed(&gsm->battery_timer))
-			{
-				gsm_get_battery_status(gsm);
-			}
+			gsm_hangup(gsm);
 
-			if (timer_elapsed(&gsm->sms_timer))
+			if (success)
 			{
-				gsm_handle_sms(gsm);
+				gsm->call_callback(gsm, phone_scratch_pad);
 			}
+		}
 
-			if(timer_elapsed(&gsm->check_gprs_timer))
+		// The report's bearer and signal checks go out with the housekeeping
+		bool report_due = timer_elapsed(&gsm->check_gprs_timer);
+		char bearer[2];
+		if (gsm_poll_status(gsm, report_due && gsm->enable_data_connection, bearer))
+		{
+			active = true;
+		}
+
+		if (timer_elapsed(&gsm->sms_timer))
+		{
+			active = true;
+			gsm_handle_sms(gsm);
+		}
+
+		if(report_due)
+		{
+			active = true;
+			// Picks up a changed interval
+			timer_init(&gsm->check_gprs_timer, SECONDS(config_get(CONFIG_UPLOAD_INTERVAL)));
+			if(gsm->enable_data_connection)
 			{
-				if(gsm->enable_data_connection)
+				// Reports wait for a better link, the reset below is
+				// for a modem that stopped working, not for poor coverage
+				if (gsm_link_defer(&gsm->link, &gsm->upload_deferred))
 				{
-					gsm->gprs_status = gsm_check_gprs_status(gsm, gsm->enable_data_connection);
-					if(gsm->gprs_status)
-					{
-						gps_position_t pos;
-						gps_get_position(gps, &pos);
-						tcp_packet_t packet;
-						packet.latitude = pos.latitude;
-						packet.longitude = pos.longitude;
-						packet.course = pos.course;
-						packet.speed = pos.speed;
-						packet.hdop = pos.hdop;
-						packet.sats = pos.sats;
-						packet.gps_age = gps_get_age_in_seconds(&pos);
-						packet.battery_percent = gsm->battery_percentage;
-						packet.battery_voltage = gsm->battery_voltage;
-						gsm_send_data(gsm, (const char*)&packet, sizeof(tcp_packet_t));
-					}
-
-					if(millis() - gsm->tcp_last_activity > MINUTES(1))
-					{
-						resetFunc();
-					}
+					gsm->tcp_last_activity = millis();
 				}
-				else
+				else if(gsm_poll_bearer(gsm, bearer[0] ? bearer : NULL))
 				{
-					if(gsm->tcp_connection_active)
-					{
-						gsm_tcp_shut(gsm);
-						gsm_command(gsm, "AT+SAPBR=0,1");
-					}
+					// Sent without a fix too, for the battery and link. The age
+					// tells how old the position is, GPS_AGE_UNKNOWN if unknown.
+					gps_position_t pos;
+					gps_get_last_position(gps, &pos);
+					tcp_packet_t packet;
+					packet.latitude = pos.latitude;
+					packet.longitude = pos.longitude;
+					packet.course = pos.course;
+					packet.speed = pos.speed;
+					packet.hdop = pos.hdop;
+					packet.sats = pos.sats;
+					packet.gps_age = gps_get_age_in_seconds(&pos);
+					packet.battery_percent = gsm->battery_percentage;
+					packet.battery_voltage = gsm->battery_voltage;
+#if GSM_STATS_UPLINK
+					gsm_stats_fill_uplink(&gsm->stats, &packet.stats);
+#endif
+					gsm_send_data(gsm, (const char*)&packet, sizeof(tcp_packet_t));
+				}
+
+				// Three reports in a row, so a single lost one does not
+				// reset the unit when the interval is a minute or more
+				uint32_t stalled = max(MINUTES(1), 3 * SECONDS(config_get(CONFIG_UPLOAD_INTERVAL)));
+				if(millis() - gsm->tcp_last_activity > stalled)
+				{
+					system_reset();
 				}
 			}
-			
+			else
+			{
+				if(gsm->tcp_connection_active)
+				{
+					gsm_tcp_shut(gsm);
+					gsm_command(gsm, "AT+SAPBR=0,1");
+				}
+			}
+		}
 
+		// Only a transaction leaves trailing output to wait for
+		if (active)
+		{
 			gsm_flush(gsm);
 		}
+		else
+		{
+			gsm_idle(gsm);
+		}
+	}
+
+	if (serial_overflow(gsm->serial))
+	{
+		DEBUG_PRINTLN("GSM RX overflow");
 	}
+	watchdog_rest(WATCHDOG_GSM);
 	return true;
 }
 
@@ -679,10 +1643,10 @@ void gsm_enable_data(gsm_t *gsm)
 {
 	gsm->enable_data_connection = true;
 	gsm->tcp_last_activity = millis();
-	EEPROM.write(EEPROM_ENABLE_DATA_CONNECTION, 1);
+	config_set(CONFIG_LIVE, 1);
 }
 void gsm_disable_data(gsm_t *gsm)
 {
 	gsm->enable_data_connection = false;
-	EEPROM.write(EEPROM_ENABLE_DATA_CONNECTION, 0);
+	config_set(CONFIG_LIVE, 0);
 }
\ No newline at end of file
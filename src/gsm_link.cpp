@@ -0,0 +1,150 @@
+#include "gsm_link.h"
+
+#define GSM_LINK_UNKNOWN 99
+
+void gsm_link_init(gsm_link_t *link)
+{
+	memset(link, 0, sizeof(gsm_link_t));
+	link->period_start = millis();
+}
+
+// Starts a new hour of counts once the current one is over
+static void gsm_link_roll(gsm_link_t *link)
+{
+	if (millis() - link->period_start < GSM_LINK_PERIOD)
+	{
+		return;
+	}
+
+	// A whole hour without calls leaves nothing worth keeping
+	link->last = millis() - link->period_start < 2 * GSM_LINK_PERIOD ? link->current : gsm_link_counts_t();
+	memset(&link->current, 0, sizeof(gsm_link_counts_t));
+	link->period_start = millis();
+}
+
+// Follows a falling signal quickly, so little is sent into a fade, and a
+// rising one a bit slower, so a single good reading is not trusted at once
+void gsm_link_sample(gsm_link_t *link, uint8_t csq, bool registered)
+{
+	uint16_t sample = (csq == GSM_LINK_UNKNOWN ? 0 : csq) << 4;
+
+	if (!link->sampled_at)
+	{
+		link->rssi = sample;
+	}
+	else if (sample < link->rssi)
+	{
+		link->rssi = (link->rssi + sample * 3) / 4;
+	}
+	else
+	{
+		link->rssi = (link->rssi + sample) / 2;
+	}
+	link->sampled_at = millis() | 1;
+	link->registered = registered;
+
+	uint8_t rssi = link->rssi >> 4;
+	if (!registered || rssi < GSM_LINK_MIN_RSSI)
+	{
+		link->poor = true;
+	}
+	else if (rssi >= GSM_LINK_MIN_RSSI + GSM_LINK_HYSTERESIS)
+	{
+		link->poor = false;
+	}
+}
+
+// Good until sampled, nothing is known to wait for
+bool gsm_link_good(gsm_link_t *link)
+{
+	return !link->poor;
+}
+
+bool gsm_link_defer(gsm_link_t *link, uint32_t *since)
+{
+	gsm_link_roll(link);
+
+	if (gsm_link_good(link))
+	{
+		*since = 0;
+		return false;
+	}
+
+	if (!*since)
+	{
+		*since = millis() | 1;
+	}
+	else if (millis() - *since >= GSM_LINK_MAX_DEFER)
+	{
+		// Waited long enough, try anyway and wait again from here
+		*since = 0;
+		return false;
+	}
+
+	link->current.deferred++;
+	return true;
+}
+
+void gsm_link_record(gsm_link_t *link, bool success)
+{
+	gsm_link_roll(link);
+
+	link->current.attempts++;
+	if (!success)
+	{
+		link->current.failed++;
+	}
+}
+
+static uint8_t gsm_link_success_rate(gsm_link_counts_t *counts)
+{
+	if (!counts->attempts)
+	{
+		return 100;
+	}
+	return uint8_t(uint32_t(counts->attempts - counts->failed) * 100 / counts->attempts);
+}
+
+static void gsm_link_print_counts(gsm_link_counts_t *counts)
+{
+	Serial.print(counts->attempts);
+	Serial.print(" sent, ");
+	Serial.print(gsm_link_success_rate(counts));
+	Serial.print("% ok, ");
+	Serial.print(counts->failed);
+	Serial.print(" wasted, ");
+	Serial.print(counts->deferred);
+	Serial.print(" deferred");
+}
+
+void gsm_link_print(gsm_link_t *link)
+{
+	gsm_link_roll(link);
+
+	Serial.print("Link: CSQ ");
+	Serial.print(link->rssi >> 4);
+	Serial.print(link->registered ? " registered" : " not registered");
+	Serial.println(link->poor ? ", poor" : "");
+
+	Serial.print("Last hour: ");
+	gsm_link_print_counts(&link->last);
+	Serial.println();
+	Serial.print("This hour (");
+	Serial.print((millis() - link->period_start) / MINUTES(1));
+	Serial.print(" min): ");
+	gsm_link_print_counts(&link->current);
+	Serial.println();
+}
+
+// The link, then the last full hour and this one so far
+uint8_t gsm_link_format(gsm_link_t *link, char *out, uint8_t max_chars)
+{
+	gsm_link_roll(link);
+
+	int length = snprintf(out, max_chars + 1, "CSQ %u%s%s\nLast h: %u sent %u%% ok %u wasted %u deferred\nThis h: %u sent %u%% ok %u wasted %u deferred\n",
+		link->rssi >> 4, link->registered ? "" : " unreg", link->poor ? " poor" : "",
+		link->last.attempts, gsm_link_success_rate(&link->last), link->last.failed, link->last.deferred,
+		link->current.attempts, gsm_link_success_rate(&link->current), link->current.failed, link->current.deferred);
+
+	return length > max_chars ? max_chars : length;
+}
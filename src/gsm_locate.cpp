@@ -0,0 +1,64 @@
+#include "gsm_locate.h"
+
+void gsm_locate_init(gsm_locate_t *locate)
+{
+	memset(locate, 0, sizeof(gsm_locate_t));
+}
+
+bool gsm_locate_find(gsm_locate_t *locate, uint32_t cell, gsm_location_t *location)
+{
+	for (uint8_t i = 0; i < GSM_LOCATE_CACHE_SIZE; i++)
+	{
+		gsm_locate_entry_t *entry = &locate->entries[i];
+		if (cell && entry->cell == cell)
+		{
+			entry->used = millis();
+			location->latitude = entry->latitude;
+			location->longitude = entry->longitude;
+			location->cached = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Replaces the entry of the same cell, else an empty or the least recently
+// used one
+void gsm_locate_store(gsm_locate_t *locate, uint32_t cell, gsm_location_t *location)
+{
+	gsm_locate_entry_t *entry = &locate->entries[0];
+
+	if (!cell)
+	{
+		return;
+	}
+
+	for (uint8_t i = 0; i < GSM_LOCATE_CACHE_SIZE; i++)
+	{
+		gsm_locate_entry_t *candidate = &locate->entries[i];
+		if (candidate->cell == cell || !candidate->cell)
+		{
+			entry = candidate;
+			break;
+		}
+		if (millis() - candidate->used > millis() - entry->used)
+		{
+			entry = candidate;
+		}
+	}
+
+	entry->cell = cell;
+	entry->latitude = location->latitude;
+	entry->longitude = location->longitude;
+	entry->used = millis();
+}
+
+// The tower is somewhere within one step beyond the timing advance
+uint16_t gsm_locate_accuracy(uint8_t ta)
+{
+	if (ta > GSM_LOCATE_MAX_TA)
+	{
+		return GSM_LOCATE_DEFAULT_ACCURACY;
+	}
+	return (ta + 1) * GSM_LOCATE_TA_STEP;
+}
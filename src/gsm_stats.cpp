@@ -0,0 +1,263 @@
+#include "gsm_stats.h"
+#include "util.h"
+
+#if GSM_STATS
+
+static bool gsm_stats_same_command(const char *a, const char *b)
+{
+	if (a == b)
+	{
+		return true;
+	}
+
+	while (*a == *b && *a && *a != '"')
+	{
+		a++;
+		b++;
+	}
+
+	return (*a == '\0' || *a == '"') && (*b == '\0' || *b == '"');
+}
+
+// Copies the label without the AT+ prefix and anything from the first '"'
+static uint8_t gsm_stats_label(const char *command, char *out, uint8_t max_chars)
+{
+	uint8_t len = 0;
+
+	if (strncmp(command, "AT+", 3) == 0)
+	{
+		command += 3;
+	}
+
+	while (command[len] && command[len] != '"' && len < max_chars)
+	{
+		out[len] = command[len];
+		len++;
+	}
+	out[len] = '\0';
+
+	return len;
+}
+
+static uint8_t gsm_stats_bucket(uint32_t ms)
+{
+	uint8_t bucket = 0;
+
+	ms /= GSM_STATS_FIRST_BUCKET_MS;
+	while (ms && bucket < GSM_STATS_BUCKETS - 1)
+	{
+		ms >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+static uint16_t gsm_stats_average(gsm_stats_slot_t *slot)
+{
+	if (!slot || !slot->count)
+	{
+		return 0;
+	}
+	return uint16_t(slot->total_ms / slot->count);
+}
+
+void gsm_stats_reset(gsm_stats_t *stats)
+{
+	memset(stats, 0, sizeof(gsm_stats_t));
+	stats->slot[GSM_STATS_SLOTS - 1].command = "other";
+	stats->since = millis();
+}
+
+gsm_stats_slot_t *gsm_stats_find(gsm_stats_t *stats, const char *command)
+{
+	for (uint8_t i = 0; i < GSM_STATS_SLOTS - 1; i++)
+	{
+		if (stats->slot[i].command && gsm_stats_same_command(stats->slot[i].command, command))
+		{
+			return &stats->slot[i];
+		}
+	}
+	return NULL;
+}
+
+// Folds the slot with the least total time into "other" and hands it out
+static gsm_stats_slot_t *gsm_stats_evict(gsm_stats_t *stats)
+{
+	gsm_stats_slot_t *other = &stats->slot[GSM_STATS_SLOTS - 1];
+	gsm_stats_slot_t *slot = &stats->slot[0];
+
+	for (uint8_t i = 1; i < GSM_STATS_SLOTS - 1; i++)
+	{
+		if (stats->slot[i].total_ms < slot->total_ms)
+		{
+			slot = &stats->slot[i];
+		}
+	}
+
+	other->count = min(uint32_t(other->count) + slot->count, uint32_t(UINT16_MAX));
+	other->timeouts = min(other->timeouts + slot->timeouts, UINT8_MAX);
+	other->errors = min(other->errors + slot->errors, UINT8_MAX);
+	other->max_ms = max(other->max_ms, slot->max_ms);
+	other->total_ms += slot->total_ms;
+	for (uint8_t i = 0; i < GSM_STATS_BUCKETS; i++)
+	{
+		other->histogram[i] = min(other->histogram[i] + slot->histogram[i], UINT8_MAX);
+	}
+
+	memset(slot, 0, sizeof(gsm_stats_slot_t));
+	return slot;
+}
+
+void gsm_stats_record(gsm_stats_t *stats, const char *command, uint32_t start, gsm_stats_result_t result)
+{
+	uint32_t elapsed = millis() - start;
+	gsm_stats_slot_t *slot = gsm_stats_find(stats, command);
+
+	if (!slot)
+	{
+		for (uint8_t i = 0; i < GSM_STATS_SLOTS - 1; i++)
+		{
+			if (!stats->slot[i].command)
+			{
+				slot = &stats->slot[i];
+				break;
+			}
+		}
+		if (!slot)
+		{
+			slot = gsm_stats_evict(stats);
+		}
+		slot->command = command;
+	}
+
+	if (slot->count == UINT16_MAX)
+	{
+		return;
+	}
+
+	slot->count++;
+	slot->total_ms += elapsed;
+	if (elapsed > slot->max_ms)
+	{
+		slot->max_ms = elapsed > UINT16_MAX ? UINT16_MAX : elapsed;
+	}
+
+	if (result == GSM_STATS_TIMEOUT && slot->timeouts < UINT8_MAX)
+	{
+		slot->timeouts++;
+	}
+	else if (result == GSM_STATS_ERROR && slot->errors < UINT8_MAX)
+	{
+		slot->errors++;
+	}
+
+	// Halve the histogram when a bucket saturates, this keeps its shape
+	uint8_t bucket = gsm_stats_bucket(elapsed);
+	if (slot->histogram[bucket] == UINT8_MAX)
+	{
+		for (uint8_t i = 0; i < GSM_STATS_BUCKETS; i++)
+		{
+			slot->histogram[i] >>= 1;
+		}
+	}
+	slot->histogram[bucket]++;
+}
+
+void gsm_stats_print(gsm_stats_t *stats)
+{
+	char label[16];
+
+	Serial.print("AT stats, ");
+	Serial.print((millis() - stats->since) / SECONDS(1));
+	Serial.println(" s");
+
+	for (uint8_t i = 0; i < GSM_STATS_SLOTS; i++)
+	{
+		gsm_stats_slot_t *slot = &stats->slot[i];
+		if (!slot->command)
+		{
+			continue;
+		}
+
+		gsm_stats_label(slot->command, label, sizeof(label) - 1);
+		Serial.print(label);
+		Serial.print(": n=");
+		Serial.print(slot->count);
+		Serial.print(" to=");
+		Serial.print(slot->timeouts);
+		Serial.print(" err=");
+		Serial.print(slot->errors);
+		Serial.print(" avg=");
+		Serial.print(gsm_stats_average(slot));
+		Serial.print(" max=");
+		Serial.print(slot->max_ms);
+		Serial.print(" |");
+		for (uint8_t b = 0; b < GSM_STATS_BUCKETS; b++)
+		{
+			Serial.print(' ');
+			Serial.print(slot->histogram[b]);
+		}
+		Serial.println();
+	}
+}
+
+// One line per command, most total time first, as many as fit
+void gsm_stats_format(gsm_stats_t *stats, char *out, uint8_t max_chars)
+{
+	char label[16];
+	bool done[GSM_STATS_SLOTS] = {0};
+	uint8_t len = snprintf(out, max_chars + 1, "AT stats %lum\n", (unsigned long)((millis() - stats->since) / MINUTES(1)));
+
+	for (;;)
+	{
+		gsm_stats_slot_t *slot = NULL;
+		uint8_t index = 0;
+		for (uint8_t i = 0; i < GSM_STATS_SLOTS; i++)
+		{
+			if (stats->slot[i].command && !done[i] && (!slot || stats->slot[i].total_ms > slot->total_ms))
+			{
+				slot = &stats->slot[i];
+				index = i;
+			}
+		}
+		if (!slot)
+		{
+			break;
+		}
+		done[index] = true;
+
+		gsm_stats_label(slot->command, label, sizeof(label) - 1);
+		// Label, 5 digit count and times, 3 digit timeouts and errors
+		char line[sizeof(label) + 33];
+		uint8_t line_len = snprintf(line, sizeof(line), "%s n%u t%u e%u %u/%ums\n", label, slot->count, slot->timeouts,
+			slot->errors, gsm_stats_average(slot), slot->max_ms);
+		if (len + line_len > max_chars)
+		{
+			break;
+		}
+		strcpy(out + len, line);
+		len += line_len;
+	}
+}
+
+void gsm_stats_fill_uplink(gsm_stats_t *stats, gsm_stats_uplink_t *out)
+{
+	memset(out, 0, sizeof(gsm_stats_uplink_t));
+	out->sapbr_open_ms = gsm_stats_average(gsm_stats_find(stats, "AT+SAPBR=1,1"));
+	out->cipstart_ms = gsm_stats_average(gsm_stats_find(stats, "AT+CIPSTART="));
+	out->cipsend_ms = gsm_stats_average(gsm_stats_find(stats, "AT+CIPSEND"));
+	out->cmgs_ms = gsm_stats_average(gsm_stats_find(stats, "AT+CMGS"));
+
+	uint16_t timeouts = 0;
+	uint16_t errors = 0;
+	for (uint8_t i = 0; i < GSM_STATS_SLOTS; i++)
+	{
+		timeouts += stats->slot[i].timeouts;
+		errors += stats->slot[i].errors;
+	}
+	out->timeouts = timeouts > UINT8_MAX ? UINT8_MAX : timeouts;
+	out->errors = errors > UINT8_MAX ? UINT8_MAX : errors;
+}
+
+#endif
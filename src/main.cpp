@@ -1,10 +1,15 @@
-#include <SoftwareSerial.h>
+#include "serial.h"
 #include "gps.h"
 #include "timer.h"
 #include "pins.h"
 #include "gsm.h"
+#include "geofence.h"
 #include "commands.h"
 #include "util.h"
+#include "profiler.h"
+#include "power.h"
+#include "config.h"
+#include "watchdog.h"
 
 #define SEND_SMS 1
 #define DEBUG 0
@@ -12,41 +17,186 @@
 #define DEBUG 0
 #endif
 
+#if GPS_UART == UART_HARDWARE
+#define gps_uart Serial
+#elif GPS_UART == UART_SOFTWARE
 SoftwareSerial gps_uart(GPS_RX, GPS_TX);
+#elif GPS_UART == UART_ALTSOFT
+AltSoftSerial gps_uart;
+#elif GPS_UART == UART_HOST
+HostSerial gps_uart("GPS_PORT", "pty");
+#endif
+
+#if GSM_UART == UART_HARDWARE
+#define gsm_uart Serial
+#elif GSM_UART == UART_SOFTWARE
 SoftwareSerial gsm_uart(GSM_RX, GSM_TX);
+#elif GSM_UART == UART_ALTSOFT
+AltSoftSerial gsm_uart;
+#elif GSM_UART == UART_HOST
+HostSerial gsm_uart("GSM_PORT", "pty", GSM_RING);
+#endif
+
+serial_t gps_serial;
+serial_t gsm_serial;
 
 timer_t gsm_subscriber_timer;
+uint32_t gsm_subscriber_deferred;
+#if GPS_WARM_START
+timer_t gps_warm_timer;
+#endif
+#if DEBUG_ENABLE
+timer_t gsm_stats_timer;
+#endif
+#if PROFILER
+timer_t profiler_timer;
+#endif
 
 gps_t gps;
 gsm_t gsm;
+geofence_t geofence;
+
+void on_gps_fix(gps_t *gps, gps_position_t *fix)
+{
+	geofence_update(&geofence, fix);
+}
+
+#if GPS_WARM_START
+void before_reset()
+{
+	gps_warm_save(&gps, true);
+}
+#endif
 
 void setup()
 {
+	watchdog_init();
+#if DEBUG_ENABLE
 	Serial.begin(115200);
-	Serial.println("Booting...");
+#endif
+	DEBUG_PRINTLN("Booting...");
+
+#if GPS_UART == UART_HARDWARE
+	serial_init_hardware(&gps_serial, &gps_uart);
+#elif GPS_UART == UART_SOFTWARE
+	serial_init_software(&gps_serial, &gps_uart);
+#elif GPS_UART == UART_ALTSOFT
+	serial_init_altsoft(&gps_serial, &gps_uart);
+#elif GPS_UART == UART_HOST
+	serial_init_host(&gps_serial, &gps_uart);
+#endif
+
+#if GSM_UART == UART_HARDWARE
+	serial_init_hardware(&gsm_serial, &gsm_uart);
+#elif GSM_UART == UART_SOFTWARE
+	serial_init_software(&gsm_serial, &gsm_uart);
+#elif GSM_UART == UART_ALTSOFT
+	serial_init_altsoft(&gsm_serial, &gsm_uart);
+#elif GSM_UART == UART_HOST
+	serial_init_host(&gsm_serial, &gsm_uart);
+#endif
 
-	gps_init(&gps, &gps_uart);
+#if SERIAL_TRACE
+	trace_init();
+	gps_serial.trace_channel = TRACE_GPS;
+	gsm_serial.trace_channel = TRACE_GSM;
+#endif
+#if GPS_WARM_START
+	reset_hook = before_reset;
+#endif
+	power_init();
+	config_init();
+	geofence_init(&geofence);
 
-	if (!gsm_init(&gsm, &gsm_uart, commands_handle_sms_command, send_position))
+	// Power the modem first, it boots while the GPS is set up
+	if (!gsm_init(&gsm, &gsm_serial, commands_handle_sms_command, send_position))
 	{
-		resetFunc();
+		system_reset();
 	}
 
-	timer_init(&gsm_subscriber_timer, MINUTES(10));
+	gps_init(&gps, &gps_serial, on_gps_fix);
+
+	timer_init(&gsm_subscriber_timer, SECONDS(config_get(CONFIG_SUBSCRIPTION_INTERVAL)));
+#if GPS_WARM_START
+	timer_init(&gps_warm_timer, GPS_WARM_SAVE_INTERVAL);
+#endif
+#if DEBUG_ENABLE
+	timer_init(&gsm_stats_timer, MINUTES(5));
+#endif
+#if PROFILER
+	timer_init(&profiler_timer, MINUTES(1));
+#endif
 }
 
 void loop()
 {
+	PROFILER_BEGIN(PHASE_LOOP);
+	watchdog_beat(WATCHDOG_LOOP);
+	// Commands sent outside gsm_run(), e.g. to subscribers, are done
+	watchdog_rest(WATCHDOG_GSM);
+	watchdog_feed();
+
 	//gsm.enable_data_connection = false;
-	gps_run(&gps, SECONDS(2));
+	PROFILER_BEGIN(PHASE_GPS);
+	// Short GPS slices while the modem boots, so it is followed closely
+	gps_run(&gps, gsm.boot_state == GSM_BOOT_READY ? config_get(CONFIG_GPS_WINDOW) : 500);
+	PROFILER_END(PHASE_GPS);
+#if DEBUG_ENABLE
+	PROFILER_BEGIN(PHASE_PRINT);
 	gps_print_position(&gps);
 	gps_print_high_scores(&gps);
+	PROFILER_END(PHASE_PRINT);
+#endif
 
-	gsm_run(&gsm, &gps, SECONDS(5));
+	PROFILER_BEGIN(PHASE_GSM);
+	send_geofence_alerts(&gsm);
+	gsm_run(&gsm, &gps, config_get(CONFIG_GSM_WINDOW));
+	PROFILER_END(PHASE_GSM);
+#if DEBUG_ENABLE
 	gsm_print_battery_status(&gsm);
+#endif
 
 	if (timer_elapsed(&gsm_subscriber_timer))
 	{
-		send_subscription(&gsm);
+		// On a poor link, look again in a minute
+		if (gsm_link_defer(&gsm.link, &gsm_subscriber_deferred))
+		{
+			timer_init(&gsm_subscriber_timer, MINUTES(1));
+		}
+		else
+		{
+			PROFILER_BEGIN(PHASE_SUBSCRIPTION);
+			send_subscription(&gsm);
+			PROFILER_END(PHASE_SUBSCRIPTION);
+			timer_init(&gsm_subscriber_timer, SECONDS(config_get(CONFIG_SUBSCRIPTION_INTERVAL)));
+		}
 	}
+
+#if GPS_WARM_START
+	if (timer_elapsed(&gps_warm_timer))
+	{
+		gps_warm_save(&gps, false);
+	}
+#endif
+
+#if DEBUG_ENABLE
+	if (timer_elapsed(&gsm_stats_timer))
+	{
+#if GSM_STATS
+		gsm_stats_print(&gsm.stats);
+#endif
+		gsm_link_print(&gsm.link);
+	}
+#endif
+
+	PROFILER_END(PHASE_LOOP);
+
+#if PROFILER
+	if (timer_elapsed(&profiler_timer))
+	{
+		profiler_print(&gps_serial, &gsm_serial);
+		gps_print_decoder_stats(&gps);
+		gps_print_window_stats(&gps);
+	}
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,112 @@
+#include "power.h"
+#include "trace.h"
+#include "watchdog.h"
+
+#ifdef HOST_BUILD
+#include <HostSerial.h>
+#else
+#include <avr/interrupt.h>
+#include <avr/power.h>
+#include <avr/sleep.h>
+#endif
+
+static volatile bool ring_pending;
+static uint32_t sleep_us;
+
+#if POWER_SLEEP
+
+#ifdef HOST_BUILD
+static void power_ring_change()
+{
+	if (!digitalRead(GSM_RING))
+	{
+		ring_pending = true;
+	}
+}
+#else
+ISR(ANALOG_COMP_vect)
+{
+	ring_pending = true;
+}
+#endif
+
+void power_init()
+{
+#ifdef HOST_BUILD
+	host_pin_change(GSM_RING, power_ring_change);
+#else
+	// Nothing here uses the ADC, the TWI, SPI or timer 2
+	ADCSRA &= ~_BV(ADEN);
+	power_adc_disable();
+	power_twi_disable();
+	power_spi_disable();
+	power_timer2_disable();
+#if GPS_UART != UART_ALTSOFT && GSM_UART != UART_ALTSOFT
+	power_timer1_disable();
+#endif
+#if !DEBUG_ENABLE && !SERIAL_TRACE && GPS_UART != UART_HARDWARE && GSM_UART != UART_HARDWARE
+	power_usart0_disable();
+#endif
+
+	// Bandgap on the positive input and RING on AIN1, so the output rises
+	// as RING falls. The digital input stays on for digitalRead().
+	ACSR = _BV(ACBG) | _BV(ACIS1) | _BV(ACIS0);
+	delayMicroseconds(100); // Bandgap start-up
+	ACSR |= _BV(ACI);
+	ACSR |= _BV(ACIE);
+
+	set_sleep_mode(SLEEP_MODE_IDLE);
+#endif
+}
+
+void power_idle()
+{
+	watchdog_feed();
+
+	uint32_t start = micros();
+#ifdef HOST_BUILD
+	HostSerial::idle(1000);
+#else
+	sleep_mode();
+#endif
+	sleep_us += micros() - start;
+}
+
+#else
+
+void power_init()
+{
+}
+
+void power_idle()
+{
+	watchdog_feed();
+}
+
+#endif
+
+void power_delay(uint32_t ms)
+{
+	uint32_t start = millis();
+	while (millis() - start < ms)
+	{
+		power_idle();
+	}
+}
+
+bool power_ring_pending()
+{
+	return ring_pending;
+}
+
+void power_ring_clear()
+{
+	ring_pending = false;
+}
+
+uint32_t power_take_sleep_us()
+{
+	uint32_t us = sleep_us;
+	sleep_us = 0;
+	return us;
+}
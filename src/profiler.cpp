@@ -0,0 +1,129 @@
+#include "profiler.h"
+#include "power.h"
+
+#if PROFILER
+
+static const char *phase_name[NUM_PHASES] = { "loop", "gps", "print", "gsm", "subscr" };
+
+static profiler_phase_stats_t phase_stats[NUM_PHASES];
+static uint32_t phase_start[NUM_PHASES];
+static profiler_phase_t active_phase = PHASE_LOOP;
+static uint8_t running; // Bit per phase
+static uint8_t wait_depth;
+static uint32_t wait_start;
+static uint32_t window_start;
+
+void profiler_begin(profiler_phase_t phase)
+{
+	phase_start[phase] = micros();
+	running |= 1 << phase;
+	if (phase != PHASE_LOOP)
+	{
+		active_phase = phase;
+	}
+}
+
+void profiler_end(profiler_phase_t phase)
+{
+	profiler_phase_stats_t *stats = &phase_stats[phase];
+	uint32_t elapsed = micros() - phase_start[phase];
+
+	if (stats->count == 0 || elapsed < stats->min_us)
+	{
+		stats->min_us = elapsed;
+	}
+	if (elapsed > stats->max_us)
+	{
+		stats->max_us = elapsed;
+	}
+	stats->total_us += elapsed;
+	stats->count++;
+
+	running &= ~(1 << phase);
+	active_phase = PHASE_LOOP;
+}
+
+void profiler_wait_begin()
+{
+	if (wait_depth++ == 0)
+	{
+		wait_start = micros();
+	}
+}
+
+void profiler_wait_end()
+{
+	if (wait_depth == 0 || --wait_depth != 0)
+	{
+		return;
+	}
+
+	uint32_t elapsed = micros() - wait_start;
+	if (active_phase != PHASE_LOOP && (running & (1 << active_phase)))
+	{
+		phase_stats[active_phase].wait_us += elapsed;
+	}
+	if (running & (1 << PHASE_LOOP))
+	{
+		phase_stats[PHASE_LOOP].wait_us += elapsed;
+	}
+}
+
+static void profiler_print_serial(const char *name, serial_t *serial)
+{
+	Serial.print(name);
+	Serial.print(" rx=");
+	Serial.print(serial->rx_bytes);
+	Serial.print(" overflows=");
+	Serial.println(serial->overflows);
+}
+
+// Times in ms, wait is the share of the phase spent blocking
+void profiler_print(serial_t *gps_serial, serial_t *gsm_serial)
+{
+	Serial.print("Profile, ");
+	Serial.print((millis() - window_start) / SECONDS(1));
+	Serial.println(" s: phase n min avg max wait%");
+
+	for (uint8_t i = 0; i < NUM_PHASES; i++)
+	{
+		profiler_phase_stats_t *stats = &phase_stats[i];
+		if (!stats->count)
+		{
+			continue;
+		}
+
+		Serial.print(phase_name[i]);
+		Serial.print(' ');
+		Serial.print(stats->count);
+		Serial.print(' ');
+		Serial.print(stats->min_us / 1000);
+		Serial.print(' ');
+		Serial.print(stats->total_us / stats->count / 1000);
+		Serial.print(' ');
+		Serial.print(stats->max_us / 1000);
+		Serial.print(' ');
+		Serial.println(stats->total_us ? uint8_t(stats->wait_us / (stats->total_us / 100 + 1)) : 0);
+	}
+
+	// The MCU's average current, from the share of time asleep
+	uint32_t window_ms = millis() - window_start;
+	uint32_t sleep = window_ms ? power_take_sleep_us() / 1000 * 100 / window_ms : 0;
+	if (sleep > 100)
+	{
+		sleep = 100;
+	}
+	Serial.print("sleep ");
+	Serial.print(sleep);
+	Serial.print("%, MCU ~");
+	Serial.print(POWER_ACTIVE_UA - uint32_t(POWER_ACTIVE_UA - POWER_IDLE_UA) * sleep / 100);
+	Serial.println(" uA");
+
+	profiler_print_serial("GPS UART", gps_serial);
+	profiler_print_serial("GSM UART", gsm_serial);
+
+	memset(phase_stats, 0, sizeof(phase_stats));
+	window_start = millis();
+}
+
+#endif
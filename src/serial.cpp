@@ -0,0 +1,123 @@
+#include "serial.h"
+
+static void serial_no_listen(serial_t *serial)
+{
+}
+
+#if GPS_UART == UART_HARDWARE || GSM_UART == UART_HARDWARE
+// The hardware UART has no overflow flag, a full buffer is the best guess
+static bool serial_overflow_hardware(serial_t *serial)
+{
+	return ((HardwareSerial *)serial->port)->available() >= SERIAL_RX_BUFFER_SIZE - 1;
+}
+
+static void serial_begin_hardware(serial_t *serial, uint32_t baud)
+{
+	((HardwareSerial *)serial->port)->begin(baud);
+}
+
+void serial_init_hardware(serial_t *serial, HardwareSerial *port)
+{
+	serial->stream = port;
+	serial->port = port;
+	serial->begin = serial_begin_hardware;
+	serial->listen = serial_no_listen;
+	serial->overflow = serial_overflow_hardware;
+}
+#endif
+
+#if GPS_UART == UART_SOFTWARE || GSM_UART == UART_SOFTWARE
+static void serial_begin_software(serial_t *serial, uint32_t baud)
+{
+	((SoftwareSerial *)serial->port)->begin(baud);
+}
+
+static void serial_listen_software(serial_t *serial)
+{
+	((SoftwareSerial *)serial->port)->listen();
+}
+
+static bool serial_overflow_software(serial_t *serial)
+{
+	return ((SoftwareSerial *)serial->port)->overflow();
+}
+
+void serial_init_software(serial_t *serial, SoftwareSerial *port)
+{
+	serial->stream = port;
+	serial->port = port;
+	serial->begin = serial_begin_software;
+	serial->listen = serial_listen_software;
+	serial->overflow = serial_overflow_software;
+}
+#endif
+
+#if GPS_UART == UART_ALTSOFT || GSM_UART == UART_ALTSOFT
+static void serial_begin_altsoft(serial_t *serial, uint32_t baud)
+{
+	((AltSoftSerial *)serial->port)->begin(baud);
+}
+
+static bool serial_overflow_altsoft(serial_t *serial)
+{
+	return ((AltSoftSerial *)serial->port)->overflow();
+}
+
+void serial_init_altsoft(serial_t *serial, AltSoftSerial *port)
+{
+	serial->stream = port;
+	serial->port = port;
+	serial->begin = serial_begin_altsoft;
+	serial->listen = serial_no_listen;
+	serial->overflow = serial_overflow_altsoft;
+}
+#endif
+
+#if GPS_UART == UART_HOST || GSM_UART == UART_HOST
+static void serial_begin_host(serial_t *serial, uint32_t baud)
+{
+	((HostSerial *)serial->port)->begin(baud);
+}
+
+static bool serial_overflow_host(serial_t *serial)
+{
+	return ((HostSerial *)serial->port)->overflow();
+}
+
+void serial_init_host(serial_t *serial, HostSerial *port)
+{
+	serial->stream = port;
+	serial->port = port;
+	serial->begin = serial_begin_host;
+	serial->listen = serial_no_listen;
+	serial->overflow = serial_overflow_host;
+}
+#endif
+
+void serial_begin(serial_t *serial, uint32_t baud)
+{
+	serial->begin(serial, baud);
+}
+
+void serial_listen(serial_t *serial)
+{
+	serial->listen(serial);
+}
+
+bool serial_overflow(serial_t *serial)
+{
+	bool overflow = serial->overflow(serial);
+#if PROFILER
+	if (overflow)
+	{
+		serial->overflows++;
+	}
+#endif
+#if SERIAL_TRACE
+	if (overflow)
+	{
+		trace_overflow(serial->trace_channel | TRACE_RX);
+	}
+#endif
+	return overflow;
+}
@@ -0,0 +1,62 @@
+#include "sms_batch.h"
+
+static uint8_t *sms_batch_put(uint8_t *out, uint32_t value, uint8_t bytes)
+{
+	while (bytes--)
+	{
+		*out++ = value >> (bytes * 8);
+	}
+	return out;
+}
+
+static uint8_t sms_batch_hdop(gps_position_t *pos)
+{
+	return pos->hdop / 10 > 255 ? 255 : pos->hdop / 10;
+}
+
+void sms_batch_init(sms_batch_t *batch)
+{
+	batch->data[0] = SMS_BATCH_VERSION;
+	batch->data[1] = 0;
+	batch->length = SMS_BATCH_HEADER;
+}
+
+bool sms_batch_add(sms_batch_t *batch, gps_position_t *pos, uint32_t utc, uint8_t battery)
+{
+	int32_t latitude = lround(pos->latitude * 100000.0);
+	int32_t longitude = lround(pos->longitude * 100000.0);
+	uint8_t *out = batch->data + batch->length;
+
+	if (!sms_batch_count(batch))
+	{
+		out = sms_batch_put(batch->data + 3, utc, 4);
+		out = sms_batch_put(out, latitude, 4);
+		out = sms_batch_put(out, longitude, 4);
+		*out = sms_batch_hdop(pos);
+		batch->last_time = pos->timestamp;
+	}
+	else
+	{
+		uint32_t seconds = (pos->timestamp - batch->last_time) / SECONDS(1);
+		int32_t dlat = latitude - batch->last_latitude;
+		int32_t dlon = longitude - batch->last_longitude;
+		if (batch->length + SMS_BATCH_FIX > SMS_BATCH_SIZE || seconds > 0xffff ||
+			dlat < INT16_MIN || dlat > INT16_MAX || dlon < INT16_MIN || dlon > INT16_MAX)
+		{
+			return false;
+		}
+		out = sms_batch_put(out, seconds, 2);
+		out = sms_batch_put(out, dlat, 2);
+		out = sms_batch_put(out, dlon, 2);
+		*out = sms_batch_hdop(pos);
+		batch->length += SMS_BATCH_FIX;
+		// Whole seconds, so the rounding does not add up over the batch
+		batch->last_time += seconds * SECONDS(1);
+	}
+
+	batch->last_latitude = latitude;
+	batch->last_longitude = longitude;
+	batch->data[1]++;
+	batch->data[2] = battery;
+	return true;
+}
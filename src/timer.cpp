@@ -19,4 +19,16 @@ bool timer_elapsed(timer_t *timer)
 		return true;
 	}
 	return false;
+}
+
+// Like timer_elapsed, without starting the next interval
+bool timer_due(timer_t *timer)
+{
+	return millis() > timer->deadline;
+}
+
+// Makes the next timer_elapsed return true
+void timer_expire(timer_t *timer)
+{
+	timer->deadline = millis() - 1;
 }
\ No newline at end of file
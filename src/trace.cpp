@@ -0,0 +1,119 @@
+#include "trace.h"
+
+#if SERIAL_TRACE
+
+#ifdef HOST_BUILD
+static FILE *trace_file;
+#endif
+
+// The record being filled, written out once another one starts or it is
+// TRACE_FLUSH_MS old
+static uint8_t record[1 + 5 + TRACE_RECORD_MAX];
+static uint8_t record_length;
+static uint8_t record_count;
+static uint8_t record_channel;
+static uint32_t record_time;
+static uint32_t last_time;
+
+static void trace_write(const uint8_t *data, uint8_t length)
+{
+#ifdef HOST_BUILD
+	if (trace_file)
+	{
+		fwrite(data, 1, length, trace_file);
+		fflush(trace_file);
+	}
+#else
+	Serial.write(data, length);
+#endif
+}
+
+static void trace_end_record()
+{
+	if (record_count)
+	{
+		record[0] = record_channel << 6 | record_count;
+		trace_write(record, record_length);
+		record_count = 0;
+	}
+}
+
+// Tag left for the caller, the time since the record before
+static void trace_begin_record(uint8_t channel, uint32_t now)
+{
+	uint32_t delta = now - last_time;
+	record_length = 1;
+	do
+	{
+		record[record_length++] = (delta & 0x7f) | (delta > 0x7f ? 0x80 : 0);
+		delta >>= 7;
+	} while (delta);
+	record_channel = channel;
+	record_time = last_time = now;
+}
+
+void trace_init()
+{
+	static const uint8_t magic[] = { 'S', 'T', TRACE_VERSION };
+
+#ifdef HOST_BUILD
+	const char *path = getenv("HOST_TRACE");
+	trace_file = path ? fopen(path, "ab") : NULL;
+#else
+	Serial.begin(TRACE_BAUD);
+#endif
+	trace_write(magic, sizeof(magic));
+	last_time = 0;
+}
+
+void trace_byte(uint8_t channel, uint8_t c)
+{
+	uint32_t now = millis();
+
+	if (record_count && (channel != record_channel || now != record_time || record_count == TRACE_RECORD_MAX))
+	{
+		trace_end_record();
+	}
+
+	if (!record_count)
+	{
+		trace_begin_record(channel, now);
+	}
+
+	record[record_length++] = c;
+	record_count++;
+}
+
+void trace_string(uint8_t channel, const char *s)
+{
+	while (*s)
+	{
+		trace_byte(channel, *s++);
+	}
+}
+
+void trace_overflow(uint8_t channel)
+{
+	trace_end_record();
+	trace_begin_record(channel, millis());
+	record[0] = channel << 6;
+	trace_write(record, record_length);
+}
+
+void trace_poll()
+{
+	if (record_count && millis() - record_time >= TRACE_FLUSH_MS)
+	{
+		trace_end_record();
+	}
+}
+
+void trace_flush()
+{
+	trace_end_record();
+#ifndef HOST_BUILD
+	Serial.flush();
+#endif
+}
+
+#endif
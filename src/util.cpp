@@ -1,5 +1,20 @@
+#include <Arduino.h>
 #include "util.h"
+#include "trace.h"
+#include "watchdog.h"
 
 char phone_scratch_pad[MAX_PHONE_NO_LENGTH + 1];
 char text_scratch_pad[MAX_SMS_LENGTH + 1];
-void(* resetFunc) (void) = 0;
\ No newline at end of file
+void(* reset_hook) (void) = NULL;
+
+void system_reset()
+{
+	if (reset_hook)
+	{
+		reset_hook();
+	}
+#if SERIAL_TRACE
+	trace_flush();
+#endif
+	watchdog_reset();
+}
@@ -0,0 +1,249 @@
+#include "watchdog.h"
+#include "trace.h"
+#include <EEPROM.h>
+#ifndef HOST_BUILD
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/wdt.h>
+#endif
+
+#define WATCHDOG_MAGIC 0x5D
+
+#ifdef HOST_BUILD
+static watchdog_crumb_t &crumb = *(watchdog_crumb_t *)host_noinit(sizeof(watchdog_crumb_t));
+#else
+static watchdog_crumb_t crumb __attribute__((section(".noinit")));
+static uint8_t reset_flags __attribute__((section(".noinit")));
+static uint8_t bootloader_flags __attribute__((section(".noinit")));
+
+// Optiboot clears MCUSR and hands its flags over in r2, which nothing has
+// touched yet
+static void watchdog_bootloader_flags() __attribute__((naked, used, section(".init0")));
+static void watchdog_bootloader_flags()
+{
+	__asm__ __volatile__ ("sts %0, r2\n" : "=m" (bootloader_flags) :);
+}
+
+// Off with the watchdog before the startup code, it may be running at
+// 15 ms after a reset
+static void watchdog_early() __attribute__((naked, used, section(".init3")));
+static void watchdog_early()
+{
+	reset_flags = MCUSR;
+	MCUSR = 0;
+	wdt_disable();
+}
+
+// Optiboot keeps its version at the end of flash, the major number in the
+// last byte. Anything else, e.g. ATmegaBOOT, cannot take a watchdog reset.
+static bool watchdog_usable()
+{
+	return pgm_read_byte(FLASHEND) != 0xFF;
+}
+#endif
+
+static watchdog_cause_t last_cause;
+
+#if WATCHDOG
+static const uint32_t watchdog_limit[WATCHDOG_NUM_TASKS] = { WATCHDOG_LOOP_LIMIT, WATCHDOG_GPS_LIMIT, WATCHDOG_GSM_LIMIT };
+static uint32_t watchdog_beats[WATCHDOG_NUM_TASKS];
+#endif
+
+static const char *watchdog_task_name[WATCHDOG_NUM_TASKS] = { "loop", "GPS", "GSM" };
+
+// CRC-8, polynomial 0x07
+static uint8_t watchdog_checksum(const watchdog_crumb_t *c)
+{
+	const uint8_t *data = (const uint8_t *)c;
+	uint8_t crc = 0;
+
+	for (uint8_t i = 0; i < offsetof(watchdog_crumb_t, checksum); i++)
+	{
+		crc ^= data[i];
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+			crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+static bool watchdog_valid(const watchdog_crumb_t *c)
+{
+	return c->magic == WATCHDOG_MAGIC && c->checksum == watchdog_checksum(c);
+}
+
+// Kept valid at all times, the reset comes without warning
+static void watchdog_seal()
+{
+	crumb.checksum = watchdog_checksum(&crumb);
+}
+
+void watchdog_init()
+{
+	bool power_on = !watchdog_valid(&crumb);
+#ifndef HOST_BUILD
+	uint8_t flags = reset_flags | (watchdog_usable() ? bootloader_flags : 0);
+	// Bootloaders may have cleared them, the crumb's checksum is the fallback
+	power_on = power_on || (flags & (_BV(PORF) | _BV(BORF)));
+	// The reset pin. Optiboot then times out through the watchdog, so WDRF
+	// may be set as well.
+	if (!power_on && (flags & _BV(EXTRF)))
+	{
+		crumb.cause = WATCHDOG_EXTERNAL;
+		watchdog_seal();
+	}
+#endif
+
+	last_cause = power_on ? WATCHDOG_POWER_ON : watchdog_cause_t(crumb.cause);
+	if (!power_on)
+	{
+		EEPROM.put(WATCHDOG_EEPROM_BASE, crumb);
+		DEBUG_PRINT("Reset: ");
+		DEBUG_PRINTLN(last_cause == WATCHDOG_STALL ? "watchdog" : last_cause == WATCHDOG_EXTERNAL ? "external" : "requested");
+	}
+
+	memset(&crumb, 0, sizeof(crumb));
+	crumb.magic = WATCHDOG_MAGIC;
+	crumb.cause = WATCHDOG_STALL; // Unless system_reset() says otherwise
+	crumb.stalled = WATCHDOG_NUM_TASKS;
+	watchdog_seal();
+
+#if WATCHDOG
+	watchdog_beat(WATCHDOG_LOOP);
+#ifdef HOST_BUILD
+	host_watchdog(WATCHDOG_PERIOD);
+#else
+	if (watchdog_usable())
+	{
+		wdt_enable(WDTO_4S);
+	}
+#endif
+#endif
+}
+
+watchdog_cause_t watchdog_last_reset(watchdog_crumb_t *out)
+{
+	if (out && last_cause != WATCHDOG_POWER_ON)
+	{
+		EEPROM.get(WATCHDOG_EEPROM_BASE, *out);
+	}
+	return last_cause;
+}
+
+void watchdog_beat(watchdog_task_t task)
+{
+#if WATCHDOG
+	watchdog_beats[task] = millis();
+	if (!(crumb.busy & (1 << task)))
+	{
+		crumb.busy |= 1 << task;
+		watchdog_seal();
+	}
+#endif
+}
+
+void watchdog_rest(watchdog_task_t task)
+{
+#if WATCHDOG
+	if (crumb.busy & (1 << task))
+	{
+		crumb.busy &= ~(1 << task);
+		watchdog_seal();
+	}
+#endif
+}
+
+void watchdog_feed()
+{
+#if WATCHDOG
+	uint32_t now = millis();
+
+	for (uint8_t task = 0; task < WATCHDOG_NUM_TASKS; task++)
+	{
+		if ((crumb.busy & (1 << task)) && now - watchdog_beats[task] > watchdog_limit[task])
+		{
+			// Starved, it goes off within WATCHDOG_PERIOD
+			if (crumb.stalled != task)
+			{
+				crumb.stalled = task;
+				watchdog_seal();
+#if SERIAL_TRACE
+				trace_flush();
+#endif
+			}
+			return;
+		}
+	}
+
+#ifdef HOST_BUILD
+	host_watchdog(WATCHDOG_PERIOD);
+#else
+	wdt_reset();
+#endif
+#endif
+}
+
+void watchdog_command(const char *command)
+{
+	strncpy(crumb.command, command, WATCHDOG_COMMAND_MAX);
+	crumb.command[WATCHDOG_COMMAND_MAX] = '\0';
+	watchdog_seal();
+}
+
+void watchdog_reset()
+{
+	crumb.cause = WATCHDOG_RESET;
+	watchdog_seal();
+#ifdef HOST_BUILD
+	host_reset();
+#else
+	if (!watchdog_usable())
+	{
+		// To the start of the program, the peripherals are left as they are
+		cli();
+		((void (*)())0)();
+	}
+	wdt_enable(WDTO_15MS);
+	for (;;)
+	{
+	}
+#endif
+}
+
+uint8_t watchdog_format(char *out, uint8_t max_chars)
+{
+	watchdog_crumb_t last;
+	int length;
+
+	EEPROM.get(WATCHDOG_EEPROM_BASE, last);
+	if (!watchdog_valid(&last))
+	{
+		return 0;
+	}
+	last.command[WATCHDOG_COMMAND_MAX] = '\0';
+
+	// The innermost busy task, for a spin nothing was over its limit
+	uint8_t task = last.stalled;
+	for (uint8_t i = 0; task == WATCHDOG_NUM_TASKS && i < WATCHDOG_NUM_TASKS; i++)
+	{
+		if (last.busy & (1 << (WATCHDOG_NUM_TASKS - 1 - i)))
+		{
+			task = WATCHDOG_NUM_TASKS - 1 - i;
+		}
+	}
+
+	if (last.cause == WATCHDOG_RESET || last.cause == WATCHDOG_EXTERNAL)
+	{
+		length = snprintf(out, max_chars + 1, "Reset: %s after %s\n",
+			last.cause == WATCHDOG_RESET ? "requested" : "external", last.command);
+	}
+	else
+	{
+		length = snprintf(out, max_chars + 1, "Reset: %s %s after %s\n",
+			task < WATCHDOG_NUM_TASKS ? watchdog_task_name[task] : "?",
+			last.stalled < WATCHDOG_NUM_TASKS ? "stalled" : "spun", last.command);
+	}
+
+	return length > max_chars ? max_chars : length;
+}
@@ -0,0 +1,812 @@
+/*
+ * Cycle benchmarks of the AVR firmware under simavr.
+ *
+ * Runs the pro8MHzatmega328 build on a simulated ATmega328P at 8 MHz with a
+ * receiver and a modem bit-banged onto the SoftwareSerial pins from pins.h,
+ * so timing matches the board: NMEA at 1 Hz on GPS_RX, AT replies after a
+ * fixed delay on GSM_RX. Both ends are deterministic, the same firmware
+ * gives the same cycle counts on every run.
+ *
+ * Measured, per the markers in include/bench.h:
+ *   cycles per NMEA byte in gps_run, interrupts excluded
+ *   cycles per gsm_command*() call, command to final result, split into
+ *   the part blocked waiting on the modem and the part spent processing
+ *   worst case latency from an interrupt going pending to its vector
+ *   peak stack depth, SP as low as it went
+ *   static RAM (.data and .bss), and the SRAM left between it and the stack
+ *   share of cycles asleep, and the MCU current that gives
+ *   with --ring-every, how long a call rings before AT+CLCC asks who it is
+ *
+ * Build the firmware with the bench environment and the harness against
+ * simavr (libsimavr-dev, or a simavr checkout with PKG_CONFIG_PATH set):
+ *
+ *     pio run -e bench
+ *     cc -O2 -o avr_bench tools/avr_bench.c $(pkg-config --cflags --libs simavr) -lelf
+ *     ./avr_bench --seconds 120 .pio/build/bench/firmware.elf
+ *
+ * It only reports, nothing is gated until there are limits from real runs.
+ * The exit status is 2 if the CPU crashed. --json writes the results for
+ * comparing runs.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_irq.h>
+#include <simavr/sim_io.h>
+#include <simavr/sim_cycle_timers.h>
+#include <simavr/sim_interrupts.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_uart.h>
+#include <simavr/avr_eeprom.h>
+
+#define FREQUENCY 8000000
+
+// From include/pins.h, all on port D
+#define GPS_RX 3
+#define GPS_TX 2
+#define GSM_RX 5
+#define GSM_TX 4
+#define GSM_RING 7
+
+// Datasheet figures, as POWER_ACTIVE_UA and POWER_IDLE_UA in include/power.h
+#define ACTIVE_UA 3000.0
+#define IDLE_UA 800.0
+
+#define RAM_START 0x100 // ATmega328P, after the I/O registers
+
+#define GSM_BAUD 19200
+#define GPS_BAUD 9600
+
+// GPIOR0, see include/bench.h
+#define BENCH_MARKER_ADDR 0x3e
+enum
+{
+	BENCH_NMEA_BEGIN = 1,
+	BENCH_NMEA_END,
+	BENCH_AT_BEGIN,
+	BENCH_AT_END,
+	BENCH_WAIT_BEGIN,
+	BENCH_WAIT_END
+};
+
+#define UART_QUEUE 1024
+#define LINE_MAX 200
+
+struct soft_uart;
+typedef void (*uart_line_t)(struct soft_uart *uart, const char *line);
+
+// One side of a SoftwareSerial link, bits are scheduled with cycle timers
+struct soft_uart
+{
+	avr_t *avr;
+	const char *name;
+	avr_irq_t *rx_pin; // Driven here, the MCU receives on it
+	double bit_cycles;
+
+	uint8_t queue[UART_QUEUE];
+	uint16_t head;
+	uint16_t count;
+	int sending;
+	int bit;
+	avr_cycle_count_t byte_start;
+
+	int tx_level; // The MCU transmits on it
+	int receiving;
+	uint8_t tx_byte;
+	avr_cycle_count_t tx_start;
+
+	// Raw bytes go to on_byte while it returns nonzero, lines otherwise
+	int (*on_byte)(struct soft_uart *uart, uint8_t c);
+	uart_line_t on_line;
+	char line[LINE_MAX];
+	int line_len;
+};
+
+struct region
+{
+	int depth;
+	avr_cycle_count_t start;
+	avr_cycle_count_t isr_start;
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+
+	// Blocked on a peripheral within the region, interrupts excluded
+	int waiting;
+	avr_cycle_count_t wait_start;
+	avr_cycle_count_t wait_isr_start;
+	uint64_t wait;
+};
+
+struct bench
+{
+	avr_t *avr;
+	struct soft_uart gps;
+	struct soft_uart gsm;
+
+	struct region nmea;
+	struct region at;
+
+	// Interrupts
+	avr_cycle_count_t pending_at[64];
+	uint64_t isr_latency_max;
+	int isr_latency_vector;
+	uint64_t isr_count;
+	uint64_t isr_cycles;
+	avr_cycle_count_t isr_entered;
+	int isr_running;
+
+	uint16_t sp_min;
+	uint64_t sleep_cycles;
+
+	// Receiver
+	uint32_t gps_second;
+	uint32_t gps_period_ms;
+	uint32_t gps_new_baud;
+
+	// Modem
+	uint32_t modem_delay_cycles;
+	int modem_started;
+	int modem_payload; // Bytes still to come after a CIPSEND or CMGS prompt
+	int modem_sms;
+	int modem_skip_lf; // The command's LF comes before the payload
+
+	// Calls
+	avr_irq_t *ring_pin;
+	uint32_t ring_every_ms;
+	avr_cycle_count_t ring_at; // 0 while no call is up
+	struct region call;
+};
+
+static struct bench bench;
+
+static avr_cycle_count_t ms_to_cycles(uint32_t ms)
+{
+	return (avr_cycle_count_t)ms * (FREQUENCY / 1000);
+}
+
+/* Soft UART */
+
+static avr_cycle_count_t uart_bit(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	struct soft_uart *uart = param;
+	uint8_t byte = uart->queue[uart->head];
+	int level;
+
+	if (uart->bit == 0)
+	{
+		uart->byte_start = when;
+		level = 0;
+	}
+	else if (uart->bit <= 8)
+	{
+		level = (byte >> (uart->bit - 1)) & 1;
+	}
+	else
+	{
+		level = 1;
+	}
+	avr_raise_irq(uart->rx_pin, level);
+
+	if (++uart->bit == 10)
+	{
+		uart->head = (uart->head + 1) % UART_QUEUE;
+		uart->count--;
+		uart->bit = 0;
+		if (!uart->count)
+		{
+			uart->sending = 0;
+			return 0;
+		}
+	}
+
+	return uart->byte_start + (avr_cycle_count_t)((uart->bit ? uart->bit : 10) * uart->bit_cycles + 0.5);
+}
+
+static void uart_send(struct soft_uart *uart, const char *data, int len)
+{
+	for (int i = 0; i < len && uart->count < UART_QUEUE; i++)
+	{
+		uart->queue[(uart->head + uart->count++) % UART_QUEUE] = data[i];
+	}
+
+	if (!uart->sending && uart->count)
+	{
+		uart->sending = 1;
+		uart->bit = 0;
+		avr_cycle_timer_register(uart->avr, 1, uart_bit, uart);
+	}
+}
+
+static void uart_send_string(struct soft_uart *uart, const char *text)
+{
+	uart_send(uart, text, strlen(text));
+}
+
+struct delayed_send
+{
+	struct soft_uart *uart;
+	char text[];
+};
+
+static avr_cycle_count_t uart_delayed(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	struct delayed_send *send = param;
+	uart_send_string(send->uart, send->text);
+	free(send);
+	return 0;
+}
+
+static void uart_send_later(struct soft_uart *uart, avr_cycle_count_t delay, const char *text)
+{
+	struct delayed_send *send = malloc(sizeof(struct delayed_send) + strlen(text) + 1);
+	send->uart = uart;
+	strcpy(send->text, text);
+	avr_cycle_timer_register(uart->avr, delay ? delay : 1, uart_delayed, send);
+}
+
+static void uart_received(struct soft_uart *uart, uint8_t c)
+{
+	if (uart->on_byte && uart->on_byte(uart, c))
+	{
+		return;
+	}
+
+	if (c == '\r' || c == '\n')
+	{
+		if (uart->line_len)
+		{
+			uart->line[uart->line_len] = '\0';
+			uart->on_line(uart, uart->line);
+			uart->line_len = 0;
+		}
+	}
+	else if (uart->line_len < LINE_MAX - 1)
+	{
+		uart->line[uart->line_len++] = c;
+	}
+}
+
+// Samples the MCU's TX pin in the middle of every bit
+static avr_cycle_count_t uart_sample(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	struct soft_uart *uart = param;
+	int bit = (int)((when - uart->tx_start) / uart->bit_cycles);
+
+	if (bit >= 1 && bit <= 8)
+	{
+		uart->tx_byte |= uart->tx_level << (bit - 1);
+	}
+	if (bit >= 9)
+	{
+		uart->receiving = 0;
+		if (uart->tx_level)
+		{
+			uart_received(uart, uart->tx_byte);
+		}
+		return 0;
+	}
+	return uart->tx_start + (avr_cycle_count_t)((bit + 1.5) * uart->bit_cycles);
+}
+
+static void uart_tx_pin(avr_irq_t *irq, uint32_t value, void *param)
+{
+	struct soft_uart *uart = param;
+
+	uart->tx_level = value & 1;
+	if (!uart->tx_level && !uart->receiving)
+	{
+		uart->receiving = 1;
+		uart->tx_byte = 0;
+		uart->tx_start = uart->avr->cycle;
+		avr_cycle_timer_register(uart->avr, (avr_cycle_count_t)(uart->bit_cycles / 2), uart_sample, uart);
+	}
+}
+
+static void uart_set_baud(struct soft_uart *uart, uint32_t baud)
+{
+	uart->bit_cycles = (double)FREQUENCY / baud;
+}
+
+static void uart_init(struct soft_uart *uart, avr_t *avr, const char *name, int rx, int tx, uint32_t baud)
+{
+	memset(uart, 0, sizeof(*uart));
+	uart->avr = avr;
+	uart->name = name;
+	uart_set_baud(uart, baud);
+	uart->rx_pin = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), rx);
+	avr_raise_irq(uart->rx_pin, 1);
+	uart->tx_level = 1;
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), tx), uart_tx_pin, uart);
+}
+
+/* Receiver, an MTK that acks every PMTK command */
+
+static void nmea_send(struct soft_uart *uart, const char *body)
+{
+	char out[LINE_MAX];
+	uint8_t checksum = 0;
+
+	for (const char *c = body; *c; c++)
+	{
+		checksum ^= *c;
+	}
+	snprintf(out, sizeof(out), "$%s*%02X\r\n", body, checksum);
+	uart_send_string(uart, out);
+}
+
+// Walks slowly east from 57.7089 N 11.9746 E, always with a good fix
+static avr_cycle_count_t gps_tick(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	char body[LINE_MAX];
+	uint32_t s = bench.gps_second++;
+	double lon_minutes = 58.476 + s * 0.0001;
+
+	snprintf(body, sizeof(body), "GPGGA,%02u%02u%02u.00,5742.5340,N,011%07.4f,E,1,08,0.9,12.0,M,41.0,M,,",
+		(s / 3600) % 24, (s / 60) % 60, s % 60, lon_minutes);
+	nmea_send(&bench.gps, body);
+	snprintf(body, sizeof(body), "GPRMC,%02u%02u%02u.00,A,5742.5340,N,011%07.4f,E,0.4,90.0,010126,,,A",
+		(s / 3600) % 24, (s / 60) % 60, s % 60, lon_minutes);
+	nmea_send(&bench.gps, body);
+
+	return when + ms_to_cycles(bench.gps_period_ms);
+}
+
+static avr_cycle_count_t gps_change_baud(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	uart_set_baud(&bench.gps, bench.gps_new_baud);
+	return 0;
+}
+
+static void gps_line(struct soft_uart *uart, const char *line)
+{
+	char body[40];
+	int command;
+
+	if (sscanf(line, "$PMTK%d", &command) != 1)
+	{
+		return;
+	}
+
+	snprintf(body, sizeof(body), "PMTK001,%d,3", command);
+	nmea_send(uart, body);
+
+	if (command == 220)
+	{
+		sscanf(line, "$PMTK220,%u", &bench.gps_period_ms);
+	}
+	else if (command == 251 && sscanf(line, "$PMTK251,%u", &bench.gps_new_baud) == 1)
+	{
+		avr_cycle_timer_register(uart->avr, ms_to_cycles(20), gps_change_baud, NULL);
+	}
+}
+
+/* Modem, a SIM800 that is registered, has no SMS and takes every upload */
+
+static int modem_byte(struct soft_uart *uart, uint8_t c)
+{
+	char reply[40];
+
+	if (bench.modem_skip_lf)
+	{
+		bench.modem_skip_lf = 0;
+		if (c == '\n')
+		{
+			return 1;
+		}
+	}
+
+	if (!bench.modem_payload)
+	{
+		return 0;
+	}
+
+	if (bench.modem_sms ? c == 0x1a : --bench.modem_payload == 0)
+	{
+		snprintf(reply, sizeof(reply), bench.modem_sms ? "\r\n+CMGS: 1\r\n\r\nOK\r\n" : "\r\nSEND OK\r\n");
+		uart_send_later(uart, bench.modem_delay_cycles, reply);
+		bench.modem_payload = 0;
+	}
+	return 1;
+}
+
+static void modem_line(struct soft_uart *uart, const char *line)
+{
+	avr_cycle_count_t delay = bench.modem_delay_cycles;
+	const char *reply = "\r\nOK\r\n";
+
+	if (strncmp(line, "AT", 2) != 0)
+	{
+		return;
+	}
+
+	if (!bench.modem_started)
+	{
+		bench.modem_started = 1;
+		uart_send_later(uart, ms_to_cycles(2000), "\r\nCall Ready\r\n\r\nSMS Ready\r\n");
+	}
+
+	if (!strcmp(line, "AT+CREG?"))
+	{
+		reply = "\r\n+CREG: 0,1\r\n\r\nOK\r\n";
+	}
+	else if (!strcmp(line, "AT+CCALR?"))
+	{
+		reply = "\r\n+CCALR: 1\r\n\r\nOK\r\n";
+	}
+	else if (!strcmp(line, "AT+CSQ"))
+	{
+		reply = "\r\n+CSQ: 20,0\r\n\r\nOK\r\n";
+	}
+	else if (!strcmp(line, "AT+CBC"))
+	{
+		reply = "\r\n+CBC: 0,85,4100\r\n\r\nOK\r\n";
+	}
+	else if (!strcmp(line, "AT+SAPBR=2,1"))
+	{
+		reply = "\r\n+SAPBR: 1,1,\"10.64.0.1\"\r\n\r\nOK\r\n";
+	}
+	else if (!strncmp(line, "AT+CIPSTART=", 12))
+	{
+		reply = "\r\nOK\r\n\r\nCONNECT OK\r\n";
+	}
+	else if (!strcmp(line, "AT+CIPSHUT"))
+	{
+		reply = "\r\nSHUT OK\r\n";
+	}
+	else if (!strcmp(line, "AT+CLCC") && bench.ring_at)
+	{
+		// How long the call rang before the firmware noticed it
+		uint64_t cycles = uart->avr->cycle - bench.ring_at;
+		bench.call.count++;
+		bench.call.total += cycles;
+		if (cycles > bench.call.max)
+		{
+			bench.call.max = cycles;
+		}
+		reply = "\r\n+CLCC: 1,1,4,0,0,\"+46701234567\",145,\"\"\r\n\r\nOK\r\n";
+	}
+	else if (!strcmp(line, "ATH"))
+	{
+		bench.ring_at = 0;
+		avr_raise_irq(bench.ring_pin, 1);
+	}
+	else if (!strncmp(line, "AT+CIPSEND=", 11) || !strncmp(line, "AT+CMGS=", 8))
+	{
+		bench.modem_sms = line[3] == 'M';
+		bench.modem_payload = bench.modem_sms ? 1 : atoi(line + 11);
+		bench.modem_skip_lf = 1;
+		reply = "\r\n> ";
+		delay = ms_to_cycles(20);
+	}
+
+	uart_send_later(uart, delay, reply);
+}
+
+// RI goes low and stays low until ATH, like the SIM800 on a voice call
+static avr_cycle_count_t ring_tick(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	if (!bench.ring_at && bench.modem_started)
+	{
+		bench.ring_at = when;
+		avr_raise_irq(bench.ring_pin, 0);
+		uart_send_string(&bench.gsm, "\r\nRING\r\n");
+	}
+	return when + ms_to_cycles(bench.ring_every_ms);
+}
+
+/* Measurements */
+
+// Waits only count within a region, so they are split off the AT figures
+// and nothing else
+static void region_wait_begin(struct region *region)
+{
+	if (region->depth && !region->waiting)
+	{
+		region->waiting = 1;
+		region->wait_start = bench.avr->cycle;
+		region->wait_isr_start = bench.isr_cycles;
+	}
+}
+
+static void region_wait_end(struct region *region)
+{
+	if (!region->waiting)
+	{
+		return;
+	}
+
+	region->waiting = 0;
+	region->wait += bench.avr->cycle - region->wait_start - (bench.isr_cycles - region->wait_isr_start);
+}
+
+static void region_begin(struct region *region)
+{
+	if (region->depth++ == 0)
+	{
+		region->start = bench.avr->cycle;
+		region->isr_start = bench.isr_cycles;
+	}
+}
+
+static void region_end(struct region *region)
+{
+	if (region->depth == 0 || --region->depth > 0)
+	{
+		return;
+	}
+	region_wait_end(region);
+
+	uint64_t cycles = bench.avr->cycle - region->start - (bench.isr_cycles - region->isr_start);
+	region->count++;
+	region->total += cycles;
+	if (cycles > region->max)
+	{
+		region->max = cycles;
+	}
+}
+
+static void marker_write(avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+	avr->data[addr] = v;
+
+	switch (v)
+	{
+	case BENCH_NMEA_BEGIN:
+		region_begin(&bench.nmea);
+		break;
+	case BENCH_NMEA_END:
+		region_end(&bench.nmea);
+		break;
+	case BENCH_AT_BEGIN:
+		region_begin(&bench.at);
+		break;
+	case BENCH_AT_END:
+		region_end(&bench.at);
+		break;
+	case BENCH_WAIT_BEGIN:
+		region_wait_begin(&bench.at);
+		break;
+	case BENCH_WAIT_END:
+		region_wait_end(&bench.at);
+		break;
+	}
+}
+
+static void interrupt_pending(avr_irq_t *irq, uint32_t vector, void *param)
+{
+	if (vector && vector < 64 && !bench.pending_at[vector])
+	{
+		bench.pending_at[vector] = bench.avr->cycle;
+	}
+}
+
+// The value is the vector now running, 0 when back in the main program
+static void interrupt_running(avr_irq_t *irq, uint32_t vector, void *param)
+{
+	if (vector && !bench.isr_running)
+	{
+		bench.isr_entered = bench.avr->cycle;
+	}
+	else if (!vector && bench.isr_running)
+	{
+		bench.isr_cycles += bench.avr->cycle - bench.isr_entered;
+	}
+	bench.isr_running = vector != 0;
+
+	if (vector && vector < 64 && bench.pending_at[vector])
+	{
+		uint64_t latency = bench.avr->cycle - bench.pending_at[vector];
+		bench.pending_at[vector] = 0;
+		bench.isr_count++;
+		if (latency > bench.isr_latency_max)
+		{
+			bench.isr_latency_max = latency;
+			bench.isr_latency_vector = vector;
+		}
+	}
+}
+
+static int console_output;
+
+static void console_byte(avr_irq_t *irq, uint32_t value, void *param)
+{
+	if (console_output)
+	{
+		fputc(value, stderr);
+	}
+}
+
+static double region_average(struct region *region)
+{
+	return region->count ? (double)region->total / region->count : 0;
+}
+
+static double region_wait_average(struct region *region)
+{
+	return region->count ? (double)region->wait / region->count : 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [--seconds N] [--modem-delay MS] [--data-off] [--ring-every MS] [--console]\n"
+		"          [--json FILE] firmware.elf\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{ "seconds", required_argument, NULL, 's' },
+		{ "modem-delay", required_argument, NULL, 'd' },
+		{ "data-off", no_argument, NULL, 'o' },
+		{ "ring-every", required_argument, NULL, 'r' },
+		{ "console", no_argument, NULL, 'c' },
+		{ "json", required_argument, NULL, 'j' },
+		{ NULL, 0, NULL, 0 }
+	};
+	double seconds = 60;
+	uint32_t modem_delay = 20;
+	int data_enabled = 1;
+	const char *json = NULL;
+	int option;
+
+	while ((option = getopt_long(argc, argv, "", options, NULL)) != -1)
+	{
+		switch (option)
+		{
+		case 's': seconds = atof(optarg); break;
+		case 'd': modem_delay = atoi(optarg); break;
+		case 'o': data_enabled = 0; break;
+		case 'r': bench.ring_every_ms = atoi(optarg); break;
+		case 'c': console_output = 1; break;
+		case 'j': json = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+	{
+		usage(argv[0]);
+	}
+
+	elf_firmware_t firmware;
+	memset(&firmware, 0, sizeof(firmware));
+	if (elf_read_firmware(argv[optind], &firmware) != 0)
+	{
+		fprintf(stderr, "could not read %s\n", argv[optind]);
+		return 1;
+	}
+
+	avr_t *avr = avr_make_mcu_by_name("atmega328p");
+	if (!avr)
+	{
+		fprintf(stderr, "simavr has no atmega328p\n");
+		return 1;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &firmware);
+	avr->frequency = FREQUENCY;
+	avr->log = LOG_WARNING;
+	bench.avr = avr;
+
+	// Data connection enabled, the rest of the EEPROM erased
+	uint8_t eeprom[1024];
+	memset(eeprom, 0xff, sizeof(eeprom));
+	eeprom[0] = data_enabled;
+	avr_eeprom_desc_t eeprom_desc = { .ee = eeprom, .offset = 0, .size = sizeof(eeprom) };
+	avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &eeprom_desc);
+
+	// The debug console, on the hardware UART
+	uint32_t flags = 0;
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT), console_byte, NULL);
+
+	bench.ring_pin = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), GSM_RING);
+	avr_raise_irq(bench.ring_pin, 1);
+	if (bench.ring_every_ms)
+	{
+		avr_cycle_timer_register(avr, ms_to_cycles(bench.ring_every_ms), ring_tick, NULL);
+	}
+
+	uart_init(&bench.gps, avr, "gps", GPS_RX, GPS_TX, GPS_BAUD);
+	bench.gps.on_line = gps_line;
+	bench.gps_period_ms = 1000;
+	avr_cycle_timer_register(avr, ms_to_cycles(500), gps_tick, NULL);
+
+	uart_init(&bench.gsm, avr, "gsm", GSM_RX, GSM_TX, GSM_BAUD);
+	bench.gsm.on_line = modem_line;
+	bench.gsm.on_byte = modem_byte;
+	bench.modem_delay_cycles = ms_to_cycles(modem_delay);
+
+	avr_register_io_write(avr, BENCH_MARKER_ADDR, marker_write, NULL);
+
+	avr_irq_t *interrupts = avr_get_interrupt_irq(avr, AVR_INT_ANY);
+	avr_irq_register_notify(interrupts + AVR_INT_IRQ_PENDING, interrupt_pending, NULL);
+	avr_irq_register_notify(interrupts + AVR_INT_IRQ_RUNNING, interrupt_running, NULL);
+
+	avr_cycle_count_t end = (avr_cycle_count_t)(seconds * FREQUENCY);
+	bench.sp_min = avr->ramend;
+	int state = cpu_Running;
+
+	while (avr->cycle < end && state != cpu_Done && state != cpu_Crashed)
+	{
+		// A sleeping core skips ahead to the next event in one step
+		avr_cycle_count_t before = avr->cycle;
+		int sleeping = avr->state == cpu_Sleeping;
+		state = avr_run(avr);
+		if (sleeping)
+		{
+			bench.sleep_cycles += avr->cycle - before;
+		}
+
+		uint16_t sp = avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+		if (sp < bench.sp_min)
+		{
+			bench.sp_min = sp;
+		}
+	}
+
+	uint16_t stack = avr->ramend - bench.sp_min;
+	uint32_t static_ram = firmware.datasize + firmware.bsssize;
+	// No heap, nothing calls malloc
+	long ram_free = (long)(avr->ramend + 1 - RAM_START) - (long)static_ram - stack;
+	double simulated = (double)avr->cycle / FREQUENCY;
+	double sleep_share = avr->cycle ? (double)bench.sleep_cycles / avr->cycle : 0;
+	double mcu_ua = ACTIVE_UA - (ACTIVE_UA - IDLE_UA) * sleep_share;
+
+	printf("=== avr_bench, %.1f s simulated ===\n", simulated);
+	if (state == cpu_Crashed)
+	{
+		printf("CPU crashed at pc 0x%04x\n", avr->pc);
+	}
+	printf("nmea bytes %llu, %.0f cycles/byte avg, %llu max\n", (unsigned long long)bench.nmea.count,
+		region_average(&bench.nmea), (unsigned long long)bench.nmea.max);
+	printf("at commands %llu, %.0f cycles avg (%.0f waiting, %.0f processing), %llu max\n",
+		(unsigned long long)bench.at.count, region_average(&bench.at), region_wait_average(&bench.at),
+		region_average(&bench.at) - region_wait_average(&bench.at), (unsigned long long)bench.at.max);
+	printf("interrupts %llu, %.1f%% of cycles, worst latency %llu cycles (vector %d)\n", (unsigned long long)bench.isr_count,
+		avr->cycle ? 100.0 * bench.isr_cycles / avr->cycle : 0, (unsigned long long)bench.isr_latency_max, bench.isr_latency_vector);
+	printf("stack peak %u bytes, SP down to 0x%04x\n", stack, bench.sp_min);
+	printf("static RAM %u bytes (.data %u, .bss %u), %ld bytes never used%s\n", static_ram,
+		firmware.datasize, firmware.bsssize, ram_free, ram_free < 0 ? ", the stack ran into .bss" : "");
+	printf("asleep %.1f%% of cycles, MCU ~%.0f uA\n", 100.0 * sleep_share, mcu_ua);
+	if (bench.ring_every_ms)
+	{
+		printf("calls %llu, picked up after %.0f ms avg, %.0f ms max\n", (unsigned long long)bench.call.count,
+			region_average(&bench.call) * 1000 / FREQUENCY, (double)bench.call.max * 1000 / FREQUENCY);
+	}
+
+	if (json)
+	{
+		FILE *out = fopen(json, "w");
+		if (out)
+		{
+			fprintf(out, "{\n  \"simulated_s\": %.3f,\n  \"crashed\": %s,\n", simulated, state == cpu_Crashed ? "true" : "false");
+			fprintf(out, "  \"nmea_bytes\": %llu,\n  \"nmea_cycles_per_byte\": %.1f,\n  \"nmea_cycles_max\": %llu,\n",
+				(unsigned long long)bench.nmea.count, region_average(&bench.nmea), (unsigned long long)bench.nmea.max);
+			fprintf(out, "  \"at_commands\": %llu,\n  \"at_cycles_avg\": %.1f,\n  \"at_cycles_max\": %llu,\n",
+				(unsigned long long)bench.at.count, region_average(&bench.at), (unsigned long long)bench.at.max);
+			fprintf(out, "  \"at_wait_cycles_avg\": %.1f,\n  \"at_processing_cycles_avg\": %.1f,\n",
+				region_wait_average(&bench.at), region_average(&bench.at) - region_wait_average(&bench.at));
+			fprintf(out, "  \"isr_latency_max\": %llu,\n  \"isr_latency_vector\": %d,\n  \"stack_peak\": %u,\n",
+				(unsigned long long)bench.isr_latency_max, bench.isr_latency_vector, stack);
+			fprintf(out, "  \"data_bytes\": %u,\n  \"bss_bytes\": %u,\n  \"ram_free\": %ld,\n",
+				firmware.datasize, firmware.bsssize, ram_free);
+			fprintf(out, "  \"sleep_share\": %.4f,\n  \"mcu_ua\": %.0f,\n", sleep_share, mcu_ua);
+			fprintf(out, "  \"calls\": %llu,\n  \"call_pickup_ms_avg\": %.1f,\n  \"call_pickup_ms_max\": %.1f\n}\n",
+				(unsigned long long)bench.call.count, region_average(&bench.call) * 1000 / FREQUENCY,
+				(double)bench.call.max * 1000 / FREQUENCY);
+			fclose(out);
+		}
+	}
+
+	return state == cpu_Crashed ? 2 : 0;
+}
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+"""Checks of the native build against the SIM800 emulator.
+
+Each check runs the firmware under tools/sim800_emu.py with a scenario of
+its own, no GPS receiver and a blank EEPROM, and looks at what the
+emulator logged and summed up:
+
+    empty-inbox   the SMS polls of an empty inbox are answered with a bare
+                  OK, STATS must not count them as timeouts
+    slow-upload   UPLOAD_S is set to 60 and every CIPSEND fails, the unit
+                  must not reset before three reports have failed
+
+    python3 tools/emu_check.py -- .pio/build/native/program
+
+The checks run side by side on ports from --port up. The exit status is 1
+if any failed.
+"""
+
+import argparse
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+PHONE = "+46701234567"
+
+
+def check_empty_inbox(log, summary):
+    # STATS lists "<label> n<count> t<timeouts> e<errors> ..." by total time,
+    # as many as fit. The polls are cheap unless they wait out a timeout.
+    if "AT stats" not in log:
+        return "no STATS reply"
+    found = re.search(r"CMGL n(\d+) t(\d+) e(\d+)", log)
+    if found and int(found.group(2)):
+        return "%s of %s SMS polls counted as timeouts" % (found.group(2), found.group(1))
+    return None
+
+
+def check_slow_upload(log, summary):
+    # A reset reconnects to the emulator
+    if "sms to %s" % PHONE not in log:
+        return "SET was not answered"
+    if "host: reset" in log or summary["connections"] > 1:
+        return "reset before three reports had failed"
+    return None
+
+
+# name, scenario, seconds to run, live data connection, function of the
+# emulator's log and JSON summary returning what went wrong or None
+CHECKS = [
+    ("empty-inbox", {"seed": 1, "events": [
+        {"kind": "sms", "at": 60, "from": PHONE, "text": "STATS"},
+    ]}, 90, False, check_empty_inbox),
+    # Ready at about 17 s, the first report at 20 s after that picks up the
+    # 60 s interval, the third failure is past the run
+    ("slow-upload", {"seed": 1, "error_rate": {"AT+CIPSEND": 1.0}, "events": [
+        {"kind": "sms", "at": 25, "from": PHONE, "text": "SET UPLOAD_S 60"},
+    ]}, 170, True, check_slow_upload),
+]
+
+
+def log(text):
+    print("[emu_check] %s" % text, file=sys.stderr, flush=True)
+
+
+def start(firmware, work, port, check):
+    name, scenario, seconds, live, _ = check
+    path = os.path.join(work, name)
+    with open(path + ".json", "w") as f:
+        json.dump(scenario, f)
+    with open(path + ".eeprom", "wb") as f:
+        f.write(b"\x01" if live else b"\x00")
+    env = dict(os.environ, GPS_PORT="/dev/null", HOST_EEPROM=path + ".eeprom")
+    for key in ("HOST_REPLAY", "HOST_TRACE", "HOST_HANG"):
+        env.pop(key, None)
+    command = [sys.executable, os.path.join(HERE, "sim800_emu.py"), "-s", path + ".json", "-p", str(port),
+               "--duration", str(seconds), "--json", path + ".summary", "--"] + firmware
+    out = open(path + ".log", "w")
+    return subprocess.Popen(command, env=env, stdout=out, stderr=subprocess.STDOUT, cwd=work), out
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--only", choices=[c[0] for c in CHECKS], help="run this check alone")
+    parser.add_argument("--port", type=int, default=7900, help="first emulator port")
+    parser.add_argument("--keep", action="store_true", help="keep the logs and print where")
+    argv = sys.argv[1:]
+    firmware = []
+    if "--" in argv:
+        argv, firmware = argv[:argv.index("--")], argv[argv.index("--") + 1:]
+    args = parser.parse_args(argv)
+    if not firmware:
+        sys.exit("emu_check: give the native build after --")
+    firmware = [os.path.abspath(firmware[0])] + firmware[1:]
+
+    work = tempfile.mkdtemp(prefix="emu_check")
+    failed = 0
+    try:
+        checks = [c for c in CHECKS if not args.only or c[0] == args.only]
+        running = [(c, start(firmware, work, args.port + i, c)) for i, c in enumerate(checks)]
+        for check, (process, out) in running:
+            process.wait()
+            out.close()
+            path = os.path.join(work, check[0])
+            with open(path + ".log", errors="replace") as f:
+                text = f.read()
+            summary = {}
+            if os.path.exists(path + ".summary"):
+                with open(path + ".summary") as f:
+                    summary = json.load(f)
+            problem = check[4](text, summary) if summary else "the emulator wrote no summary"
+            failed += problem is not None
+            log("%s: %s" % (check[0], "FAILED, " + problem if problem else "ok"))
+    finally:
+        if args.keep:
+            log("logs in %s" % work)
+        else:
+            shutil.rmtree(work)
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
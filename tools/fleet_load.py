@@ -0,0 +1,423 @@
+#!/usr/bin/env python3
+"""Fleet load generator for the tracker uplink, see tcp_packet_t in src/gsm.cpp.
+
+Simulates N trackers, each sending a frame every --interval seconds the way
+gsm_send_data() does. By default a tracker keeps one TCP session open, with
+--fresh it connects for every frame. Timing follows the firmware:
+
+- Each tracker starts at a random point of its interval. Frames come up to
+  --jitter seconds late, because the upload timer is only checked between
+  the GPS and GSM windows of the main loop.
+- With probability --shut-rate a send fails halfway and the session is torn
+  down with a RST, like CIPSHUT after a failed CIPSEND. The receiver sees a
+  partial frame. The next frame goes over a new connection.
+- Every --outage-every seconds the cell of --outage-fraction of the fleet
+  goes down for --outage-duration seconds. Their sessions drop and the
+  frames due meanwhile are deferred. When the cell is back, the signal poll
+  notices it within --storm-spread seconds, so they all reconnect at once.
+
+The built in receiver decodes the frames and matches each one to the time it
+was sent, which gives the ingest latency. Pass --receiver HOST:PORT to load
+an external receiver instead, the report then only has the sender side.
+
+    python3 tools/fleet_load.py -n 2000 --duration 120 --outage-every 60
+
+The receiver shares the interpreter with the senders, so at high rates the
+latency includes waiting for the GIL. Compare runs at the same --threads.
+"""
+
+import argparse
+import collections
+import heapq
+import json
+import math
+import random
+import resource
+import selectors
+import socket
+import struct
+import sys
+import threading
+import time
+
+import tracker_protocol
+
+
+def percentile(samples, p):
+    if not samples:
+        return 0.0
+    ordered = sorted(samples)
+    k = (len(ordered) - 1) * p / 100.0
+    lo = math.floor(k)
+    hi = math.ceil(k)
+    return ordered[lo] + (ordered[hi] - ordered[lo]) * (k - lo)
+
+
+def log(text):
+    print("[%9.3f] %s" % (time.monotonic() - START, text), file=sys.stderr, flush=True)
+
+
+START = time.monotonic()
+
+
+class Counters:
+    """Shared by the threads, a lock is cheap next to a socket call."""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.values = collections.Counter()
+
+    def add(self, name, count=1):
+        with self.lock:
+            self.values[name] += count
+
+    def __getitem__(self, name):
+        return self.values[name]
+
+
+class Receiver:
+    """Accepts the trackers' sessions and decodes their frames.
+
+    Frames of a session arrive in the order they were sent, so the sender
+    keeps a queue of send times per session, found by the client address.
+    """
+
+    def __init__(self, threads, pending, counters):
+        self.pending = pending
+        self.counters = counters
+        self.latency = []
+        self.latency_lock = threading.Lock()
+        self.open = 0
+        self.peak_open = 0
+        self.server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.server.bind(("127.0.0.1", 0))
+        self.server.listen(4096)
+        self.address = self.server.getsockname()
+        self.selectors = [selectors.DefaultSelector() for _ in range(threads)]
+        # A socket that never fires keeps a selector without sessions from
+        # returning at once on some platforms
+        self.idle = [socket.socketpair() for _ in self.selectors]
+        for selector, (idle, _) in zip(self.selectors, self.idle):
+            selector.register(idle, selectors.EVENT_READ, None)
+        self.stopping = False
+        self.threads = [threading.Thread(target=self.accept_loop, daemon=True)]
+        self.threads += [threading.Thread(target=self.read_loop, args=(s,), daemon=True) for s in self.selectors]
+        for thread in self.threads:
+            thread.start()
+
+    def accept_loop(self):
+        turn = 0
+        while not self.stopping:
+            try:
+                conn, peer = self.server.accept()
+            except OSError:
+                return
+            conn.setblocking(False)
+            session = {"peer": peer, "reader": tracker_protocol.FrameReader(), "sent": None}
+            with self.latency_lock:
+                self.open += 1
+                self.peak_open = max(self.peak_open, self.open)
+            self.selectors[turn % len(self.selectors)].register(conn, selectors.EVENT_READ, session)
+            turn += 1
+
+    def read_loop(self, selector):
+        while not self.stopping:
+            for key, _ in selector.select(0.1):
+                if key.data:
+                    self.receive(selector, key.fileobj, key.data)
+
+    def receive(self, selector, conn, session):
+        try:
+            data = conn.recv(4096)
+        except ConnectionResetError:
+            self.counters.add("rx_resets")
+            data = b""
+        except OSError:
+            data = b""
+
+        if data:
+            now = time.monotonic()
+            frames = session["reader"].feed(data)
+            if frames and session["sent"] is None:
+                session["sent"] = self.pending.get(session["peer"])
+            samples = []
+            for _ in frames:
+                if session["sent"]:
+                    samples.append(now - session["sent"].popleft())
+            self.counters.add("rx_frames", len(frames))
+            self.counters.add("rx_bytes", len(data))
+            with self.latency_lock:
+                self.latency.extend(samples)
+            return
+
+        if session["reader"].buffer:
+            self.counters.add("rx_partial")
+        selector.unregister(conn)
+        conn.close()
+        with self.latency_lock:
+            self.open -= 1
+
+    def stop(self):
+        self.stopping = True
+        self.server.close()
+
+
+class Tracker:
+    def __init__(self, index, args, rng, now):
+        self.index = index
+        self.sock = None
+        self.affected = rng.random() < args.outage_fraction
+        # Around the gps_sim.py default position, moving about
+        self.latitude = 57.7089 + rng.uniform(-0.2, 0.2)
+        self.longitude = 11.9746 + rng.uniform(-0.4, 0.4)
+        self.course = rng.uniform(0, 360)
+        self.battery = rng.uniform(3.7, 4.2)
+        self.next_due = now + rng.uniform(0, args.interval)
+
+    def frame(self, rng):
+        self.course = (self.course + rng.gauss(0, 20)) % 360
+        speed = max(0.0, rng.gauss(8, 4))
+        self.latitude += speed * math.cos(math.radians(self.course)) * 2e-6
+        self.longitude += speed * math.sin(math.radians(self.course)) * 4e-6
+        self.battery = max(3.4, self.battery - 0.0005)
+        percent = int(min(100, max(0, (self.battery - 3.4) / 0.8 * 100)))
+        return tracker_protocol.encode(tracker_protocol.Packet(
+            self.latitude, self.longitude, self.course, speed,
+            int(rng.uniform(70, 250)), int(rng.uniform(0, 3)), rng.randint(5, 12), self.battery, percent))
+
+
+class Fleet:
+    """A shard of the trackers, run by one sender thread."""
+
+    def __init__(self, trackers, args, address, pending, counters, outages, seed):
+        self.trackers = trackers
+        self.args = args
+        self.address = address
+        self.pending = pending
+        self.counters = counters
+        self.outages = outages
+        self.rng = random.Random(seed)
+        self.connect_times = []
+
+    def outage_end(self, when):
+        """End of the outage covering when, None if there is none."""
+        for start, end in self.outages:
+            if start <= when < end:
+                return end
+        return None
+
+    def connect(self, tracker):
+        start = time.monotonic()
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        sock.settimeout(10)
+        try:
+            sock.connect(self.address)
+        except OSError:
+            sock.close()
+            self.counters.add("connect_failures")
+            return False
+        self.connect_times.append(time.monotonic() - start)
+        self.counters.add("connects")
+        tracker.sock = sock
+        self.pending[sock.getsockname()] = collections.deque()
+        return True
+
+    def close(self, tracker, abrupt):
+        if not tracker.sock:
+            return
+        if abrupt:
+            # RST rather than FIN, as when the modem drops the bearer
+            tracker.sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+        tracker.sock.close()
+        tracker.sock = None
+
+    def send(self, tracker):
+        args = self.args
+        if not tracker.sock and not self.connect(tracker):
+            return
+
+        frame = tracker.frame(self.rng)
+        sent = self.pending[tracker.sock.getsockname()]
+        try:
+            if self.rng.random() < args.shut_rate:
+                tracker.sock.sendall(frame[:self.rng.randrange(len(frame))])
+                self.counters.add("shuts")
+                self.close(tracker, True)
+                return
+            sent.append(time.monotonic())
+            tracker.sock.sendall(frame)
+        except OSError:
+            self.counters.add("send_failures")
+            self.close(tracker, True)
+            return
+        self.counters.add("frames")
+        self.counters.add("bytes", len(frame))
+        if args.fresh:
+            self.close(tracker, False)
+
+    def run(self, deadline, stop):
+        args = self.args
+        queue = [(t.next_due, t.index, t) for t in self.trackers]
+        heapq.heapify(queue)
+
+        while queue and not stop.is_set():
+            due, _, tracker = queue[0]
+            now = time.monotonic()
+            if due > deadline:
+                break
+            if due > now:
+                stop.wait(min(due - now, 0.2))
+                continue
+            heapq.heappop(queue)
+
+            end = self.outage_end(now) if tracker.affected else None
+            if end is not None:
+                # The modem lost the cell, the session is gone and the
+                # report waits for the signal to come back
+                if tracker.sock:
+                    self.counters.add("outage_drops")
+                    self.close(tracker, True)
+                self.counters.add("deferred")
+                tracker.next_due = end + self.rng.uniform(0, args.storm_spread)
+            else:
+                self.send(tracker)
+                tracker.next_due = now + args.interval + self.rng.uniform(0, args.jitter)
+            heapq.heappush(queue, (tracker.next_due, tracker.index, tracker))
+
+        for tracker in self.trackers:
+            self.close(tracker, False)
+
+
+def raise_file_limit(needed):
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft != resource.RLIM_INFINITY and soft < needed:
+        target = needed if hard == resource.RLIM_INFINITY else min(needed, hard)
+        resource.setrlimit(resource.RLIMIT_NOFILE, (target, hard))
+        if target < needed:
+            log("open file limit %d, sessions beyond that fail to connect" % target)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("-n", "--trackers", type=int, default=1000)
+    parser.add_argument("--interval", type=float, default=20.0, help="seconds between frames, the UPLOAD_S setting")
+    parser.add_argument("--jitter", type=float, default=1.0, help="up to this many seconds late per frame")
+    parser.add_argument("--duration", type=float, default=60.0)
+    parser.add_argument("--threads", type=int, default=4, help="sender threads")
+    parser.add_argument("--receiver-threads", type=int, default=2)
+    parser.add_argument("--receiver", help="send to HOST:PORT instead of the built in receiver")
+    parser.add_argument("--fresh", action="store_true", help="a new session for every frame")
+    parser.add_argument("--shut-rate", type=float, default=0.01, help="share of sends torn down halfway")
+    parser.add_argument("--outage-every", type=float, help="seconds between cell outages")
+    parser.add_argument("--outage-at", type=float, help="seconds to the first outage, default --outage-every")
+    parser.add_argument("--outage-duration", type=float, default=30.0)
+    parser.add_argument("--outage-fraction", type=float, default=0.5, help="share of the fleet in the failing cell")
+    parser.add_argument("--storm-spread", type=float, default=10.0, help="seconds over which the cell reconnects")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--json", help="write the summary to this file")
+    args = parser.parse_args()
+
+    raise_file_limit(args.trackers * 2 + 64)
+
+    counters = Counters()
+    pending = {}
+    receiver = None
+    if args.receiver:
+        host, port = args.receiver.rsplit(":", 1)
+        address = (host, int(port))
+    else:
+        receiver = Receiver(args.receiver_threads, pending, counters)
+        address = receiver.address
+
+    start = time.monotonic()
+    deadline = start + args.duration
+    outages = []
+    if args.outage_every:
+        at = start + (args.outage_at if args.outage_at is not None else args.outage_every)
+        while at < deadline:
+            outages.append((at, at + args.outage_duration))
+            at += args.outage_every
+
+    rng = random.Random(args.seed)
+    trackers = [Tracker(i, args, rng, start) for i in range(args.trackers)]
+    fleets = [Fleet(trackers[i::args.threads], args, address, pending, counters, outages, args.seed + i + 1)
+              for i in range(args.threads)]
+    log("%d trackers, %d sender threads, receiver %s:%d, %d outages" % (
+        args.trackers, args.threads, address[0], address[1], len(outages)))
+
+    stop = threading.Event()
+    threads = [threading.Thread(target=f.run, args=(deadline, stop), daemon=True) for f in fleets]
+    for thread in threads:
+        thread.start()
+    try:
+        for thread in threads:
+            while thread.is_alive():
+                thread.join(0.5)
+    except KeyboardInterrupt:
+        stop.set()
+        for thread in threads:
+            thread.join()
+    elapsed = time.monotonic() - start
+
+    # Let the receiver catch up with what is still in the sockets
+    if receiver:
+        settle = time.monotonic() + 2
+        while counters["rx_frames"] < counters["frames"] and time.monotonic() < settle:
+            time.sleep(0.05)
+        receiver.stop()
+
+    connect_times = [t for f in fleets for t in f.connect_times]
+    summary = {
+        "trackers": args.trackers,
+        "elapsed_s": elapsed,
+        "frames_sent": counters["frames"],
+        "frames_per_s": counters["frames"] / elapsed,
+        "offered_frames_per_s": args.trackers / (args.interval + args.jitter / 2),
+        "connects": counters["connects"],
+        "connects_per_s": counters["connects"] / elapsed,
+        "connect_failures": counters["connect_failures"],
+        "connect_ms": {"p50": percentile(connect_times, 50) * 1000, "p99": percentile(connect_times, 99) * 1000},
+        "shuts": counters["shuts"],
+        "send_failures": counters["send_failures"],
+        "outage_drops": counters["outage_drops"],
+        "deferred": counters["deferred"],
+    }
+    if receiver:
+        with receiver.latency_lock:
+            latency = list(receiver.latency)
+        summary.update({
+            "frames_received": counters["rx_frames"],
+            "received_per_s": counters["rx_frames"] / elapsed,
+            "partial_frames": counters["rx_partial"],
+            "resets_seen": counters["rx_resets"],
+            "peak_sessions": receiver.peak_open,
+            "ingest_ms": {
+                "p50": percentile(latency, 50) * 1000,
+                "p99": percentile(latency, 99) * 1000,
+                "p999": percentile(latency, 99.9) * 1000,
+                "max": max(latency) * 1000 if latency else 0,
+            },
+        })
+
+    s = summary
+    print("\n=== fleet_load summary (%d trackers, %.1f s) ===" % (s["trackers"], s["elapsed_s"]), file=sys.stderr)
+    print("sent %d frames (%.1f/s of %.1f/s offered), %d deferred by outages" % (
+        s["frames_sent"], s["frames_per_s"], s["offered_frames_per_s"], s["deferred"]), file=sys.stderr)
+    print("connects %d (%.2f/s), %d failed, connect p50 %.2f ms p99 %.2f ms" % (
+        s["connects"], s["connects_per_s"], s["connect_failures"], s["connect_ms"]["p50"], s["connect_ms"]["p99"]), file=sys.stderr)
+    print("torn down: %d halfway through a send, %d by outages, %d send failures" % (
+        s["shuts"], s["outage_drops"], s["send_failures"]), file=sys.stderr)
+    if receiver:
+        print("received %d frames (%.1f/s), %d partial, %d resets, peak %d sessions" % (
+            s["frames_received"], s["received_per_s"], s["partial_frames"], s["resets_seen"], s["peak_sessions"]), file=sys.stderr)
+        print("ingest latency p50 %.2f ms p99 %.2f ms p999 %.2f ms max %.2f ms" % (
+            s["ingest_ms"]["p50"], s["ingest_ms"]["p99"], s["ingest_ms"]["p999"], s["ingest_ms"]["max"]), file=sys.stderr)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(summary, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
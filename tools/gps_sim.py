@@ -0,0 +1,225 @@
+#!/usr/bin/env python3
+"""MTK GPS receiver simulator for the native build.
+
+Serves one receiver on a TCP port, connect with GPS_PORT=tcp:127.0.0.1:7801.
+Every connection is a receiver power up: no fix until --ttff seconds have
+passed, then hdop converges from --start-hdop towards --hdop.
+
+Understands the PMTK commands gps_config.cpp sends: PMTK000 (test),
+PMTK314 (sentence filter), PMTK220 (update rate), PMTK251 (baud, which
+is accepted and otherwise ignored, there is no baud rate on a socket) and
+PMTK740/741 (time and position aiding, which cut the time to first fix to
+--warm-ttff when the aided position is within 100 km).
+
+    python3 tools/gps_sim.py --ttff 30 --lat 57.7089 --lon 11.9746
+"""
+
+import argparse
+import datetime
+import math
+import random
+import selectors
+import socket
+import sys
+import time
+
+# PMTK314 field order
+SENTENCES = ["GLL", "RMC", "VTG", "GGA", "GSA", "GSV"]
+
+
+def checksum(body):
+    value = 0
+    for c in body.encode("ascii"):
+        value ^= c
+    return "%02X" % value
+
+
+def sentence(body):
+    return "$%s*%s\r\n" % (body, checksum(body))
+
+
+def nmea_coordinate(value, lat):
+    hemisphere = ("N" if value >= 0 else "S") if lat else ("E" if value >= 0 else "W")
+    value = abs(value)
+    degrees = int(value)
+    minutes = (value - degrees) * 60
+    return ("%02d%07.4f" if lat else "%03d%07.4f") % (degrees, minutes), hemisphere
+
+
+class Receiver:
+    def __init__(self, conn, args, log):
+        self.conn = conn
+        self.args = args
+        self.log = log
+        self.rng = random.Random(args.seed)
+        self.started = time.monotonic()
+        self.enabled = {name: 1 for name in SENTENCES}
+        self.period = 1.0
+        self.next_fix = time.monotonic()
+        self.line = bytearray()
+        self.sent_bytes = 0
+        self.ttff = args.ttff
+        self.aided_time = False
+
+    def send(self, text):
+        data = text.encode("ascii")
+        self.sent_bytes += len(data)
+        self.conn.sendall(data)
+
+    def ack(self, command, flag=3):
+        self.send(sentence("PMTK001,%d,%d" % (command, flag)))
+
+    def receive(self, data):
+        for b in data:
+            if b in (0x0D, 0x0A):
+                if self.line:
+                    self.command(self.line.decode("ascii", "replace"))
+                    self.line.clear()
+            else:
+                self.line.append(b)
+
+    def command(self, line):
+        if not line.startswith("$PMTK") or "*" not in line:
+            return
+        body, cs = line[1:].split("*", 1)
+        if cs.strip().upper() != checksum(body):
+            self.ack(int(body[4:7]) if body[4:7].isdigit() else 0, 1)
+            return
+        self.log("<- %s" % line)
+        fields = body.split(",")
+        number = int(fields[0][4:])
+        if number == 0:
+            self.ack(0)
+        elif number == 314:
+            for i, name in enumerate(SENTENCES):
+                self.enabled[name] = int(fields[i + 1]) if i + 1 < len(fields) else 0
+            self.ack(314)
+        elif number == 220:
+            self.period = max(int(fields[1]), 100) / 1000.0
+            self.ack(220)
+        elif number == 251:
+            pass
+        elif number == 740:
+            self.aided_time = len(fields) == 7
+            self.ack(740, 3 if self.aided_time else 2)
+        elif number == 741:
+            try:
+                lat, lon = float(fields[1]), float(fields[2])
+            except (IndexError, ValueError):
+                self.ack(741, 2)
+                return
+            self.ack(741)
+            distance = math.hypot(lat - self.args.lat, (lon - self.args.lon) * math.cos(math.radians(lat))) * 111.0
+            if self.aided_time and distance < 100:
+                self.ttff = min(self.ttff, time.monotonic() - self.started + self.args.warm_ttff)
+                self.log("aided, %.1f km off, fix in %.1f s" % (distance, self.ttff))
+        else:
+            self.ack(number, 1)
+
+    def position(self, elapsed):
+        """Current fix or None, hdop converges after the first fix."""
+        args = self.args
+        if elapsed < self.ttff:
+            return None
+        since = elapsed - self.ttff
+        hdop = args.hdop + (args.start_hdop - args.hdop) * math.exp(-since / args.converge)
+        noise = hdop * 2.5e-6
+        return (args.lat + self.rng.gauss(0, noise), args.lon + self.rng.gauss(0, noise),
+                hdop, min(12, 4 + int(since / 5)))
+
+    def tick(self):
+        now = time.monotonic()
+        if now < self.next_fix:
+            return self.next_fix
+        self.next_fix += self.period
+
+        utc = datetime.datetime.utcnow()
+        stamp = utc.strftime("%H%M%S.") + "%03d" % (utc.microsecond // 1000)
+        fix = self.position(now - self.started)
+        out = ""
+
+        if fix:
+            lat, lat_h = nmea_coordinate(fix[0], True)
+            lon, lon_h = nmea_coordinate(fix[1], False)
+            if self.enabled["GGA"]:
+                out += sentence("GPGGA,%s,%s,%s,%s,%s,1,%02d,%.1f,12.0,M,40.0,M,," % (
+                    stamp, lat, lat_h, lon, lon_h, fix[3], fix[2]))
+            if self.enabled["RMC"]:
+                out += sentence("GPRMC,%s,A,%s,%s,%s,%s,0.10,0.00,%s,,,A" % (
+                    stamp, lat, lat_h, lon, lon_h, utc.strftime("%d%m%y")))
+            if self.enabled["GLL"]:
+                out += sentence("GPGLL,%s,%s,%s,%s,%s,A,A" % (lat, lat_h, lon, lon_h, stamp))
+        else:
+            if self.enabled["GGA"]:
+                out += sentence("GPGGA,%s,,,,,0,00,99.9,,M,,M,," % stamp)
+            if self.enabled["RMC"]:
+                out += sentence("GPRMC,%s,V,,,,,,,%s,,,N" % (stamp, utc.strftime("%d%m%y")))
+        if self.enabled["VTG"]:
+            out += sentence("GPVTG,0.00,T,,M,0.10,N,0.19,K,A")
+        if self.enabled["GSA"]:
+            out += sentence("GPGSA,A,%d,01,02,03,04,05,06,,,,,,,2.0,%.1f,1.8" % (3 if fix else 1, fix[2] if fix else 99.9))
+        if self.enabled["GSV"]:
+            for i in range(3):
+                out += sentence("GPGSV,3,%d,12,%02d,45,120,35,%02d,30,200,30,%02d,15,300,25,%02d,60,040,40" % (
+                    i + 1, i * 4 + 1, i * 4 + 2, i * 4 + 3, i * 4 + 4))
+        self.send(out)
+        return self.next_fix
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("-p", "--port", type=int, default=7801)
+    parser.add_argument("--lat", type=float, default=57.7089)
+    parser.add_argument("--lon", type=float, default=11.9746)
+    parser.add_argument("--ttff", type=float, default=30.0, help="seconds to first fix")
+    parser.add_argument("--warm-ttff", type=float, default=3.0, help="seconds to first fix after aiding")
+    parser.add_argument("--start-hdop", type=float, default=5.0)
+    parser.add_argument("--hdop", type=float, default=0.8, help="hdop the fix converges to")
+    parser.add_argument("--converge", type=float, default=10.0, help="hdop time constant, seconds")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    def log(text):
+        print("[gps_sim] %s" % text, file=sys.stderr, flush=True)
+
+    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    server.bind(("127.0.0.1", args.port))
+    server.listen(1)
+    selector = selectors.DefaultSelector()
+    selector.register(server, selectors.EVENT_READ)
+    receiver = None
+    log("listening on 127.0.0.1:%d" % args.port)
+
+    while True:
+        wait = 0.1
+        if receiver:
+            try:
+                wait = max(0.0, receiver.tick() - time.monotonic())
+            except OSError:
+                selector.unregister(receiver.conn)
+                receiver = None
+        for key, _ in selector.select(wait):
+            if key.fileobj is server:
+                conn, _ = server.accept()
+                if receiver:
+                    selector.unregister(receiver.conn)
+                    receiver.conn.close()
+                receiver = Receiver(conn, args, log)
+                selector.register(conn, selectors.EVENT_READ)
+                log("receiver powered up")
+            else:
+                try:
+                    data = key.fileobj.recv(4096)
+                except OSError:
+                    data = b""
+                if not data:
+                    selector.unregister(key.fileobj)
+                    receiver = None
+                    log("disconnected")
+                else:
+                    receiver.receive(data)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+"""Newest position of every device, for dispatchers asking where each unit is.
+
+The receiving side's counterpart of gps_get_position(). It is read far more
+often than reports arrive, so reads take no lock:
+
+- Every report becomes a new immutable Entry. The writer publishes it with a
+  single dict store, RCU style. A reader gets the old entry or the new one,
+  never a mix of both, and never waits for a writer.
+- Writers take a lock among themselves. A report that arrives after a newer
+  one of the same device is dropped, and every publish gets the next
+  generation number.
+- snapshot() reads the generation, then copies the table in one call. An
+  entry published in between shows up in this snapshot and again in the
+  next snapshot(since=generation), but none is missed. Pollers only fetch
+  what changed.
+
+With the GIL a dict store and a dict copy are single steps. Without the
+GIL, dict operations lock per dict, which gives the same guarantees.
+
+    python3 tools/latest_cache.py --devices 10000 --readers 4 --duration 5
+
+The benchmark publishes at the full fleet load, one report per device every
+--interval seconds, or as fast as it can with --interval 0. Meanwhile reader
+threads look devices up one by one and a thousand at a time, and check that
+no entry is torn.
+"""
+
+import argparse
+import collections
+import random
+import sys
+import threading
+import time
+
+import tracker_protocol
+
+Entry = collections.namedtuple("Entry", ("device", "received", "generation") + tracker_protocol.Packet._fields)
+
+
+class LatestCache:
+    def __init__(self):
+        self.entries = {}
+        self.generation = 0
+        self.write_lock = threading.Lock()
+
+    def publish(self, device, received, packet):
+        """received in seconds. False if a newer report is already in."""
+        with self.write_lock:
+            current = self.entries.get(device)
+            if current and current.received > received:
+                return False
+            self.generation += 1
+            self.entries[device] = Entry(device, received, self.generation, *packet)
+        return True
+
+    def get(self, device):
+        """Newest entry of the device, None before its first report."""
+        return self.entries.get(device)
+
+    def get_many(self, devices):
+        """Entries of a list of devices, looked up in one call."""
+        return list(map(self.entries.get, devices))
+
+    def snapshot(self, since=0):
+        """(generation, entries changed after since). Pass the generation to
+        the next call to get only what changed in between."""
+        generation = self.generation
+        entries = self.entries.copy()
+        return generation, [e for e in entries.values() if e.generation > since]
+
+    def __len__(self):
+        return len(self.entries)
+
+
+def packet_for(value):
+    """Every field derived from value, so a torn entry would show."""
+    return tracker_protocol.Packet(value, value, value, value, value, value, value, value, value)
+
+
+def torn(entry):
+    return any(v != entry.latitude for v in entry[3:])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--devices", type=int, default=10000)
+    parser.add_argument("--interval", type=float, default=20.0, help="seconds between reports per device, 0 for flat out")
+    parser.add_argument("--writers", type=int, default=2)
+    parser.add_argument("--readers", type=int, default=4)
+    parser.add_argument("--snapshot-every", type=float, default=1.0, help="seconds between incremental snapshots")
+    parser.add_argument("--duration", type=float, default=5.0)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    cache = LatestCache()
+    devices = ["tracker-%d" % i for i in range(args.devices)]
+    for device in devices:
+        cache.publish(device, 0.0, packet_for(0))
+
+    stop = threading.Event()
+    counts = collections.Counter()
+    counts_lock = threading.Lock()
+    snapshot_ms = []
+
+    def writer(index):
+        mine = devices[index::args.writers]
+        rate = len(mine) / args.interval if args.interval else 0
+        written = 0
+        start = time.monotonic()
+        value = 0
+        while not stop.is_set():
+            for device in mine:
+                value += 1
+                cache.publish(device, time.monotonic(), packet_for(value))
+                written += 1
+                # Paced in small batches, a sleep per report is too coarse
+                if rate and written % 64 == 0:
+                    ahead = written / rate - (time.monotonic() - start)
+                    if ahead > 0:
+                        stop.wait(ahead)
+                if stop.is_set():
+                    break
+        with counts_lock:
+            counts["writes"] += written
+
+    def reader(index):
+        rng = random.Random(args.seed + index)
+        order = devices[:]
+        rng.shuffle(order)
+        reads = bad = 0
+        while not stop.is_set():
+            # Single lookups, then the dispatcher's whole fleet at once
+            for device in order[:1000]:
+                if torn(cache.get(device)):
+                    bad += 1
+            reads += 1000
+            for start in range(0, len(order), 1000):
+                entries = cache.get_many(order[start:start + 1000])
+                bad += sum(1 for e in entries[::50] if torn(e))
+                reads += len(entries)
+        with counts_lock:
+            counts["reads"] += reads
+            counts["torn"] += bad
+
+    def poller():
+        since = cache.generation
+        while not stop.wait(args.snapshot_every):
+            start = time.perf_counter()
+            since, changed = cache.snapshot(since)
+            snapshot_ms.append((time.perf_counter() - start) * 1000)
+            with counts_lock:
+                counts["snapshot_entries"] += len(changed)
+
+    threads = [threading.Thread(target=writer, args=(i,)) for i in range(args.writers)]
+    threads += [threading.Thread(target=reader, args=(i,)) for i in range(args.readers)]
+    threads.append(threading.Thread(target=poller))
+    start = time.monotonic()
+    for thread in threads:
+        thread.start()
+    stop.wait(args.duration)
+    stop.set()
+    for thread in threads:
+        thread.join()
+    elapsed = time.monotonic() - start
+
+    start = time.perf_counter()
+    _, full = cache.snapshot()
+    full_ms = (time.perf_counter() - start) * 1000
+
+    offered = "%.0f/s offered" % (args.devices / args.interval) if args.interval else "flat out"
+    print("%d devices, %d writers, %d readers, %.1f s" % (args.devices, args.writers, args.readers, elapsed), file=sys.stderr)
+    print("writes %.0f/s (%s)" % (counts["writes"] / elapsed, offered), file=sys.stderr)
+    print("reads %.0f/s, %d torn" % (counts["reads"] / elapsed, counts["torn"]), file=sys.stderr)
+    if snapshot_ms:
+        snapshot_ms.sort()
+        print("incremental snapshot every %.1f s: p50 %.2f ms max %.2f ms, %.0f entries each" % (
+            args.snapshot_every, snapshot_ms[len(snapshot_ms) // 2], snapshot_ms[-1],
+            counts["snapshot_entries"] / len(snapshot_ms)), file=sys.stderr)
+    print("full snapshot of %d entries: %.2f ms" % (len(full), full_ms), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
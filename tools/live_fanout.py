@@ -0,0 +1,565 @@
+#!/usr/bin/env python3
+"""Pushes every position the trackers upload to live viewers, per device.
+
+Trackers in live mode (START LIVE) send a tcp_packet_t frame every UPLOAD_S
+seconds to the ingest port. Viewers connect to the viewer port, over plain
+TCP or WebSocket on the same port, and subscribe to devices:
+
+    SUB <device>      positions of one device, the newest one right away
+    SUB *             positions of every device
+    UNSUB <device>
+
+Over plain TCP these are lines, over WebSocket text messages. Positions come
+back as one JSON object per line or per text message. The device is the
+tracker's address; with --device-by-port it is address and port, for
+trackers simulated on one host.
+
+Each position is encoded once per transport. All subscribers share the same
+bytes and are sent slices of memoryviews of them, nothing is copied per
+viewer. A viewer that reads slower than positions arrive keeps at most one
+unsent position per device: a newer fix replaces the one still waiting, so
+a slow viewer sees fewer fixes rather than older ones, and memory stays
+bounded.
+
+    python3 tools/live_fanout.py --ingest-port 5195 --port 8080
+    python3 tools/sim800_emu.py --sink 127.0.0.1:5195 -- .pio/build/native/program
+
+    python3 tools/live_fanout.py bench --viewers 3000 --devices 1000 --interval 1
+
+The bench runs the server in a child process, feeds it synthetic positions
+and measures the added latency, from the position arriving to a viewer
+reading it, across the viewers. Some of the viewers never read, to show
+they cost the others nothing.
+"""
+
+import argparse
+import base64
+import collections
+import hashlib
+import json
+import multiprocessing
+import os
+import random
+import resource
+import selectors
+import socket
+import struct
+import sys
+import threading
+import time
+
+import latest_cache
+import tracker_protocol
+
+WEBSOCKET_GUID = b"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+MAX_REQUEST = 4096
+VIEWER_SEND_BUFFER = 64 * 1024
+
+
+def log(text):
+    print("[%9.3f] %s" % (time.monotonic() - START, text), file=sys.stderr, flush=True)
+
+
+START = time.monotonic()
+
+
+def websocket_frame(payload, opcode=0x1):
+    """Server to client, unmasked, so the same bytes suit every viewer."""
+    if len(payload) < 126:
+        header = struct.pack("!BB", 0x80 | opcode, len(payload))
+    elif len(payload) < 1 << 16:
+        header = struct.pack("!BBH", 0x80 | opcode, 126, len(payload))
+    else:
+        header = struct.pack("!BBQ", 0x80 | opcode, 127, len(payload))
+    return header + payload
+
+
+def websocket_parse(buffer):
+    """(opcode, payload, size) of the first whole client frame, None while
+    incomplete. Client frames are masked."""
+    if len(buffer) < 2:
+        return None
+    opcode = buffer[0] & 0x0F
+    length = buffer[1] & 0x7F
+    offset = 2
+    if length == 126:
+        if len(buffer) < 4:
+            return None
+        length = struct.unpack_from("!H", buffer, 2)[0]
+        offset = 4
+    elif length == 127:
+        if len(buffer) < 10:
+            return None
+        length = struct.unpack_from("!Q", buffer, 2)[0]
+        offset = 10
+    masked = buffer[1] & 0x80
+    mask = buffer[offset:offset + 4] if masked else b"\0\0\0\0"
+    offset += 4 if masked else 0
+    if len(buffer) < offset + length:
+        return None
+    payload = bytes(b ^ mask[i % 4] for i, b in enumerate(buffer[offset:offset + length]))
+    return opcode, payload, offset + length
+
+
+class Message:
+    """A position encoded for both transports, shared by all viewers."""
+
+    __slots__ = ("line", "websocket")
+
+    def __init__(self, entry):
+        body = json.dumps({
+            "device": entry.device,
+            "t": round(entry.received, 6),
+            "lat": round(entry.latitude, 6),
+            "lon": round(entry.longitude, 6),
+            "course": round(entry.course, 1),
+            "speed": round(entry.speed, 2),
+            "hdop": entry.hdop / 100.0,
+            "sats": entry.sats,
+            "age": entry.gps_age,
+            "bat_v": round(entry.battery_voltage, 2),
+            "bat_pct": entry.battery_percent,
+        }, separators=(",", ":")).encode()
+        self.line = body + b"\n"
+        self.websocket = websocket_frame(body)
+
+
+class Viewer:
+    def __init__(self, fanout, sock):
+        self.fanout = fanout
+        self.sock = sock
+        self.websocket = None  # Unknown until the first bytes
+        self.input = bytearray()
+        self.topics = set()
+        # Unsent positions, at most one per device, oldest first
+        self.pending = collections.OrderedDict()
+        self.current = None  # memoryview of the one being sent
+        self.writing = False
+        self.replaced = 0
+
+    def queue(self, device, message):
+        if device in self.pending:
+            self.replaced += 1
+            self.pending.move_to_end(device)
+        self.pending[device] = message.websocket if self.websocket else message.line
+
+    def queue_raw(self, data):
+        # Control replies go in front of positions, under a key of their own
+        self.pending[object()] = data
+        self.pending.move_to_end(next(reversed(self.pending)), last=False)
+
+    def flush(self):
+        """Sends what the socket takes, False if the viewer is gone."""
+        try:
+            while True:
+                if self.current is None:
+                    if not self.pending:
+                        break
+                    self.current = memoryview(self.pending.popitem(last=False)[1])
+                sent = self.sock.send(self.current)
+                self.current = self.current[sent:] if sent < len(self.current) else None
+        except BlockingIOError:
+            pass
+        except OSError:
+            return False
+
+        busy = self.current is not None or bool(self.pending)
+        if busy != self.writing:
+            self.writing = busy
+            self.fanout.selector.modify(self.sock, selectors.EVENT_READ | (selectors.EVENT_WRITE if busy else 0), self.on_event)
+        return True
+
+    def on_event(self, mask):
+        if mask & selectors.EVENT_WRITE and not self.flush():
+            self.fanout.drop(self)
+            return
+        if mask & selectors.EVENT_READ:
+            try:
+                data = self.sock.recv(4096)
+            except BlockingIOError:
+                return
+            except OSError:
+                data = b""
+            if not data or len(self.input) + len(data) > MAX_REQUEST:
+                self.fanout.drop(self)
+                return
+            self.input += data
+            self.parse()
+
+    def parse(self):
+        if self.websocket is None:
+            if not self.input.startswith(b"GET "[:len(self.input)]):
+                self.websocket = False
+            elif b"\r\n\r\n" in self.input:
+                self.handshake()
+            else:
+                return
+
+        if self.websocket:
+            while True:
+                frame = websocket_parse(self.input)
+                if not frame:
+                    break
+                opcode, payload, size = frame
+                del self.input[:size]
+                if opcode == 0x8:
+                    self.fanout.drop(self)
+                    return
+                if opcode == 0x9:
+                    self.queue_raw(websocket_frame(payload, 0xA))
+                elif opcode == 0x1:
+                    for line in payload.decode("utf-8", "replace").splitlines():
+                        self.command(line)
+        else:
+            while b"\n" in self.input:
+                line, _, rest = bytes(self.input).partition(b"\n")
+                self.input[:] = rest
+                self.command(line.decode("utf-8", "replace"))
+        if not self.flush():
+            self.fanout.drop(self)
+
+    def handshake(self):
+        request, _, rest = bytes(self.input).partition(b"\r\n\r\n")
+        self.input[:] = rest
+        key = None
+        for line in request.split(b"\r\n")[1:]:
+            name, _, value = line.partition(b":")
+            if name.strip().lower() == b"sec-websocket-key":
+                key = value.strip()
+        if not key:
+            self.websocket = False
+            self.queue_raw(b"HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n")
+            return
+        accept = base64.b64encode(hashlib.sha1(key + WEBSOCKET_GUID).digest())
+        self.websocket = True
+        self.queue_raw(b"HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                       b"Sec-WebSocket-Accept: " + accept + b"\r\n\r\n")
+
+    def command(self, line):
+        verb, _, device = line.strip().partition(" ")
+        device = device.strip()
+        if verb.upper() == "SUB" and device:
+            self.fanout.subscribe(self, device)
+        elif verb.upper() == "UNSUB" and device:
+            self.fanout.unsubscribe(self, device)
+
+
+class Fanout:
+    def __init__(self, port, ingest_port=None, device_by_port=False):
+        self.selector = selectors.DefaultSelector()
+        self.device_by_port = device_by_port
+        self.latest = latest_cache.LatestCache()
+        self.topics = collections.defaultdict(set)
+        self.everything = set()
+        self.viewers = set()
+        self.counts = collections.Counter()
+        self.inbox = collections.deque()
+
+        self.server = self.listen(port, self.on_viewer)
+        self.port = self.server.getsockname()[1]
+        self.ingest = self.listen(ingest_port, self.on_tracker) if ingest_port is not None else None
+        # Wakes the loop for positions published from other threads
+        self.wake_read, self.wake_write = socket.socketpair()
+        self.wake_read.setblocking(False)
+        self.wake_write.setblocking(False)
+        self.selector.register(self.wake_read, selectors.EVENT_READ, self.on_wake)
+
+    def listen(self, port, callback):
+        server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        server.bind(("127.0.0.1", port))
+        server.listen(1024)
+        server.setblocking(False)
+        self.selector.register(server, selectors.EVENT_READ, lambda mask: callback(server))
+        return server
+
+    # Viewers
+
+    def on_viewer(self, server):
+        try:
+            sock, _ = server.accept()
+        except BlockingIOError:
+            return
+        sock.setblocking(False)
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        # A small kernel buffer, so a slow viewer gets to skipping fixes
+        # before it falls seconds behind
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_SNDBUF, VIEWER_SEND_BUFFER)
+        viewer = Viewer(self, sock)
+        self.viewers.add(viewer)
+        self.selector.register(sock, selectors.EVENT_READ, viewer.on_event)
+
+    def subscribe(self, viewer, device):
+        viewer.topics.add(device)
+        if device == "*":
+            self.everything.add(viewer)
+            _, entries = self.latest.snapshot()
+        else:
+            self.topics[device].add(viewer)
+            entry = self.latest.get(device)
+            entries = [entry] if entry else []
+        for entry in entries:
+            viewer.queue(entry.device, Message(entry))
+
+    def unsubscribe(self, viewer, device):
+        viewer.topics.discard(device)
+        if device == "*":
+            self.everything.discard(viewer)
+        elif viewer in self.topics.get(device, ()):
+            self.topics[device].discard(viewer)
+            if not self.topics[device]:
+                del self.topics[device]
+
+    def drop(self, viewer):
+        if viewer not in self.viewers:
+            return
+        for device in list(viewer.topics):
+            self.unsubscribe(viewer, device)
+        self.viewers.discard(viewer)
+        self.counts["replaced"] += viewer.replaced
+        self.selector.unregister(viewer.sock)
+        viewer.sock.close()
+
+    # Positions
+
+    def publish(self, device, received, packet):
+        """On the loop's thread."""
+        if not self.latest.publish(device, received, packet):
+            self.counts["late"] += 1
+            return
+        viewers = self.topics.get(device)
+        if not viewers and not self.everything:
+            return
+        message = Message(self.latest.get(device))
+        self.counts["published"] += 1
+        for viewer in list(viewers or ()) + list(self.everything):
+            viewer.queue(device, message)
+            if not viewer.writing and not viewer.flush():
+                self.drop(viewer)
+
+    def publish_threadsafe(self, device, received, packet):
+        self.inbox.append((device, received, packet))
+        try:
+            self.wake_write.send(b"\0")
+        except BlockingIOError:
+            pass
+
+    def on_wake(self, mask):
+        try:
+            self.wake_read.recv(4096)
+        except BlockingIOError:
+            pass
+        while self.inbox:
+            self.publish(*self.inbox.popleft())
+
+    # Trackers
+
+    def on_tracker(self, server):
+        try:
+            sock, peer = server.accept()
+        except BlockingIOError:
+            return
+        sock.setblocking(False)
+        device = "%s:%d" % peer if self.device_by_port else peer[0]
+        reader = tracker_protocol.FrameReader()
+        self.selector.register(sock, selectors.EVENT_READ, lambda mask: self.on_frames(sock, device, reader))
+
+    def on_frames(self, sock, device, reader):
+        try:
+            data = sock.recv(4096)
+        except BlockingIOError:
+            return
+        except OSError:
+            data = b""
+        if not data:
+            self.selector.unregister(sock)
+            sock.close()
+            return
+        for packet in reader.feed(data):
+            self.publish(device, time.time(), packet)
+
+    def run(self, stop):
+        while not stop.is_set():
+            for key, mask in self.selector.select(0.2):
+                key.data(mask)
+
+
+def raise_file_limit(needed):
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft != resource.RLIM_INFINITY and soft < needed:
+        resource.setrlimit(resource.RLIMIT_NOFILE, (needed if hard == resource.RLIM_INFINITY else min(needed, hard), hard))
+
+
+# Benchmark
+
+def bench_server(port_pipe, devices, interval, duration, seed):
+    """Child process, the fan-out and a feeder publishing every device once
+    per interval, spread evenly."""
+    raise_file_limit(65536)
+    fanout = Fanout(0)
+    port_pipe.send(fanout.port)
+    stop = threading.Event()
+
+    def feed():
+        rng = random.Random(seed)
+        positions = [(57.7 + rng.uniform(-0.3, 0.3), 11.97 + rng.uniform(-0.5, 0.5)) for _ in range(devices)]
+        # Viewers connect and subscribe first
+        port_pipe.recv()
+        start = time.monotonic()
+        n = 0
+        while not stop.is_set():
+            ahead = start + n * interval / devices - time.monotonic()
+            if ahead > 0:
+                time.sleep(ahead)
+            index = n % devices
+            lat, lon = positions[index]
+            fanout.publish_threadsafe("tracker-%d" % index, time.time(),
+                                      tracker_protocol.Packet(lat, lon, 90.0, 10.0, 120, 1, 8, 4.0, 75))
+            n += 1
+
+    thread = threading.Thread(target=feed, daemon=True)
+    thread.start()
+    timer = threading.Timer(duration, stop.set)
+    timer.start()
+    fanout.run(stop)
+    for viewer in list(fanout.viewers):
+        fanout.counts["replaced"] += viewer.replaced
+    port_pipe.send(dict(fanout.counts))
+
+
+def bench(args):
+    raise_file_limit(args.viewers * 2 + 256)
+    parent, child = multiprocessing.Pipe()
+    server = multiprocessing.Process(target=bench_server, args=(child, args.devices, args.interval, args.duration + 2, args.seed))
+    server.start()
+    port = parent.recv()
+
+    rng = random.Random(args.seed)
+    selector = selectors.DefaultSelector()
+    latency = []
+    received = collections.Counter()
+    viewers = []
+    for i in range(args.viewers):
+        slow = i >= args.viewers - args.slow
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        if slow:
+            # Never read, the server's send buffer for it fills up
+            sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        sock.connect(("127.0.0.1", port))
+        websocket = i < args.viewers * args.websocket_share
+        topic = "*" if slow or i % args.wildcard_every == 0 else "tracker-%d" % rng.randrange(args.devices)
+        if websocket:
+            sock.sendall(b"GET / HTTP/1.1\r\nHost: x\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                         b"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n")
+            payload = ("SUB %s" % topic).encode()
+            mask = os.urandom(4)
+            sock.sendall(struct.pack("!BB", 0x81, 0x80 | len(payload)) + mask +
+                         bytes(b ^ mask[j % 4] for j, b in enumerate(payload)))
+        else:
+            sock.sendall(("SUB %s\n" % topic).encode())
+        if slow:
+            viewers.append(sock)
+            continue
+        sock.setblocking(False)
+        state = {"websocket": websocket, "buffer": bytearray(), "upgraded": not websocket}
+        selector.register(sock, selectors.EVENT_READ, state)
+        viewers.append(sock)
+    parent.send("go")
+
+    def messages(state):
+        buffer = state["buffer"]
+        if not state["upgraded"]:
+            end = buffer.find(b"\r\n\r\n")
+            if end < 0:
+                return
+            del buffer[:end + 4]
+            state["upgraded"] = True
+        while True:
+            if state["websocket"]:
+                frame = websocket_parse(buffer)
+                if not frame:
+                    return
+                _, payload, size = frame
+                del buffer[:size]
+                yield payload
+            else:
+                end = buffer.find(b"\n")
+                if end < 0:
+                    return
+                payload = bytes(buffer[:end])
+                del buffer[:end + 1]
+                yield payload
+
+    deadline = time.monotonic() + args.duration
+    warmup = time.monotonic() + 1
+    while time.monotonic() < deadline:
+        for key, _ in selector.select(0.1):
+            state = key.data
+            try:
+                data = key.fileobj.recv(65536)
+            except BlockingIOError:
+                continue
+            now = time.time()
+            if not data:
+                selector.unregister(key.fileobj)
+                continue
+            state["buffer"] += data
+            for payload in messages(state):
+                # The first messages are the latest state on subscribing
+                if time.monotonic() > warmup:
+                    latency.append(now - json.loads(payload)["t"])
+                received["websocket" if state["websocket"] else "tcp"] += 1
+
+    counts = parent.recv()
+    server.join()
+    for sock in viewers:
+        sock.close()
+
+    latency.sort()
+
+    def at(p):
+        return latency[min(len(latency) - 1, int(len(latency) * p))] * 1000 if latency else 0
+
+    print("%d viewers (%d WebSocket, every %dth on all devices, %d never reading), %d devices every %.1f s" % (
+        args.viewers, int(args.viewers * args.websocket_share), args.wildcard_every, args.slow, args.devices, args.interval),
+        file=sys.stderr)
+    print("delivered %.0f/s (tcp %d, websocket %d), published %d, replaced for slow viewers %d" % (
+        sum(received.values()) / args.duration, received["tcp"], received["websocket"],
+        counts.get("published", 0), counts.get("replaced", 0)), file=sys.stderr)
+    print("added latency p50 %.2f ms p99 %.2f ms p999 %.2f ms max %.2f ms" % (at(0.5), at(0.99), at(0.999), at(1.0)),
+          file=sys.stderr)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--port", type=int, default=8080, help="viewer port, TCP lines or WebSocket")
+    parser.add_argument("--ingest-port", type=int, default=5195, help="port the trackers send frames to")
+    parser.add_argument("--device-by-port", action="store_true", help="tell trackers apart by address and port")
+    commands = parser.add_subparsers(dest="command")
+    p = commands.add_parser("bench", help="latency with many viewers")
+    p.add_argument("--viewers", type=int, default=2000)
+    p.add_argument("--devices", type=int, default=1000)
+    p.add_argument("--interval", type=float, default=1.0, help="seconds between positions per device")
+    p.add_argument("--websocket-share", type=float, default=0.25)
+    p.add_argument("--wildcard-every", type=int, default=200, help="every n-th viewer follows all devices")
+    p.add_argument("--slow", type=int, default=20, help="viewers of all devices that never read")
+    p.add_argument("--duration", type=float, default=10.0)
+    p.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    if args.command == "bench":
+        bench(args)
+        return
+
+    raise_file_limit(65536)
+    fanout = Fanout(args.port, args.ingest_port, args.device_by_port)
+    log("viewers on 127.0.0.1:%d, trackers on 127.0.0.1:%d" % (args.port, args.ingest_port))
+    stop = threading.Event()
+    try:
+        fanout.run(stop)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
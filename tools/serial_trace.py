@@ -0,0 +1,267 @@
+#!/usr/bin/env python3
+"""Serial traces from firmware built with SERIAL_TRACE=1, see include/trace.h.
+
+Capture from the unit's hardware UART, look at a trace, and replay it
+through the native build. The native build records one itself with
+HOST_TRACE=file, which is appended to, one boot after the other.
+
+    python3 tools/serial_trace.py capture /dev/ttyUSB0 -o field.trace
+    python3 tools/serial_trace.py stats field.trace
+    python3 tools/serial_trace.py dump field.trace --boot 2 --start 600 --end 660
+    python3 tools/serial_trace.py replay field.trace --boot 2 -- .pio/build/native/program
+
+A replay runs the firmware on a virtual clock, fed with what was read in
+the recording at the time it was read, and compares what it sends with
+what was sent then, see lib/host/HostReplay.h. Receive overflows in the
+recording are reported where they happened, the bytes lost in them were
+never traced and the firmware does not get them either. It gives the same result
+every time and exits 1 if any line differed, so a trace of a field problem
+doubles as a regression test. The EEPROM starts out blank unless --eeprom
+gives an image of the unit's.
+"""
+
+import argparse
+import collections
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+MAGIC = b"ST"
+VERSION = 2
+RECORD_MAX = 16
+CHANNELS = ("GPS<", "GPS>", "GSM<", "GSM>")  # < read by the firmware, > sent
+
+# data is None for a receive overflow on the channel
+Record = collections.namedtuple("Record", ["time", "channel", "data"])
+
+
+def log(text):
+    print("[serial_trace] %s" % text, file=sys.stderr, flush=True)
+
+
+def split_boots(trace):
+    """The trace as (offset, bytes) of each boot, junk before the first dropped."""
+    boots = []
+    at = trace.find(MAGIC + bytes([VERSION]))
+    while at >= 0:
+        records, end = parse(trace, at + 3)
+        boots.append((at, trace[at:end]))
+        at = trace.find(MAGIC + bytes([VERSION]), end)
+    return boots
+
+
+def parse(trace, at=3):
+    """Records from at up to the next boot or the end, and where they stop."""
+    records = []
+    now = 0
+    while at < len(trace):
+        tag = trace[at]
+        length = tag & 0x3F
+        if length > RECORD_MAX:
+            break
+        pos = at + 1
+        delta = shift = 0
+        while pos < len(trace):
+            b = trace[pos]
+            pos += 1
+            delta |= (b & 0x7F) << shift
+            shift += 7
+            if not b & 0x80:
+                break
+        if pos + length > len(trace):
+            break
+        now += delta
+        records.append(Record(now, tag >> 6, trace[pos:pos + length] if length else None))
+        at = pos + length
+    return records, at
+
+
+def load(path, boot):
+    with open(path, "rb") as f:
+        trace = f.read()
+    boots = split_boots(trace)
+    if not boots:
+        sys.exit("%s: no trace in it" % path)
+    if not 1 <= boot <= len(boots):
+        sys.exit("%s: boot %d of %d" % (path, boot, len(boots)))
+    return boots[boot - 1][1]
+
+
+def escape(data):
+    out = ""
+    for b in data:
+        if b == 0x0D:
+            out += "\\r"
+        elif b == 0x0A:
+            out += "\\n"
+        elif 0x20 <= b < 0x7F:
+            out += chr(b)
+        else:
+            out += "\\x%02x" % b
+    return out
+
+
+def cmd_capture(args):
+    import termios
+    import tty
+
+    fd = os.open(args.device, os.O_RDONLY | os.O_NOCTTY)
+    tty.setraw(fd)
+    attrs = termios.tcgetattr(fd)
+    speed = getattr(termios, "B%d" % args.baud)
+    attrs[4] = attrs[5] = speed
+    termios.tcsetattr(fd, termios.TCSANOW, attrs)
+
+    total = 0
+    start = time.monotonic()
+    log("capturing %s at %d baud to %s" % (args.device, args.baud, args.output))
+    with open(args.output, "ab") as out:
+        try:
+            while not args.duration or time.monotonic() - start < args.duration:
+                data = os.read(fd, 4096)
+                out.write(data)
+                out.flush()
+                total += len(data)
+        except KeyboardInterrupt:
+            pass
+    log("%d bytes in %.0f s" % (total, time.monotonic() - start))
+
+
+def cmd_stats(args):
+    with open(args.trace, "rb") as f:
+        trace = f.read()
+    result = []
+    for index, (offset, data) in enumerate(split_boots(trace)):
+        records, _ = parse(data)
+        counts = [0] * 4
+        overflows = [0] * 4
+        for r in records:
+            if r.data is None:
+                overflows[r.channel] += 1
+            else:
+                counts[r.channel] += len(r.data)
+        duration = records[-1].time / 1000.0 if records else 0
+        payload = sum(counts)
+        result.append({
+            "boot": index + 1,
+            "offset": offset,
+            "duration_s": duration,
+            "records": len(records),
+            "bytes": dict(zip(CHANNELS, counts)),
+            "overflows": {"GPS": overflows[0], "GSM": overflows[2]},
+            "trace_bytes": len(data),
+            "overhead": (len(data) - payload) / payload if payload else 0,
+        })
+        print("boot %d at byte %d: %.1f s, %d records, %d bytes (%.0f%% overhead), %s, overflows GPS %d GSM %d" % (
+            index + 1, offset, duration, len(records), len(data), result[-1]["overhead"] * 100,
+            ", ".join("%s %d" % (name, count) for name, count in zip(CHANNELS, counts)),
+            overflows[0], overflows[2]))
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(result, f, indent=2)
+
+
+def cmd_dump(args):
+    records, _ = parse(load(args.trace, args.boot))
+    wanted = [i for i, name in enumerate(CHANNELS) if not args.port or name.startswith(args.port.upper())]
+    line = None  # (time, channel, bytes) until a newline or another channel
+    for r in records:
+        if r.channel not in wanted or r.time < args.start * 1000 or (args.end and r.time > args.end * 1000):
+            continue
+        if r.data is None:
+            if line:
+                print("%10.3f %s %s" % (line[0] / 1000.0, CHANNELS[line[1]], escape(line[2])))
+                line = None
+            print("%10.3f %s overflow, bytes lost" % (r.time / 1000.0, CHANNELS[r.channel]))
+            continue
+        for b in r.data:
+            if line and line[1] != r.channel:
+                print("%10.3f %s %s" % (line[0] / 1000.0, CHANNELS[line[1]], escape(line[2])))
+                line = None
+            if not line:
+                line = (r.time, r.channel, bytearray())
+            line[2].append(b)
+            if b == 0x0A:
+                print("%10.3f %s %s" % (line[0] / 1000.0, CHANNELS[line[1]], escape(line[2])))
+                line = None
+    if line:
+        print("%10.3f %s %s" % (line[0] / 1000.0, CHANNELS[line[1]], escape(line[2])))
+
+
+def cmd_replay(args):
+    firmware = args.firmware
+    if not firmware:
+        sys.exit("replay: give the native build after --")
+    work = tempfile.mkdtemp(prefix="replay")
+    try:
+        trace = os.path.join(work, "trace")
+        with open(trace, "wb") as f:
+            f.write(load(args.trace, args.boot))
+        eeprom = os.path.join(work, "eeprom")
+        if args.eeprom:
+            shutil.copy(args.eeprom, eeprom)
+        report = os.path.join(work, "report.json")
+        env = dict(os.environ, HOST_REPLAY=trace, HOST_REPLAY_REPORT=report, HOST_EEPROM=eeprom)
+        env.pop("HOST_TRACE", None)
+        output = subprocess.DEVNULL if args.quiet else None
+        status = subprocess.call(firmware, env=env, stdout=output)
+        if not os.path.exists(report):
+            sys.exit("replay: the firmware ended without a report, status %d" % status)
+        with open(report) as f:
+            summary = json.load(f)
+    finally:
+        shutil.rmtree(work)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(summary, f, indent=2)
+    sys.exit(status)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    p = commands.add_parser("capture", help="record the trace a unit sends")
+    p.add_argument("device")
+    p.add_argument("-o", "--output", required=True, help="appended to")
+    p.add_argument("--baud", type=int, default=115200)
+    p.add_argument("--duration", type=float, help="seconds, until ^C without")
+    p.set_defaults(run=cmd_capture)
+
+    p = commands.add_parser("stats", help="size and duration of each boot")
+    p.add_argument("trace")
+    p.add_argument("--json", help="write the same to this file")
+    p.set_defaults(run=cmd_stats)
+
+    p = commands.add_parser("dump", help="the traffic as text lines")
+    p.add_argument("trace")
+    p.add_argument("--boot", type=int, default=1)
+    p.add_argument("--port", choices=("gps", "gsm"))
+    p.add_argument("--start", type=float, default=0, help="seconds after boot")
+    p.add_argument("--end", type=float)
+    p.set_defaults(run=cmd_dump)
+
+    p = commands.add_parser("replay", help="run a boot of the trace through the native build")
+    p.add_argument("trace")
+    p.add_argument("--boot", type=int, default=1)
+    p.add_argument("--eeprom", help="EEPROM image to start from, copied first")
+    p.add_argument("--json", help="write the replay's summary to this file")
+    p.add_argument("-q", "--quiet", action="store_true", help="drop the firmware's debug output")
+    p.set_defaults(run=cmd_replay)
+
+    # The native build and its arguments follow --
+    argv = sys.argv[1:]
+    firmware = []
+    if "--" in argv:
+        argv, firmware = argv[:argv.index("--")], argv[argv.index("--") + 1:]
+    args = parser.parse_args(argv)
+    args.firmware = firmware
+    args.run(args)
+
+
+if __name__ == "__main__":
+    main()
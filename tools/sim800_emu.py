@@ -0,0 +1,981 @@
+#!/usr/bin/env python3
+"""SIM800 emulator for the AT subset used by src/gsm.cpp.
+
+Serves one modem on a TCP port. The native build connects to it with
+GSM_PORT=tcp:127.0.0.1:7800. Every new connection is a power cycled modem,
+unless --keep-modem has it run on through the reset of the MCU that the
+reconnect stands for.
+
+Per command latency, injected errors, dropped bytes, URCs, incoming SMS,
+calls and network outages are scripted with a JSON scenario, see
+tools/scenarios/*.json. Bytes sent with CIPSEND go over a real TCP
+connection to a sink, by default one built into the emulator that decodes
+the tracker frames.
+
+End to end benchmark against the native build:
+
+    python3 tools/sim800_emu.py -s tools/scenarios/bad_network.json \\
+        --duration 600 -- .pio/build/native/program
+
+With a fixed seed the injected faults are repeatable. On exit a summary of
+modem latency, driver turnaround per command and delivered frames is
+printed, --json writes the same data for comparing runs.
+"""
+
+import argparse
+import json
+import math
+import os
+import random
+import re
+import selectors
+import signal
+import socket
+import subprocess
+import sys
+import time
+
+import sms_batch
+import track_store
+import tracker_protocol
+
+DEFAULT_SCENARIO = {
+    "seed": 1,
+    # Modem side latency per command, from the end of the command line to
+    # the final result code. Keys are tried as the full command, then the
+    # command name, then "default".
+    "latency": {
+        "default": {"fixed": 20},
+        "AT+CFUN": {"uniform": [100, 400]},
+        "AT+CMGS": {"lognormal": {"median": 3000, "sigma": 0.4}},
+        "AT+SAPBR=1,1": {"lognormal": {"median": 2000, "sigma": 0.5}},
+        "AT+CIPSTART": {"lognormal": {"median": 1500, "sigma": 0.5}},
+        "AT+CIPSEND": {"lognormal": {"median": 400, "sigma": 0.5}},
+        "AT+CIPSHUT": {"uniform": [200, 800]},
+        "AT+CIPGSMLOC": {"lognormal": {"median": 3000, "sigma": 0.4}},
+        "prompt": {"fixed": 20},
+    },
+    # Probability that a command fails, and that it is never answered
+    "error_rate": {},
+    "no_reply_rate": {},
+    # Probability that a byte from the modem to the MCU is lost
+    "drop_rate": 0.0,
+    "battery": {"percent": 85, "millivolts": 4100},
+    # Seconds after power up until the modem answers AT, reports Call Ready
+    # and SMS Ready and is registered. With autobaud the URCs only come once
+    # an AT has been seen.
+    "boot": {"at_ready": 2.5, "call_ready": 6.0, "sms_ready": 8.0, "registered": 7.0},
+    # AT+CSQ rssi. Below weak_below, uploads and SMS fail with
+    # weak_error_rate and take weak_latency_factor times longer.
+    "signal": {"rssi": 20, "weak_below": 8, "weak_error_rate": 0.5, "weak_latency_factor": 3},
+    # Serving cell for AT+CENG? and where AT+CIPGSMLOC places it, "ta" is
+    # the timing advance. A cell without a position is not found (601).
+    "cell": {"mcc": 240, "mnc": 7, "lac": 0x8A3B, "cellid": 0x3A17, "ta": 2,
+             "latitude": 59.334591, "longitude": 18.063240},
+    # Timed events, "at" is seconds after the connection. Events can repeat
+    # with "every". Kinds: urc, sms, call, bearer_drop, outage, fade (the
+    # signal drops to "rssi" for "duration" seconds), handover (the fields
+    # given in "cell" replace those of the serving cell).
+    "events": [],
+}
+
+# Device name of the emulated tracker in a --store
+STORE_DEVICE = "sim800_emu"
+
+OUTAGE_COMMANDS = ("AT+SAPBR=1,1", "AT+CIPSTART", "AT+CIPSEND", "AT+CMGS")
+
+
+def percentile(samples, p):
+    if not samples:
+        return 0.0
+    ordered = sorted(samples)
+    k = (len(ordered) - 1) * p / 100.0
+    lo = math.floor(k)
+    hi = math.ceil(k)
+    return ordered[lo] + (ordered[hi] - ordered[lo]) * (k - lo)
+
+
+class Distribution:
+    def __init__(self, spec, rng):
+        self.spec = spec
+        self.rng = rng
+
+    def sample(self):
+        """Returns a delay in seconds."""
+        spec = self.spec
+        if "fixed" in spec:
+            ms = spec["fixed"]
+        elif "uniform" in spec:
+            ms = self.rng.uniform(*spec["uniform"])
+        elif "lognormal" in spec:
+            ms = self.rng.lognormvariate(math.log(spec["lognormal"]["median"]), spec["lognormal"]["sigma"])
+        elif "exp" in spec:
+            ms = self.rng.expovariate(1.0 / spec["exp"])
+        else:
+            raise ValueError("unknown distribution %r" % spec)
+        return max(ms, 0) / 1000.0
+
+
+class Stats:
+    def __init__(self):
+        self.commands = {}
+        self.frames = 0
+        self.frame_bytes = 0
+        self.frame_latency = []
+        self.sms_sent = 0
+        self.sms_delivered = 0
+        self.sms_binary = 0  # Of sms_sent, in PDU mode
+        self.sms_bytes = 0
+        self.sms_fixes = 0
+        self.sms_parts = 0  # Of sms_sent, parts of a concatenated text
+        self.sms_long = 0  # Concatenated texts with all their parts
+        self.calls_answered = 0
+        self.call_latency = []
+        self.lines = 0  # Command lines, a batch of commands is one
+        self.dropped_bytes = 0
+        self.connections = 0
+        self.tcp_connects = 0
+        self.started = time.monotonic()
+        self.powered_up = None
+        self.first_frame = None
+
+    def command(self, key):
+        if key not in self.commands:
+            self.commands[key] = {"count": 0, "errors": 0, "no_reply": 0, "modem": [], "turnaround": []}
+        return self.commands[key]
+
+    def summary(self):
+        elapsed = time.monotonic() - self.started
+        result = {
+            "elapsed_s": elapsed,
+            "connections": self.connections,
+            "tcp_connects": self.tcp_connects,
+            "frames": self.frames,
+            "frames_per_min": self.frames * 60.0 / elapsed if elapsed else 0,
+            "frame_bytes_per_s": self.frame_bytes / elapsed if elapsed else 0,
+            "frame_latency_ms": {
+                "p50": percentile(self.frame_latency, 50) * 1000,
+                "p99": percentile(self.frame_latency, 99) * 1000,
+            },
+            "first_frame_s": self.first_frame - self.powered_up if self.first_frame else None,
+            "sms_sent": self.sms_sent,
+            "sms_binary": self.sms_binary,
+            "sms_binary_bytes": self.sms_bytes,
+            "sms_binary_fixes": self.sms_fixes,
+            "sms_parts": self.sms_parts,
+            "sms_long": self.sms_long,
+            "calls_answered": self.calls_answered,
+            "call_latency_ms": {
+                "p50": percentile(self.call_latency, 50) * 1000,
+                "max": max(self.call_latency) * 1000 if self.call_latency else 0,
+            },
+            "dropped_bytes": self.dropped_bytes,
+            "command_lines": self.lines,
+            "commands": {},
+        }
+        for key, c in sorted(self.commands.items()):
+            result["commands"][key] = {
+                "count": c["count"],
+                "errors": c["errors"],
+                "no_reply": c["no_reply"],
+                "modem_p50_ms": percentile(c["modem"], 50) * 1000,
+                "turnaround_p50_ms": percentile(c["turnaround"], 50) * 1000,
+                "turnaround_p99_ms": percentile(c["turnaround"], 99) * 1000,
+                "turnaround_max_ms": max(c["turnaround"]) * 1000 if c["turnaround"] else 0,
+            }
+        return result
+
+    def print(self, out=sys.stderr):
+        s = self.summary()
+        print("\n=== sim800_emu summary (%.1f s) ===" % s["elapsed_s"], file=out)
+        print("connections %d, tcp connects %d, frames %d (%.1f/min, %.1f B/s), "
+              "frame latency p50 %.0f ms p99 %.0f ms" % (
+                  s["connections"], s["tcp_connects"], s["frames"], s["frames_per_min"],
+                  s["frame_bytes_per_s"], s["frame_latency_ms"]["p50"], s["frame_latency_ms"]["p99"]), file=out)
+        print("sms sent %d, calls answered %d, dropped bytes %d, first frame %s" % (
+            s["sms_sent"], s["calls_answered"], s["dropped_bytes"],
+            "%.1f s after power up" % s["first_frame_s"] if s["first_frame_s"] is not None else "never"), file=out)
+        if self.sms_binary:
+            print("binary sms %d, %d bytes, %d fixes (%.1f per sms)" % (
+                s["sms_binary"], s["sms_binary_bytes"], s["sms_binary_fixes"],
+                s["sms_binary_fixes"] / s["sms_binary"]), file=out)
+        if self.sms_parts:
+            print("concatenated sms %d, in %d parts" % (s["sms_long"], s["sms_parts"]), file=out)
+        if self.call_latency:
+            print("calls picked up (first RING to AT+CLCC) p50 %.0f ms max %.0f ms" % (
+                s["call_latency_ms"]["p50"], s["call_latency_ms"]["max"]), file=out)
+        print("command lines %d, %d commands" % (
+            s["command_lines"], sum(c["count"] for c in s["commands"].values())), file=out)
+        print("%-32s %6s %6s %6s %10s %10s %10s %10s" % (
+            "command", "count", "err", "noreply", "modem p50", "turn p50", "turn p99", "turn max"), file=out)
+        for key, c in s["commands"].items():
+            print("%-32s %6d %6d %6d %10.0f %10.0f %10.0f %10.0f" % (
+                key[:32], c["count"], c["errors"], c["no_reply"], c["modem_p50_ms"],
+                c["turnaround_p50_ms"], c["turnaround_p99_ms"], c["turnaround_max_ms"]), file=out)
+
+
+class Sink:
+    """Built in TCP sink, decodes tracker frames as they arrive."""
+
+    def __init__(self, loop, stats, quiet, uplink_stats, store=None):
+        self.loop = loop
+        self.stats = stats
+        self.quiet = quiet
+        self.uplink_stats = uplink_stats
+        self.store = store
+        self.server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.server.bind(("127.0.0.1", 0))
+        self.server.listen(8)
+        self.server.setblocking(False)
+        self.address = self.server.getsockname()
+        loop.register(self.server, self.accept)
+        # Times the MCU finished CIPSEND payloads still in flight
+        self.pending = []
+
+    def accept(self, sock):
+        conn, _ = sock.accept()
+        conn.setblocking(False)
+        reader = tracker_protocol.FrameReader(self.uplink_stats)
+        self.loop.register(conn, lambda c: self.receive(c, reader))
+
+    def receive(self, conn, reader):
+        try:
+            data = conn.recv(4096)
+        except OSError:
+            data = b""
+        if not data:
+            self.loop.unregister(conn)
+            conn.close()
+            return
+        for frame in reader.feed(data):
+            if self.uplink_stats:
+                frame, modem_stats = frame
+                if not self.quiet:
+                    log("sink: %r" % (modem_stats,))
+            self.stats.frames += 1
+            if self.store:
+                self.store.append(STORE_DEVICE, int(time.time()), frame)
+            self.stats.frame_bytes += reader.size
+            if self.stats.first_frame is None:
+                self.stats.first_frame = time.monotonic()
+            if self.pending:
+                self.stats.frame_latency.append(time.monotonic() - self.pending.pop(0))
+            if not self.quiet:
+                log("sink: %.6f,%.6f hdop %.2f sats %d bat %d%%" % (
+                    frame.latitude, frame.longitude, frame.hdop / 100.0, frame.sats, frame.battery_percent))
+
+
+class Loop:
+    """selectors plus a timer queue, all of the emulator runs on one thread."""
+
+    def __init__(self):
+        self.selector = selectors.DefaultSelector()
+        self.timers = []
+
+    def register(self, sock, callback):
+        self.selector.register(sock, selectors.EVENT_READ, callback)
+
+    def unregister(self, sock):
+        try:
+            self.selector.unregister(sock)
+        except (KeyError, ValueError):
+            pass
+
+    def call_at(self, when, callback):
+        self.timers.append((when, callback))
+        self.timers.sort(key=lambda t: t[0])
+
+    def run_once(self, max_wait=0.1):
+        now = time.monotonic()
+        wait = max_wait
+        if self.timers:
+            wait = min(wait, max(0.0, self.timers[0][0] - now))
+        for key, _ in self.selector.select(wait):
+            key.data(key.fileobj)
+        now = time.monotonic()
+        while self.timers and self.timers[0][0] <= now:
+            _, callback = self.timers.pop(0)
+            callback()
+
+
+class Modem:
+    def __init__(self, loop, conn, scenario, stats, sink_address, verbose):
+        self.loop = loop
+        self.conn = conn
+        self.scenario = scenario
+        self.stats = stats
+        self.sink_address = sink_address
+        self.verbose = verbose
+        self.rng = random.Random(scenario["seed"])
+        self.latency = {k: Distribution(v, self.rng) for k, v in scenario["latency"].items()}
+        self.connected_at = time.monotonic()
+
+        self.alive = True
+        self.echo = True
+        self.text_mode = False
+        self.cfun = 1
+        self.bearer = 0
+        self.tcp = None
+        self.outage_until = 0
+        self.fade_until = 0
+        self.fade_rssi = 0
+        self.cell = dict(scenario["cell"])
+        self.engineering = 0
+        self.inbox = []
+        self.concatenated = {}  # (number, reference) to the parts so far
+        self.caller = None
+        self.call_started = None
+        self.boot = scenario["boot"]
+        self.autobaud_locked = False
+
+        self.line = bytearray()
+        self.skip_lf = False
+        self.mode = "command"
+        self.payload = bytearray()
+        self.payload_len = 0
+        self.busy_until = time.monotonic()
+        self.last_command = None
+        self.last_command_time = None
+        self.captured = None  # Replies of a command within a batch
+
+        for event in scenario["events"]:
+            self.schedule_event(event, self.connected_at + event.get("at", 0))
+
+    def log(self, text):
+        if self.verbose:
+            log(text)
+
+    def key_for(self, command):
+        if command in self.latency:
+            return command
+        name = re.split(r"[=?]", command, 1)[0]
+        return name if name in self.latency else "default"
+
+    def sample_latency(self, command):
+        return self.latency[self.key_for(command)].sample()
+
+    def rate(self, table, command):
+        name = re.split(r"[=?]", command, 1)[0]
+        return table.get(command, table.get(name, table.get("default", 0.0)))
+
+    def in_outage(self):
+        return time.monotonic() < self.outage_until
+
+    def rssi(self):
+        if self.in_outage():
+            return 99
+        if time.monotonic() < self.fade_until:
+            return self.fade_rssi
+        return self.scenario["signal"]["rssi"]
+
+    def weak_signal(self):
+        rssi = self.rssi()
+        return rssi == 99 or rssi < self.scenario["signal"]["weak_below"]
+
+    def booted(self, stage):
+        return time.monotonic() >= self.connected_at + self.boot[stage]
+
+    def lock_autobaud(self):
+        """First AT after the modem is up, the boot URCs follow from here."""
+        self.autobaud_locked = True
+        for stage, text in (("call_ready", "Call Ready"), ("sms_ready", "SMS Ready")):
+            at = max(time.monotonic(), self.connected_at + self.boot[stage])
+            self.loop.call_at(at, lambda text=text: self.urc(text))
+
+    # Modem -> MCU
+
+    def send(self, text):
+        if not self.alive:
+            return
+        data = text.encode("latin-1") if isinstance(text, str) else text
+        drop = self.scenario["drop_rate"]
+        if drop:
+            kept = bytearray()
+            for b in data:
+                if self.rng.random() < drop:
+                    self.stats.dropped_bytes += 1
+                else:
+                    kept.append(b)
+            data = bytes(kept)
+        try:
+            self.conn.sendall(data)
+        except OSError:
+            self.alive = False
+
+    def reply_at(self, when, text):
+        if self.captured is not None:
+            self.captured.append((when, text))
+            return
+        self.busy_until = max(self.busy_until, when)
+        self.loop.call_at(self.busy_until, lambda: self.send(text))
+
+    def urc(self, text):
+        self.send("\r\n%s\r\n" % text)
+
+    # MCU -> modem
+
+    def receive(self, data):
+        for b in data:
+            # The LF of a command's CRLF may arrive after the switch to a
+            # payload mode
+            if self.skip_lf:
+                self.skip_lf = False
+                if b == 0x0A:
+                    continue
+            if self.mode == "sms":
+                self.receive_sms_byte(b)
+            elif self.mode == "data":
+                self.receive_data_byte(b)
+            elif b == 0x0D:
+                self.skip_lf = True
+                line = self.line.decode("latin-1").strip()
+                self.line.clear()
+                if line:
+                    self.command(line)
+            elif b != 0x0A:
+                self.line.append(b)
+
+    def command(self, line):
+        now = time.monotonic()
+        if not self.booted("at_ready"):
+            self.log("<- %s (still booting)" % line)
+            return
+        if not self.autobaud_locked:
+            self.lock_autobaud()
+        if self.echo:
+            self.send(line + "\r\n")
+
+        parts = split_commands(line)
+        self.stats.lines += 1
+        if self.last_command is not None:
+            self.stats.command(self.last_command)["turnaround"].append(now - self.last_command_time)
+        self.last_command = ";".join(self.stats_key(part) for part in parts)
+        self.last_command_time = now
+        self.log("<- %s" % line)
+
+        if len(parts) == 1:
+            self.execute(line, now)
+        else:
+            self.execute_batch(parts, now)
+
+    def stats_key(self, line):
+        return line if line in self.latency else re.split(r"[=?]", line, 1)[0]
+
+    def execute(self, line, now):
+        entry = self.stats.command(self.stats_key(line))
+        entry["count"] += 1
+        if self.rng.random() < self.rate(self.scenario["no_reply_rate"], line):
+            entry["no_reply"] += 1
+            return False
+
+        delay = self.sample_latency(line)
+        failed = self.rng.random() < self.rate(self.scenario["error_rate"], line)
+        if self.in_outage() and line.startswith(OUTAGE_COMMANDS):
+            failed = True
+        elif self.weak_signal() and line.startswith(OUTAGE_COMMANDS):
+            delay *= self.scenario["signal"]["weak_latency_factor"]
+            failed = failed or self.rng.random() < self.scenario["signal"]["weak_error_rate"]
+        entry["modem"].append(delay)
+        if failed:
+            entry["errors"] += 1
+
+        self.handle(line, max(now, self.busy_until) + delay, failed)
+        return True
+
+    def execute_batch(self, parts, now):
+        """AT+CBC;+CSQ;+CREG? runs the commands one after the other. The
+        answers go out together with one final result, an error ends the
+        line at the failing command."""
+        out = ""
+        when = now
+        for part in parts:
+            self.captured = []
+            answered = self.execute(part, when)
+            replies, self.captured = self.captured, None
+            if not answered:
+                # Hangs like a single command would
+                return
+            text = "".join(text for _, text in replies)
+            when = max([when] + [at for at, _ in replies])
+            if "ERROR" in text or part is parts[-1] or self.mode != "command":
+                out += text
+                break
+            out += text[:-len("\r\nOK\r\n")] if text.endswith("\r\nOK\r\n") else text
+        self.reply_at(when, out)
+
+    def handle(self, line, when, failed):
+        upper = line.upper()
+        ok = "\r\nOK\r\n"
+        error = "\r\nERROR\r\n"
+
+        if upper in ("AT", "ATE0", "ATE1"):
+            if upper == "ATE0":
+                self.echo = False
+            elif upper == "ATE1":
+                self.echo = True
+            self.reply_at(when, error if failed else ok)
+        elif upper.startswith("AT+CFUN="):
+            self.cfun = int(upper.split("=")[1].split(",")[0] or 0)
+            self.reply_at(when, error if failed else ok)
+            if not failed and self.cfun == 1 and self.booted("sms_ready"):
+                self.reply_at(when + 0.5, "\r\nCall Ready\r\n\r\nSMS Ready\r\n")
+        elif upper == "AT+CREG?":
+            stat = 1 if self.booted("registered") and not self.in_outage() else 2
+            self.reply_at(when, error if failed else "\r\n+CREG: 0,%d\r\n%s" % (stat, ok))
+        elif upper == "AT+CSQ":
+            self.reply_at(when, error if failed else "\r\n+CSQ: %d,0\r\n%s" % (self.rssi(), ok))
+        elif upper == "AT+CCALR?":
+            self.reply_at(when, error if failed else "\r\n+CCALR: %d\r\n%s" % (1 if self.booted("call_ready") else 0, ok))
+        elif upper.startswith("AT+CMGF="):
+            self.text_mode = upper.endswith("1")
+            self.reply_at(when, error if failed else ok)
+        elif upper.startswith("AT+CMGL"):
+            self.handle_cmgl(when, failed)
+        elif upper.startswith("AT+CMGD="):
+            failed = failed or not self.booted("sms_ready")
+            if not failed:
+                self.inbox = []
+            self.reply_at(when, error if failed else ok)
+        elif upper.startswith("AT+CMGS="):
+            self.handle_cmgs(line, when, failed)
+        elif upper == "AT+CBC":
+            battery = self.scenario["battery"]
+            self.reply_at(when, error if failed else "\r\n+CBC: 0,%d,%d\r\n%s" % (
+                battery["percent"], battery["millivolts"], ok))
+        elif upper == "AT+CLCC":
+            if self.caller and self.call_started:
+                self.stats.call_latency.append(time.monotonic() - self.call_started)
+                self.call_started = None
+            if self.caller and not failed:
+                self.reply_at(when, '\r\n+CLCC: 1,1,4,0,0,"%s",145,""\r\n%s' % (self.caller, ok))
+            else:
+                self.reply_at(when, ok)
+        elif upper == "ATH":
+            if self.caller:
+                self.stats.calls_answered += 1
+            self.caller = None
+            self.reply_at(when, ok)
+        elif upper.startswith("AT+SAPBR="):
+            self.handle_sapbr(upper, when, failed)
+        elif upper.startswith("AT+CIPSTART="):
+            self.handle_cipstart(when, failed)
+        elif upper.startswith("AT+CIPSEND="):
+            self.handle_cipsend(upper, when, failed)
+        elif upper.startswith("AT+CENG="):
+            self.engineering = int(upper.split("=")[1].split(",")[0] or 0)
+            self.reply_at(when, error if failed else ok)
+        elif upper == "AT+CENG?":
+            self.handle_ceng(when, failed)
+        elif upper.startswith("AT+CIPGSMLOC="):
+            self.handle_cipgsmloc(when, failed)
+        elif upper == "AT+CIPSHUT":
+            self.close_tcp()
+            self.reply_at(when, error if failed else "\r\nSHUT OK\r\n")
+        else:
+            self.reply_at(when, error)
+
+    def handle_cmgl(self, when, failed):
+        if failed or not self.text_mode:
+            self.reply_at(when, "\r\nERROR\r\n")
+            return
+        out = ""
+        for index, sms in enumerate(self.inbox):
+            if sms["read"]:
+                continue
+            sms["read"] = True
+            out += '\r\n+CMGL: %d,"REC UNREAD","%s","","24/01/01,12:00:00+04"\r\n%s' % (
+                index + 1, sms["from"], sms["text"])
+        self.reply_at(when, out + "\r\n\r\nOK\r\n")
+
+    def handle_cmgs(self, line, when, failed):
+        failed = failed or not self.booted("sms_ready")
+        prompt = self.latency.get("prompt")
+        prompt_at = time.monotonic() + (prompt.sample() if prompt else 0)
+        if failed:
+            self.reply_at(prompt_at, "\r\n+CMS ERROR: 500\r\n")
+            return
+        self.sms_to = line.split("=", 1)[1].strip('"')
+        self.sms_done_delay = max(0.0, when - time.monotonic())
+        self.payload.clear()
+        self.mode = "sms"
+        self.reply_at(prompt_at, "\r\n> ")
+
+    def receive_sms_byte(self, b):
+        if b == 0x1A:
+            self.mode = "command"
+            if not self.text_mode:
+                self.submit_pdu()
+                return
+            text = self.payload.decode("latin-1").strip()
+            self.stats.sms_sent += 1
+            log("sms to %s: %r" % (self.sms_to, text))
+            self.reply_at(time.monotonic() + self.sms_done_delay, "\r\n+CMGS: %d\r\n\r\nOK\r\n" % self.stats.sms_sent)
+        elif b == 0x1B:
+            self.mode = "command"
+            self.reply_at(time.monotonic(), "\r\nOK\r\n")
+        else:
+            self.payload.append(b)
+
+    def submit_pdu(self):
+        """Ctrl-Z after a PDU, AT+CMGS gave the length without the service centre."""
+        try:
+            pdu = sms_batch.decode_pdu(self.payload.decode("latin-1"))
+            service_centre = int(self.payload[:2], 16)
+            if len(self.payload.strip()) // 2 - 1 - service_centre != int(self.sms_to):
+                raise sms_batch.DecodeError("length is not %s" % self.sms_to)
+        except (sms_batch.DecodeError, ValueError) as e:
+            log("bad pdu: %s" % e)
+            self.reply_at(time.monotonic(), "\r\n+CMS ERROR: 304\r\n")
+            return
+        self.stats.sms_sent += 1
+        if pdu.dcs & 0x0C == 0:
+            self.submit_text_pdu(pdu)
+            self.reply_at(time.monotonic() + self.sms_done_delay, "\r\n+CMGS: %d\r\n\r\nOK\r\n" % self.stats.sms_sent)
+            return
+        self.stats.sms_binary += 1
+        self.stats.sms_bytes += len(pdu.data)
+        try:
+            batch = sms_batch.decode(pdu.data)
+            self.stats.sms_fixes += len(batch.fixes)
+            log("binary sms to %s: %d fixes, battery %d%%" % (pdu.number, len(batch.fixes), batch.battery))
+            if self.verbose:
+                for fix in batch.fixes:
+                    log("  %s %.5f %.5f hdop %.1f" % (sms_batch.format_time(batch, fix), fix.latitude, fix.longitude, fix.hdop))
+        except sms_batch.DecodeError as e:
+            log("binary sms to %s: %d bytes, %s" % (pdu.number, len(pdu.data), e))
+        self.reply_at(time.monotonic() + self.sms_done_delay, "\r\n+CMGS: %d\r\n\r\nOK\r\n" % self.stats.sms_sent)
+
+    def submit_text_pdu(self, pdu):
+        """7-bit text, logged once all parts of a concatenated one are in."""
+        parts = sms_batch.concatenation(pdu.header)
+        if not parts:
+            log("sms to %s: %r" % (pdu.number, pdu.data))
+            return
+        reference, total, part = parts
+        self.stats.sms_parts += 1
+        received = self.concatenated.setdefault((pdu.number, reference), {})
+        if not 1 <= part <= total or part in received:
+            log("sms to %s: bad or repeated part %d of %d" % (pdu.number, part, total))
+        received[part] = pdu.data
+        if self.verbose:
+            log("sms to %s: part %d of %d, %d characters" % (pdu.number, part, total, len(pdu.data)))
+        if len(received) == total:
+            del self.concatenated[(pdu.number, reference)]
+            self.stats.sms_long += 1
+            text = "".join(received[i] for i in sorted(received))
+            log("sms to %s in %d parts: %r" % (pdu.number, total, text))
+
+    def handle_ceng(self, when, failed):
+        if failed:
+            self.reply_at(when, "\r\nERROR\r\n")
+            return
+        out = "\r\n+CENG: %d,1\r\n" % self.engineering
+        if self.engineering and not self.in_outage():
+            cell = self.cell
+            out += '\r\n+CENG: 0,"0012,%d,00,%03d,%02d,53,%04x,10,05,%04x,%d"' % (
+                self.rssi() * 2, cell["mcc"], cell["mnc"], cell["cellid"], cell["lac"], cell["ta"])
+            # A neighbour, the driver only looks at the serving cell
+            out += '\r\n+CENG: 1,"0024,21,67,%04x,%03d,%02d,%04x"' % (
+                cell["cellid"] + 1, cell["mcc"], cell["mnc"], cell["lac"])
+        self.reply_at(when, out + "\r\n\r\nOK\r\n")
+
+    def handle_cipgsmloc(self, when, failed):
+        cell = self.cell
+        if failed or not self.bearer:
+            code = 601
+        elif "latitude" not in cell:
+            code = 404
+        else:
+            code = 0
+        if code:
+            self.reply_at(when, "\r\n+CIPGSMLOC: %d\r\n\r\nOK\r\n" % code)
+            return
+        stamp = time.gmtime()
+        self.reply_at(when, "\r\n+CIPGSMLOC: 0,%.6f,%.6f,%s,%s\r\n\r\nOK\r\n" % (
+            cell["longitude"], cell["latitude"], time.strftime("%Y/%m/%d", stamp), time.strftime("%H:%M:%S", stamp)))
+
+    def handle_sapbr(self, upper, when, failed):
+        args = upper.split("=", 1)[1].split(",")
+        if failed:
+            self.reply_at(when, "\r\nERROR\r\n")
+        elif args[0] == "1":
+            self.bearer = 1
+            self.reply_at(when, "\r\nOK\r\n")
+        elif args[0] == "0":
+            self.bearer = 0
+            self.close_tcp()
+            self.reply_at(when, "\r\nOK\r\n")
+        elif args[0] == "2":
+            status = 1 if self.bearer else 3
+            address = "10.64.%d.%d" % (self.rng.randint(0, 255), self.rng.randint(1, 254)) if self.bearer else "0.0.0.0"
+            self.reply_at(when, '\r\n+SAPBR: 1,%d,"%s"\r\n\r\nOK\r\n' % (status, address))
+        else:
+            self.reply_at(when, "\r\nOK\r\n")
+
+    def handle_cipstart(self, when, failed):
+        if self.tcp:
+            self.reply_at(when, "\r\nALREADY CONNECT\r\n")
+            return
+        self.reply_at(time.monotonic(), "\r\nOK\r\n")
+        if failed or not self.bearer:
+            self.reply_at(when, "\r\nCONNECT FAIL\r\n")
+            return
+        try:
+            self.tcp = socket.create_connection(self.sink_address, timeout=2)
+            self.stats.tcp_connects += 1
+        except OSError:
+            self.tcp = None
+            self.reply_at(when, "\r\nCONNECT FAIL\r\n")
+            return
+        self.reply_at(when, "\r\nCONNECT OK\r\n")
+
+    def handle_cipsend(self, upper, when, failed):
+        if not self.tcp or failed:
+            self.reply_at(when, "\r\nERROR\r\n")
+            return
+        self.payload.clear()
+        self.payload_len = int(upper.split("=", 1)[1])
+        self.send_done_delay = max(0.0, when - time.monotonic())
+        self.mode = "data"
+        prompt = self.latency.get("prompt")
+        self.reply_at(time.monotonic() + (prompt.sample() if prompt else 0), "\r\n> ")
+
+    def receive_data_byte(self, b):
+        self.payload.append(b)
+        if len(self.payload) < self.payload_len:
+            return
+        self.mode = "command"
+        data = bytes(self.payload)
+        received = time.monotonic()
+        done = received + self.send_done_delay
+        sink = self.loop.sink
+
+        def deliver():
+            if not self.tcp:
+                return
+            try:
+                sink.pending.append(received)
+                self.tcp.sendall(data)
+            except OSError:
+                self.close_tcp()
+
+        self.loop.call_at(done, deliver)
+        self.reply_at(done, "\r\nSEND OK\r\n")
+
+    def close_tcp(self):
+        if self.tcp:
+            self.tcp.close()
+            self.tcp = None
+
+    # Scripted events
+
+    def schedule_event(self, event, when):
+        def fire():
+            if not self.alive:
+                return
+            self.run_event(event)
+            if "every" in event:
+                self.schedule_event(event, when + event["every"])
+        self.loop.call_at(when, fire)
+
+    def run_event(self, event):
+        kind = event["kind"]
+        if kind == "urc":
+            self.urc(event["text"])
+        elif kind == "sms":
+            self.inbox.append({"from": event["from"], "text": event["text"], "read": False})
+            self.urc('+CMTI: "SM",%d' % len(self.inbox))
+        elif kind == "call":
+            self.caller = event["from"]
+            self.call_started = time.monotonic()
+            self.ring(event.get("rings", 5))
+        elif kind == "bearer_drop":
+            if self.tcp:
+                self.close_tcp()
+                self.urc("CLOSED")
+            self.bearer = 0
+        elif kind == "fade":
+            self.fade_until = time.monotonic() + event["duration"]
+            self.fade_rssi = event["rssi"]
+        elif kind == "handover":
+            self.cell.update(event["cell"])
+        elif kind == "outage":
+            self.outage_until = time.monotonic() + event["duration"]
+            if self.tcp:
+                self.close_tcp()
+                self.urc("CLOSED")
+            self.bearer = 0
+        self.log("event %s" % kind)
+
+    def ring(self, rings_left):
+        if not self.caller or not self.alive:
+            return
+        if rings_left == 0:
+            self.caller = None
+            self.urc("NO CARRIER")
+            return
+        self.urc("RING")
+        self.loop.call_at(time.monotonic() + 3, lambda: self.ring(rings_left - 1))
+
+    def close(self):
+        self.alive = False
+        self.close_tcp()
+
+    def detach(self):
+        """The MCU went away, the modem keeps its state and connections."""
+        self.alive = False
+
+    def attach(self, conn):
+        self.conn = conn
+        self.alive = True
+        self.line.clear()
+        self.skip_lf = False
+        self.mode = "command"
+        self.payload.clear()
+
+
+def split_commands(line):
+    """AT+CMGF=1;+CMGL into AT+CMGF=1 and AT+CMGL, quoted ; kept."""
+    parts = [""]
+    quoted = False
+    for c in line:
+        if c == '"':
+            quoted = not quoted
+        if c == ";" and not quoted:
+            parts.append("")
+        else:
+            parts[-1] += c
+    return [parts[0]] + ["AT" + part.strip() for part in parts[1:] if part.strip()]
+
+
+def log(text):
+    print("[%9.3f] %s" % (time.monotonic() - START, text), file=sys.stderr, flush=True)
+
+
+START = time.monotonic()
+
+
+def load_scenario(path):
+    scenario = json.loads(json.dumps(DEFAULT_SCENARIO))
+    if path:
+        with open(path) as f:
+            custom = json.load(f)
+        for key, value in custom.items():
+            if key in ("latency", "boot", "signal", "cell"):
+                scenario[key].update(value)
+            else:
+                scenario[key] = value
+    return scenario
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("-s", "--scenario", help="JSON scenario file")
+    parser.add_argument("-p", "--port", type=int, default=7800, help="port the firmware connects to")
+    parser.add_argument("--sink", help="forward CIPSEND data to HOST:PORT instead of the built in sink")
+    parser.add_argument("--store", help="keep the frames the built in sink receives in this track store")
+    parser.add_argument("--uplink-stats", action="store_true", help="frames carry GSM_STATS_UPLINK data")
+    parser.add_argument("--seed", type=int, help="override the scenario seed")
+    parser.add_argument("--duration", type=float, help="stop after this many seconds")
+    parser.add_argument("--json", help="write the summary to this file")
+    parser.add_argument("--keep-modem", action="store_true",
+                        help="a reconnect is a reset of the MCU alone, the modem runs on")
+    parser.add_argument("-v", "--verbose", action="store_true", help="log every command")
+    parser.add_argument("-q", "--quiet", action="store_true", help="don't log received frames")
+    parser.add_argument("firmware", nargs=argparse.REMAINDER, help="-- command to run with GSM_PORT set")
+    args = parser.parse_args()
+
+    scenario = load_scenario(args.scenario)
+    if args.seed is not None:
+        scenario["seed"] = args.seed
+
+    stats = Stats()
+    loop = Loop()
+    store = track_store.TrackStore(args.store) if args.store else None
+    loop.sink = Sink(loop, stats, args.quiet, args.uplink_stats, store)
+    sink_address = loop.sink.address
+    if args.sink:
+        host, port = args.sink.rsplit(":", 1)
+        sink_address = (host, int(port))
+
+    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    server.bind(("127.0.0.1", args.port))
+    server.listen(1)
+    server.setblocking(False)
+    log("listening on 127.0.0.1:%d, sink %s:%d" % (args.port, sink_address[0], sink_address[1]))
+
+    state = {"modem": None}
+
+    def on_data(conn):
+        modem = state["modem"]
+        try:
+            data = conn.recv(4096)
+        except OSError:
+            data = b""
+        if not data:
+            loop.unregister(conn)
+            conn.close()
+            if modem and modem.conn is conn:
+                if args.keep_modem:
+                    modem.detach()
+                else:
+                    modem.close()
+                    state["modem"] = None
+            log("firmware disconnected")
+            return
+        modem.receive(data)
+
+    def on_accept(sock):
+        conn, _ = sock.accept()
+        conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        conn.setblocking(False)
+        stats.connections += 1
+        loop.register(conn, on_data)
+        if args.keep_modem and state["modem"]:
+            state["modem"].attach(conn)
+            log("firmware connected, modem still running")
+            return
+        if state["modem"]:
+            state["modem"].close()
+        if stats.powered_up is None:
+            stats.powered_up = time.monotonic()
+        state["modem"] = Modem(loop, conn, scenario, stats, sink_address, args.verbose)
+        log("firmware connected, modem powered up")
+
+    loop.register(server, on_accept)
+
+    child = None
+    firmware = [a for a in args.firmware if a != "--"]
+    if firmware:
+        env = dict(os.environ, GSM_PORT="tcp:127.0.0.1:%d" % args.port)
+        child = subprocess.Popen(firmware, env=env)
+
+    stop = {"now": False}
+    signal.signal(signal.SIGINT, lambda *_: stop.update(now=True))
+    signal.signal(signal.SIGTERM, lambda *_: stop.update(now=True))
+
+    deadline = time.monotonic() + args.duration if args.duration else None
+    while not stop["now"]:
+        if deadline and time.monotonic() > deadline:
+            break
+        if child and child.poll() is not None:
+            log("firmware exited with %d" % child.returncode)
+            break
+        loop.run_once()
+
+    if child and child.poll() is None:
+        child.terminate()
+        child.wait()
+
+    stats.print()
+    if store:
+        store.close()
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(stats.summary(), f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,208 @@
+#!/usr/bin/env python3
+"""Binary SMS with a batch of fixes, see include/sms_batch.h.
+
+Units that only report over SMS send these instead of a text SMS per fix
+once BATCH is set. Decodes PDUs as a modem shows them, with the service
+centre first: the SMS-DELIVER a receiving modem lists with AT+CMGF=0 and
+AT+CMGL=4, or the SMS-SUBMIT the tracker sends.
+
+    python3 tools/sms_batch.py 0791644...
+    echo 0791644... | python3 tools/sms_batch.py --json out.json
+    python3 tools/sms_batch.py --payload 0101...
+
+One line per fix, time in UTC or in seconds after the first fix when the
+tracker did not know the date.
+"""
+
+import argparse
+import datetime
+import json
+import struct
+import sys
+from collections import namedtuple
+
+VERSION = 1
+HEADER = struct.Struct(">BBBIiiB")
+FIX = struct.Struct(">HhhB")
+MAX_SIZE = 140
+EPOCH = datetime.datetime(2000, 1, 1, tzinfo=datetime.timezone.utc)
+
+# The GSM 7-bit default alphabet, escapes to the extension table are not used
+GSM_ALPHABET = ("@£$¥èéùìòÇ\nØø\rÅåΔ_ΦΓΛΩΠΨΣΘΞ\x1bÆæßÉ !\"#¤%&'()*+,-./0123456789:;<=>?"
+                "¡ABCDEFGHIJKLMNOPQRSTUVWXYZÄÖÑÜ§¿abcdefghijklmnopqrstuvwxyzäöñüà")
+
+# data is the user data without the header, as text for the 7-bit alphabet
+Pdu = namedtuple("Pdu", ["kind", "number", "dcs", "header", "data"])
+Fix = namedtuple("Fix", ["time", "latitude", "longitude", "hdop"])
+Batch = namedtuple("Batch", ["battery", "utc", "fixes"])
+
+
+class DecodeError(ValueError):
+    pass
+
+
+def decode_number(octets, digits):
+    number = ""
+    for octet in octets:
+        number += "%d" % (octet & 0x0F)
+        if octet >> 4 != 0x0F:
+            number += "%d" % (octet >> 4)
+    return number[:digits]
+
+
+def decode_pdu(text):
+    """SMS-SUBMIT or SMS-DELIVER in hex, service centre first."""
+    try:
+        pdu = bytes.fromhex(text.strip())
+    except ValueError as e:
+        raise DecodeError("not hex: %s" % e)
+    try:
+        at = 1 + pdu[0]
+        first = pdu[at]
+        kind = "submit" if first & 0x03 == 1 else "deliver"
+        at += 2 if kind == "submit" else 1  # Message reference
+        digits, number_type = pdu[at], pdu[at + 1]
+        at += 2
+        number = decode_number(pdu[at:at + (digits + 1) // 2], digits)
+        at += (digits + 1) // 2
+        if number_type == 0x91:
+            number = "+" + number
+        dcs = pdu[at + 1]
+        at += 2
+        if kind == "deliver":
+            at += 7  # Service centre time stamp
+        elif first & 0x18 == 0x10:
+            at += 1  # Relative validity period
+        elif first & 0x18:
+            at += 7
+        length = pdu[at]
+        septets = dcs & 0x0C == 0
+        size = (length * 7 + 7) // 8 if septets else length
+        data = pdu[at + 1:at + 1 + size]
+    except IndexError:
+        raise DecodeError("PDU too short")
+    if len(data) != size:
+        raise DecodeError("user data is %d bytes, header says %d" % (len(data), size))
+    header = b""
+    skip = 0
+    if first & 0x40:
+        header = data[1:1 + data[0]]
+        skip = 1 + data[0]
+    if septets:
+        return Pdu(kind, number, dcs, header, unpack_septets(data, length, skip))
+    return Pdu(kind, number, dcs, header, data[skip:])
+
+
+def unpack_septets(data, length, skip=0):
+    """7-bit text of length septets, from the first septet boundary after skip bytes."""
+    bits = int.from_bytes(data, "little")
+    first = (skip * 8 + 6) // 7
+    return "".join(GSM_ALPHABET[bits >> (7 * i) & 0x7F] for i in range(first, length))
+
+
+def concatenation(header):
+    """(reference, parts, part) from a concatenation header, None without one."""
+    at = 0
+    while at + 1 < len(header):
+        iei, size = header[at], header[at + 1]
+        value = header[at + 2:at + 2 + size]
+        if iei == 0x00 and size == 3:
+            return value[0], value[1], value[2]
+        if iei == 0x08 and size == 4:
+            return value[0] << 8 | value[1], value[2], value[3]
+        at += 2 + size
+    return None
+
+
+def decode(data):
+    """The batch in the user data of a binary SMS."""
+    if len(data) < HEADER.size:
+        raise DecodeError("batch too short")
+    version, count, battery, utc, latitude, longitude, hdop = HEADER.unpack_from(data)
+    if version != VERSION:
+        raise DecodeError("batch version %d" % version)
+    if len(data) != HEADER.size + (count - 1) * FIX.size:
+        raise DecodeError("%d fixes in %d bytes" % (count, len(data)))
+    seconds = 0
+    fixes = [Fix(0, latitude / 1e5, longitude / 1e5, hdop / 10)]
+    for offset in range(HEADER.size, len(data), FIX.size):
+        dt, dlat, dlon, hdop = FIX.unpack_from(data, offset)
+        seconds += dt
+        latitude += dlat
+        longitude += dlon
+        fixes.append(Fix(seconds, latitude / 1e5, longitude / 1e5, hdop / 10))
+    if utc:
+        fixes = [f._replace(time=utc + f.time) for f in fixes]
+    return Batch(battery, bool(utc), fixes)
+
+
+def encode(fixes, battery=0, utc=True):
+    """The reverse of decode()."""
+    fixes = list(fixes)
+    out = bytearray()
+    first = fixes[0]
+    latitude, longitude = round(first.latitude * 1e5), round(first.longitude * 1e5)
+    out += HEADER.pack(VERSION, len(fixes), battery, first.time if utc else 0, latitude, longitude,
+                       min(round(first.hdop * 10), 255))
+    time = first.time
+    for fix in fixes[1:]:
+        lat, lon = round(fix.latitude * 1e5), round(fix.longitude * 1e5)
+        out += FIX.pack(fix.time - time, lat - latitude, lon - longitude, min(round(fix.hdop * 10), 255))
+        time, latitude, longitude = fix.time, lat, lon
+    if len(out) > MAX_SIZE:
+        raise ValueError("%d fixes do not fit in one SMS" % len(fixes))
+    return bytes(out)
+
+
+def format_time(batch, fix):
+    if batch.utc:
+        return (EPOCH + datetime.timedelta(seconds=fix.time)).strftime("%Y-%m-%d %H:%M:%SZ")
+    return "+%ds" % fix.time
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("hex", nargs="*", help="PDUs, read from stdin if none")
+    parser.add_argument("--payload", action="store_true", help="the hex is the user data alone")
+    parser.add_argument("--json", help="write the decoded batches to this file")
+    args = parser.parse_args()
+
+    batches = []
+    errors = 0
+    for text in args.hex or sys.stdin:
+        text = text.strip()
+        if not text:
+            continue
+        try:
+            if args.payload:
+                pdu = Pdu("payload", "", 4, b"", bytes.fromhex(text))
+            else:
+                pdu = decode_pdu(text)
+                if pdu.dcs & 0x0C != 0x04:
+                    raise DecodeError("not 8-bit data, DCS %02X" % pdu.dcs)
+            batch = decode(pdu.data)
+        except (DecodeError, ValueError) as e:
+            print("error: %s" % e, file=sys.stderr)
+            errors += 1
+            continue
+        print("%s %s, %d fixes, battery %d%%" % (pdu.kind, pdu.number, len(batch.fixes), batch.battery))
+        for fix in batch.fixes:
+            print("  %s %.5f %.5f hdop %.1f" % (format_time(batch, fix), fix.latitude, fix.longitude, fix.hdop))
+        batches.append({
+            "kind": pdu.kind,
+            "number": pdu.number,
+            "battery": batch.battery,
+            "utc": batch.utc,
+            "fixes": [f._asdict() for f in batch.fixes],
+        })
+
+    fixes = sum(len(b["fixes"]) for b in batches)
+    print("%d SMS, %d fixes, %d errors" % (len(batches), fixes, errors), file=sys.stderr)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(batches, f, indent=2)
+    sys.exit(1 if errors else 0)
+
+
+if __name__ == "__main__":
+    main()
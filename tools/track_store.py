@@ -0,0 +1,587 @@
+#!/usr/bin/env python3
+"""Append-only store for the positions the trackers upload, see tracker_protocol.py.
+
+Every device has its own directory. New records are appended to a head file
+of fixed size rows. Once the head holds SEGMENT_RECORDS rows it is sealed
+into a segment: blocks of BLOCK_RECORDS records, stored column by column,
+each column as a first value and the deltas from one record to the next in
+the narrowest of 1, 2, 4 or 8 bytes that fits them all. Positions move
+little between reports, so a record takes about 14 bytes instead of the 22
+of a head row. Segments are memory mapped for reading, a block decodes with
+array and itertools.accumulate without a Python loop per value.
+
+Three levels let queries skip what they don't need:
+
+- The catalog, one line per sealed segment with its time range and bounding
+  box, kept in memory.
+- A sparse index at the end of each segment, one entry per block with its
+  time range and bounding box.
+- The same per block summary of the head, kept in memory.
+
+Records of a device have to be appended in time order, which they are when
+the time is when the frame arrived.
+
+    python3 tools/track_store.py /tmp/tracks fill --devices 500 --days 30
+    python3 tools/track_store.py /tmp/tracks bench
+    python3 tools/track_store.py /tmp/tracks device tracker-17 --hours 24
+    python3 tools/track_store.py /tmp/tracks bbox 57.6 11.8 57.8 12.1 --hours 1
+
+Only one process may write a store at a time.
+"""
+
+import argparse
+import array
+import bisect
+import collections
+import itertools
+import math
+import mmap
+import os
+import random
+import re
+import struct
+import sys
+import time
+
+import tracker_protocol
+
+BLOCK_RECORDS = 256
+SEGMENT_RECORDS = 8192
+MAX_OPEN_SEGMENTS = 256
+
+# time s, latitude and longitude 1e-6 deg, course 0.01 deg, speed cm/s,
+# hdop 100ths, sats, battery mV, battery %
+ROW = struct.Struct("<IiiHHHBHB")
+COLUMNS = ("time", "latitude", "longitude", "course", "speed", "hdop", "sats", "battery_mv", "battery_percent")
+TIME, LATITUDE, LONGITUDE, COURSE = 0, 1, 2, 3
+# Columns that wrap around, their deltas are taken the short way round
+WRAP = {COURSE: 36000}
+
+SEGMENT_MAGIC = b"TRK1"
+SEGMENT_HEADER = struct.Struct("<4sHHIIIIiiiiI")
+BLOCK_INDEX = struct.Struct("<IIiiiiHI")
+CHUNK_HEADER = struct.Struct("<Bq")
+WIDTHS = ((1, "b"), (2, "h"), (4, "i"), (8, "q"))
+TYPECODES = dict(WIDTHS)
+
+DEVICE_NAME = re.compile(r"^[A-Za-z0-9+._-]{1,64}$")
+
+Record = collections.namedtuple("Record", [
+    "device",
+    "time",
+    "latitude",
+    "longitude",
+    "course",
+    "speed",
+    "hdop",
+    "sats",
+    "battery_voltage",
+    "battery_percent",
+])
+
+# Time range and bounding box of a block, a head chunk or a segment
+Summary = collections.namedtuple("Summary", ["t_first", "t_last", "lat_min", "lat_max", "lon_min", "lon_max", "count"])
+
+Box = collections.namedtuple("Box", ["lat_min", "lon_min", "lat_max", "lon_max"])
+
+
+def clamp(value, low, high):
+    return low if value < low else high if value > high else value
+
+
+def to_row(t, packet):
+    return (
+        int(t),
+        int(round(packet.latitude * 1e6)),
+        int(round(packet.longitude * 1e6)),
+        int(round(packet.course * 100)) % 36000,
+        clamp(int(round(packet.speed * 100)), 0, 0xFFFF),
+        clamp(int(packet.hdop), 0, 0xFFFF),
+        clamp(int(packet.sats), 0, 0xFF),
+        clamp(int(round(packet.battery_voltage * 1000)), 0, 0xFFFF),
+        clamp(int(packet.battery_percent), 0, 0xFF),
+    )
+
+
+def to_record(device, row):
+    return Record(device, row[0], row[1] / 1e6, row[2] / 1e6, row[3] / 100.0, row[4] / 100.0,
+                  row[5], row[6], row[7] / 1000.0, row[8])
+
+
+def summarize(rows):
+    lats = [r[LATITUDE] for r in rows]
+    lons = [r[LONGITUDE] for r in rows]
+    return Summary(rows[0][TIME], rows[-1][TIME], min(lats), max(lats), min(lons), max(lons), len(rows))
+
+
+def merge(summaries):
+    return Summary(summaries[0].t_first, summaries[-1].t_last,
+                   min(s.lat_min for s in summaries), max(s.lat_max for s in summaries),
+                   min(s.lon_min for s in summaries), max(s.lon_max for s in summaries),
+                   sum(s.count for s in summaries))
+
+
+def overlaps(summary, since, until, box):
+    if summary.t_last < since or summary.t_first > until:
+        return False
+    if box is None:
+        return True
+    return not (summary.lat_max < box.lat_min or summary.lat_min > box.lat_max or
+                summary.lon_max < box.lon_min or summary.lon_min > box.lon_max)
+
+
+def inside(row, since, until, box):
+    return since <= row[TIME] <= until and (box is None or (
+        box.lat_min <= row[LATITUDE] <= box.lat_max and box.lon_min <= row[LONGITUDE] <= box.lon_max))
+
+
+# Segments
+
+def encode_column(values, wrap=None):
+    first = values[0]
+    deltas = [b - a for a, b in zip(values, values[1:])]
+    if wrap:
+        deltas = [(d + wrap // 2) % wrap - wrap // 2 for d in deltas]
+    bound = max((abs(d) for d in deltas), default=0)
+    for width, code in WIDTHS:
+        if bound < 1 << (width * 8 - 1):
+            break
+    data = array.array(code, deltas)
+    if sys.byteorder == "big":
+        data.byteswap()
+    return CHUNK_HEADER.pack(width, first) + data.tobytes()
+
+
+def write_segment(path, rows):
+    """rows in time order. Written aside and renamed, a segment is complete
+    or not there."""
+    blocks = []
+    body = bytearray()
+    for start in range(0, len(rows), BLOCK_RECORDS):
+        block = rows[start:start + BLOCK_RECORDS]
+        offset = SEGMENT_HEADER.size + len(body)
+        for column in range(len(COLUMNS)):
+            body += encode_column([r[column] for r in block], WRAP.get(column))
+        blocks.append((summarize(block), offset))
+
+    total = merge([b[0] for b in blocks])
+    index_offset = SEGMENT_HEADER.size + len(body)
+    header = SEGMENT_HEADER.pack(SEGMENT_MAGIC, 1, len(COLUMNS), total.count, len(blocks), total.t_first,
+                                 total.t_last, total.lat_min, total.lat_max, total.lon_min, total.lon_max, index_offset)
+    index = b"".join(BLOCK_INDEX.pack(s.t_first, s.t_last, s.lat_min, s.lat_max, s.lon_min, s.lon_max, s.count, offset)
+                     for s, offset in blocks)
+
+    temporary = path + ".tmp"
+    with open(temporary, "wb") as f:
+        f.write(header)
+        f.write(body)
+        f.write(index)
+        f.flush()
+        os.fsync(f.fileno())
+    os.replace(temporary, path)
+    return total
+
+
+class Segment:
+    """A sealed segment, mapped for reading."""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        header = SEGMENT_HEADER.unpack_from(self.map, 0)
+        if header[0] != SEGMENT_MAGIC or header[2] != len(COLUMNS):
+            raise ValueError("%s is not a track segment" % path)
+        blocks = header[4]
+        index_offset = header[11]
+        self.blocks = []
+        self.offsets = []
+        for i in range(blocks):
+            entry = BLOCK_INDEX.unpack_from(self.map, index_offset + i * BLOCK_INDEX.size)
+            self.blocks.append(Summary(*entry[:7]))
+            self.offsets.append(entry[7])
+        self.t_last = [b.t_last for b in self.blocks]
+
+    def decode(self, block, columns):
+        """Values of the wanted columns of a block, None for the others."""
+        count = self.blocks[block].count
+        offset = self.offsets[block]
+        out = [None] * len(COLUMNS)
+        for column in range(max(columns) + 1):
+            width, first = CHUNK_HEADER.unpack_from(self.map, offset)
+            offset += CHUNK_HEADER.size
+            size = (count - 1) * width
+            if column in columns:
+                deltas = array.array(TYPECODES[width])
+                deltas.frombytes(self.map[offset:offset + size])
+                if sys.byteorder == "big":
+                    deltas.byteswap()
+                out[column] = list(itertools.accumulate(deltas, initial=first))
+                if column in WRAP:
+                    out[column] = [v % WRAP[column] for v in out[column]]
+            offset += size
+        return out
+
+    def scan(self, since, until, box):
+        """Rows in the time range and box, as tuples of the stored values."""
+        rows = []
+        # Blocks are in time order, the first one that may hold since
+        first = bisect.bisect_left(self.t_last, since)
+        for block in range(first, len(self.blocks)):
+            summary = self.blocks[block]
+            if summary.t_first > until:
+                break
+            if not overlaps(summary, since, until, box):
+                continue
+            # Time and position first, the rest only for blocks with hits
+            values = self.decode(block, {TIME, LATITUDE, LONGITUDE})
+            hits = [i for i, (t, lat, lon) in enumerate(zip(values[TIME], values[LATITUDE], values[LONGITUDE]))
+                    if inside((t, lat, lon), since, until, box)]
+            if not hits:
+                continue
+            values = self.decode(block, set(range(len(COLUMNS))))
+            rows.extend(tuple(values[c][i] for c in range(len(COLUMNS))) for i in hits)
+        return rows
+
+    def close(self):
+        self.map.close()
+
+
+# Devices
+
+class Device:
+    def __init__(self, store, name):
+        self.store = store
+        self.name = name
+        self.path = os.path.join(store.path, name)
+        self.segments = []  # (sequence, Summary), oldest first
+        self.head_sequence = 0
+        self.head_chunks = []  # Summary per BLOCK_RECORDS rows of the head
+        self.head_count = 0
+        self.last = None  # Last row appended
+
+    def head_path(self, sequence=None):
+        return os.path.join(self.path, "head.%d" % (self.head_sequence if sequence is None else sequence))
+
+    def segment_path(self, sequence):
+        return os.path.join(self.path, "%08d.seg" % sequence)
+
+    def load(self):
+        """Picks up the head after a restart. A head that was sealed before
+        the restart is dropped, a torn last row is cut off."""
+        self.head_sequence = self.segments[-1][0] + 1 if self.segments else 0
+        for name in os.listdir(self.path):
+            match = re.match(r"^head\.(\d+)$", name)
+            if match and int(match.group(1)) < self.head_sequence:
+                os.remove(os.path.join(self.path, name))
+            elif name.endswith(".tmp"):
+                os.remove(os.path.join(self.path, name))
+
+        rows = self.read_head(0, None)
+        size = len(rows) * ROW.size
+        if os.path.exists(self.head_path()) and os.path.getsize(self.head_path()) != size:
+            os.truncate(self.head_path(), size)
+        self.head_count = len(rows)
+        self.head_chunks = [summarize(rows[i:i + BLOCK_RECORDS]) for i in range(0, len(rows), BLOCK_RECORDS)]
+        if rows:
+            self.last = rows[-1]
+        elif self.segments:
+            segment = self.store.segment(self, self.segments[-1][0])
+            self.last = segment.scan(self.segments[-1][1].t_last, self.segments[-1][1].t_last, None)[-1]
+
+    def read_head(self, first, count):
+        try:
+            with open(self.head_path(), "rb") as f:
+                f.seek(first * ROW.size)
+                data = f.read(count * ROW.size if count is not None else -1)
+        except FileNotFoundError:
+            return []
+        usable = len(data) - len(data) % ROW.size
+        return list(ROW.iter_unpack(data[:usable]))
+
+    def append(self, rows):
+        if self.last and rows[0][TIME] < self.last[TIME]:
+            raise ValueError("%s: record at %d is older than the last one at %d" % (self.name, rows[0][TIME], self.last[TIME]))
+        for a, b in zip(rows, rows[1:]):
+            if b[TIME] < a[TIME]:
+                raise ValueError("%s: records out of time order" % self.name)
+
+        while rows:
+            room = SEGMENT_RECORDS - self.head_count
+            part, rows = rows[:room], rows[room:]
+            with open(self.head_path(), "ab") as f:
+                f.write(b"".join(ROW.pack(*r) for r in part))
+            self.extend_chunks(part)
+            self.head_count += len(part)
+            self.last = part[-1]
+            if self.head_count >= SEGMENT_RECORDS:
+                self.seal()
+
+    def extend_chunks(self, rows):
+        if self.head_chunks and self.head_chunks[-1].count < BLOCK_RECORDS:
+            room = BLOCK_RECORDS - self.head_chunks[-1].count
+            last = self.head_chunks.pop()
+            self.head_chunks.append(merge([last, summarize(rows[:room])]))
+            rows = rows[room:]
+        for i in range(0, len(rows), BLOCK_RECORDS):
+            self.head_chunks.append(summarize(rows[i:i + BLOCK_RECORDS]))
+
+    def seal(self):
+        """Segment first, then the catalog, then a new head. A restart in
+        between finds the head in the catalog and drops it."""
+        rows = self.read_head(0, None)
+        sequence = self.head_sequence
+        summary = write_segment(self.segment_path(sequence), rows)
+        self.store.catalog_append(self.name, sequence, summary)
+        self.segments.append((sequence, summary))
+        self.head_sequence += 1
+        self.head_chunks = []
+        self.head_count = 0
+        os.remove(self.head_path(sequence))
+
+    def scan(self, since, until, box):
+        rows = []
+        for sequence, summary in self.segments:
+            if overlaps(summary, since, until, box):
+                rows.extend(self.store.segment(self, sequence).scan(since, until, box))
+        for i, chunk in enumerate(self.head_chunks):
+            if overlaps(chunk, since, until, box):
+                rows.extend(r for r in self.read_head(i * BLOCK_RECORDS, chunk.count) if inside(r, since, until, box))
+        return rows
+
+
+class TrackStore:
+    def __init__(self, path):
+        self.path = path
+        os.makedirs(path, exist_ok=True)
+        self.devices = {}
+        self.open_segments = collections.OrderedDict()
+        self.catalog_path = os.path.join(path, "catalog")
+        self.load_catalog()
+        for name in sorted(os.listdir(path)):
+            if DEVICE_NAME.match(name) and os.path.isdir(os.path.join(path, name)):
+                self.device(name)
+        for device in self.devices.values():
+            device.load()
+
+    def load_catalog(self):
+        """device, sequence, count, time range and box per line. A torn last
+        line is cut off."""
+        good = 0
+        try:
+            with open(self.catalog_path, "rb") as f:
+                data = f.read()
+        except FileNotFoundError:
+            return
+        for line in data.split(b"\n")[:-1]:
+            fields = line.decode("ascii", "replace").split("\t")
+            try:
+                name, sequence = fields[0], int(fields[1])
+                count, t_first, t_last, lat_min, lat_max, lon_min, lon_max = (int(v) for v in fields[2:9])
+            except (IndexError, ValueError):
+                break
+            if not DEVICE_NAME.match(name):
+                break
+            self.device(name).segments.append((sequence, Summary(t_first, t_last, lat_min, lat_max, lon_min, lon_max, count)))
+            good += len(line) + 1
+        if good != len(data):
+            os.truncate(self.catalog_path, good)
+
+    def catalog_append(self, name, sequence, s):
+        with open(self.catalog_path, "ab") as f:
+            f.write(("%s\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n" % (
+                name, sequence, s.count, s.t_first, s.t_last, s.lat_min, s.lat_max, s.lon_min, s.lon_max)).encode("ascii"))
+            f.flush()
+            os.fsync(f.fileno())
+
+    def device(self, name):
+        if name not in self.devices:
+            if not DEVICE_NAME.match(name):
+                raise ValueError("bad device name %r" % name)
+            device = Device(self, name)
+            os.makedirs(device.path, exist_ok=True)
+            self.devices[name] = device
+        return self.devices[name]
+
+    def segment(self, device, sequence):
+        key = (device.name, sequence)
+        if key in self.open_segments:
+            self.open_segments.move_to_end(key)
+            return self.open_segments[key]
+        segment = Segment(device.segment_path(sequence))
+        self.open_segments[key] = segment
+        if len(self.open_segments) > MAX_OPEN_SEGMENTS:
+            self.open_segments.popitem(last=False)[1].close()
+        return segment
+
+    def append(self, name, t, packet):
+        """A decoded frame, t in seconds since the epoch."""
+        self.append_many(name, [(t, packet)])
+
+    def append_many(self, name, records):
+        """(t, packet) pairs in time order."""
+        if records:
+            self.device(name).append([to_row(t, packet) for t, packet in records])
+
+    def query(self, name, since, until):
+        """Track of one device, oldest first."""
+        device = self.devices.get(name)
+        if not device:
+            return []
+        return [to_record(name, r) for r in device.scan(since, until, None)]
+
+    def bbox(self, lat_min, lon_min, lat_max, lon_max, since, until):
+        """Records of every device inside the box, by device and time."""
+        box = Box(int(round(lat_min * 1e6)), int(round(lon_min * 1e6)), int(round(lat_max * 1e6)), int(round(lon_max * 1e6)))
+        out = []
+        for name, device in self.devices.items():
+            out.extend(to_record(name, r) for r in device.scan(since, until, box))
+        return out
+
+    def latest(self):
+        """Time of the newest record in the store."""
+        return max((d.last[TIME] for d in self.devices.values() if d.last), default=0)
+
+    def stats(self):
+        records = segments = segment_bytes = head_bytes = 0
+        for device in self.devices.values():
+            for sequence, summary in device.segments:
+                segments += 1
+                records += summary.count
+                segment_bytes += os.path.getsize(device.segment_path(sequence))
+            records += device.head_count
+            head_bytes += device.head_count * ROW.size
+        return {
+            "devices": len(self.devices),
+            "segments": segments,
+            "records": records,
+            "segment_bytes": segment_bytes,
+            "head_bytes": head_bytes,
+            "bytes_per_record": (segment_bytes + head_bytes) / records if records else 0,
+        }
+
+    def close(self):
+        for segment in self.open_segments.values():
+            segment.close()
+        self.open_segments.clear()
+
+
+# Command line
+
+def fill(store, args):
+    """Synthetic fleet, one report every --interval seconds per device while
+    it drives about, around the gps_sim.py default position."""
+    rng = random.Random(args.seed)
+    end = int(time.time())
+    start = end - int(args.days * 86400)
+    for index in range(args.devices):
+        name = "tracker-%d" % index
+        device = store.device(name)
+        t = device.last[TIME] + args.interval if device.last else start + rng.randrange(args.interval)
+        lat = 57.7089 + rng.uniform(-0.5, 0.5)
+        lon = 11.9746 + rng.uniform(-1.0, 1.0)
+        course = rng.uniform(0, 360)
+        battery = 4.1
+        batch = []
+        while t <= end:
+            course = (course + rng.gauss(0, 15)) % 360
+            speed = max(0.0, rng.gauss(10, 5))
+            lat = clamp(lat + speed * args.interval * math.cos(math.radians(course)) / 111000, 57.0, 58.4)
+            lon = clamp(lon + speed * args.interval * math.sin(math.radians(course)) / 60000, 10.9, 13.0)
+            battery = 4.1 if battery < 3.5 else battery - 0.00002 * args.interval
+            batch.append((t, tracker_protocol.Packet(lat, lon, course, speed, rng.randint(70, 200), 0,
+                                                      rng.randint(5, 12), battery, int((battery - 3.4) / 0.8 * 100))))
+            t += args.interval + rng.randrange(2)
+            if len(batch) == SEGMENT_RECORDS:
+                store.append_many(name, batch)
+                batch = []
+        store.append_many(name, batch)
+        if args.devices >= 10 and (index + 1) % (args.devices // 10) == 0:
+            print("%d/%d devices" % (index + 1, args.devices), file=sys.stderr, flush=True)
+
+
+def timed(function, runs):
+    samples = []
+    result = None
+    for i in range(runs):
+        start = time.perf_counter()
+        result = function(i)
+        samples.append((time.perf_counter() - start) * 1000)
+    samples.sort()
+    return samples[len(samples) // 2], samples[min(len(samples) - 1, int(len(samples) * 0.99))], result
+
+
+def bench(store, args):
+    """The two queries the store is built for, against the newest data."""
+    rng = random.Random(args.seed)
+    now = store.latest()
+    names = sorted(store.devices)
+    if not names:
+        print("empty store", file=sys.stderr)
+        return
+
+    p50, p99, track = timed(lambda i: store.query(rng.choice(names), now - 86400, now), args.runs)
+    print("device, last 24 h: p50 %.1f ms p99 %.1f ms (%d records)" % (p50, p99, len(track)))
+
+    def viewport(i):
+        lat = 57.7089 + rng.uniform(-0.4, 0.4)
+        lon = 11.9746 + rng.uniform(-0.8, 0.8)
+        return store.bbox(lat - 0.05, lon - 0.1, lat + 0.05, lon + 0.1, now - 3600, now)
+
+    p50, p99, hits = timed(viewport, args.runs)
+    print("all devices in a 11x12 km box, last hour: p50 %.1f ms p99 %.1f ms (%d records)" % (p50, p99, len(hits)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("path", help="store directory")
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    p = commands.add_parser("fill", help="add synthetic tracks up to now")
+    p.add_argument("--devices", type=int, default=100)
+    p.add_argument("--days", type=float, default=30)
+    p.add_argument("--interval", type=int, default=20, help="seconds between reports")
+    p.add_argument("--seed", type=int, default=1)
+
+    p = commands.add_parser("bench", help="time the device and viewport queries")
+    p.add_argument("--runs", type=int, default=50)
+    p.add_argument("--seed", type=int, default=1)
+
+    p = commands.add_parser("device", help="track of one device")
+    p.add_argument("name")
+    p.add_argument("--hours", type=float, default=24)
+
+    p = commands.add_parser("bbox", help="records of all devices in a box")
+    p.add_argument("lat_min", type=float)
+    p.add_argument("lon_min", type=float)
+    p.add_argument("lat_max", type=float)
+    p.add_argument("lon_max", type=float)
+    p.add_argument("--hours", type=float, default=1)
+
+    commands.add_parser("stats", help="size of the store")
+    args = parser.parse_args()
+
+    store = TrackStore(args.path)
+    if args.command == "fill":
+        fill(store, args)
+        args.command = "stats"
+    if args.command == "bench":
+        bench(store, args)
+    elif args.command in ("device", "bbox"):
+        now = store.latest()
+        since = now - int(args.hours * 3600)
+        if args.command == "device":
+            records = store.query(args.name, since, now)
+        else:
+            records = store.bbox(args.lat_min, args.lon_min, args.lat_max, args.lon_max, since, now)
+        for r in records:
+            print("%s,%d,%.6f,%.6f,%.2f,%.2f,%.2f,%d,%.3f,%d" % (
+                r.device, r.time, r.latitude, r.longitude, r.course, r.speed, r.hdop / 100.0, r.sats,
+                r.battery_voltage, r.battery_percent))
+    if args.command == "stats":
+        for key, value in store.stats().items():
+            print("%s: %s" % (key, round(value, 1) if isinstance(value, float) else value))
+    store.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,69 @@
+"""Uplink frame sent by gsm_send_data(), see tcp_packet_t in src/gsm.cpp.
+
+The AVR has 4 byte doubles and no struct padding, so on the wire the frame
+is 26 bytes, little endian. Firmware built with GSM_STATS_UPLINK=1 appends
+gsm_stats_uplink_t, 10 more bytes, pass stats=True for those.
+"""
+
+import struct
+from collections import namedtuple
+
+FRAME = struct.Struct("<ffffHHBfB")
+FRAME_SIZE = FRAME.size
+
+STATS = struct.Struct("<HHHHBB")
+STATS_SIZE = STATS.size
+
+Stats = namedtuple("Stats", [
+    "sapbr_open_ms",
+    "cipstart_ms",
+    "cipsend_ms",
+    "cmgs_ms",
+    "timeouts",
+    "errors",
+])
+
+Packet = namedtuple("Packet", [
+    "latitude",
+    "longitude",
+    "course",
+    "speed",
+    "hdop",
+    "gps_age",
+    "sats",
+    "battery_voltage",
+    "battery_percent",
+])
+
+
+def decode(data, offset=0):
+    return Packet(*FRAME.unpack_from(data, offset))
+
+
+def decode_stats(data, offset=FRAME_SIZE):
+    return Stats(*STATS.unpack_from(data, offset))
+
+
+def encode(packet):
+    return FRAME.pack(*packet)
+
+
+class FrameReader:
+    """Reassembles frames from a TCP byte stream. With stats=True it returns
+    (packet, stats) pairs."""
+
+    def __init__(self, stats=False):
+        self.buffer = bytearray()
+        self.stats = stats
+        self.size = FRAME_SIZE + (STATS_SIZE if stats else 0)
+
+    def feed(self, data):
+        self.buffer += data
+        frames = []
+        while len(self.buffer) >= self.size:
+            if self.stats:
+                frames.append((decode(self.buffer), decode_stats(self.buffer)))
+            else:
+                frames.append(decode(self.buffer))
+            del self.buffer[:self.size]
+        return frames
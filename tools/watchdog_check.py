@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""Checks of the watchdog on the native build, see include/watchdog.h.
+
+Each check runs the firmware with nothing on either port and reads its
+stderr, where the host prints "host: watchdog reset" when the watchdog
+goes off:
+
+    no-gps        boots with no receiver, the baud scan waits 2 s on each
+                  rate and must keep the watchdog fed
+    double-stall  HOST_HANG stops the main loop on every boot, the watchdog
+                  must reset it every time, not only the first
+
+    python3 tools/watchdog_check.py -- .pio/build/native/program
+
+The checks run side by side and take about 40 s. The exit status is 1 if
+any failed.
+"""
+
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+RESET = "host: watchdog reset"
+
+# name, extra environment, seconds to run, watchdog resets expected at least,
+# none means none at all
+CHECKS = [
+    ("no-gps", {}, 30, None),
+    ("double-stall", {"HOST_HANG": "1"}, 40, 2),
+]
+
+
+def log(text):
+    print("[watchdog_check] %s" % text, file=sys.stderr, flush=True)
+
+
+def start(firmware, work, name, extra):
+    eeprom = os.path.join(work, name + ".eeprom")
+    with open(eeprom, "wb") as f:
+        f.write(b"\x00")  # Data connection off
+    env = dict(os.environ, GPS_PORT="/dev/null", GSM_PORT="/dev/null", HOST_EEPROM=eeprom, **extra)
+    for key in ("HOST_REPLAY", "HOST_TRACE", "HOST_HANG"):
+        if key not in extra:
+            env.pop(key, None)
+    return subprocess.Popen(firmware, env=env, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+                            universal_newlines=True, errors="replace")
+
+
+def finish(process, deadline):
+    try:
+        _, err = process.communicate(timeout=max(0, deadline - time.monotonic()))
+    except subprocess.TimeoutExpired:
+        process.kill()
+        _, err = process.communicate()
+    return err.count(RESET)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--only", choices=[c[0] for c in CHECKS], help="run this check alone")
+    argv = sys.argv[1:]
+    firmware = []
+    if "--" in argv:
+        argv, firmware = argv[:argv.index("--")], argv[argv.index("--") + 1:]
+    args = parser.parse_args(argv)
+    if not firmware:
+        sys.exit("watchdog_check: give the native build after --")
+
+    work = tempfile.mkdtemp(prefix="watchdog")
+    try:
+        checks = [c for c in CHECKS if not args.only or c[0] == args.only]
+        began = time.monotonic()
+        running = [(c, start(firmware, work, c[0], c[1])) for c in checks]
+        failed = 0
+        for (name, _, seconds, expected), process in running:
+            resets = finish(process, began + seconds)
+            ok = resets >= expected if expected else resets == 0
+            failed += not ok
+            log("%s: %s, %d watchdog resets in %d s, %s expected" % (
+                name, "ok" if ok else "FAILED", resets, seconds, expected or "none"))
+    finally:
+        shutil.rmtree(work)
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()